@@ -0,0 +1,57 @@
+;
+; Interrupt test program for pumpkin_irq_tb.vhd
+;
+; The main program adds STEP to a 32 bit count PASSES times, using the carry flag to carry into
+; the high word, then writes the count and the number of interrupts taken to IO addresses 1 to 3.
+; The interrupt handler counts the interrupt and changes A and C before writing IO address 0 to
+; acknowledge it, the testbench then drops irq. If A or C were lost across an interrupt the final
+; count would be wrong.
+;
+
+                  BR START        ; Branch to start of program
+                  IRQ HANDLER     ; Interrupt vector, address 1
+
+; Main program
+
+START             LOAD LOW        ; Add STEP to the low word
+                  ADD #0x9000     ; C is set when the low word overflows
+                  STORE LOW
+                  BNC NO_CARRY    ; An interrupt here must not change C
+                  LOAD HIGH       ; Carry into the high word
+                  ADD #1
+                  STORE HIGH
+NO_CARRY          LOAD PASSES     ; Count the passes down
+                  SUB #1
+                  STORE PASSES
+                  BNZ START       ; An interrupt here must not change A
+                  LOAD LOW        ; Write the result
+                  OUT LOW_PORT
+                  LOAD HIGH
+                  OUT HIGH_PORT
+                  LOAD IRQ_COUNT
+                  OUT COUNT_PORT
+DONE              BR DONE
+
+; Interrupt handler
+
+HANDLER           STORE SAVE_A    ; Keep A, RETI restores C
+                  LOAD IRQ_COUNT  ; Count the interrupt
+                  ADD #1
+                  STORE IRQ_COUNT
+                  LOAD #0xFFFF    ; Set C
+                  ADD #0xFFFF
+                  LOAD SAVE_A     ; Restore A
+                  OUT ACK_PORT    ; Acknowledge, irq is dropped
+                  RETI
+
+; Variables
+
+PASSES            DW 1000         ; Passes of the main loop
+LOW               DW 0            ; 32 bit count
+HIGH              DW 0
+IRQ_COUNT         DW 0            ; Interrupts taken
+SAVE_A            DW 0            ; A while the handler runs
+ACK_PORT          DW 0            ; IO addresses
+LOW_PORT          DW 1
+HIGH_PORT         DW 2
+COUNT_PORT        DW 3
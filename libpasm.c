@@ -0,0 +1,3574 @@
+/*------------------------------------------------------------------------------------------------------
+--
+-- libpasm.c
+-- An assembler library for the pumpkin-cpu, see pasm.h for the interface
+--
+--------------------------------------------------------------------------------------------------------
+--
+-- This file is part of the pumpkin-cpu Project
+-- Copyright (C) 2020 Steve Teal
+-- 
+-- This source file may be used and distributed without restriction provided that this copyright
+-- statement is not removed from the file and that any derivative work contains the original
+-- copyright notice and the associated disclaimer.
+-- 
+-- This source file is free software; you can redistribute it and/or modify it under the terms
+-- of the GNU Lesser General Public License as published by the Free Software Foundation,
+-- either version 3 of the License, or (at your option) any later version.
+-- 
+-- This source is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+-- without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. 
+-- See the GNU Lesser General Public License for more details.
+-- 
+-- You should have received a copy of the GNU Lesser General Public License along with this
+-- source; if not, download it from http://www.gnu.org/licenses/lgpl-3.0.en.html
+--
+------------------------------------------------------------------------------------------------------*/
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<stdarg.h>
+#include<ctype.h>
+#include<time.h>
+#include<limits.h>
+#include "pasm.h"
+
+#define VERSION_STRING         PASM_VERSION_STRING
+#define MAX_MEMORY_SIZE        (PASM_MAX_MEMORY_SIZE)
+#define MAX_LABEL_NAME_LENGTH  (64)
+#define LABEL_HASH_SIZE        (256) /* Initial number of hash buckets, a 2^n number */
+#define IMMEDIATE_HASH_SIZE    (256) /* Initial number of constant pool hash buckets, a 2^n number */
+#define WORD_TABLE_SIZE        (8) /* Initial size of the word table, lines may have any number of words */
+#define MAX_MESSAGE_LENGTH     (256)
+#define NUMBER_OF_INSTRUCTIONS (16)
+#define DB_DW_BUFFER_SIZE      (256)
+#define FIXUP_TABLE_SIZE       (256) /* Initial size of the fixup table */
+#define MESSAGE_BUFFER_SIZE    (1024) /* Initial size of the message buffer */
+#define SHORT_IMMEDIATE        (0x800) /* Instruction bit selecting a short immediate operand */
+#define SHORT_IMMEDIATE_MAX    (0x7FF) /* Largest short immediate value */
+#define SHORT_IMMEDIATE_MEMORY (2048) /* Largest memory size for short immediates, bit 11 must not be an address bit */
+
+/* Fixup types, operands and data that could not be resolved when the line was read */
+#define FIXUP_LABEL            (0) /* Instruction operand referencing a label */
+#define FIXUP_IMMEDIATE        (1) /* Instruction operand '#value' */
+#define FIXUP_ADDRESS_OF       (2) /* Instruction operand '@label' */
+#define FIXUP_DATA             (3) /* Label in a DW list */
+#define FIXUP_ERROR            (4) /* Error reported along with the fixups to keep errors in line order */
+#define FIXUP_NONE             (5) /* Fixup removed by the optimizer */
+
+/* DW entry types */
+#define DW_VALUE               (0) /* Numeric value */
+#define DW_LABEL               (1) /* Label already defined */
+#define DW_PENDING             (2) /* Label defined later on */
+
+/* Word kinds recorded as the image is built, used by the optimizer */
+#define WORD_EMPTY             (0)
+#define WORD_CODE              (1) /* Instruction */
+#define WORD_DATA              (2) /* DB or DW value */
+#define WORD_ADDRESS           (3) /* DW label, the value is an address */
+#define WORD_KIND              (0x0F) /* Mask for the kind */
+#define WORD_ORG               (0x80) /* Flag set on the first word following a gap made by ORG */
+
+/* Optimizer flags for each word */
+#define OPT_DELETED            (0x01) /* Word is removed from the image */
+#define OPT_TARGET             (0x02) /* Word is the target of a branch or CALL */
+#define OPT_PINNED             (0x04) /* Word is read or written as data, or its address is taken, it must not change */
+#define OPT_POOL               (0x08) /* Operand comes from the constant pool */
+#define OPT_TAIL_CALL          (0x10) /* CALL converted to BR */
+#define OPT_LIVE               (0x20) /* Word is reachable or referenced */
+#define OPT_EXEC               (0x40) /* Word is reachable as code */
+#define OPT_LABEL              (0x80) /* A label is defined at this word */
+#define OPT_BLOCK              (0x100) /* Word is the start of a referenced block */
+
+/* Flags for each word when translating to C */
+#define C_REACHED              (0x01) /* Word is reachable as code */
+#define C_WRITTEN              (0x02) /* Word is written by a STORE */
+#define C_LEADER               (0x04) /* Word starts a translated block */
+#define C_FIXED                (0x08) /* Word is built into translated code */
+
+#define I_LOAD                 (0)
+#define I_STORE                (1)
+#define I_ADD                  (2)
+#define I_SUB                  (3)
+#define I_OR                   (4)
+#define I_AND                  (5)
+#define I_XOR                  (6)
+#define I_ROR                  (7)
+#define I_SWAP                 (8)
+#define I_IN                   (9)
+#define I_OUT                  (10)
+#define I_BR                   (11)
+#define I_BNC                  (12)
+#define I_BNZ                  (13)
+#define I_CALL                 (14)
+#define I_RETURN               (15)
+
+#define RETI                   (0xF001) /* RETURN with bit 0 set, return from interrupt */
+#define IRQ_VECTOR             (1) /* Address the core calls on an interrupt */
+
+static const char *instructions[] = {"LOAD","STORE","ADD","SUB","OR","AND","XOR","ROR","SWAP","IN","OUT","BR","BNC","BNZ","CALL","RETURN"};
+
+static const char VHDLFileStart[] =
+    "---------------------------------------------------------------------\n"
+    "--\n"
+    "-- Built with PASM version %s\n"
+    "-- File name: %s\n"
+    "-- %s\n"
+    "-- \n"
+    "---------------------------------------------------------------------\n"
+    "library ieee;\n"
+    "use ieee.std_logic_1164.all;\n"
+    "use ieee.numeric_std.all;\n\n"
+    
+    "entity %s is\n"
+    "port (\n"
+    "    clock        : in std_logic;\n"
+    "    clock_enable : in std_logic;\n"
+    "    address      : in std_logic_vector(%d downto 0);\n"
+    "    data_out     : out std_logic_vector(15 downto 0);\n"
+    "    data_in      : in std_logic_vector(15 downto 0);\n"
+    "    write_enable : in std_logic);\n"
+    "end entity;\n\n"
+    "architecture rtl of %s is\n\n"
+    "    type ram_type is array (0 to %d) of std_logic_vector(15 downto 0);\n"
+    "    signal ram : ram_type := (\n";
+
+static const char VHDLFileEnd[] =
+    "begin\n\n"
+    "    process(clock)\n"
+    "    begin\n"
+    "        if rising_edge(clock) then\n"
+    "            if clock_enable = '1' then\n"
+    "                if write_enable = '1' then\n"
+    "                    ram(to_integer(unsigned(address))) <= data_in;\n"
+    "                else\n"
+    "                    data_out <= ram(to_integer(unsigned(address)));\n"
+    "                end if;\n"
+    "            end if;\n"
+    "        end if;\n"
+    "    end process;\n\n"
+    "end rtl;\n\n"
+    "--- End of file ---\n";
+
+static const char CFileStep[] =
+    "/*\n"
+    "    Push a return address, the call stack is a shift register so the deepest entry is lost\n"
+    "*/\n\n"
+    "static void push(pumpkin_t *s, unsigned int address)\n"
+    "{\n"
+    "    s->stackTop = (s->stackTop == 0) ? STACK_DEPTH - 1 : s->stackTop - 1;\n"
+    "    s->callstack[s->stackTop] = address;\n"
+    "}\n\n"
+    "/*\n"
+    "    Pop a return address, the deepest entry is left unchanged\n"
+    "*/\n\n"
+    "static unsigned int pop(pumpkin_t *s)\n"
+    "{\n"
+    "    unsigned int address;\n\n"
+    "    address = s->callstack[s->stackTop];\n"
+    "    s->callstack[s->stackTop] = s->callstack[(s->stackTop + STACK_DEPTH - 1) % STACK_DEPTH];\n"
+    "    s->stackTop = (s->stackTop + 1 == STACK_DEPTH) ? 0 : s->stackTop + 1;\n"
+    "    return address;\n"
+    "}\n\n"
+    "/*\n"
+    "    Interpret one instruction, returns 1 if it is a branch to itself. A STORE into a word\n"
+    "    built into translated code turns translation off, everything is interpreted from then on.\n"
+    "*/\n\n"
+    "static int step(pumpkin_t *s)\n"
+    "{\n"
+    "    unsigned int address;\n"
+    "    unsigned int ir;\n"
+    "    unsigned int x;\n"
+    "    unsigned int t;\n\n"
+    "    address = s->pc;\n"
+    "    ir = s->memory[address];\n"
+    "    x = ir & (MEMORY_SIZE - 1);\n"
+    "    t = s->memory[x];\n"
+    "    s->pc = (address + 1) & (MEMORY_SIZE - 1);\n"
+    "    switch(ir >> 12)\n"
+    "    {\n"
+    "        case 0x0: /* LOAD */\n"
+    "            s->a = t;\n"
+    "            break;\n"
+    "        case 0x1: /* STORE */\n"
+    "            s->memory[x] = (unsigned short)s->a;\n"
+    "            if(fixed[x])\n"
+    "            {\n"
+    "                s->translated = 0;\n"
+    "            }\n"
+    "            break;\n"
+    "        case 0x2: /* ADD */\n"
+    "            t += s->a;\n"
+    "            s->c = t >> 16;\n"
+    "            s->a = t & 0xFFFF;\n"
+    "            break;\n"
+    "        case 0x3: /* SUB */\n"
+    "            t = s->a + (t ^ 0xFFFF) + 1;\n"
+    "            s->c = t >> 16;\n"
+    "            s->a = t & 0xFFFF;\n"
+    "            break;\n"
+    "        case 0x4: /* OR */\n"
+    "            s->a |= t;\n"
+    "            break;\n"
+    "        case 0x5: /* AND */\n"
+    "            s->a &= t;\n"
+    "            break;\n"
+    "        case 0x6: /* XOR */\n"
+    "            s->a ^= t;\n"
+    "            break;\n"
+    "        case 0x7: /* ROR */\n"
+    "            s->a = (s->c << 15) | (t >> 1);\n"
+    "            s->c = t & 1;\n"
+    "            break;\n"
+    "        case 0x8: /* SWAP */\n"
+    "            s->a = ((t << 8) | (t >> 8)) & 0xFFFF;\n"
+    "            break;\n"
+    "        case 0x9: /* IN */\n"
+    "            s->a = s->in(s,t) & 0xFFFF;\n"
+    "            break;\n"
+    "        case 0xA: /* OUT */\n"
+    "            s->out(s,t,s->a);\n"
+    "            break;\n"
+    "        case 0xB: /* BR */\n"
+    "            s->pc = x;\n"
+    "            break;\n"
+    "        case 0xC: /* BNC */\n"
+    "            if(!s->c)\n"
+    "            {\n"
+    "                s->pc = x;\n"
+    "            }\n"
+    "            break;\n"
+    "        case 0xD: /* BNZ */\n"
+    "            if(s->a)\n"
+    "            {\n"
+    "                s->pc = x;\n"
+    "            }\n"
+    "            break;\n"
+    "        case 0xE: /* CALL */\n"
+    "            push(s,s->pc);\n"
+    "            s->pc = x;\n"
+    "            break;\n"
+    "        default: /* RETURN */\n"
+    "            s->pc = pop(s);\n"
+    "            break;\n"
+    "    }\n"
+    "    s->cycles += (ir >> 12) >= 0xB ? 1 : 2;\n"
+    "    s->instructions++;\n\n"
+    "    return (ir >> 12) == 0xB && x == address;\n"
+    "}\n\n";
+
+static const char CFileSync[] =
+    "    s->a = a;\n"
+    "    s->c = c;\n"
+    "    s->pc = pc;\n"
+    "    s->cycles = cycles;\n"
+    "    s->instructions = instructions;\n";
+
+static const char CFileLoad[] =
+    "    a = s->a;\n"
+    "    c = s->c;\n"
+    "    pc = s->pc;\n"
+    "    cycles = s->cycles;\n"
+    "    instructions = s->instructions;\n";
+
+
+typedef struct 
+{
+    char *name; /* Interned copy of the label name */
+    int length;
+    int value;
+    int next; /* Index of next label in the same hash bucket, -1 for end of chain */
+}label_t;
+
+typedef struct
+{
+    int value;
+    int address;
+    int next; /* Index of next immediate in the same hash bucket, -1 for end of chain */
+}immediate_t;
+
+typedef struct
+{
+    int offset; /* Start of the span in the source */
+    int length;
+}span_t;
+
+typedef struct
+{
+    int type;
+    int address; /* Memory location to patch */
+    int line; /* Source line for error messages */
+    int lineOffset; /* Start of the source line */
+    int column; /* Source offset reported in error messages */
+    int value; /* Immediate value for FIXUP_IMMEDIATE */
+    int offset; /* Label name as a span of the source */
+    int length;
+    const char *message; /* Error message for FIXUP_ERROR */
+}fixup_t;
+
+struct pasm_ctx
+{
+    int memorySize; /* Size of target memory */
+    int memoryImage[MAX_MEMORY_SIZE]; /* Assembled memory image */
+    unsigned char wordKind[MAX_MEMORY_SIZE]; /* WORD_ kind of each word in the image */
+    int wordLine[MAX_MEMORY_SIZE]; /* Source line of each word in the image */
+    unsigned short wordFlags[MAX_MEMORY_SIZE+1]; /* OPT_ flags used by the optimizer */
+    int operandFixup[MAX_MEMORY_SIZE]; /* Constant pool fixup for each instruction, used by the optimizer */
+    int relocation[MAX_MEMORY_SIZE+1]; /* New address of each word after optimization */
+    int options; /* PASM_OPTIMIZE_ flags */
+    int currentAddress;
+    int endAddress;
+    int currentLine; 
+    int numImmediates;
+    int numShortImmediates; /* Operands encoded in the instruction in place of a pool entry */
+    int maxImmediates; /* Allocated size of immediates */
+    immediate_t *immediates; /* Constant pool */
+    int immediateHashSize; /* Number of hash buckets, grows with the size of the pool */
+    int *immediateHash; /* Index of first immediate in each bucket, -1 for empty */
+    int numLabels;
+    int maxLabels; /* Allocated size of labels */
+    label_t *labels;
+    int hashSize; /* Number of hash buckets, grows with the number of labels */
+    int *labelHash; /* Index of first label in each bucket, -1 for empty */
+    int errorCount;
+    int irqVector; /* Set when the IRQ directive has placed a branch at the interrupt vector */
+    const char *source; /* Source being assembled, words and fixups refer to spans of it */
+    int lineOffset; /* Start of the current line in the source */
+    span_t *words; /* Words on the current line */
+    int wordCount;
+    int maxWords; /* Allocated size of words */
+    int buffer[DB_DW_BUFFER_SIZE]; /* Output storage for DB and DW parsers */
+    int bufferIndex;
+    int bufferType[DB_DW_BUFFER_SIZE]; /* DW entry types, DW_PENDING entries wait on a label defined later on */
+    span_t bufferLabel[DB_DW_BUFFER_SIZE]; /* Label names for pending DW entries */
+    int dup; /* DUP value used by DB/DW parsers */
+    int numFixups;
+    int maxFixups; /* Allocated size of fixups */
+    fixup_t *fixups; /* Forward references in source order, resolved at the end of assembly */
+    char *messages; /* Messages collected by report() */
+    int messageLength;
+    int messageSize; /* Allocated size of messages */
+};
+
+/*
+    Add a message to the context, messages are collected rather than printed so
+    contexts can be used from separate threads
+*/
+
+static void report(pasm_ctx_t *ctx, const char *format, ...)
+{
+    va_list args;
+    char *newMessages;
+    int length;
+    int size;
+
+    va_start(args,format);
+    length = vsnprintf(NULL,0,format,args);
+    va_end(args);
+    if(length < 0)
+    {
+        return;
+    }
+
+    /* Make room for the new message, the buffer grows as required */
+    if(ctx->messageLength + length + 1 > ctx->messageSize)
+    {
+        size = ctx->messageSize ? ctx->messageSize : MESSAGE_BUFFER_SIZE;
+        while(ctx->messageLength + length + 1 > size)
+        {
+            size *= 2;
+        }
+        newMessages = (char*)realloc(ctx->messages,size);
+        if(newMessages == NULL)
+        {
+            return;
+        }
+        ctx->messages = newMessages;
+        ctx->messageSize = size;
+    }
+
+    va_start(args,format);
+    vsnprintf(&ctx->messages[ctx->messageLength],length + 1,format,args);
+    va_end(args);
+    ctx->messageLength += length;
+}
+
+/*
+    Remove path from fileName
+*/
+
+static void removePath(char *fileName, char *filePath, int size)
+{
+    int i;
+
+    for(i=strlen(filePath);i>0;i--)
+    {
+        if(filePath[i-1]=='/' || filePath[i-1]=='\\')
+        {
+            break;
+        }
+    }
+
+    strncpy(fileName,&filePath[i],size);
+}
+
+/*
+    Remove extension from fileName
+*/
+
+static void removeExtension(char *noExt, char *fileName, int size)
+{
+    int i;
+
+    for(i=strlen(fileName);i>0;i--)
+    {
+        if(fileName[i]=='.')
+        {
+            break;
+        }
+    }
+
+    if(i == 0)
+    {
+        i = strlen(fileName);
+    }
+
+    if(i > size)
+    {
+        i = size;
+    }
+
+    strncpy(noExt,fileName,i);
+    noExt[i] = 0;
+}
+
+/*
+    Return pointer to filename extension
+*/
+
+static char *getExtension(char *fileName)
+{
+    char *ptr;
+
+    ptr = fileName;
+
+    if(strlen(fileName)>3)
+    {
+        ptr += strlen(fileName);
+        do
+        {
+            ptr--;
+            if(*ptr == '.')
+            {
+                return ptr+1;
+            }
+        }
+        while(ptr != fileName);
+    }
+    
+    return NULL;
+}
+
+/*
+    Get current date and time and return as string
+*/
+
+static void getTimeDate(char *str, int size)
+{
+    time_t t = time(NULL);
+    struct tm tm;
+
+    /* localtime() shares a static buffer, use the reentrant forms */
+#ifdef _WIN32
+    localtime_s(&tm,&t);
+#else
+    localtime_r(&t,&tm);
+#endif
+    snprintf(str,size,"%d-%d-%d %02d:%02d:%02d",tm.tm_mday,tm.tm_mon + 1,tm.tm_year + 1900,tm.tm_hour,tm.tm_min,tm.tm_sec);
+}
+
+static int bit_width(int m)
+{
+    int i;
+
+    i = 0;
+    while(m > 2)
+    {
+        i++;
+        m >>= 1;
+    }
+
+    return i;
+}
+
+
+/*
+    Create a VHDL file of a RAM model initialized with the assembled memory image 
+*/
+static int createVHDLFile(pasm_ctx_t *ctx, char *fileName)
+{
+    FILE *fp;
+    int i;
+    char entity[40];
+    char file[40];
+    char dateTime[80];
+
+    fp = fopen(fileName,"w");
+    if(fp == NULL)
+    {
+        report(ctx,"Could not open output file %s\n",fileName);
+        return 0;
+    }
+    else
+    {       
+        removePath(file, fileName, sizeof(file));
+        removeExtension(entity, file, sizeof(entity));
+        getTimeDate(dateTime, sizeof(dateTime));
+        fprintf(fp, VHDLFileStart, VERSION_STRING, file, dateTime, entity, bit_width(ctx->memorySize), entity, ctx->memorySize-1);
+        fputs("\t\t\t",fp);
+        for(i=0;i<ctx->memorySize;i++)
+        {
+            fprintf(fp, "X\"%04X\"",ctx->memoryImage[i]);
+            if(i<ctx->memorySize-1)
+            {
+                fputc(',',fp);
+                if((i+1)%8 == 0)
+                {
+                    fputs("\n\t\t\t",fp);
+                }
+            }
+            else
+            {
+                fputs(");\n",fp);
+            }            
+        }
+        fprintf(fp,VHDLFileEnd);
+        fclose(fp);
+        report(ctx,"VHDL file '%s' created.\n",fileName);
+    }
+
+    return 1;
+}
+
+/*
+    Create MIF file
+*/
+
+static int createMIFFile(pasm_ctx_t *ctx, char *fileName)
+{
+    FILE *fp;
+    int i;
+    char file[40];
+    char dateTime[80];
+
+    fp = fopen(fileName,"w");
+    if(fp == NULL)
+    {
+        report(ctx,"Could not open output file %s\n",fileName);
+        return 0;
+    }
+    else
+    {       
+        removePath(file, fileName, sizeof(file));
+        getTimeDate(dateTime, sizeof(dateTime));
+        fprintf(fp, "-- Built with PASM version %s\n",VERSION_STRING);
+        fprintf(fp, "-- File name: %s\n",file);
+        fprintf(fp, "-- %s\n\n",dateTime );
+        fprintf(fp, "DEPTH = %d;\n", ctx->memorySize);
+        fprintf(fp, "WIDTH = 16;\n");
+        fprintf(fp, "ADDRESS_RADIX = HEX;\n");
+        fprintf(fp, "DATA_RADIX = HEX;\n");
+        fprintf(fp, "CONTENT\nBEGIN\n");
+        for(i=0;i<ctx->memorySize;i++)
+        {
+            fprintf(fp, "%03X : %04X ;\n",i,ctx->memoryImage[i]);
+        }
+        fprintf(fp, "END;\n");
+        fclose(fp);
+        report(ctx,"MIF file '%s' created.\n",fileName);
+    }
+
+    return 1;
+}
+
+/*
+    Create MEM file
+*/
+
+static int createMEMFile(pasm_ctx_t *ctx, char *fileName)
+{
+    FILE *fp;
+    int i;
+    char file[40];
+    char dateTime[80];
+
+
+    fp = fopen(fileName,"w");
+    if(fp == NULL)
+    {
+        report(ctx,"Could not open output file %s\n",fileName);
+        return 0;
+    }
+    else
+    {       
+        removePath(file, fileName, sizeof(file));
+        getTimeDate(dateTime, sizeof(dateTime));
+        fprintf(fp, "#Format=AddrHex\n");
+        fprintf(fp, "#Depth=%d\n",ctx->memorySize);
+        fprintf(fp, "#Width=16\n");
+        fprintf(fp, "#AddrRadix=3\n");
+        fprintf(fp, "#DataRadix=3\n");
+        fprintf(fp, "#Data\n");
+        fprintf(fp, "#Built with PASM version %s\n",VERSION_STRING);
+        fprintf(fp, "#File name: %s\n",file);
+        fprintf(fp, "#%s\n",dateTime );
+        for(i=0;i<ctx->memorySize;i++)
+        {
+            fprintf(fp, "%03X : %04X\n",i,ctx->memoryImage[i]);
+        }
+        fprintf(fp, "# The end\n");
+        fclose(fp);
+        report(ctx,"MEM file '%s' created.\n",fileName);
+    }
+
+    return 1;
+}
+
+/*
+    Order labels by address, labels at the same address stay in the order they were defined
+*/
+
+static int compareLabels(const void *left, const void *right)
+{
+    const label_t *l = *(const label_t * const *)left;
+    const label_t *r = *(const label_t * const *)right;
+
+    if(l->value != r->value)
+    {
+        return l->value < r->value ? -1 : 1;
+    }
+    return l < r ? -1 : (l > r);
+}
+
+/*
+    Create a symbol file, the address of each label in address order
+*/
+
+static int createSYMFile(pasm_ctx_t *ctx, char *fileName)
+{
+    FILE *fp;
+    int i;
+    char file[40];
+    char dateTime[80];
+    label_t **sorted;
+
+    sorted = (label_t**)malloc((ctx->numLabels + 1) * sizeof(label_t*));
+    if(sorted == NULL)
+    {
+        report(ctx,"Error: out of memory\n");
+        return 0;
+    }
+    for(i=0;i<ctx->numLabels;i++)
+    {
+        sorted[i] = &ctx->labels[i];
+    }
+    qsort(sorted,ctx->numLabels,sizeof(label_t*),compareLabels);
+
+    fp = fopen(fileName,"w");
+    if(fp == NULL)
+    {
+        report(ctx,"Could not open output file %s\n",fileName);
+        free(sorted);
+        return 0;
+    }
+    removePath(file, fileName, sizeof(file));
+    getTimeDate(dateTime, sizeof(dateTime));
+    fprintf(fp, "; Built with PASM version %s\n",VERSION_STRING);
+    fprintf(fp, "; File name: %s\n",file);
+    fprintf(fp, "; %s\n",dateTime);
+    fprintf(fp, "; Address Label\n");
+    for(i=0;i<ctx->numLabels;i++)
+    {
+        fprintf(fp, "%03X %s\n",sorted[i]->value,sorted[i]->name);
+    }
+    fclose(fp);
+    free(sorted);
+    report(ctx,"SYM file '%s' created.\n",fileName);
+
+    return 1;
+}
+
+/*
+    Report an error at a position in the current line, ptr may be NULL if there is no position
+*/
+
+static void error(pasm_ctx_t *ctx, const char *ptr, const char *format, ...)
+{
+    va_list args;
+    char message[MAX_MESSAGE_LENGTH];
+
+    va_start(args,format);
+    vsnprintf(message,sizeof(message),format,args);
+    va_end(args);
+
+    if(ptr != NULL)
+    {
+        report(ctx,"Error line %d, column %d: %s\n",ctx->currentLine,(int)(ptr - ctx->source) - ctx->lineOffset + 1,message);
+    }
+    else
+    {
+        report(ctx,"Error line %d: %s\n",ctx->currentLine,message);
+    }
+    ctx->errorCount++;
+}
+
+/*
+    Record the kind and source line of a word written to the image
+*/
+
+static void markWord(pasm_ctx_t *ctx, int address, int kind)
+{
+    if(address < ctx->memorySize)
+    {
+        ctx->wordKind[address] = (ctx->wordKind[address] & WORD_ORG) | kind;
+        ctx->wordLine[address] = ctx->currentLine;
+    }
+}
+
+/*
+    Return pointer to the first character of a word
+*/
+
+static const char *wordText(pasm_ctx_t *ctx, int word)
+{
+    return ctx->source + ctx->words[word].offset;
+}
+
+/*
+    Compare a word with a string
+*/
+
+static int wordIs(pasm_ctx_t *ctx, int word, const char *match)
+{
+    return ctx->words[word].length == (int)strlen(match) && memcmp(wordText(ctx,word),match,ctx->words[word].length) == 0;
+}
+
+/*
+    Convert number in the same way as strtol() with base 0, the number must not extend past end.
+    Returns a pointer to the first character after the number, or ptr if there is no number.
+*/
+
+static const char *parseNumber(const char *ptr, const char *end, long *value)
+{
+    const char *start;
+    unsigned long result;
+    int negative;
+    int overflow;
+    int base;
+    int digit;
+    int digits;
+
+    start = ptr;
+    result = 0;
+    negative = 0;
+    overflow = 0;
+    digits = 0;
+    base = 10;
+
+    if(ptr < end && (*ptr == '+' || *ptr == '-'))
+    {
+        negative = (*ptr == '-');
+        ptr++;
+    }
+    if(ptr < end && *ptr == '0')
+    {
+        base = 8;
+        if(ptr + 2 < end && (ptr[1] == 'x' || ptr[1] == 'X') && isxdigit((unsigned char)ptr[2]))
+        {
+            base = 16;
+            ptr += 2;
+        }
+    }
+    while(ptr < end)
+    {
+        if(isdigit((unsigned char)*ptr))
+        {
+            digit = *ptr - '0';
+        }
+        else if(isxdigit((unsigned char)*ptr))
+        {
+            digit = toupper((unsigned char)*ptr) - 'A' + 10;
+        }
+        else
+        {
+            break;
+        }
+        if(digit >= base)
+        {
+            break;
+        }
+        if(result > (ULONG_MAX - digit) / base)
+        {
+            overflow = 1;
+        }
+        result = result * base + digit;
+        digits++;
+        ptr++;
+    }
+
+    if(digits == 0)
+    {
+        *value = 0;
+        return start;
+    }
+
+    /* Clamp out of range values as strtol() */
+    if(negative)
+    {
+        *value = (overflow || result > (unsigned long)LONG_MAX + 1) ? LONG_MIN : -(long)result;
+    }
+    else
+    {
+        *value = (overflow || result > (unsigned long)LONG_MAX) ? LONG_MAX : (long)result;
+    }
+
+    return ptr;
+}
+
+/*
+    Add a word to the current line
+*/
+
+static int addWord(pasm_ctx_t *ctx, int offset, int length)
+{
+    span_t *newWords;
+    int size;
+
+    /* Make room for the new word, there is no limit on the number of words on a line */
+    if(ctx->wordCount >= ctx->maxWords)
+    {
+        size = ctx->maxWords ? ctx->maxWords * 2 : WORD_TABLE_SIZE;
+        newWords = (span_t*)realloc(ctx->words,size * sizeof(span_t));
+        if(newWords == NULL)
+        {
+            error(ctx,NULL,"out of memory");
+            return 0;
+        }
+        ctx->words = newWords;
+        ctx->maxWords = size;
+    }
+
+    ctx->words[ctx->wordCount].offset = offset;
+    ctx->words[ctx->wordCount].length = length;
+    ctx->wordCount++;
+    return 1;
+}
+
+/* 
+    Split the line starting at ctx->lineOffset into words delimited by whitespace, words are
+    spans of the source which is not copied or changed. Returns the offset of the next line.
+*/
+static int splitLine(pasm_ctx_t *ctx, int length)
+{
+    int i;
+    int lineEnd;
+    int nextWord;
+    int wordStart;
+    int quote; 
+    int quoteStart;
+    const char *source;
+
+    source = ctx->source;
+    ctx->wordCount = 0;
+    nextWord = 1; /* Searching for start of next word */
+    quote = 0; /* Ignore spaces inside quotes */
+    quoteStart = 0;
+    wordStart = 0;
+
+    /* Find end of line */
+    for(lineEnd=ctx->lineOffset;lineEnd<length;lineEnd++)
+    {
+        if(source[lineEnd] == '\n')
+        {
+            break;
+        }
+    }
+
+    for(i=ctx->lineOffset;i<lineEnd;i++)
+    {
+        /* End of line or start of comment */
+        if(source[i] == 0 || source[i] == ';')
+        {
+            break;
+        }
+        /* Toggle quotes (used to ignore spaces inside quotes) */
+        if(source[i] == '\"')
+        {
+            quote ^= 1;            
+            quoteStart = i;
+        }        
+        if(nextWord == 1 && !isspace((unsigned char)source[i]))
+        {
+            /* Start of next word */
+            wordStart = i;
+            nextWord = 0;
+            continue;
+        }
+        if(nextWord == 0 && isspace((unsigned char)source[i]) && quote == 0)
+        {
+            /* End of current word */
+            if(!addWord(ctx,wordStart,i - wordStart))
+            {
+                ctx->wordCount = 0;
+                return lineEnd + 1;
+            }
+            nextWord = 1;
+        }
+    }
+    if(nextWord == 0 && !addWord(ctx,wordStart,i - wordStart))
+    {
+        ctx->wordCount = 0;
+        return lineEnd + 1;
+    }
+
+    /* Check if quotes are still open */
+    if(quote)
+    {
+        error(ctx,&source[quoteStart],"no closing \"");
+        ctx->wordCount = 0;
+    }
+
+    return lineEnd + 1;
+}
+
+/*
+    Return instruction opcode (0 to 15) or -1 if word is not an instruction 
+*/
+
+static int getInstruction(pasm_ctx_t *ctx, int word)
+{
+    int i;
+
+    for(i=0;i<NUMBER_OF_INSTRUCTIONS;i++)
+    {
+        if(wordIs(ctx,word,instructions[i]))
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Hash a label name (FNV-1a)
+*/
+
+static unsigned int hashLabel(const char *name, int length)
+{
+    unsigned int hash;
+
+    hash = 2166136261u;
+    while(length--)
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+    Return index of label in labels[] or -1 if it does not exist
+*/
+
+static int lookupLabel(pasm_ctx_t *ctx, const char *name, int length)
+{
+    int i;
+
+    if(ctx->hashSize == 0)
+    {
+        return -1;
+    }
+
+    for(i=ctx->labelHash[hashLabel(name,length) & (ctx->hashSize - 1)];i>=0;i=ctx->labels[i].next)
+    {
+        if(ctx->labels[i].length == length && memcmp(ctx->labels[i].name,name,length)==0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Change the number of hash buckets and rebuild the chains, size must be a 2^n number
+*/
+
+static int resizeLabelHash(pasm_ctx_t *ctx, int size)
+{
+    int *newHash;
+    int bucket;
+    int i;
+
+    newHash = (int*)malloc(size * sizeof(int));
+    if(newHash == NULL)
+    {
+        return 0;
+    }
+    for(i=0;i<size;i++)
+    {
+        newHash[i] = -1;
+    }
+    for(i=0;i<ctx->numLabels;i++)
+    {
+        bucket = hashLabel(ctx->labels[i].name,ctx->labels[i].length) & (size - 1);
+        ctx->labels[i].next = newHash[bucket];
+        newHash[bucket] = i;
+    }
+
+    free(ctx->labelHash);
+    ctx->labelHash = newHash;
+    ctx->hashSize = size;
+    return 1;
+}
+
+/*
+    Remove all labels
+*/
+
+static void clearLabels(pasm_ctx_t *ctx)
+{
+    int i;
+
+    for(i=0;i<ctx->numLabels;i++)
+    {
+        free(ctx->labels[i].name);
+    }
+    free(ctx->labels);
+    free(ctx->labelHash);
+    ctx->labels = NULL;
+    ctx->labelHash = NULL;
+    ctx->numLabels = 0;
+    ctx->maxLabels = 0;
+    ctx->hashSize = 0;
+}
+
+/* 
+    Perform various checks on the label in word if all is OK add to label list
+*/
+
+static int addLabel(pasm_ctx_t *ctx, int word)
+{
+    int i;
+    int bucket;
+    int length;
+    const char *newLabel;
+    label_t *newLabels;
+
+    newLabel = wordText(ctx,word);
+    length = ctx->words[word].length;
+
+    /* Check label is not too long */
+    if(length > MAX_LABEL_NAME_LENGTH)
+    {
+        error(ctx,newLabel,"label too long");
+        return 0;
+    }
+
+    /* Check if label is a reserved word */
+    if(getInstruction(ctx,word) >= 0 ||
+        wordIs(ctx,word,"ORG") || 
+        wordIs(ctx,word,"DUP") ||
+        wordIs(ctx,word,"DW") ||
+        wordIs(ctx,word,"DB") ||
+        wordIs(ctx,word,"NOP") ||
+        wordIs(ctx,word,"RETI") ||
+        wordIs(ctx,word,"IRQ"))
+    {
+        error(ctx,newLabel,"reserved word %.*s found in column 1",length,newLabel);
+        return 0;
+    }
+
+    /* Check if label is already defined */
+    if(lookupLabel(ctx,newLabel,length) >= 0)
+    {
+        error(ctx,newLabel,"label %.*s already defined",length,newLabel);
+        return 0;
+    }
+
+    /* Make room for the new label, the table grows as required */
+    if(ctx->numLabels >= ctx->maxLabels)
+    {
+        i = ctx->maxLabels ? ctx->maxLabels * 2 : LABEL_HASH_SIZE;
+        newLabels = (label_t*)realloc(ctx->labels,i * sizeof(label_t));
+        if(newLabels == NULL)
+        {
+            error(ctx,NULL,"out of memory");
+            return 0;
+        }
+        ctx->labels = newLabels;
+        ctx->maxLabels = i;
+    }
+
+    /* Keep chains short by doubling the number of buckets when the table fills */
+    if(ctx->numLabels >= ctx->hashSize && !resizeLabelHash(ctx,ctx->hashSize ? ctx->hashSize * 2 : LABEL_HASH_SIZE))
+    {
+        error(ctx,NULL,"out of memory");
+        return 0;
+    }
+
+    /* Add label to list */
+    ctx->labels[ctx->numLabels].name = (char*)malloc(length + 1);
+    if(ctx->labels[ctx->numLabels].name == NULL)
+    {
+        error(ctx,NULL,"out of memory");
+        return 0;
+    }
+    memcpy(ctx->labels[ctx->numLabels].name,newLabel,length);
+    ctx->labels[ctx->numLabels].name[length] = 0;
+    ctx->labels[ctx->numLabels].length = length;
+    ctx->labels[ctx->numLabels].value = ctx->currentAddress;
+    bucket = hashLabel(newLabel,length) & (ctx->hashSize - 1);
+    ctx->labels[ctx->numLabels].next = ctx->labelHash[bucket];
+    ctx->labelHash[bucket] = ctx->numLabels;
+    ctx->numLabels++;
+    return 1;
+}
+
+/*
+    Check if the first word is a valid label then add to the label list checking it does not
+    already exist. A label must start at column 1 and start with a alpha character and
+    only contain alpha-numeric and underscore characters.
+*/
+
+static int firstWordLabel(pasm_ctx_t *ctx)
+{
+    int i;
+    char c;
+    const char *word;
+
+    word = wordText(ctx,0);
+    if(ctx->words[0].offset == ctx->lineOffset && isalpha((unsigned char)word[0]))
+    {
+        for(i=0;i<MAX_LABEL_NAME_LENGTH;i++)
+        {
+            /* End of word - try to add to label list */
+            if(i == ctx->words[0].length)
+            {
+                if(!addLabel(ctx,0))
+                {
+                    /* Error adding label, clear word count to stop parsing the rest of the line */
+                    ctx->wordCount = 0;
+                    return 0;
+                }
+                else
+                {
+                    /* New label created */
+                    return 1;
+                }
+            }
+            /* Check character by character */
+            c = word[i];
+            if((!isalnum((unsigned char)c)) && c != '_')
+            {
+                break; /* Not a valid label */
+            }
+        }
+    }
+    return 0; /* Not a valid label */
+}
+
+/*
+    Handle the ORG directive, change currentAddress to value following ORG
+    firstWord indexes 'ORG' in the words array
+*/
+
+static void parseORG(pasm_ctx_t *ctx, int firstWord)
+{
+    long orgValue;
+    const char *value;
+    const char *end;
+
+    /* Check for correct number of words and parameter starts with a number */
+    if((ctx->wordCount != firstWord + 2) || (!isdigit((unsigned char)wordText(ctx,firstWord+1)[0])))
+    {
+        error(ctx,wordText(ctx,firstWord),"ORG expects a single numeric value");
+        return;
+    }
+
+    /* Convert string to int */
+    value = wordText(ctx,firstWord+1);
+    end = value + ctx->words[firstWord+1].length;
+
+    /* Check for garbage after number */
+    if(parseNumber(value,end,&orgValue) != end)
+    {
+        error(ctx,value,"syntax");
+        return;
+    }
+
+    /* Check if ORG is backwards */
+    if((int)orgValue < ctx->currentAddress)
+    {
+        error(ctx,value,"ORG preceeds current address");
+        return;
+    }
+
+    /* Check ORG is within memory range */
+    if((int)orgValue >= ctx->memorySize)
+    {
+        error(ctx,value,"ORG exceeds memory size");
+        return;  
+    }
+
+    /* Mark the start of a new block, the optimizer keeps it at the same address */
+    if((int)orgValue > ctx->currentAddress)
+    {
+        ctx->wordKind[orgValue] |= WORD_ORG;
+    }
+
+    /* Change current address to ORG value */
+    ctx->currentAddress = (int)orgValue;
+}
+
+/*
+    Check if label exists, return label value or -1 if it does not exist.
+*/
+
+static int findLabel(pasm_ctx_t *ctx, const char *name, int length)
+{
+    int i;
+
+    i = lookupLabel(ctx,name,length);
+    if(i >= 0)
+    {
+        return ctx->labels[i].value;
+    }
+
+    return -1;
+}
+
+/*
+    Add a fixup to be resolved at the end of assembly, the label name is a span of the source
+    at offset, message is used for FIXUP_ERROR and column is where an error is reported
+*/
+
+static void addFixup(pasm_ctx_t *ctx, int type, int address, int value, int offset, int length, const char *column, const char *message)
+{
+    fixup_t *newFixups;
+    int size;
+
+    /* Make room for the new fixup, the table grows as required */
+    if(ctx->numFixups >= ctx->maxFixups)
+    {
+        size = ctx->maxFixups ? ctx->maxFixups * 2 : FIXUP_TABLE_SIZE;
+        newFixups = (fixup_t*)realloc(ctx->fixups,size * sizeof(fixup_t));
+        if(newFixups == NULL)
+        {
+            error(ctx,NULL,"out of memory");
+            return;
+        }
+        ctx->fixups = newFixups;
+        ctx->maxFixups = size;
+    }
+
+    ctx->fixups[ctx->numFixups].type = type;
+    ctx->fixups[ctx->numFixups].address = address;
+    ctx->fixups[ctx->numFixups].line = ctx->currentLine;
+    ctx->fixups[ctx->numFixups].lineOffset = ctx->lineOffset;
+    ctx->fixups[ctx->numFixups].column = (int)(column - ctx->source);
+    ctx->fixups[ctx->numFixups].value = value;
+    ctx->fixups[ctx->numFixups].offset = offset;
+    ctx->fixups[ctx->numFixups].length = length;
+    ctx->fixups[ctx->numFixups].message = message;
+    ctx->numFixups++;
+}
+
+/*
+    Remove all fixups
+*/
+
+static void clearFixups(pasm_ctx_t *ctx)
+{
+    free(ctx->fixups);
+    ctx->fixups = NULL;
+    ctx->numFixups = 0;
+    ctx->maxFixups = 0;
+}
+
+/*
+    Check and extract DUP from DW / DB
+*/
+
+static int parseDUP(pasm_ctx_t *ctx, int firstWord)
+{
+    long value;
+    const char *count;
+    const char *end;
+
+    /* Nothing to do if wordCount = firstword + 2 */
+    if(ctx->wordCount == firstWord + 2)
+    {
+        ctx->dup = 0;
+        return 1;
+    }
+
+
+    /* Check if line includes DUP */
+    if(ctx->wordCount == firstWord + 4)
+    {
+        if(wordIs(ctx,firstWord+2,"DUP"))
+        {
+            count = wordText(ctx,firstWord+3);
+            end = count + ctx->words[firstWord+3].length;
+            if(parseNumber(count,end,&value) == end)
+            {
+               ctx->dup = (int)value;
+               if(ctx->dup > sizeof(ctx->buffer))
+               {
+                    error(ctx,count,"DUP exceeds maximum");
+                    return 0;
+               }
+               return 1;
+            }            
+        }
+    }
+
+    error(ctx,wordText(ctx,firstWord+2),"syntax");
+    return 0;
+}
+
+/*
+    Lower level DB parsing
+
+    Returns bufferIndex value which will be 0 if an error was found
+*/
+
+static int parseDB2(pasm_ctx_t *ctx, const char *word, const char *end)
+{
+    const char *ptr;
+    const char *endStrol;
+    long value;
+
+    ctx->bufferIndex = 0;
+    ptr = word;
+    while(1)
+    {
+        /* Check for number */
+        if(ptr < end && isdigit((unsigned char)*ptr))
+        {
+            endStrol = parseNumber(ptr,end,&value);
+            /* Check valid delimiters */
+            if(endStrol == end || *endStrol == ',')
+            {
+                /* Range check */
+                if(value < 256)
+                {
+                    /* Store value and advance index if space in buffer */
+                    if(ctx->bufferIndex < DB_DW_BUFFER_SIZE)
+                    {
+                        ctx->buffer[ctx->bufferIndex++] = (int)value;
+                    }                    
+                    if(endStrol == end)
+                    {
+                        break; /* Finished */
+                    }
+                    else
+                    {                        
+                        ptr = endStrol + 1; /* More data, update and advance pointer past comma */                        
+                        continue;
+                    }
+                }
+                else
+                {
+                    error(ctx,ptr,"DB value exceeds 255");
+                    ctx->bufferIndex = 0;
+                    break;
+                }
+            }
+        }
+
+        /* Check for string in quotes */
+        if(ptr < end && *ptr == '\"')
+        {
+            do /* Copy string to buffer */
+            {
+                ptr++;
+                if(ptr == end || *ptr == '\"')
+                {
+                    break;
+                }
+                if(ctx->bufferIndex < DB_DW_BUFFER_SIZE)
+                {
+                    ctx->buffer[ctx->bufferIndex++] = (int)*ptr;
+                }
+            }while(1);
+            /* Check string terminated correctly */
+            if(ptr < end && *ptr == '\"')
+            {
+                ptr++;
+                if(ptr < end && *ptr == ',')
+                {
+                    ptr++; /* More data */
+                    continue;
+                }
+                if(ptr == end)
+                {
+                    break; /* No more data */
+                }
+            }
+        }
+
+        error(ctx,ptr,"syntax");
+        ctx->bufferIndex = 0;
+        break;
+    }
+
+    return ctx->bufferIndex;
+}
+
+/*
+    Handle NOP - just a branch to the next instruction
+*/
+
+static void parseNOP(pasm_ctx_t *ctx, int firstWord)
+{
+    /* Make sure there is nothing else on ths line */
+    if(firstWord + 1 != ctx->wordCount)
+    {
+        error(ctx,wordText(ctx,firstWord+1),"NOP does not take parameters");
+        return;  
+    }
+
+    if(ctx->currentAddress < ctx->memorySize)
+    {
+        markWord(ctx,ctx->currentAddress,WORD_CODE);
+        ctx->memoryImage[ctx->currentAddress] = 0xB000 + ctx->currentAddress + 1;
+    }
+    ctx->currentAddress++;
+}
+
+/*
+    Handle RETI - RETURN with bit 0 set, also restores the carry flag saved on interrupt entry
+*/
+
+static void parseRETI(pasm_ctx_t *ctx, int firstWord)
+{
+    if(firstWord + 1 != ctx->wordCount)
+    {
+        error(ctx,wordText(ctx,firstWord+1),"RETI does not take parameters");
+        return;  
+    }
+
+    if(ctx->currentAddress < ctx->memorySize)
+    {
+        markWord(ctx,ctx->currentAddress,WORD_CODE);
+        ctx->memoryImage[ctx->currentAddress] = RETI;
+    }
+    ctx->currentAddress++;
+}
+
+/*
+    Handle DB
+*/
+
+static void parseDB(pasm_ctx_t *ctx, int firstWord)
+{
+    int i;
+
+    /* Check if there is something else on this line */
+    if(ctx->wordCount < firstWord + 2)
+    {
+        error(ctx,wordText(ctx,firstWord),"DB expects one or more values");
+        return;
+    }
+
+    /* Check for DUP */
+    if(!parseDUP(ctx,firstWord))
+    {
+        return; /* An error was found */
+    }
+
+    /* Parse the line */
+    if(parseDB2(ctx,wordText(ctx,firstWord+1),wordText(ctx,firstWord+1) + ctx->words[firstWord+1].length) == 0)
+    {
+        return; /* Error */
+    }
+
+    /* Duplicate */
+    if(ctx->dup > 0)
+    {
+        if(ctx->bufferIndex > 1)
+        {
+            error(ctx,wordText(ctx,firstWord+1),"can only duplicate a single byte");
+            return;
+        }
+        for(i=1;i<ctx->dup;i++)
+        {
+            if(ctx->bufferIndex < DB_DW_BUFFER_SIZE)
+            {
+                ctx->buffer[ctx->bufferIndex] = ctx->buffer[0];
+            }
+            ctx->bufferIndex++;
+        }
+    }
+
+    /* Check for data overflow */
+    if(ctx->bufferIndex > DB_DW_BUFFER_SIZE)
+    {
+        error(ctx,wordText(ctx,firstWord+1),"too much data for DB");
+        return;
+    }
+
+    /* Add pading byte if odd number of bytes */
+    if(ctx->bufferIndex%2)
+    {
+        ctx->buffer[ctx->bufferIndex++] = 0;
+    }
+
+    /* Check data fits into memory */
+    if(ctx->currentAddress + (ctx->bufferIndex/2) > ctx->memorySize)
+    {
+        error(ctx,wordText(ctx,firstWord),"DB exceeds remaining memory");
+        return;  
+    }
+
+    /* Copy to memory image */
+    for(i=0;i<ctx->bufferIndex;i+=2)
+    {
+        markWord(ctx,ctx->currentAddress,WORD_DATA);
+        ctx->memoryImage[ctx->currentAddress++] = (ctx->buffer[i] << 8)|(ctx->buffer[i+1]);
+    }
+}
+
+/*
+    Lower level DW parsing
+
+    Returns bufferIndex value which will be 0 if an error was found
+*/
+
+static int parseDW2(pasm_ctx_t *ctx, const char *word, const char *end)
+{
+    const char *ptr;
+    const char *endStrol;
+    const char *name;
+    long value;
+    int nameLength;
+
+    ctx->bufferIndex = 0;
+    ptr = word;
+    while(1)
+    {
+        /* Check for number */
+        if(ptr < end && isdigit((unsigned char)*ptr))
+        {
+            endStrol = parseNumber(ptr,end,&value);
+            /* Check valid delimiters */
+            if(endStrol == end || *endStrol == ',')
+            {
+                /* Range check */
+                if(value < 65536L)
+                {
+                    /* Store value and advance index if space in buffer */
+                    if(ctx->bufferIndex < DB_DW_BUFFER_SIZE)
+                    {
+                        ctx->buffer[ctx->bufferIndex] = (int)value;
+                        ctx->bufferType[ctx->bufferIndex] = DW_VALUE;
+                    }  
+                    ctx->bufferIndex++;                  
+                    if(endStrol == end)
+                    {
+                        break; /* Finished */
+                    }
+                    else
+                    {                        
+                        ptr = endStrol + 1; /* More data, update and advance pointer past comma */                        
+                        continue;
+                    }
+                }
+                else
+                {
+                    error(ctx,ptr,"DW value exceeds 65536");
+                    ctx->bufferIndex = 0;
+                    break;
+                }
+            }
+        }
+        /* Check for leter - start of label */
+        if(ptr < end && isalpha((unsigned char)*ptr))            
+        {
+            /* Find end of label */
+            name = ptr;
+            while(ptr < end && *ptr != ',')
+            {
+                ptr++;
+            }
+            nameLength = (int)(ptr - name);
+            if(nameLength >= MAX_LABEL_NAME_LENGTH)
+            {
+                /* If label is too long, clear and end the list so error will be detected trying to resolve label */
+                nameLength = 0;
+                end = name + MAX_LABEL_NAME_LENGTH;
+                ptr = end;
+            }
+            if(ctx->bufferIndex < DB_DW_BUFFER_SIZE)
+            {
+                /* Resolve label if already defined, otherwise leave it pending until the end of assembly */
+                value = (long)findLabel(ctx,name,nameLength);
+                if(value < 0)
+                {
+                    ctx->buffer[ctx->bufferIndex] = 0;
+                    ctx->bufferType[ctx->bufferIndex] = DW_PENDING;
+                    ctx->bufferLabel[ctx->bufferIndex].offset = (int)(name - ctx->source);
+                    ctx->bufferLabel[ctx->bufferIndex].length = nameLength;
+                }
+                else
+                {
+                    ctx->buffer[ctx->bufferIndex] = (int)value;
+                    ctx->bufferType[ctx->bufferIndex] = DW_LABEL;
+                }                    
+            }
+            ctx->bufferIndex++;
+            /* Check for more data on this line */
+            if(ptr == end)
+            {                            
+                break; /* Finished */
+            }
+            else
+            {
+                ptr++; /* More data move past comma */
+                continue; 
+            }
+                    
+        }
+        /* If not a letter or number then syntax error */
+        error(ctx,ptr,"syntax");
+        ctx->bufferIndex = 0;
+        break;
+    }
+
+    return ctx->bufferIndex;
+}
+
+/*
+    Handle DW
+*/
+
+static void parseDW(pasm_ctx_t *ctx, int firstWord)
+{
+    int i;
+
+    /* Check if there is something else on this line */
+    if(ctx->wordCount < firstWord + 2)
+    {
+        error(ctx,wordText(ctx,firstWord),"DW expects one or more values");
+        return;
+    }
+
+    /* Check for DUP */
+    if(!parseDUP(ctx,firstWord))
+    {
+        return; /* An error was found */
+    }
+
+    /* Parse the line */
+    if(parseDW2(ctx,wordText(ctx,firstWord+1),wordText(ctx,firstWord+1) + ctx->words[firstWord+1].length) == 0)
+    {
+        return; /* Error */
+    }
+
+    /* Duplicate */
+    if(ctx->dup > 0)
+    {
+        if(ctx->bufferIndex > 1)
+        {
+            error(ctx,wordText(ctx,firstWord+1),"can only duplicate a single word");
+            return;
+        }
+        for(i=1;i<ctx->dup;i++)
+        {
+            if(ctx->bufferIndex < DB_DW_BUFFER_SIZE)
+            {
+                ctx->buffer[ctx->bufferIndex] = ctx->buffer[0];
+                ctx->bufferType[ctx->bufferIndex] = ctx->bufferType[0];
+                ctx->bufferLabel[ctx->bufferIndex] = ctx->bufferLabel[0];
+            }
+            ctx->bufferIndex++;
+        }
+    }
+
+    /* Check for data overflow */
+    if(ctx->bufferIndex > DB_DW_BUFFER_SIZE)
+    {
+        error(ctx,wordText(ctx,firstWord+1),"too much data for DW");
+        return;
+    }
+
+    /* Check data fits into memory */
+    if(ctx->currentAddress + ctx->bufferIndex > ctx->memorySize)
+    {
+        error(ctx,wordText(ctx,firstWord),"DW exceeds remaining memory");
+        return;  
+    }
+
+    /* Copy to memory image, labels not yet defined are patched at the end of assembly */
+    for(i=0;i<ctx->bufferIndex;i++)
+    {
+        markWord(ctx,ctx->currentAddress,ctx->bufferType[i] == DW_VALUE ? WORD_DATA : WORD_ADDRESS);
+        if(ctx->bufferType[i] == DW_PENDING)
+        {
+            addFixup(ctx,FIXUP_DATA,ctx->currentAddress,0,ctx->bufferLabel[i].offset,ctx->bufferLabel[i].length,wordText(ctx,firstWord+1),NULL);
+        }
+        ctx->memoryImage[ctx->currentAddress++] = ctx->buffer[i];
+    }
+}
+
+/*
+    Get immediate value from string
+*/
+
+static int getImmediateValue(const char *operand, int length, int *value)
+{
+    long number;
+    
+    if(length > 0)
+    {
+        if(parseNumber(operand,operand + length,&number) == operand + length)
+        {
+            *value = (int)number;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+    Hash an immediate value
+*/
+
+static unsigned int hashImmediate(int value)
+{
+    return ((unsigned int)value * 2654435761u) >> 8;
+}
+
+/*
+    Change the number of constant pool hash buckets and rebuild the chains, size must be a 2^n number
+*/
+
+static int resizeImmediateHash(pasm_ctx_t *ctx, int size)
+{
+    int *newHash;
+    int bucket;
+    int i;
+
+    newHash = (int*)malloc(size * sizeof(int));
+    if(newHash == NULL)
+    {
+        return 0;
+    }
+    for(i=0;i<size;i++)
+    {
+        newHash[i] = -1;
+    }
+    for(i=0;i<ctx->numImmediates;i++)
+    {
+        bucket = hashImmediate(ctx->immediates[i].value) & (size - 1);
+        ctx->immediates[i].next = newHash[bucket];
+        newHash[bucket] = i;
+    }
+
+    free(ctx->immediateHash);
+    ctx->immediateHash = newHash;
+    ctx->immediateHashSize = size;
+    return 1;
+}
+
+/*
+    Remove all immediates from the constant pool
+*/
+
+static void clearImmediates(pasm_ctx_t *ctx)
+{
+    free(ctx->immediates);
+    free(ctx->immediateHash);
+    ctx->immediates = NULL;
+    ctx->immediateHash = NULL;
+    ctx->numImmediates = 0;
+    ctx->maxImmediates = 0;
+    ctx->immediateHashSize = 0;
+}
+
+/*
+    Add immediate to list if not already there and return address
+*/
+
+static int resolveImmediate(pasm_ctx_t *ctx, int value)
+{
+    int i;
+    int bucket;
+    immediate_t *newImmediates;
+
+    /* Check if immediate has been used before */
+    if(ctx->immediateHashSize > 0)
+    {
+        for(i=ctx->immediateHash[hashImmediate(value) & (ctx->immediateHashSize - 1)];i>=0;i=ctx->immediates[i].next)
+        {
+            if(ctx->immediates[i].value == value)
+            {
+                /* Retrun address of existing immediate */
+                return ctx->immediates[i].address;
+            }
+        }
+    }
+
+    /* Make room for new immediate, the pool grows as required */
+    if(ctx->numImmediates >= ctx->maxImmediates)
+    {
+        i = ctx->maxImmediates ? ctx->maxImmediates * 2 : IMMEDIATE_HASH_SIZE;
+        newImmediates = (immediate_t*)realloc(ctx->immediates,i * sizeof(immediate_t));
+        if(newImmediates == NULL)
+        {
+            report(ctx,"Error line %d: out of memory\n",ctx->currentLine);
+            ctx->errorCount++;
+            return 0;
+        }
+        ctx->immediates = newImmediates;
+        ctx->maxImmediates = i;
+    }
+    if(ctx->numImmediates >= ctx->immediateHashSize && !resizeImmediateHash(ctx,ctx->immediateHashSize ? ctx->immediateHashSize * 2 : IMMEDIATE_HASH_SIZE))
+    {
+        report(ctx,"Error line %d: out of memory\n",ctx->currentLine);
+        ctx->errorCount++;
+        return 0;
+    }
+
+    /* Create new immediate */
+    ctx->immediates[ctx->numImmediates].value = value;
+    ctx->immediates[ctx->numImmediates].address = ctx->endAddress;
+    bucket = hashImmediate(value) & (ctx->immediateHashSize - 1);
+    ctx->immediates[ctx->numImmediates].next = ctx->immediateHash[bucket];
+    ctx->immediateHash[bucket] = ctx->numImmediates;
+    ctx->numImmediates++;
+
+    /* Add to memory image if there is space - overflow error detected later on */
+    if(ctx->endAddress < ctx->memorySize)
+    {
+        ctx->memoryImage[ctx->endAddress] = value;
+    }
+    
+    return(ctx->endAddress++);
+}
+
+
+/*
+    Patch the memory image with an operand value
+*/
+
+static void patchOperand(pasm_ctx_t *ctx, int address, int value)
+{
+    if(address < ctx->memorySize)
+    {
+        ctx->memoryImage[address] |= value;
+    }
+}
+
+/*
+    Parse instruction, operands that are not yet known are left as fixups
+    firstWord indexes the instruction in the words array
+*/
+
+static void parseInstruction(pasm_ctx_t *ctx, int instruction, int firstWord)
+{
+    int value;
+    int operandCount;
+    const char *operand;
+    int length;
+
+    operandCount = ctx->wordCount - firstWord - 1;
+
+    /* Check correct number of operands first, reported with the fixups to keep errors in line order */
+    if(instruction==15 && operandCount > 0)
+    {
+        addFixup(ctx,FIXUP_ERROR,ctx->currentAddress,0,0,0,wordText(ctx,firstWord+1),"operand not valid for RETURN instruction");
+        return;
+    }
+    if(instruction!=15 && operandCount != 1)
+    {
+        addFixup(ctx,FIXUP_ERROR,ctx->currentAddress,0,0,0,wordText(ctx,operandCount ? firstWord+2 : firstWord),"instruction expects an operand");
+        return;
+    }
+    /* Shift opcode */
+    if(ctx->currentAddress < ctx->memorySize)
+    {
+        markWord(ctx,ctx->currentAddress,WORD_CODE);
+        ctx->memoryImage[ctx->currentAddress] = instruction << 12;
+    }
+    /* Handle operand if there is one */
+    while(operandCount)
+    {
+        operand = wordText(ctx,firstWord+1);
+        length = ctx->words[firstWord+1].length;
+        /* Constant pool entries are allocated in source order once all labels are known */
+        if(operand[0]=='#') /* Immediate */
+        {
+            if(getImmediateValue(&operand[1],length-1,&value))
+            {
+                addFixup(ctx,FIXUP_IMMEDIATE,ctx->currentAddress,value,0,0,operand,NULL);
+                break;
+            }
+        }  
+        if(operand[0]=='@') /* Address of label */
+        {
+            addFixup(ctx,FIXUP_ADDRESS_OF,ctx->currentAddress,0,(int)(operand + 1 - ctx->source),length-1,operand,NULL);
+            break;
+        }
+        /* Any error with '#' will fall through here and findLable will fail */
+        value = findLabel(ctx,operand,length);       
+        if(value >= 0)
+        {
+            /* Label found */
+            patchOperand(ctx,ctx->currentAddress,value);
+            break;
+        }
+        /* Label may be defined later on */
+        addFixup(ctx,FIXUP_LABEL,ctx->currentAddress,0,(int)(operand - ctx->source),length,operand,NULL);
+        break;
+    }
+}
+
+/*
+    Handle the IRQ directive, a branch to the interrupt handler placed at the interrupt vector
+    firstWord indexes 'IRQ' in the words array
+*/
+
+static void parseIRQ(pasm_ctx_t *ctx, int firstWord)
+{
+    if(ctx->currentAddress != IRQ_VECTOR)
+    {
+        error(ctx,wordText(ctx,firstWord),"IRQ must be at the interrupt vector, address %d",IRQ_VECTOR);
+        return;
+    }
+
+    parseInstruction(ctx,I_BR,firstWord);
+    ctx->wordKind[IRQ_VECTOR] |= WORD_ORG;
+    ctx->irqVector = 1;
+    ctx->currentAddress++;
+}
+
+/*
+    Resolve label fixups in source order, all labels are now known. Operands from the constant pool
+    are checked here but left for resolvePool() so the optimizer can run before the pool is built.
+*/
+
+static void resolveFixups(pasm_ctx_t *ctx)
+{
+    int i;
+    int value;
+    int dataErrorLine;
+    fixup_t *fixup;
+
+    dataErrorLine = 0;
+    for(i=0;i<ctx->numFixups;i++)
+    {
+        fixup = &ctx->fixups[i];
+        ctx->currentLine = fixup->line;
+        ctx->lineOffset = fixup->lineOffset;
+        switch(fixup->type)
+        {
+            case FIXUP_ERROR:
+                error(ctx,ctx->source + fixup->column,"%s",fixup->message);
+                break;
+            case FIXUP_ADDRESS_OF:
+                if(findLabel(ctx,ctx->source + fixup->offset,fixup->length) < 0)
+                {
+                    error(ctx,ctx->source + fixup->column,"syntax");
+                }
+                break;
+            case FIXUP_LABEL:
+                value = findLabel(ctx,ctx->source + fixup->offset,fixup->length);
+                if(value >= 0)
+                {
+                    patchOperand(ctx,fixup->address,value);
+                    break;
+                }
+                error(ctx,ctx->source + fixup->column,"syntax");
+                break;
+            case FIXUP_DATA:
+                value = findLabel(ctx,ctx->source + fixup->offset,fixup->length);
+                if(value >= 0)
+                {
+                    if(fixup->address < ctx->memorySize)
+                    {
+                        ctx->memoryImage[fixup->address] = value;
+                    }
+                    break;
+                }
+                /* Only the first unresolved label in a DW statement is reported */
+                if(dataErrorLine != ctx->currentLine)
+                {
+                    error(ctx,ctx->source + fixup->column,"failed to resolve label");
+                    dataErrorLine = ctx->currentLine;
+                }
+                break;
+        }
+    }
+}
+
+/*
+    Patch an instruction with an immediate operand, a short immediate when the option is set and the
+    value fits, otherwise the address of its constant pool entry. STORE, IN and OUT always use the pool.
+*/
+
+static void resolveOperand(pasm_ctx_t *ctx, int address, int value)
+{
+    int opcode;
+
+    if((ctx->options & PASM_SHORT_IMMEDIATE) && address < ctx->memorySize && value >= 0 && value <= SHORT_IMMEDIATE_MAX)
+    {
+        opcode = (ctx->memoryImage[address] >> 12) & 0x0F;
+        if(opcode == I_LOAD || (opcode >= I_ADD && opcode <= I_SWAP))
+        {
+            patchOperand(ctx,address,SHORT_IMMEDIATE | value);
+            ctx->numShortImmediates++;
+            return;
+        }
+    }
+    patchOperand(ctx,address,resolveImmediate(ctx,value));
+}
+
+/*
+    Build the constant pool, entries are allocated in source order starting at endAddress
+*/
+
+static void resolvePool(pasm_ctx_t *ctx)
+{
+    int i;
+    int value;
+    fixup_t *fixup;
+
+    for(i=0;i<ctx->numFixups;i++)
+    {
+        fixup = &ctx->fixups[i];
+        ctx->currentLine = fixup->line;
+        switch(fixup->type)
+        {
+            case FIXUP_IMMEDIATE:
+                resolveOperand(ctx,fixup->address,fixup->value);
+                break;
+            case FIXUP_ADDRESS_OF:
+                value = findLabel(ctx,ctx->source + fixup->offset,fixup->length);
+                if(value >= 0)
+                {
+                    resolveOperand(ctx,fixup->address,value);
+                }
+                break;
+        }
+    }
+}
+
+/*
+    Return the operand of an instruction in the image
+*/
+
+static int getOperand(pasm_ctx_t *ctx, int address)
+{
+    return ctx->memoryImage[address] & 0x0FFF;
+}
+
+/*
+    Return the opcode of an instruction in the image
+*/
+
+static int getOpcode(pasm_ctx_t *ctx, int address)
+{
+    return (ctx->memoryImage[address] >> 12) & 0x0F;
+}
+
+/*
+    Check if two instructions reference the same memory word, for constant pool operands
+    the same value will share the same pool entry
+*/
+
+static int sameOperand(pasm_ctx_t *ctx, int a, int b)
+{
+    fixup_t *fixupA;
+    fixup_t *fixupB;
+
+    if((ctx->wordFlags[a] & OPT_POOL) != (ctx->wordFlags[b] & OPT_POOL))
+    {
+        return 0;
+    }
+    if(!(ctx->wordFlags[a] & OPT_POOL))
+    {
+        return getOperand(ctx,a) == getOperand(ctx,b);
+    }
+
+    fixupA = &ctx->fixups[ctx->operandFixup[a]];
+    fixupB = &ctx->fixups[ctx->operandFixup[b]];
+    if(fixupA->type == FIXUP_ADDRESS_OF && fixupB->type == FIXUP_ADDRESS_OF)
+    {
+        return findLabel(ctx,ctx->source + fixupA->offset,fixupA->length) == findLabel(ctx,ctx->source + fixupB->offset,fixupB->length);
+    }
+    if(fixupA->type == FIXUP_IMMEDIATE && fixupB->type == FIXUP_IMMEDIATE)
+    {
+        return fixupA->value == fixupB->value;
+    }
+
+    return 0;
+}
+
+/*
+    Find how each word in the image is used. Branch and CALL targets are marked OPT_TARGET, words
+    used as data, written by STORE or referenced with '@' or by DW are marked OPT_PINNED.
+*/
+
+static void analyseImage(pasm_ctx_t *ctx)
+{
+    int i;
+    int operand;
+    int opcode;
+    fixup_t *fixup;
+
+    memset(ctx->wordFlags,0,sizeof(ctx->wordFlags));
+    for(i=0;i<ctx->numFixups;i++)
+    {
+        fixup = &ctx->fixups[i];
+        if(fixup->type == FIXUP_IMMEDIATE || fixup->type == FIXUP_ADDRESS_OF)
+        {
+            ctx->wordFlags[fixup->address] |= OPT_POOL;
+            ctx->operandFixup[fixup->address] = i;
+            if(fixup->type == FIXUP_ADDRESS_OF)
+            {
+                ctx->wordFlags[findLabel(ctx,ctx->source + fixup->offset,fixup->length)] |= OPT_PINNED;
+            }
+        }
+    }
+
+    for(i=0;i<ctx->currentAddress;i++)
+    {
+        switch(ctx->wordKind[i] & WORD_KIND)
+        {
+            case WORD_CODE:
+                opcode = getOpcode(ctx,i);
+                if(opcode == I_RETURN || (ctx->wordFlags[i] & OPT_POOL))
+                {
+                    break;
+                }
+                operand = getOperand(ctx,i);
+                if(opcode == I_BR && operand == i + 1)
+                {
+                    break; /* NOP, the same as falling through to the next word */
+                }
+                if(opcode >= I_BR && opcode <= I_CALL)
+                {
+                    ctx->wordFlags[operand] |= OPT_TARGET;
+                }
+                else
+                {
+                    ctx->wordFlags[operand] |= OPT_PINNED;
+                }
+                break;
+            case WORD_ADDRESS:
+                ctx->wordFlags[ctx->memoryImage[i] & 0x0FFF] |= OPT_PINNED;
+                break;
+        }
+    }
+
+    /* The core branches through the interrupt vector, it and the word before it must stay as they are */
+    if(ctx->irqVector)
+    {
+        ctx->wordFlags[0] |= OPT_PINNED;
+        ctx->wordFlags[IRQ_VECTOR] |= OPT_PINNED;
+    }
+}
+
+/*
+    Check if an instruction can be changed by the optimizer
+*/
+
+static int isFree(pasm_ctx_t *ctx, int address)
+{
+    return address < ctx->currentAddress && (ctx->wordKind[address] & WORD_KIND) == WORD_CODE && !(ctx->wordFlags[address] & (OPT_PINNED|OPT_DELETED));
+}
+
+/*
+    Follow a chain of BR instructions and deleted words, returns the final destination
+*/
+
+static int followBranch(pasm_ctx_t *ctx, int target, int *hops)
+{
+    int i;
+    int next;
+
+    *hops = 0;
+    for(i=0;i<ctx->memorySize;i++)
+    {
+        while(target < ctx->currentAddress && (ctx->wordFlags[target] & OPT_DELETED))
+        {
+            target++;
+        }
+        if(!isFree(ctx,target) || getOpcode(ctx,target) != I_BR || (ctx->wordFlags[target] & OPT_POOL))
+        {
+            break;
+        }
+        next = getOperand(ctx,target);
+        if(next == target)
+        {
+            break; /* Halt */
+        }
+        target = next;
+        (*hops)++;
+    }
+
+    return target;
+}
+
+/*
+    Check if an instruction does nothing when it follows the previous instruction
+*/
+
+static int isRedundant(pasm_ctx_t *ctx, int previous, int address)
+{
+    int opcode;
+    int previousOpcode;
+
+    opcode = getOpcode(ctx,address);
+    previousOpcode = getOpcode(ctx,previous);
+    if(!sameOperand(ctx,previous,address))
+    {
+        return 0;
+    }
+
+    /* An interrupt handler can write a variable between the two instructions, constants it can not */
+    if(ctx->irqVector && !(ctx->wordFlags[address] & OPT_POOL))
+    {
+        return 0;
+    }
+
+    /* A already holds the value */
+    if(opcode == I_LOAD && (previousOpcode == I_STORE || previousOpcode == I_LOAD))
+    {
+        return 1;
+    }
+
+    /* Masks have no further effect */
+    if(opcode == previousOpcode && (opcode == I_AND || opcode == I_OR))
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+    Remove NOPs, a branch to the next word, a branch to a NOP now goes to the following word
+*/
+
+static int removeNops(pasm_ctx_t *ctx)
+{
+    int i;
+    int removed;
+
+    removed = 0;
+    for(i=0;i<ctx->currentAddress;i++)
+    {
+        if(isFree(ctx,i) && getOpcode(ctx,i) == I_BR && !(ctx->wordFlags[i] & OPT_POOL) && getOperand(ctx,i) == i + 1)
+        {
+            ctx->wordFlags[i] |= OPT_DELETED;
+            ctx->wordFlags[i+1] |= ctx->wordFlags[i] & OPT_TARGET;
+            removed++;
+        }
+    }
+
+    return removed;
+}
+
+/*
+    Thread branches, a branch or CALL to a BR goes straight to the final target
+*/
+
+static int threadBranches(pasm_ctx_t *ctx)
+{
+    int i;
+    int hops;
+    int target;
+    int threaded;
+
+    threaded = 0;
+    for(i=0;i<ctx->currentAddress;i++)
+    {
+        if(isFree(ctx,i) && getOpcode(ctx,i) >= I_BR && getOpcode(ctx,i) <= I_CALL && !(ctx->wordFlags[i] & OPT_POOL))
+        {
+            target = followBranch(ctx,getOperand(ctx,i),&hops);
+            if(hops > 0)
+            {
+                ctx->memoryImage[i] = (ctx->memoryImage[i] & 0xF000) | target;
+                ctx->wordFlags[target] |= OPT_TARGET;
+                threaded++;
+            }
+        }
+    }
+
+    return threaded;
+}
+
+/*
+    Remove instructions made redundant by the previous instruction, neither can be changed at run time
+*/
+
+static int removeRedundant(pasm_ctx_t *ctx)
+{
+    int i;
+    int previous;
+    int removed;
+
+    removed = 0;
+    previous = -1;
+    for(i=0;i<ctx->currentAddress;i++)
+    {
+        if((ctx->wordKind[i] & (WORD_ORG|WORD_KIND)) != WORD_CODE)
+        {
+            previous = -1;
+            if((ctx->wordKind[i] & WORD_KIND) != WORD_CODE)
+            {
+                continue;
+            }
+        }
+        if(ctx->wordFlags[i] & OPT_DELETED)
+        {
+            continue;
+        }
+        if(previous >= 0 && isFree(ctx,previous) && isFree(ctx,i) && !(ctx->wordFlags[i] & OPT_TARGET) && isRedundant(ctx,previous,i))
+        {
+            ctx->wordFlags[i] |= OPT_DELETED;
+            removed++;
+            continue;
+        }
+        previous = i;
+    }
+
+    return removed;
+}
+
+/*
+    Convert a CALL followed by RETURN into a BR, the routine called returns straight to our caller.
+    The RETURN is removed, it must not be a branch target. Converted CALLs are marked OPT_TAIL_CALL.
+*/
+
+static int convertTailCalls(pasm_ctx_t *ctx)
+{
+    int i;
+    int next;
+    int converted;
+
+    converted = 0;
+    for(i=0;i<ctx->currentAddress;i++)
+    {
+        if(!isFree(ctx,i) || getOpcode(ctx,i) != I_CALL || (ctx->wordFlags[i] & OPT_POOL))
+        {
+            continue;
+        }
+        /* The CALL returns to the next word, skipping any words already removed */
+        for(next=i+1;next<ctx->currentAddress && (ctx->wordFlags[next] & OPT_DELETED);next++);
+        if(isFree(ctx,next) && !(ctx->wordKind[next] & WORD_ORG) && getOpcode(ctx,next) == I_RETURN && ctx->memoryImage[next] != RETI && !(ctx->wordFlags[next] & OPT_TARGET))
+        {
+            ctx->memoryImage[i] = (I_BR << 12) | getOperand(ctx,i);
+            ctx->wordFlags[i] |= OPT_TAIL_CALL;
+            ctx->wordFlags[next] |= OPT_DELETED;
+            converted++;
+        }
+    }
+
+    return converted;
+}
+
+/*
+    Return the name of a label with a value or NULL if there is none
+*/
+
+static const char *getLabelName(pasm_ctx_t *ctx, int value)
+{
+    int i;
+
+    for(i=0;i<ctx->numLabels;i++)
+    {
+        if(ctx->labels[i].value == value)
+        {
+            return ctx->labels[i].name;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Remove deleted words from the image and relocate every address. Blocks started by ORG stay
+    at the same address, the words freed at the end of a block are left empty.
+*/
+
+static void relocateImage(pasm_ctx_t *ctx)
+{
+    int i;
+    int next;
+    int fill;
+    int word;
+    int kind;
+    fixup_t *fixup;
+
+    /* New address of each word, a deleted word maps to the word that follows it */
+    next = 0;
+    for(i=0;i<=ctx->currentAddress;i++)
+    {
+        if(i < ctx->currentAddress && (ctx->wordKind[i] & WORD_ORG))
+        {
+            next = i;
+        }
+        ctx->relocation[i] = next;
+        if(i < ctx->currentAddress && !(ctx->wordFlags[i] & OPT_DELETED))
+        {
+            next++;
+        }
+    }
+
+    /* Move words down, relocating instruction operands and DW labels */
+    fill = 0;
+    for(i=0;i<ctx->currentAddress;i++)
+    {
+        if(ctx->wordFlags[i] & OPT_DELETED)
+        {
+            continue;
+        }
+        word = ctx->memoryImage[i];
+        kind = ctx->wordKind[i] & WORD_KIND;
+        if(kind == WORD_CODE && (word >> 12) != I_RETURN && !(ctx->wordFlags[i] & OPT_POOL) && (word & 0x0FFF) <= ctx->currentAddress)
+        {
+            word = (word & 0xF000) | ctx->relocation[word & 0x0FFF];
+        }
+        if(kind == WORD_ADDRESS && word <= ctx->currentAddress)
+        {
+            word = ctx->relocation[word];
+        }
+        while(fill < ctx->relocation[i])
+        {
+            ctx->memoryImage[fill] = 0;
+            ctx->wordKind[fill++] = WORD_EMPTY;
+        }
+        ctx->memoryImage[fill] = word;
+        ctx->wordKind[fill] = ctx->wordKind[i];
+        ctx->wordLine[fill++] = ctx->wordLine[i];
+    }
+    while(fill < ctx->currentAddress)
+    {
+        ctx->memoryImage[fill] = 0;
+        ctx->wordKind[fill++] = WORD_EMPTY;
+    }
+
+    /* Constant pool operands are patched later on */
+    for(i=0;i<ctx->numFixups;i++)
+    {
+        fixup = &ctx->fixups[i];
+        if(fixup->type == FIXUP_IMMEDIATE || fixup->type == FIXUP_ADDRESS_OF)
+        {
+            if(ctx->wordFlags[fixup->address] & OPT_DELETED)
+            {
+                fixup->type = FIXUP_NONE;
+            }
+            else
+            {
+                fixup->address = ctx->relocation[fixup->address];
+            }
+        }
+    }
+
+    for(i=0;i<ctx->numLabels;i++)
+    {
+        ctx->labels[i].value = ctx->relocation[ctx->labels[i].value];
+    }
+
+    ctx->currentAddress = ctx->relocation[ctx->currentAddress];
+    ctx->endAddress = ctx->currentAddress;
+}
+
+/*
+    Add an address to a work list if it has not already been marked with flag
+*/
+
+static void pushWork(pasm_ctx_t *ctx, int *list, int *count, int address, int flag)
+{
+    if(address < ctx->currentAddress && !(ctx->wordFlags[address] & flag))
+    {
+        ctx->wordFlags[address] |= flag;
+        list[(*count)++] = address;
+    }
+}
+
+/*
+    Find every word that can be executed or referenced, starting from address 0. A referenced
+    address keeps every word up to the next label as the program may calculate addresses within
+    the block, any code in a referenced block may be executed through self-modifying code.
+    Returns 0 if out of memory.
+*/
+
+static int findLiveWords(pasm_ctx_t *ctx)
+{
+    int *code;
+    int *blocks;
+    int numCode;
+    int numBlocks;
+    int i;
+    int address;
+    int opcode;
+    int operand;
+    fixup_t *fixup;
+
+    code = (int*)malloc((ctx->currentAddress + 1) * sizeof(int));
+    blocks = (int*)malloc((ctx->currentAddress + 1) * sizeof(int));
+    if(code == NULL || blocks == NULL)
+    {
+        free(code);
+        free(blocks);
+        return 0;
+    }
+
+    for(i=0;i<ctx->numLabels;i++)
+    {
+        ctx->wordFlags[ctx->labels[i].value] |= OPT_LABEL;
+    }
+
+    numCode = 0;
+    numBlocks = 0;
+    pushWork(ctx,code,&numCode,0,OPT_EXEC);
+    if(ctx->irqVector)
+    {
+        pushWork(ctx,code,&numCode,IRQ_VECTOR,OPT_EXEC);
+    }
+    while(numCode > 0 || numBlocks > 0)
+    {
+        /* Follow the program flow */
+        while(numCode > 0)
+        {
+            address = code[--numCode];
+            ctx->wordFlags[address] |= OPT_LIVE;
+            opcode = getOpcode(ctx,address);
+            operand = getOperand(ctx,address);
+            if(ctx->wordFlags[address] & OPT_POOL)
+            {
+                /* Constant pool operand, the address of a label is a reference */
+                fixup = &ctx->fixups[ctx->operandFixup[address]];
+                if(fixup->type == FIXUP_ADDRESS_OF)
+                {
+                    pushWork(ctx,blocks,&numBlocks,findLabel(ctx,ctx->source + fixup->offset,fixup->length),OPT_BLOCK);
+                }
+                if(opcode != I_BR)
+                {
+                    pushWork(ctx,code,&numCode,address + 1,OPT_EXEC);
+                }
+                continue;
+            }
+            switch(opcode)
+            {
+                case I_RETURN:
+                    break;
+                case I_BR:
+                    pushWork(ctx,code,&numCode,operand,OPT_EXEC);
+                    break;
+                case I_CALL:
+                case I_BR+1: /* BNC */
+                case I_BR+2: /* BNZ */
+                    pushWork(ctx,code,&numCode,operand,OPT_EXEC);
+                    pushWork(ctx,code,&numCode,address + 1,OPT_EXEC);
+                    break;
+                default:
+                    pushWork(ctx,blocks,&numBlocks,operand,OPT_BLOCK);
+                    pushWork(ctx,code,&numCode,address + 1,OPT_EXEC);
+                    break;
+            }
+        }
+
+        /* Keep referenced blocks */
+        while(numBlocks > 0)
+        {
+            address = blocks[--numBlocks];
+            do
+            {
+                ctx->wordFlags[address] |= OPT_LIVE;
+                switch(ctx->wordKind[address] & WORD_KIND)
+                {
+                    case WORD_CODE:
+                        pushWork(ctx,code,&numCode,address,OPT_EXEC);
+                        break;
+                    case WORD_ADDRESS:
+                        pushWork(ctx,blocks,&numBlocks,ctx->memoryImage[address] & 0x0FFF,OPT_BLOCK);
+                        break;
+                }
+                address++;
+            }while(address < ctx->currentAddress && !(ctx->wordFlags[address] & OPT_LABEL) && !(ctx->wordKind[address] & WORD_ORG));
+        }
+    }
+
+    free(code);
+    free(blocks);
+    return 1;
+}
+
+/*
+    Remove code and data that can not be reached or referenced, empty words are left in place
+*/
+
+static int removeDeadWords(pasm_ctx_t *ctx, int *removedData)
+{
+    int i;
+    int removed;
+
+    removed = 0;
+    *removedData = 0;
+    if(!findLiveWords(ctx))
+    {
+        report(ctx,"Error: out of memory\n");
+        ctx->errorCount++;
+        return 0;
+    }
+    for(i=0;i<ctx->currentAddress;i++)
+    {
+        if(!(ctx->wordFlags[i] & OPT_LIVE) && (ctx->wordKind[i] & WORD_KIND) != WORD_EMPTY)
+        {
+            ctx->wordFlags[i] |= OPT_DELETED;
+            if((ctx->wordKind[i] & WORD_KIND) == WORD_CODE)
+            {
+                removed++;
+            }
+            else
+            {
+                (*removedData)++;
+            }
+        }
+    }
+
+    return removed;
+}
+
+/*
+    Run the optimizations selected with pasm_set_options()
+*/
+
+static void optimize(pasm_ctx_t *ctx)
+{
+    int i;
+    int removed;
+    int threaded;
+    int converted;
+    int deadCode;
+    int deadData;
+    int address;
+    int end;
+    const char *name;
+
+    /* Words past the end of memory have been lost, the program is too big */
+    if(ctx->currentAddress > ctx->memorySize)
+    {
+        return;
+    }
+
+    removed = 0;
+    threaded = 0;
+    converted = 0;
+    deadCode = 0;
+    deadData = 0;
+    analyseImage(ctx);
+    if(ctx->options & PASM_OPTIMIZE_DEAD_CODE)
+    {
+        deadCode = removeDeadWords(ctx,&deadData);
+    }
+    if(ctx->options & PASM_OPTIMIZE_PEEPHOLE)
+    {
+        removed += removeNops(ctx);
+    }
+    if(ctx->options & PASM_OPTIMIZE_TAIL_CALL)
+    {
+        converted = convertTailCalls(ctx);
+    }
+    if(ctx->options & PASM_OPTIMIZE_PEEPHOLE)
+    {
+        threaded = threadBranches(ctx);
+        removed += removeRedundant(ctx);
+    }
+    end = ctx->currentAddress;
+    relocateImage(ctx);
+
+    if(ctx->options & PASM_OPTIMIZE_DEAD_CODE)
+    {
+        report(ctx,"Dead code removed %d instruction%s, %d data word%s\n",deadCode,deadCode == 1 ? "" : "s",deadData,deadData == 1 ? "" : "s");
+    }
+    if(ctx->options & PASM_OPTIMIZE_PEEPHOLE)
+    {
+        report(ctx,"Peephole optimizer removed %d instruction%s, threaded %d branch%s\n",removed,removed == 1 ? "" : "s",threaded,threaded == 1 ? "" : "es");
+    }
+    if(ctx->options & PASM_OPTIMIZE_TAIL_CALL)
+    {
+        /* List each converted CALL at its new address */
+        for(i=0;i<end;i++)
+        {
+            if(ctx->wordFlags[i] & OPT_TAIL_CALL)
+            {
+                address = ctx->relocation[i];
+                name = getLabelName(ctx,getOperand(ctx,address));
+                report(ctx,"Tail call line %d: CALL %s at %03X converted to BR\n",ctx->wordLine[address],name != NULL ? name : "?",address);
+            }
+        }
+        report(ctx,"Tail call optimizer converted %d call%s\n",converted,converted == 1 ? "" : "s");
+    }
+}
+
+/*
+    Assemble a line of source code
+*/
+
+static void assembleLine(pasm_ctx_t *ctx)
+{
+    int thisWord = 0;
+    int instruction;
+
+    thisWord = 0;
+
+    /* Interate twice if first word is a label */
+    while(1)
+    {
+        /* Instruction? */
+        instruction = getInstruction(ctx,thisWord);
+        if(instruction >= 0)
+        {
+            parseInstruction(ctx,instruction,thisWord);           
+            ctx->currentAddress++;
+            break;
+        }
+        /* ORG directive ? */
+        if(wordIs(ctx,thisWord,"ORG"))
+        {
+            parseORG(ctx,thisWord);
+            break;;
+        }
+        /* DB */
+        if(wordIs(ctx,thisWord,"DB"))
+        {
+            parseDB(ctx,thisWord);
+            break;
+        }
+        /* DW */
+        if(wordIs(ctx,thisWord,"DW"))
+        {
+            parseDW(ctx,thisWord);
+            break;
+        }
+        /* NOP */
+        if(wordIs(ctx,thisWord,"NOP"))
+        {
+            parseNOP(ctx,thisWord);
+            break;
+        }
+        /* RETI */
+        if(wordIs(ctx,thisWord,"RETI"))
+        {
+            parseRETI(ctx,thisWord);
+            break;
+        }
+        /* IRQ directive */
+        if(wordIs(ctx,thisWord,"IRQ"))
+        {
+            parseIRQ(ctx,thisWord);
+            break;
+        }
+        /* Label? - only for first word */
+        if(thisWord == 0)
+        {
+            if(firstWordLabel(ctx))
+            {
+                if(ctx->wordCount > 1)
+                {
+                    thisWord = 1;
+                    continue;
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }        
+        error(ctx,wordText(ctx,thisWord),"syntax");
+        break;
+    }
+}
+
+/*
+    Single pass assembler loop, forward references are resolved from the fixup list at the end.
+    The source is tokenized in place, words and labels are spans of the source buffer.
+*/
+
+static int assemble(pasm_ctx_t *ctx, const char *source, size_t length)
+{
+    int offset;
+    int size;
+
+    clearLabels(ctx);
+    clearImmediates(ctx);
+    clearFixups(ctx);
+    memset(ctx->memoryImage,0,sizeof(ctx->memoryImage));     
+    memset(ctx->wordKind,0,sizeof(ctx->wordKind));
+    memset(ctx->wordLine,0,sizeof(ctx->wordLine));
+    ctx->currentAddress = 0;
+    ctx->endAddress = 0;
+    ctx->errorCount = 0;
+    ctx->irqVector = 0;
+    ctx->numShortImmediates = 0;
+    ctx->currentLine = 1;    
+    ctx->source = source;
+
+    if((ctx->options & PASM_SHORT_IMMEDIATE) && ctx->memorySize > SHORT_IMMEDIATE_MEMORY)
+    {
+        report(ctx,"Error: short immediates need a memory size of %d or less\n",SHORT_IMMEDIATE_MEMORY);
+        ctx->errorCount = 1;
+        ctx->source = NULL;
+        return 0;
+    }
+
+    if(length > INT_MAX)
+    {
+        report(ctx,"Error: source too big\n");
+        ctx->errorCount = 1;
+        ctx->source = NULL;
+        return 0;
+    }
+
+    /* Parse each line - define labels, create memory image and record forward references */
+    offset = 0;
+    while(offset < (int)length)
+    {
+        ctx->lineOffset = offset;
+        offset = splitLine(ctx,(int)length);
+        if(ctx->wordCount > 0)
+        {
+            assembleLine(ctx);
+        }
+        ctx->currentLine++;
+    }
+    if(ctx->errorCount == 0)
+    {
+        /* Immediates are added to the end of memory */
+        ctx->endAddress = ctx->currentAddress;
+        resolveFixups(ctx);
+        if(ctx->errorCount == 0 && (ctx->options & (PASM_OPTIMIZE_PEEPHOLE | PASM_OPTIMIZE_TAIL_CALL | PASM_OPTIMIZE_DEAD_CODE)))
+        {
+            optimize(ctx);
+        }
+        resolvePool(ctx);
+    }
+    ctx->source = NULL;
+
+    /* Check program fits into our memory */
+    if(ctx->endAddress > ctx->memorySize)
+    {
+        report(ctx,"Error: Program too big for memory\n");
+        ctx->errorCount++;
+    }
+
+    /* Display assembly results */
+    if(ctx->errorCount == 0)
+    {
+        report(ctx,"Assembly successfull %d memory words used\n",ctx->endAddress);
+        report(ctx,"Constant pool %d words\n",ctx->numImmediates);
+        if(ctx->options & PASM_SHORT_IMMEDIATE)
+        {
+            report(ctx,"Short immediates %d\n",ctx->numShortImmediates);
+        }
+        if(ctx->options & PASM_OPTIMIZE_DEAD_CODE)
+        {
+            for(size=PASM_MIN_MEMORY_SIZE;size<ctx->endAddress;size*=2);
+            report(ctx,"Smallest memory size %d words\n",size);
+        }
+    }
+    else
+    {
+        report(ctx,"Assembly failed with %d errors\n",ctx->errorCount);
+    }
+
+    return (ctx->errorCount==0);
+}
+
+/*
+    Make a C identifier from a file name, upper selects upper case for macro names
+*/
+
+static void makeIdentifier(char *identifier, const char *name, int upper)
+{
+    int i;
+
+    i = 0;
+    if(!isalpha((unsigned char)name[0]))
+    {
+        identifier[i++] = upper ? 'P' : 'p';
+    }
+    while(*name)
+    {
+        if(isalnum((unsigned char)*name))
+        {
+            identifier[i++] = upper ? toupper((unsigned char)*name) : *name;
+        }
+        else
+        {
+            identifier[i++] = '_';
+        }
+        name++;
+    }
+    identifier[i] = 0;
+}
+
+/*
+    Mark a word reached as code and add it to the work list
+*/
+
+static void reachCode(unsigned char *flags, int *work, int *count, int address)
+{
+    if(!(flags[address] & C_REACHED))
+    {
+        flags[address] |= C_REACHED;
+        work[(*count)++] = address;
+    }
+}
+
+/*
+    Find the words reachable as code from address 0 and the words they STORE into, code that is
+    not written is translated. Returns 1 if translated code needs a temporary.
+*/
+
+static int findCBlocks(pasm_ctx_t *ctx, unsigned char *flags, int *work)
+{
+    int mask;
+    int count;
+    int address;
+    int previous;
+    int opcode;
+    int x;
+    int temporary;
+
+    mask = ctx->memorySize - 1;
+    count = 0;
+    reachCode(flags,work,&count,0);
+    while(count > 0)
+    {
+        address = work[--count];
+        opcode = (ctx->memoryImage[address] >> 12) & 0xF;
+        x = ctx->memoryImage[address] & mask;
+        if(opcode == I_STORE)
+        {
+            flags[x] |= C_WRITTEN;
+        }
+        if(opcode >= I_BR && opcode <= I_CALL)
+        {
+            reachCode(flags,work,&count,x);
+        }
+        if(opcode != I_BR && opcode != I_RETURN)
+        {
+            reachCode(flags,work,&count,(address + 1) & mask);
+        }
+    }
+
+    /* Blocks start at branch targets, after branches and after words that are interpreted */
+    temporary = 0;
+    for(address=0;address<ctx->memorySize;address++)
+    {
+        if((flags[address] & (C_REACHED | C_WRITTEN)) != C_REACHED)
+        {
+            continue;
+        }
+        flags[address] |= C_FIXED;
+        opcode = (ctx->memoryImage[address] >> 12) & 0xF;
+        x = ctx->memoryImage[address] & mask;
+        if(opcode != I_STORE && opcode < I_BR && !(flags[x] & C_WRITTEN))
+        {
+            flags[x] |= C_FIXED;
+        }
+        if(opcode >= I_BR && opcode <= I_CALL && (flags[x] & (C_REACHED | C_WRITTEN)) == C_REACHED)
+        {
+            flags[x] |= C_LEADER;
+        }
+        previous = (address - 1) & mask;
+        if(address == 0 || (flags[previous] & (C_REACHED | C_WRITTEN)) != C_REACHED || ((ctx->memoryImage[previous] >> 12) & 0xF) >= I_BR)
+        {
+            flags[address] |= C_LEADER;
+        }
+        if(opcode == I_ADD || opcode == I_SUB || ((opcode == I_ROR || opcode == I_SWAP) && (flags[x] & C_WRITTEN)))
+        {
+            temporary = 1;
+        }
+    }
+
+    return temporary;
+}
+
+/*
+    Write a jump to the block at target, or through the dispatcher if there is no block there
+*/
+
+static void writeCJump(FILE *fp, unsigned char *flags, const char *indent, int target)
+{
+    if((flags[target] & (C_LEADER | C_WRITTEN)) == C_LEADER)
+    {
+        fprintf(fp,"%sgoto b_%03X;\n",indent,target);
+    }
+    else
+    {
+        fprintf(fp,"%spc = 0x%03X;\n%sgoto dispatch;\n",indent,target,indent);
+    }
+}
+
+/*
+    Write the translated block starting at start. The block is run by the interpreter if the
+    cycle limit would be reached part way through it.
+*/
+
+static void writeCBlock(pasm_ctx_t *ctx, FILE *fp, unsigned char *flags, int start)
+{
+    int mask;
+    int address;
+    int next;
+    int opcode;
+    int x;
+    int value;
+    int cycles;
+    const char *label;
+    char operand[32];
+
+    mask = ctx->memorySize - 1;
+    cycles = 0;
+    address = start;
+    do
+    {
+        opcode = (ctx->memoryImage[address] >> 12) & 0xF;
+        cycles += (opcode >= I_BR) ? 1 : 2;
+        address = (address + 1) & mask;
+    }
+    while(opcode < I_BR && (flags[address] & (C_REACHED | C_WRITTEN | C_LEADER)) == C_REACHED);
+
+    label = getLabelName(ctx,start);
+    fprintf(fp,"b_%03X:",start);
+    if(label != NULL)
+    {
+        fprintf(fp," /* %s */",label);
+    }
+    fprintf(fp,"\n    if(cycles + %d > maxCycles)\n    {\n        pc = 0x%03X;\n        goto interpret;\n    }\n",cycles,start);
+
+    address = start;
+    do
+    {
+        opcode = (ctx->memoryImage[address] >> 12) & 0xF;
+        x = ctx->memoryImage[address] & mask;
+        value = ctx->memoryImage[x] & 0xFFFF;
+        next = (address + 1) & mask;
+        if(flags[x] & C_WRITTEN)
+        {
+            snprintf(operand,sizeof(operand),"s->memory[0x%03X]",x);
+        }
+        else
+        {
+            snprintf(operand,sizeof(operand),"0x%04X",value);
+        }
+        if(opcode == I_RETURN)
+        {
+            fprintf(fp,"    /* %03X RETURN */\n",address);
+        }
+        else
+        {
+            fprintf(fp,"    /* %03X %s %03X */\n",address,instructions[opcode],x);
+        }
+
+        switch(opcode)
+        {
+            case I_LOAD:
+                fprintf(fp,"    a = %s;\n",operand);
+                break;
+            case I_STORE:
+                fprintf(fp,"    s->memory[0x%03X] = (unsigned short)a;\n",x);
+                break;
+            case I_ADD:
+                fprintf(fp,"    t = a + %s;\n    c = t >> 16;\n    a = t & 0xFFFF;\n",operand);
+                break;
+            case I_SUB:
+                /* A + not M + 1 as the core */
+                if(flags[x] & C_WRITTEN)
+                {
+                    fprintf(fp,"    t = a + (%s ^ 0xFFFF) + 1;\n",operand);
+                }
+                else
+                {
+                    fprintf(fp,"    t = a + 0x%05X;\n",(value ^ 0xFFFF) + 1);
+                }
+                fprintf(fp,"    c = t >> 16;\n    a = t & 0xFFFF;\n");
+                break;
+            case I_OR:
+                fprintf(fp,"    a |= %s;\n",operand);
+                break;
+            case I_AND:
+                fprintf(fp,"    a &= %s;\n",operand);
+                break;
+            case I_XOR:
+                fprintf(fp,"    a ^= %s;\n",operand);
+                break;
+            case I_ROR:
+                if(flags[x] & C_WRITTEN)
+                {
+                    fprintf(fp,"    t = %s;\n    a = (c << 15) | (t >> 1);\n    c = t & 1;\n",operand);
+                }
+                else
+                {
+                    fprintf(fp,"    a = (c << 15) | 0x%04X;\n    c = %d;\n",value >> 1,value & 1);
+                }
+                break;
+            case I_SWAP:
+                if(flags[x] & C_WRITTEN)
+                {
+                    fprintf(fp,"    t = %s;\n    a = ((t << 8) | (t >> 8)) & 0xFFFF;\n",operand);
+                }
+                else
+                {
+                    fprintf(fp,"    a = 0x%04X;\n",((value << 8) | (value >> 8)) & 0xFFFF);
+                }
+                break;
+            case I_IN:
+                fprintf(fp,"    s->cycles = cycles;\n    a = s->in(s,%s) & 0xFFFF;\n",operand);
+                break;
+            case I_OUT:
+                fprintf(fp,"    s->cycles = cycles;\n    s->out(s,%s,a);\n",operand);
+                break;
+        }
+
+        if(opcode < I_BR)
+        {
+            fprintf(fp,"    cycles += 2;\n    instructions++;\n");
+        }
+        else
+        {
+            fprintf(fp,"    cycles += 1;\n    instructions++;\n");
+        }
+
+        switch(opcode)
+        {
+            case I_BR:
+                if(x == address)
+                {
+                    /* Branch to self, the program halts */
+                    fprintf(fp,"    pc = 0x%03X;\n    stop = 1;\n    goto done;\n",x);
+                }
+                else
+                {
+                    writeCJump(fp,flags,"    ",x);
+                }
+                break;
+            case I_BNC:
+            case I_BNZ:
+                fprintf(fp,"    if(%s)\n    {\n",opcode == I_BNC ? "!c" : "a");
+                writeCJump(fp,flags,"        ",x);
+                fprintf(fp,"    }\n");
+                writeCJump(fp,flags,"    ",next);
+                break;
+            case I_CALL:
+                fprintf(fp,"    push(s,0x%03X);\n",next);
+                writeCJump(fp,flags,"    ",x);
+                break;
+            case I_RETURN:
+                fprintf(fp,"    pc = pop(s);\n    goto dispatch;\n");
+                break;
+            default:
+                if((flags[next] & (C_REACHED | C_WRITTEN | C_LEADER)) != C_REACHED)
+                {
+                    writeCJump(fp,flags,"    ",next);
+                }
+                break;
+        }
+        address = next;
+    }
+    while(opcode < I_BR && (flags[address] & (C_REACHED | C_WRITTEN | C_LEADER)) == C_REACHED);
+    fprintf(fp,"\n");
+}
+
+/*
+    Write the header for a C translation, the state of the CPU and the interface
+*/
+
+static int createCHeader(pasm_ctx_t *ctx, char *fileName, const char *prefix, const char *macro)
+{
+    FILE *fp;
+    char file[40];
+    char dateTime[80];
+
+    fp = fopen(fileName,"w");
+    if(fp == NULL)
+    {
+        report(ctx,"Could not open output file %s\n",fileName);
+        return 0;
+    }
+    removePath(file, fileName, sizeof(file));
+    getTimeDate(dateTime, sizeof(dateTime));
+    fprintf(fp, "/*\n");
+    fprintf(fp, "    Built with PASM version %s\n",VERSION_STRING);
+    fprintf(fp, "    File name: %s\n",file);
+    fprintf(fp, "    %s\n\n",dateTime);
+    fprintf(fp, "    C model of a pumpkin-cpu program. Set the in and out hooks, call %s_reset() then\n",prefix);
+    fprintf(fp, "    %s_run() with the cycle count to stop at, it can be called again to carry on.\n",prefix);
+    fprintf(fp, "    The hooks are called with cycles set to the cycle the IN or OUT instruction started on.\n");
+    fprintf(fp, "*/\n");
+    fprintf(fp, "#ifndef %s_H\n#define %s_H\n\n",macro,macro);
+    fprintf(fp, "#define %s_MEMORY_SIZE (%d)\n",macro,ctx->memorySize);
+    fprintf(fp, "#ifndef %s_STACK_DEPTH\n",macro);
+    fprintf(fp, "#define %s_STACK_DEPTH (4) /* stack_depth generic of the core */\n",macro);
+    fprintf(fp, "#endif\n\n");
+    fprintf(fp, "typedef struct %s_state %s_t;\n\n",prefix,prefix);
+    fprintf(fp, "struct %s_state\n{\n",prefix);
+    fprintf(fp, "    unsigned int a;\n");
+    fprintf(fp, "    unsigned int c;\n");
+    fprintf(fp, "    unsigned int pc;\n");
+    fprintf(fp, "    unsigned int callstack[%s_STACK_DEPTH];\n",macro);
+    fprintf(fp, "    int stackTop; /* Index of callstack(0) within callstack[] */\n");
+    fprintf(fp, "    unsigned long long cycles;\n");
+    fprintf(fp, "    unsigned long long instructions;\n");
+    fprintf(fp, "    unsigned int (*in)(%s_t *s, unsigned int address); /* IN hook, returns the value read */\n",prefix);
+    fprintf(fp, "    void (*out)(%s_t *s, unsigned int address, unsigned int value); /* OUT hook */\n",prefix);
+    fprintf(fp, "    void *user; /* For use by the hooks */\n");
+    fprintf(fp, "    int translated; /* Cleared when translated code is written to, everything is interpreted from then on */\n");
+    fprintf(fp, "    unsigned short memory[%s_MEMORY_SIZE];\n",macro);
+    fprintf(fp, "};\n\n");
+    fprintf(fp, "/* Reset the CPU and program memory, the hooks and user pointer are left unchanged */\n");
+    fprintf(fp, "void %s_reset(%s_t *s);\n\n",prefix,prefix);
+    fprintf(fp, "/* Run until maxCycles is reached or the program branches to itself, returns 1 if it halted */\n");
+    fprintf(fp, "int %s_run(%s_t *s, unsigned long long maxCycles);\n\n",prefix,prefix);
+    fprintf(fp, "#endif\n\n/* End of File */\n");
+    fclose(fp);
+    report(ctx,"C header '%s' created.\n",fileName);
+
+    return 1;
+}
+
+/*
+    Create a C translation of the program with a header of the same name. Code reachable from
+    address 0 is translated into blocks joined by goto, words written by STORE are interpreted.
+    Cycle and instruction counts are the same as the core.
+*/
+
+static int createCFile(pasm_ctx_t *ctx, char *fileName)
+{
+    FILE *fp;
+    unsigned char *flags;
+    int *work;
+    char *headerName;
+    char file[40];
+    char header[40];
+    char entity[40];
+    char prefix[48];
+    char macro[48];
+    char dateTime[80];
+    int temporary;
+    int i;
+
+    /* The translation reads every operand from memory */
+    if(ctx->numShortImmediates > 0)
+    {
+        report(ctx,"Error: C output does not support short immediates\n");
+        return 0;
+    }
+
+    /* The header has the same name with a .h extension */
+    headerName = (char*)malloc(strlen(fileName) + 1);
+    flags = (unsigned char*)calloc(ctx->memorySize,1);
+    work = (int*)malloc(ctx->memorySize * sizeof(int));
+    if(headerName == NULL || flags == NULL || work == NULL)
+    {
+        report(ctx,"Error: out of memory\n");
+        free(headerName);
+        free(flags);
+        free(work);
+        return 0;
+    }
+    strcpy(headerName,fileName);
+    headerName[strlen(headerName)-1] = 'h';
+
+    removePath(file, fileName, sizeof(file));
+    removePath(header, headerName, sizeof(header));
+    removeExtension(entity, file, sizeof(entity) - 1);
+    makeIdentifier(prefix,entity,0);
+    makeIdentifier(macro,entity,1);
+    temporary = findCBlocks(ctx,flags,work);
+    free(work);
+
+    if(!createCHeader(ctx,headerName,prefix,macro))
+    {
+        free(headerName);
+        free(flags);
+        return 0;
+    }
+    free(headerName);
+
+    fp = fopen(fileName,"w");
+    if(fp == NULL)
+    {
+        report(ctx,"Could not open output file %s\n",fileName);
+        free(flags);
+        return 0;
+    }
+
+    getTimeDate(dateTime, sizeof(dateTime));
+    fprintf(fp, "/*\n");
+    fprintf(fp, "    Built with PASM version %s\n",VERSION_STRING);
+    fprintf(fp, "    File name: %s\n",file);
+    fprintf(fp, "    %s\n\n",dateTime);
+    fprintf(fp, "    C model of a pumpkin-cpu program, see %s for the interface\n",header);
+    fprintf(fp, "*/\n");
+    fprintf(fp, "#include<string.h>\n#include \"%s\"\n\n",header);
+    fprintf(fp, "typedef %s_t pumpkin_t;\n",prefix);
+    fprintf(fp, "#define MEMORY_SIZE %s_MEMORY_SIZE\n",macro);
+    fprintf(fp, "#define STACK_DEPTH %s_STACK_DEPTH\n\n",macro);
+
+    /* Memory image and the words built into translated code */
+    fprintf(fp, "static const unsigned short image[MEMORY_SIZE] = {");
+    for(i=0;i<ctx->memorySize;i++)
+    {
+        fprintf(fp, "%s0x%04X%s",(i % 8) ? " " : "\n    ",ctx->memoryImage[i] & 0xFFFF,(i < ctx->memorySize-1) ? "," : "\n};\n\n");
+    }
+    fprintf(fp, "static const unsigned char fixed[MEMORY_SIZE] = {");
+    for(i=0;i<ctx->memorySize;i++)
+    {
+        fprintf(fp, "%s%d%s",(i % 32) ? "" : "\n    ",(flags[i] & C_FIXED) ? 1 : 0,(i < ctx->memorySize-1) ? "," : "\n};\n\n");
+    }
+    fputs(CFileStep,fp);
+
+    fprintf(fp, "void %s_reset(pumpkin_t *s)\n{\n",prefix);
+    fprintf(fp, "    s->a = 0;\n    s->c = 0;\n    s->pc = 0;\n    s->stackTop = 0;\n");
+    fprintf(fp, "    memset(s->callstack,0,sizeof(s->callstack));\n");
+    fprintf(fp, "    memcpy(s->memory,image,sizeof(image));\n");
+    fprintf(fp, "    s->cycles = 1;\n    s->instructions = 0;\n    s->translated = 1;\n}\n\n");
+
+    fprintf(fp, "int %s_run(pumpkin_t *s, unsigned long long maxCycles)\n{\n",prefix);
+    fprintf(fp, "    unsigned int a;\n    unsigned int c;\n    unsigned int pc;\n");
+    if(temporary)
+    {
+        fprintf(fp, "    unsigned int t;\n");
+    }
+    fprintf(fp, "    unsigned long long cycles;\n    unsigned long long instructions;\n    int stop;\n\n");
+    fputs(CFileLoad,fp);
+    fprintf(fp, "    stop = 0;\n\n");
+    fprintf(fp, "dispatch:\n    if(s->translated)\n    {\n        switch(pc)\n        {\n");
+    for(i=0;i<ctx->memorySize;i++)
+    {
+        if((flags[i] & (C_LEADER | C_WRITTEN)) == C_LEADER)
+        {
+            fprintf(fp, "            case 0x%03X: goto b_%03X;\n",i,i);
+        }
+    }
+    fprintf(fp, "        }\n    }\n\n");
+    fprintf(fp, "interpret:\n");
+    fprintf(fp, "    /* Words written by STORE, and blocks that would pass the cycle limit */\n");
+    fprintf(fp, "    if(cycles >= maxCycles)\n    {\n        goto done;\n    }\n");
+    fputs(CFileSync,fp);
+    fprintf(fp, "    stop = step(s);\n");
+    fputs(CFileLoad,fp);
+    fprintf(fp, "    if(stop)\n    {\n        goto done;\n    }\n    goto dispatch;\n\n");
+
+    for(i=0;i<ctx->memorySize;i++)
+    {
+        if((flags[i] & (C_LEADER | C_WRITTEN)) == C_LEADER)
+        {
+            writeCBlock(ctx,fp,flags,i);
+        }
+    }
+
+    fprintf(fp, "done:\n");
+    fputs(CFileSync,fp);
+    fprintf(fp, "    return stop;\n}\n\n/* End of File */\n");
+    fclose(fp);
+    free(flags);
+    report(ctx,"C file '%s' created.\n",fileName);
+
+    return 1;
+}
+
+/*
+    Library interface, see pasm.h
+*/
+
+pasm_ctx_t *pasm_ctx_create(int memorySize)
+{
+    pasm_ctx_t *ctx;
+
+    if((memorySize & (memorySize-1)) != 0 || memorySize < PASM_MIN_MEMORY_SIZE || memorySize > PASM_MAX_MEMORY_SIZE)
+    {
+        return NULL;
+    }
+
+    ctx = (pasm_ctx_t*)calloc(1,sizeof(pasm_ctx_t));
+    if(ctx != NULL)
+    {
+        ctx->memorySize = memorySize;
+    }
+
+    return ctx;
+}
+
+void pasm_ctx_destroy(pasm_ctx_t *ctx)
+{
+    if(ctx != NULL)
+    {
+        clearLabels(ctx);
+        clearImmediates(ctx);
+        clearFixups(ctx);
+        free(ctx->words);
+        free(ctx->messages);
+        free(ctx);
+    }
+}
+
+void pasm_set_options(pasm_ctx_t *ctx, int options)
+{
+    ctx->options = options;
+}
+
+int pasm_assemble_buffer(pasm_ctx_t *ctx, const char *source, size_t length)
+{
+    return assemble(ctx,source,length);
+}
+
+int pasm_assemble_file(pasm_ctx_t *ctx, FILE *fp)
+{
+    char *source;
+    char *newSource;
+    size_t length;
+    size_t size;
+    size_t count;
+    int result;
+
+    /* Read the whole source, the stream does not need to be seekable */
+    size = 65536;
+    length = 0;
+    source = (char*)malloc(size);
+    while(source != NULL)
+    {
+        count = fread(&source[length],1,size - length,fp);
+        length += count;
+        if(length < size)
+        {
+            break;
+        }
+        size *= 2;
+        newSource = (char*)realloc(source,size);
+        if(newSource == NULL)
+        {
+            free(source);
+        }
+        source = newSource;
+    }
+
+    if(source == NULL)
+    {
+        report(ctx,"Error: out of memory\n");
+        ctx->errorCount = 1;
+        return 0;
+    }
+
+    result = assemble(ctx,source,length);
+    free(source);
+
+    return result;
+}
+
+const int *pasm_get_image(pasm_ctx_t *ctx, int *size)
+{
+    if(size != NULL)
+    {
+        *size = ctx->memorySize;
+    }
+
+    return ctx->memoryImage;
+}
+
+int pasm_get_words_used(pasm_ctx_t *ctx)
+{
+    return ctx->endAddress;
+}
+
+int pasm_get_label_count(pasm_ctx_t *ctx)
+{
+    return ctx->numLabels;
+}
+
+const char *pasm_get_label(pasm_ctx_t *ctx, int index, int *address)
+{
+    if(index < 0 || index >= ctx->numLabels)
+    {
+        return NULL;
+    }
+    if(address != NULL)
+    {
+        *address = ctx->labels[index].value;
+    }
+
+    return ctx->labels[index].name;
+}
+
+int pasm_get_error_count(pasm_ctx_t *ctx)
+{
+    return ctx->errorCount;
+}
+
+const char *pasm_get_messages(pasm_ctx_t *ctx)
+{
+    return ctx->messages != NULL ? ctx->messages : "";
+}
+
+void pasm_clear_messages(pasm_ctx_t *ctx)
+{
+    ctx->messageLength = 0;
+    if(ctx->messages != NULL)
+    {
+        ctx->messages[0] = 0;
+    }
+}
+
+int pasm_write_output(pasm_ctx_t *ctx, const char *fileName)
+{
+    char *outFileExtention;
+
+    /* Get output file extention to determine file format */
+    outFileExtention = getExtension((char*)fileName);
+    if(outFileExtention != NULL)
+    {
+        /* VHDL */
+        if(strcmp(outFileExtention,"VHD") == 0 || strcmp(outFileExtention,"vhd") == 0)
+        {
+            return createVHDLFile(ctx,(char*)fileName);
+        }
+        /* Intel/Altera MIF */
+        if(strcmp(outFileExtention,"MIF") == 0 || strcmp(outFileExtention,"mif") == 0)
+        {
+            return createMIFFile(ctx,(char*)fileName);
+        }
+        /* Lattice Semmiconductor MEM */
+        if(strcmp(outFileExtention,"MEM") == 0 || strcmp(outFileExtention,"mem") == 0)
+        {
+            return createMEMFile(ctx,(char*)fileName);
+        }
+        /* Symbol file */
+        if(strcmp(outFileExtention,"SYM") == 0 || strcmp(outFileExtention,"sym") == 0)
+        {
+            return createSYMFile(ctx,(char*)fileName);
+        }
+        /* C translation and header */
+        if(strcmp(outFileExtention,"C") == 0 || strcmp(outFileExtention,"c") == 0)
+        {
+            return createCFile(ctx,(char*)fileName);
+        }
+    }
+    /* Error */
+    report(ctx,"Invalid output file extention\n");
+
+    return 0;
+}
+
+/* End of File */
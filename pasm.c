@@ -2,7 +2,7 @@
 --
 -- pasm.c
 -- An assembler for the pumpkin-cpu
--- Version 1.3
+-- Version 1.4
 --
 --------------------------------------------------------------------------------------------------------
 --
@@ -26,1270 +26,320 @@
 --
 ------------------------------------------------------------------------------------------------------*/
 #include<stdio.h>
-#include<conio.h>
 #include<string.h>
 #include<stdlib.h>
 #include<ctype.h>
-#include<time.h>
+#include<pthread.h>
+#include "pasm.h"
+#include "putil.h"
 
-#define VERSION_STRING         "1.3" 
-#define MAX_MEMORY_SIZE        (4096)
-#define MAX_LABEL_NAME_LENGTH  (64)
-#define MAX_LABELS             (500)
-#define MAX_IMMEDIATES         (500)
-#define MAX_LINE_LENGTH        (256)
-#define MAX_WORDS_ON_LINE      (5) /* eg: LABEL DB 0 DUP 125 */
-#define NUMBER_OF_INSTRUCTIONS (16)
-#define DB_DW_BUFFER_SIZE      (256)
-
-char *instructions[] = {"LOAD","STORE","ADD","SUB","OR","AND","XOR","ROR","SWAP","IN","OUT","BR","BNC","BNZ","CALL","RETURN"};
-
-char VHDLFileStart[] =
-    "---------------------------------------------------------------------\n"
-    "--\n"
-    "-- Built with PASM version %s\n"
-    "-- File name: %s\n"
-    "-- %s\n"
-    "-- \n"
-    "---------------------------------------------------------------------\n"
-    "library ieee;\n"
-    "use ieee.std_logic_1164.all;\n"
-    "use ieee.numeric_std.all;\n\n"
-    
-    "entity %s is\n"
-    "port (\n"
-    "    clock        : in std_logic;\n"
-    "    clock_enable : in std_logic;\n"
-    "    address      : in std_logic_vector(%d downto 0);\n"
-    "    data_out     : out std_logic_vector(15 downto 0);\n"
-    "    data_in      : in std_logic_vector(15 downto 0);\n"
-    "    write_enable : in std_logic);\n"
-    "end entity;\n\n"
-    "architecture rtl of %s is\n\n"
-    "    type ram_type is array (0 to %d) of std_logic_vector(15 downto 0);\n"
-    "    signal ram : ram_type := (\n";
-
-char VHDLFileEnd[] =
-    "begin\n\n"
-    "    process(clock)\n"
-    "    begin\n"
-    "        if rising_edge(clock) then\n"
-    "            if clock_enable = '1' then\n"
-    "                if write_enable = '1' then\n"
-    "                    ram(to_integer(unsigned(address))) <= data_in;\n"
-    "                else\n"
-    "                    data_out <= ram(to_integer(unsigned(address)));\n"
-    "                end if;\n"
-    "            end if;\n"
-    "        end if;\n"
-    "    end process;\n\n"
-    "end rtl;\n\n"
-    "--- End of file ---\n";
-
-
-typedef struct 
-{
-    char name[MAX_LABEL_NAME_LENGTH+1]; /* +1 to allow space for null */
-    int value;
-}label_t;
+#define DEFAULT_MEMORY_SIZE    (2048)
+#define MAX_MANIFEST_LINE      (1024)
+#define MAX_WORKERS            (256)
 
 typedef struct
 {
-    int value;
-    int address;
-}immediate_t;
-
-int memorySize; /* Size of target memory */
-int memoryImage[MAX_MEMORY_SIZE]; /* Assembled memory image */
-int currentAddress;
-int endAddress;
-int currentLine; 
-int numImmediates;
-immediate_t immediates[MAX_IMMEDIATES];
-int numLabels;
-label_t labels[MAX_LABELS];
-int errorCount;
-char line[MAX_LINE_LENGTH+1];
-char *words[MAX_WORDS_ON_LINE];
-int wordCount;
-int buffer[DB_DW_BUFFER_SIZE]; /* Output storage for DB and DW parsers */
-int bufferIndex;
-int dup; /* DUP value used by DB/DW parsers */
-int pass; /* Which pass we're on */
-
-/*
-    Remove path from fileName
-*/
-
-void removePath(char *fileName, char *filePath, int size)
-{
-    int i;
-
-    for(i=strlen(filePath);i>0;i--)
-    {
-        if(filePath[i-1]=='/' || filePath[i-1]=='\\')
-        {
-            break;
-        }
-    }
-
-    strncpy(fileName,&filePath[i],size);
-}
-
-/*
-    Remove extension from fileName
-*/
-
-void removeExtension(char *noExt, char *fileName, int size)
-{
-    int i;
-
-    for(i=strlen(fileName);i>0;i--)
-    {
-        if(fileName[i]=='.')
-        {
-            break;
-        }
-    }
-
-    if(i == 0)
-    {
-        i = strlen(fileName);
-    }
-
-    if(i > size)
-    {
-        i = size;
-    }
-
-    strncpy(noExt,fileName,i);
-    noExt[i] = 0;
-}
-
-/*
-    Return pointer to filename extension
-*/
-
-char *getExtension(char *fileName)
-{
-    char *ptr;
-
-    ptr = fileName;
-
-    if(strlen(fileName)>3)
-    {
-        ptr += strlen(fileName);
-        do
-        {
-            ptr--;
-            if(*ptr == '.')
-            {
-                return ptr+1;
-            }
-        }
-        while(ptr != fileName);
-    }
-    
-    return NULL;
-}
-
-/*
-    Get current date and time and return as string
-*/
-
-void getTimeDate(char *str, int size)
-{
-    time_t t = time(NULL);
-    struct tm tm = *localtime(&t);
-    snprintf(str,size,"%d-%d-%d %02d:%02d:%02d",tm.tm_mday,tm.tm_mon + 1,tm.tm_year + 1900,tm.tm_hour,tm.tm_min,tm.tm_sec);
-}
-
-int bit_width(int m)
-{
-    int i;
-
-    i = 0;
-    while(m > 2)
-    {
-        i++;
-        m >>= 1;
-    }
-
-    return i;
-}
-
+    int line; /* Manifest line number */
+    char *source;
+    char *output;
+    int memorySize;
+    int result; /* 1 if the job assembled and the output was written */
+    char *messages; /* Messages collected while running the job */
+}job_t;
+
+int numJobs;
+job_t *jobs;
+int nextJob; /* Index of next job to be taken by a worker */
+int jobOptions; /* Optimizer options applied to every job */
+pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
-    Create a VHDL file of a RAM model initialized with the assembled memory image 
+    Run a single job, messages are kept with the job to be printed in manifest order
 */
-void createVHDLFile(char *fileName)
-{
-    FILE *fp;
-    int i;
-    char entity[40];
-    char file[40];
-    char dateTime[80];
 
-    fp = fopen(fileName,"w");
-    if(fp == NULL)
-    {
-        fclose(fp);
-        printf("Could not open output file %s\n",fileName);
-    }
-    else
-    {       
-        removePath(file, fileName, sizeof(file));
-        removeExtension(entity, file, sizeof(entity));
-        getTimeDate(dateTime, sizeof(dateTime));
-        fprintf(fp, VHDLFileStart, VERSION_STRING, file, dateTime, entity, bit_width(memorySize), entity, memorySize-1);
-        fputs("\t\t\t",fp);
-        for(i=0;i<memorySize;i++)
-        {
-            fprintf(fp, "X\"%04X\"",memoryImage[i]);
-            if(i<memorySize-1)
-            {
-                fputc(',',fp);
-                if((i+1)%8 == 0)
-                {
-                    fputs("\n\t\t\t",fp);
-                }
-            }
-            else
-            {
-                fputs(");\n",fp);
-            }            
-        }
-        fprintf(fp,VHDLFileEnd);
-        fclose(fp);
-        printf("VHDL file '%s' created.\n",fileName);
-    }
-}
-
-/*
-    Create MIF file
-*/
-
-void createMIFFile(char *fileName)
-{
-    FILE *fp;
-    int i;
-    char file[40];
-    char dateTime[80];
-
-    fp = fopen(fileName,"w");
-    if(fp == NULL)
-    {
-        fclose(fp);
-        printf("Could not open output file %s\n",fileName);
-    }
-    else
-    {       
-        removePath(file, fileName, sizeof(file));
-        getTimeDate(dateTime, sizeof(dateTime));
-        fprintf(fp, "-- Built with PASM version %s\n",VERSION_STRING);
-        fprintf(fp, "-- File name: %s\n",file);
-        fprintf(fp, "-- %s\n\n",dateTime );
-        fprintf(fp, "DEPTH = %d;\n", memorySize);
-        fprintf(fp, "WIDTH = 16;\n");
-        fprintf(fp, "ADDRESS_RADIX = HEX;\n");
-        fprintf(fp, "DATA_RADIX = HEX;\n");
-        fprintf(fp, "CONTENT\nBEGIN\n");
-        for(i=0;i<memorySize;i++)
-        {
-            fprintf(fp, "%03X : %04X ;\n",i,memoryImage[i]);
-        }
-        fprintf(fp, "END;\n");
-        fclose(fp);
-        printf("MIF file '%s' created.\n",fileName);
-    }
-}
-
-/*
-    Create MEM file
-*/
-
-void createMEMFile(char *fileName)
+void runJob(job_t *job)
 {
+    pasm_ctx_t *ctx;
     FILE *fp;
-    int i;
-    char file[40];
-    char dateTime[80];
-
-
-    fp = fopen(fileName,"w");
-    if(fp == NULL)
-    {
-        fclose(fp);
-        printf("Could not open output file %s\n",fileName);
-    }
-    else
-    {       
-        removePath(file, fileName, sizeof(file));
-        getTimeDate(dateTime, sizeof(dateTime));
-        fprintf(fp, "#Format=AddrHex\n");
-        fprintf(fp, "#Depth=%d\n",memorySize);
-        fprintf(fp, "#Width=16\n");
-        fprintf(fp, "#AddrRadix=3\n");
-        fprintf(fp, "#DataRadix=3\n");
-        fprintf(fp, "#Data\n");
-        fprintf(fp, "#Built with PASM version %s\n",VERSION_STRING);
-        fprintf(fp, "#File name: %s\n",file);
-        fprintf(fp, "#%s\n",dateTime );
-        for(i=0;i<memorySize;i++)
-        {
-            fprintf(fp, "%03X : %04X\n",i,memoryImage[i]);
-        }
-        fprintf(fp, "# The end\n");
-        fclose(fp);
-        printf("MEM file '%s' created.\n",fileName);
-    }
-}
-
-/* 
-    Split line into words delimited by whitespace 
-*/
-void splitLine(void)
-{
-    int i;
-    int nextWord;
-    int lineLength;
-    int quote; 
-
-    wordCount = 0;
-    nextWord = 1; /* Searching for start of next word */
-    quote = 0; /* Ignore spaces inside quotes */
-    lineLength = strlen(line);
-    for(i=0;i<lineLength;i++)
-    {
-        /* End of line or start of comment */
-        if(line[i] == 0 || line[i] == ';')
-        {
-            break;
-        }
-        /* Toggle quotes (used to ignore spaces inside quotes) */
-        if(line[i] == '\"')
-        {
-            quote ^= 1;            
-        }        
-        if(nextWord == 1 && !isspace(line[i]))
-        {
-            /* Start of next word */
-            words[wordCount++] = &line[i];
-            nextWord = 0;
-            if(wordCount > MAX_WORDS_ON_LINE)
-            {
-                printf("Error line %d: too many words\n",currentLine);
-                errorCount++;
-                wordCount = 0;
-                return;
-            }            
-            continue;
-        }
-        if(nextWord == 0 && isspace(line[i]) && quote == 0)
-        {
-            /* End of current word - mark with null */
-            line[i] = 0; 
-            nextWord = 1;
-        }
-    }
-
-    /* Check if quotes are still open */
-    if(quote)
-    {
-        printf("Error line %d: no closing \"\n",currentLine);
-        errorCount++;
-        wordCount = 0;
-    }
-}
-
-/*
-    Return instruction opcode (0 to 15) or -1 if word is not an instruction 
-*/
-
-int getInstruction(char *word)
-{
-    int i;
-
-    for(i=0;i<NUMBER_OF_INSTRUCTIONS;i++)
-    {
-        if(strcmp(instructions[i],word)==0)
-        {
-            return i;
-        }
-    }
-
-    return -1;
-}
-
-/* 
-    Perform various checks on newLabel if all is OK add to label list
-*/
-
-int addLabel(char *newLabel)
-{
-    int i;
-
-    /* Check label is not too long */
-    if(strlen(newLabel) > MAX_LABEL_NAME_LENGTH)
-    {
-        printf("Error line %d: label too long\n",currentLine);
-        return 0;
-    }
-
-    /* Check if label is a reserved word */
-    if(getInstruction(newLabel) >= 0 ||
-        strcmp(newLabel,"ORG") == 0 || 
-        strcmp(newLabel,"DUP") == 0 ||
-        strcmp(newLabel,"DW") == 0 ||
-        strcmp(newLabel,"DB") == 0 ||
-        strcmp(newLabel,"NOP") == 0)
-    {
-        printf("Error line %d: reserved word %s found in column 1\n",currentLine,newLabel);
-        return 0;
-    }
-
-    /* Check if label is already defined */
-    for(i=0;i<numLabels;i++)
-    {
-        if(strcmp(labels[i].name,newLabel)==0)
-        {
-            printf("Error line %d: label %s already defined\n",currentLine,newLabel);
-            return 0;
-        }
-    }
+    char message[MAX_MANIFEST_LINE];
 
-    /* Check if we have too many labels */
-    if(numLabels >= MAX_LABELS)
+    job->result = 0;
+    ctx = pasm_ctx_create(job->memorySize);
+    if(ctx == NULL)
     {
-        printf("Error line %d: too many labels\n",currentLine);
-        return 0;
-    }
-
-    /* Add label to list */
-    strcpy(labels[numLabels].name,newLabel);
-    labels[numLabels].value = currentAddress;
-    numLabels++;
-    return 1;
-}
-
-/*
-    Check if the first word is a valid label then add to the label list checking it does not
-    already exist. A label must start at column 1 and start with a alpha character and
-    only contain alpha-numeric and underscore characters.
-*/
-
-int firstWordLabel(void)
-{
-    int i;
-    char c;
-
-    if(isalpha(line[0]))
-    {
-        for(i=0;i<MAX_LABEL_NAME_LENGTH;i++)
-        {
-            /* Check character by character */
-            c = words[0][i];
-            if(c == 0)
-            {
-                /* End of word - try to add to label list */
-                if(!addLabel(words[0]))
-                {
-                    /* Error adding label, increment error counter and clear word count to stop parsing the rest of the line */
-                    errorCount++;
-                    wordCount = 0;
-                    return 0;
-                }
-                else
-                {
-                    /* New label created */
-                    return 1;
-                }
-            }
-            if((!isalnum(c)) && c != '_')
-            {
-                break; /* Not a valid label */
-            }
-        }
-    }
-    return 0; /* Not a valid label */
-}
-
-/*
-    Handle the ORG directive, change currentAddress to value following ORG
-    firstWord indexes 'ORG' in the words array
-*/
-
-void parseORG(int firstWord)
-{
-    int orgValue;
-    char *ptr;
-
-    /* Check for correct number of words and parameter starts with a number */
-    if((wordCount != firstWord + 2) || (!isdigit(words[firstWord+1][0])))
-    {
-        printf("Error line %d: ORG expects a single numeric value\n",currentLine);
-        errorCount++;
+        snprintf(message,sizeof(message),"Error: invalid memory size %d\n",job->memorySize);
+        job->messages = copyString(message);
         return;
     }
+    pasm_set_options(ctx,jobOptions);
 
-    /* Convert string to int */
-    orgValue = (int)strtol(words[firstWord+1],&ptr,0);
-
-    /* Check for garbage after number */
-    if(*ptr != 0)
-    {
-        printf("Error line %d: syntax\n",currentLine);
-        errorCount++;
-        return;
-    }
-
-    /* Check if ORG is backwards */
-    if(orgValue < currentAddress)
+    fp = fopen(job->source,"r");
+    if(fp == NULL)
     {
-        printf("Error line %d: ORG preceeds current address\n",currentLine);
-        errorCount++;
+        snprintf(message,sizeof(message),"Could not open source file %s\n",job->source);
+        job->messages = copyString(message);
+        pasm_ctx_destroy(ctx);
         return;
     }
 
-    /* Check ORG is within memory range */
-    if(orgValue >= memorySize)
+    if(pasm_assemble_file(ctx,fp))
     {
-        printf("Error line %d: ORG exceeds memory size\n",currentLine);
-        errorCount++;
-        return;  
+        job->result = pasm_write_output(ctx,job->output);
     }
+    fclose(fp);
 
-    /* Change current address to ORG value */
-    currentAddress = orgValue;
+    job->messages = copyString(pasm_get_messages(ctx));
+    pasm_ctx_destroy(ctx);
 }
 
 /*
-    Check if label exists, return label value or -1 if it does not exist.
+    Worker thread, takes jobs from the list until there are none left
 */
 
-int findLabel(char *word)
+void *worker(void *arg)
 {
-    int i;
+    int job;
 
-    for(i=0;i<numLabels;i++)
+    (void)arg;
+    while(1)
     {
-        if(strcmp(labels[i].name,word)==0)
+        pthread_mutex_lock(&jobLock);
+        job = nextJob++;
+        pthread_mutex_unlock(&jobLock);
+        if(job >= numJobs)
         {
-            return labels[i].value;
+            break;
         }
+        runJob(&jobs[job]);
     }
 
-    return -1;
+    return NULL;
 }
 
 /*
-    Check and extract DUP from DW / DB
+    Read the batch manifest, each line is 'source.asm [S] output.(vhd|mem|mif|c|sym)' as on the
+    command line, blank lines and lines starting with ';' or '#' are ignored
 */
 
-int parseDUP(int firstWord)
+int readManifest(char *fileName)
 {
+    FILE *fp;
+    char line[MAX_MANIFEST_LINE];
+    char *words[4];
     char *endStrol;
+    int wordCount;
+    int lineNumber;
+    int errors;
+    int size;
+    job_t *newJobs;
+    char *ptr;
 
-    /* Nothing to do if wordCount = firstword + 2 */
-    if(wordCount == firstWord + 2)
+    fp = fopen(fileName,"r");
+    if(fp == NULL)
     {
-        dup = 0;
-        return 1;
+        printf("Could not open manifest file %s\n",fileName);
+        return 0;
     }
 
-
-    /* Check if line includes DUP */
-    if(wordCount == firstWord + 4)
+    size = 0;
+    errors = 0;
+    lineNumber = 0;
+    while(fgets(line,sizeof(line),fp))
     {
-        if(strcmp(words[firstWord+2],"DUP")==0)
+        lineNumber++;
+        /* Split into words */
+        wordCount = 0;
+        ptr = strtok(line," \t\r\n");
+        while(ptr != NULL && wordCount < 4)
         {
-            dup = (int)strtol(words[firstWord+3],&endStrol,0);
-            if(*endStrol==0)
-            {
-               if(dup > sizeof(buffer))
-               {
-                    printf("Error line %d: DUP exceeds maximum\n",currentLine);
-                    errorCount++;
-                    return 0;
-               }
-               return 1;
-            }            
+            words[wordCount++] = ptr;
+            ptr = strtok(NULL," \t\r\n");
         }
-    }
-
-    printf("Error line %d: syntax\n",currentLine);
-    errorCount++;
-    return 0;
-}
-
-/*
-    Lower level DB parsing
-
-    Returns bufferIndex value which will be 0 if an error was found
-*/
-
-int parseDB2(char *word)
-{
-    char *ptr;
-    char *endStrol;
-    long value;
-
-    bufferIndex = 0;
-    ptr = word;
-    while(1)
-    {
-        /* Check for number */
-        if(isdigit(*ptr))
+        if(wordCount == 0 || words[0][0] == ';' || words[0][0] == '#')
         {
-            value = strtol(ptr,&endStrol,0);
-            /* Check valid delimiters */
-            if(*endStrol == 0 || *endStrol == ',')
-            {
-                /* Range check */
-                if(value < 256)
-                {
-                    /* Store value and advance index if space in buffer */
-                    if(bufferIndex < DB_DW_BUFFER_SIZE)
-                    {
-                        buffer[bufferIndex++] = (int)value;
-                    }                    
-                    if(*endStrol == 0)
-                    {
-                        break; /* Finished */
-                    }
-                    else
-                    {                        
-                        ptr = endStrol + 1; /* More data, update and advance pointer past comma */                        
-                        continue;
-                    }
-                }
-                else
-                {
-                    printf("Error line %d: DB value exceeds 255\n",currentLine);
-                    bufferIndex = 0;
-                    errorCount++;
-                    break;
-                }
-            }
+            continue;
         }
-
-        /* Check for string in quotes */
-        if(*ptr = '\"')
+        if(wordCount < 2 || wordCount > 3)
         {
-            do /* Copy string to buffer */
-            {
-                ptr++;
-                if(*ptr == 0 || *ptr == '\"')
-                {
-                    break;
-                }
-                if(bufferIndex < DB_DW_BUFFER_SIZE)
-                {
-                    buffer[bufferIndex++] = (int)*ptr;
-                }
-            }while(1);
-            /* Check string terminated correctly */
-            if(*ptr == '\"')
-            {
-                ptr++;
-                if(*ptr == ',')
-                {
-                    ptr++; /* More data */
-                    continue;
-                }
-                if(*ptr == 0)
-                {
-                    break; /* No more data */
-                }
-            }
+            printf("Error manifest line %d: syntax\n",lineNumber);
+            errors++;
+            continue;
         }
 
-        printf("Error line %d: syntax\n",currentLine);
-        bufferIndex = 0;
-        errorCount++;
-        break;
-    }
-
-    return bufferIndex;
-}
-
-/*
-    Handle NOP - just a branch to the next instruction
-*/
-
-void parseNOP(int firstWord)
-{
-    /* Make sure there is nothing else on ths line */
-    if(firstWord + 1 != wordCount)
-    {
-        printf("Error line %d: NOP does not take parameters\n",currentLine);
-        errorCount++;
-        return;  
-    }
-
-    memoryImage[currentAddress] = 0xB000 + currentAddress + 1;
-    currentAddress++;
-}
-
-/*
-    Handle DB
-*/
-
-void parseDB(int firstWord)
-{
-    int i;
-
-    /* Check if there is something else on this line */
-    if(wordCount < firstWord + 2)
-    {
-        printf("Error line %d: DB expects one or more values\n",currentLine);
-        errorCount++;
-        return;
-    }
-
-    /* Check for DUP */
-    if(!parseDUP(firstWord))
-    {
-        return; /* An error was found */
-    }
-
-    /* Parse the line */
-    if(parseDB2(words[firstWord+1]) == 0)
-    {
-        return; /* Error */
-    }
-
-    /* Duplicate */
-    if(dup > 0)
-    {
-        if(bufferIndex > 1)
+        /* Make room for the new job */
+        if(numJobs >= size)
         {
-            printf("Error line %d: can only duplicate a single byte\n",currentLine);
-            errorCount++;
-            return;
-        }
-        for(i=1;i<dup;i++)
-        {
-            if(bufferIndex < DB_DW_BUFFER_SIZE)
+            size = size ? size * 2 : 64;
+            newJobs = (job_t*)realloc(jobs,size * sizeof(job_t));
+            if(newJobs == NULL)
             {
-                buffer[bufferIndex] = buffer[0];
+                printf("Error: out of memory\n");
+                fclose(fp);
+                return 0;
             }
-            bufferIndex++;
+            jobs = newJobs;
         }
-    }
-
-    /* Check for data overflow */
-    if(bufferIndex > DB_DW_BUFFER_SIZE)
-    {
-        printf("Error line %d: too much data for DB\n",currentLine);
-        errorCount++;
-        return;
-    }
-
-    /* Add pading byte if odd number of bytes */
-    if(bufferIndex%2)
-    {
-        buffer[bufferIndex++] = 0;
-    }
-
-    /* Check data fits into memory */
-    if(currentAddress + (bufferIndex/2) > memorySize)
-    {
-        printf("Error line %d: DB exceeds remaining memory\n",currentLine);
-        errorCount++;
-        return;  
-    }
-
-    /* Copy to memory image */
-    for(i=0;i<bufferIndex;i+=2)
-    {
-        memoryImage[currentAddress++] = (buffer[i] << 8)|(buffer[i+1]);
-    }
-}
-
-/*
-    Lower level DW parsing
 
-    Returns bufferIndex value which will be 0 if an error was found
-*/
-
-int parseDW2(char *word)
-{
-    char *ptr;
-    char *endStrol;
-    long value;
-    char string[MAX_LABEL_NAME_LENGTH];
-    int stringIndex;
-
-    bufferIndex = 0;
-    ptr = word;
-    while(1)
-    {
-        /* Check for number */
-        if(isdigit(*ptr))
+        jobs[numJobs].line = lineNumber;
+        jobs[numJobs].memorySize = DEFAULT_MEMORY_SIZE;
+        jobs[numJobs].messages = NULL;
+        jobs[numJobs].result = 0;
+        if(wordCount == 3)
         {
-            value = strtol(ptr,&endStrol,0);
-            /* Check valid delimiters */
-            if(*endStrol == 0 || *endStrol == ',')
+            jobs[numJobs].memorySize = (int)strtol(words[1],&endStrol,0);
+            if(*endStrol != 0)
             {
-                /* Range check */
-                if(value < 65536L)
-                {
-                    /* Store value and advance index if space in buffer */
-                    if(bufferIndex < DB_DW_BUFFER_SIZE)
-                    {
-                        buffer[bufferIndex] = (int)value;
-                    }  
-                    bufferIndex++;                  
-                    if(*endStrol == 0)
-                    {
-                        break; /* Finished */
-                    }
-                    else
-                    {                        
-                        ptr = endStrol + 1; /* More data, update and advance pointer past comma */                        
-                        continue;
-                    }
-                }
-                else
-                {
-                    printf("Error line %d: DW value exceeds 65536\n",currentLine);
-                    bufferIndex = 0;
-                    errorCount++;
-                    break;
-                }
+                printf("Error manifest line %d: memory size expected\n",lineNumber);
+                errors++;
+                continue;
             }
         }
-        /* Check for leter - start of label */
-        if(isalpha(*ptr))            
+        jobs[numJobs].source = copyString(words[0]);
+        jobs[numJobs].output = copyString(words[wordCount-1]);
+        if(jobs[numJobs].source == NULL || jobs[numJobs].output == NULL)
         {
-            /* Copy string */
-            stringIndex = 0;
-            while(1)
-            {
-                if(stringIndex < MAX_LABEL_NAME_LENGTH)
-                {                                        
-                    if(*ptr == 0 || *ptr == ',')
-                    {
-                        string[stringIndex] = 0;
-                        break;  
-                    }
-                    string[stringIndex++] = *ptr;
-                    ptr++;
-                }
-                else
-                {
-                    /* If string is too long, clear and break so error will be detected trying to resolve label */
-                    string[0] = 0;
-                    *ptr = 0;
-                    break;
-                }
-            }
-            /* String copied ptr points to termination character */            
-            if(pass==1)                      
-            {
-                /* Pass 1 - just increment index */
-                bufferIndex++;
-            }
-            else
-            {
-                /* Pass 2 - resolve label */
-                if(bufferIndex < DB_DW_BUFFER_SIZE)
-                {
-                    value = (long)findLabel(string);
-                    if(value < 0)
-                    {
-                        /* Could not find label */
-                        printf("Error line %d: failed to resolve label\n",currentLine);
-                        bufferIndex = 0;
-                        errorCount++;
-                        break;
-                    }
-                    else
-                    {
-                        buffer[bufferIndex] = (int)value;
-                    }                    
-                }
-                bufferIndex++;
-            }
-            /* Check for more data on this line */
-            if(*ptr == 0)
-            {                            
-                break; /* Finished */
-            }
-            else
-            {
-                ptr++; /* More data move past comma */
-                continue; 
-            }
-                    
+            printf("Error manifest line %d: out of memory\n",lineNumber);
+            free(jobs[numJobs].source);
+            free(jobs[numJobs].output);
+            errors++;
+            continue;
         }
-        /* If not a letter or number then syntax error */
-        printf("Error line %d: syntax\n",currentLine);
-        bufferIndex = 0;
-        errorCount++;
-        break;
+        numJobs++;
     }
+    fclose(fp);
 
-    return bufferIndex;
+    return (errors == 0);
 }
 
 /*
-    Handle DW
+    Assemble every job in the manifest on a pool of worker threads, one per processor.
+    Results are printed in manifest order so the output does not depend on scheduling.
 */
 
-void parseDW(int firstWord)
+int runBatch(char *fileName, int options)
 {
+    pthread_t threads[MAX_WORKERS];
+    int workers;
+    int failed;
     int i;
+    double start;
+    double seconds;
 
-    /* Check if there is something else on this line */
-    if(wordCount < firstWord + 2)
+    if(!readManifest(fileName))
     {
-        printf("Error line %d: DW expects one or more values\n",currentLine);
-        errorCount++;
-        return;
-    }
-
-    /* Check for DUP */
-    if(!parseDUP(firstWord))
-    {
-        return; /* An error was found */
+        return 1;
     }
 
-    /* Parse the line */
-    if(parseDW2(words[firstWord+1]) == 0)
+    jobOptions = options;
+    start = getWallTime();
+    workers = getCoreCount(MAX_WORKERS);
+    if(workers > numJobs)
     {
-        return; /* Error */
+        workers = numJobs;
     }
-
-    /* Duplicate */
-    if(dup > 0)
+    nextJob = 0;
+    for(i=0;i<workers;i++)
     {
-        if(bufferIndex > 1)
+        if(pthread_create(&threads[i],NULL,worker,NULL) != 0)
         {
-            printf("Error line %d: can only duplicate a single word\n",currentLine);
-            errorCount++;
-            return;
-        }
-        for(i=1;i<dup;i++)
-        {
-            if(bufferIndex < DB_DW_BUFFER_SIZE)
-            {
-                buffer[bufferIndex] = buffer[0];
-            }
-            bufferIndex++;
+            break;
         }
     }
-
-    /* Check for data overflow */
-    if(bufferIndex > DB_DW_BUFFER_SIZE)
-    {
-        printf("Error line %d: too much data for DW\n",currentLine);
-        errorCount++;
-        return;
-    }
-
-    /* Check data fits into memory */
-    if(currentAddress + bufferIndex > memorySize)
+    workers = i;
+    /* If no threads could be started run the jobs here */
+    if(workers == 0)
     {
-        printf("Error line %d: DW exceeds remaining memory\n",currentLine);
-        errorCount++;
-        return;  
+        worker(NULL);
     }
-
-    /* Copy to memory image */
-    for(i=0;i<bufferIndex;i++)
+    for(i=0;i<workers;i++)
     {
-        memoryImage[currentAddress++] = buffer[i];
+        pthread_join(threads[i],NULL);
     }
-}
+    seconds = getWallTime() - start;
 
-/*
-    Get immediate value from string
-*/
-
-int getImmediateValue(char *operand, int *value)
-{
-    char *endStrol;
-    
-    if(strlen(operand) > 0)
+    failed = 0;
+    for(i=0;i<numJobs;i++)
     {
-        *value = (int)strtol(operand,&endStrol,0);
-        return (*endStrol == 0);
-    }
-    return 0;
-}
-
-/*
-    Add immediate to list if not already there and return address
-*/
-
-int resolveImmediate(int value)
-{
-    int i;
-
-    /* Check if immediate has been used before */
-    for(i=0;i<numImmediates;i++)
-    {
-        if(immediates[i].value == value)
+        printf("Job %d (manifest line %d): %s -> %s\n",i+1,jobs[i].line,jobs[i].source,jobs[i].output);
+        printf("%s",jobs[i].messages != NULL ? jobs[i].messages : "Error: out of memory\n");
+        if(!jobs[i].result)
         {
-            /* Retrun address of existing immediate */
-            return immediates[i].address;
+            failed++;
         }
+        free(jobs[i].source);
+        free(jobs[i].output);
+        free(jobs[i].messages);
     }
+    free(jobs);
 
-    /* Create if space for new immediate */
-    if(numImmediates >= MAX_IMMEDIATES)
+    workers = workers ? workers : 1;
+    printf("Batch complete: %d jobs, %d failed, %d thread%s\n",numJobs,failed,workers,workers == 1 ? "" : "s");
+    printf("Wall time %.3f s",seconds);
+    if(seconds > 0.0)
     {
-        printf("Error line %d: too many immediates\n",currentLine);
-        errorCount++;
-        return 0;
+        printf(", %.1f jobs/s",numJobs / seconds);
     }
+    printf("\n");
 
-    /* Create new immediate */
-    immediates[numImmediates].value = value;
-    immediates[numImmediates++].address = endAddress;
-
-    /* Add to memory image if there is space - overflow error detected later on */
-    if(endAddress < memorySize)
-    {
-        memoryImage[endAddress] = value;
-    }
-    
-    return(endAddress++);
+    return (failed != 0);
 }
 
 
 /*
-    Parse instruction
+    Check for an option, returns 1 and updates options if arg is an option
 */
 
-void parseInstruction(int instruction, int operandCount, char*operand)
+int getOption(char *arg, int *options)
 {
-    int value;
-
-    /* Check correct number of operands first */
-    if(instruction==15 && operandCount > 0)
+    if(strcmp(arg,"-O") == 0)
     {
-        printf("Error line %d: operand not valid for RETURN instruction\n",currentLine);
-        errorCount++;
-        return;
-    }
-    if(instruction!=15 && operandCount != 1)
-    {
-        printf("Error line %d: instruction expects an operand\n",currentLine);
-        errorCount++;
-        return;
-    }
-    /* Shift opcode */
-    instruction <<= 12; 
-    /* Handle operand if there is one */
-    while(operandCount)
-    {
-        if(operand[0]=='#') /* Immediate */
-        {
-            if(getImmediateValue(&operand[1],&value))
-            {
-                instruction |= resolveImmediate(value);
-                break;
-            }
-        }  
-        if(operand[0]=='@') /* Address of label */
-        {
-            value = findLabel(&operand[1]);
-            if(value >= 0)
-            {
-                instruction |= resolveImmediate(value);
-                break;
-            }
-        }
-        /* Any error with '#' or '@' will fall through here and findLable will fail */
-        value = findLabel(operand);       
-        if(value >= 0)
-        {
-            /* Label found */
-            instruction |= value;
-            break;
-        }
-        /* Else error ... */
-        printf("Error line %d: syntax\n",currentLine);
-        errorCount++;
-        break;
-    }
-
-    memoryImage[currentAddress] = instruction;
-}
-
-/*
-    Assemble a line of source code, pass variable controls flow
-*/
-
-void assembleLine(void)
-{
-    int thisWord = 0;
-    int instruction;
-
-    thisWord = 0;
-
-    /* Interate twice if first word is a label */
-    while(1)
-    {
-        /* Instruction? */
-        instruction = getInstruction(words[thisWord]);
-        if(instruction >= 0)
-        {
-            if(pass == 2)
-            {      
-                /* Parse instruction in second pass only */                                    
-                parseInstruction(instruction,wordCount-thisWord-1,words[thisWord+1]);           
-            }           
-            currentAddress++;
-            break;
-        }
-        /* ORG directive ? */
-        if(strcmp("ORG",words[thisWord])==0)
-        {
-            parseORG(thisWord);
-            break;;
-        }
-        /* DB */
-        if(strcmp("DB",words[thisWord])==0)
-        {
-            parseDB(thisWord);
-            break;
-        }
-        /* DW */
-        if(strcmp("DW",words[thisWord])==0)
-        {
-            parseDW(thisWord);
-            break;
-        }
-        /* NOP */
-        if(strcmp("NOP",words[thisWord])==0)
-        {
-            parseNOP(thisWord);
-            break;
-        }
-        /* Label? - only for first word */
-        if(thisWord == 0)
-        {
-            if(pass == 1)
-            {
-                if(firstWordLabel())
-                {
-                    if(wordCount > 1)
-                    {
-                        thisWord = 1;
-                        continue;
-                    }
-                    else
-                    {
-                        break;
-                    }
-                }
-            }
-            if(pass == 2)
-            {
-                if(findLabel(words[0]) >= 0)
-                {
-                    if(wordCount > 1)
-                    {
-                        thisWord = 1;
-                        continue;
-                    }
-                    else
-                    {
-                        break;
-                    }
-                }
-            }
-        }        
-        printf("Error line %d: syntax\n",currentLine);
-        errorCount++;
-        break;
-    }
-}
-
-/*
-    Two pass assembler loop
-*/
-
-int assemble(FILE *fp)
-{
-    /* Get ready for first pass */
-    numLabels = 0;
-    numImmediates = 0;
-    currentAddress = 0;
-    errorCount = 0;
-    currentLine = 1;    
-    fseek(fp, 0, SEEK_SET);
-    /* Parse each line - find labels, constants and basic syntax checking */
-    pass = 1;
-    printf("Pass 1\n");
-    while(fgets(line,sizeof(line),fp))
-    {
-        splitLine();
-        if(wordCount > 0)
-        {
-            assembleLine();
-        }
-        currentLine++;
-    }
-    if(errorCount == 0)
-    {
-        /* Get ready for second pass */
-        endAddress = currentAddress; /* Used to add immediates to end of memory during pass 2 */
-        fseek(fp, 0, SEEK_SET);
-        currentLine = 1;
-        currentAddress = 0;
-        memset(memoryImage,0,sizeof(memoryImage));     
-        /* Parse each line in file and create output memory image */   
-        pass = 2;
-        printf("Pass 2\n");
-        while(fgets(line,sizeof(line),fp))
-        {
-            splitLine();
-            if(wordCount > 0)
-            {
-                assembleLine();
-            }
-            currentLine++;
-        }
+        *options |= PASM_OPTIMIZE_PEEPHOLE;
+        return 1;
     }
-
-    /* Check program fits into our memory */
-    if(endAddress > memorySize)
+    if(strcmp(arg,"-D") == 0)
     {
-        printf("Error: Program too big for memory\n");
-        errorCount++;
+        *options |= PASM_OPTIMIZE_DEAD_CODE;
+        return 1;
     }
-
-    /* Display assembly results */
-    if(errorCount == 0)
+    if(strcmp(arg,"-T") == 0)
     {
-        printf("Assembly successfull %d memory words used\n",endAddress);
+        *options |= PASM_OPTIMIZE_TAIL_CALL;
+        return 1;
     }
-    else
+    if(strcmp(arg,"-I") == 0)
     {
-        printf("Assembly failed with %d errors\n",errorCount);
+        *options |= PASM_SHORT_IMMEDIATE;
+        return 1;
     }
 
-    /* Close source file */
-    fclose(fp);
-
-    return (errorCount==0);
+    return 0;
 }
 
 void print_usage(void)
 {
     printf("Usage:\n");
-    printf("       pasm source.asm [S] output.(vhd|mem|mif)\n\n");
+    printf("       pasm [options] source.asm [S] output.(vhd|mem|mif|c|sym)\n");
+    printf("       pasm [options] --batch manifest\n\n");
+    printf("       Options:\n");
+    printf("          -O    peephole optimizer, removes NOPs and redundant instructions\n");
+    printf("                and threads chains of branches, with an IRQ directive only\n");
+    printf("                instructions with constant operands are treated as redundant\n");
+    printf("          -T    convert CALL followed by RETURN to BR and list each site\n");
+    printf("          -D    remove code and data that can not be reached or referenced\n");
+    printf("          -I    short immediates, '#' and '@' operands of 0 to 2047 are held in the\n");
+    printf("                instruction, for a core with the short_immediate generic and a memory\n");
+    printf("                size of 2048 or less\n");
+    printf("       Use - as the source file name to read from standard input\n");
     printf("       Optional parameter S is the target memory size; a 2^n number\n");
     printf("       in the range 32 to 4096 defaults to 2048\n");
     printf("       The output file extention determines the output format:\n");
     printf("          .vhd  creates a VHLD initialized RAM model\n");
     printf("          .mif  creates a Intel/Altera MIF File\n");
     printf("          .mem  creates a Lattice Semiconductors MEM File\n");
+    printf("          .c    creates a C model of the program and a .h header for it\n");
+    printf("          .sym  creates a symbol file listing the address of each label\n");
+    printf("       A batch manifest lists one job per line in the form 'source.asm [S] output',\n");
+    printf("       jobs are assembled in parallel on one thread per processor\n");
 }
 
 int main(int argc, char *argv[])
@@ -1297,8 +347,25 @@ int main(int argc, char *argv[])
     FILE *fp;
     char *endStrol;
     int outFileArg;
-    char *outFileExtention;
+    int memorySize;
+    int options;
+    int sourceArg;
+    pasm_ctx_t *ctx;
+
+    /* Options come before the file names */
+    options = 0;
+    sourceArg = 1;
+    while(sourceArg < argc && getOption(argv[sourceArg],&options))
+    {
+        sourceArg++;
+    }
+    argc -= sourceArg - 1;
     
+    if(argc == 3 && strcmp(argv[sourceArg],"--batch") == 0)
+    {
+        return runBatch(argv[sourceArg+1],options);
+    }
+
     if(argc < 3 || argc > 4)
     {
         print_usage();
@@ -1306,56 +373,55 @@ int main(int argc, char *argv[])
     }
 
     
-    memorySize = 2048; /* Default Memory Size */
-    outFileArg = 2;
+    memorySize = DEFAULT_MEMORY_SIZE; /* Default Memory Size */
+    outFileArg = sourceArg + 1;
 
     if(argc == 4)
     {
-        memorySize = (int)strtol(argv[2],&endStrol,0);
-        if(*endStrol != 0 || memorySize & (memorySize-1) != 0 | memorySize < 32 || memorySize > 4096)
+        memorySize = (int)strtol(argv[sourceArg+1],&endStrol,0);
+        if(*endStrol != 0)
         {
             print_usage();
             return 0;
         }
-        outFileArg = 3;
+        outFileArg = sourceArg + 2;
+    }
+
+    /* Context creation fails if the memory size is not valid */
+    ctx = pasm_ctx_create(memorySize);
+    if(ctx == NULL)
+    {
+        print_usage();
+        return 0;
     }
+    pasm_set_options(ctx,options);
 
-    fp = fopen(argv[1],"r");   
+    if(strcmp(argv[sourceArg],"-") == 0)
+    {
+        fp = stdin;
+    }
+    else
+    {
+        fp = fopen(argv[sourceArg],"r");   
+    }
 
     if(fp == NULL)
     {
-        printf("Could not open source file %s\n",argv[1]);
+        printf("Could not open source file %s\n",argv[sourceArg]);
+        pasm_ctx_destroy(ctx);
         return 0;
     }
 
-    if(assemble(fp))
+    if(pasm_assemble_file(ctx,fp))
     {
-        /* Get output file extention to determine file format */
-        outFileExtention = getExtension(argv[outFileArg]);
-        /* VHDL */
-        if(strcmp(outFileExtention,"VHD") == 0 || strcmp(outFileExtention,"vhd") == 0)
-        {
-            createVHDLFile(argv[outFileArg]);
-            return 0;
-        }
-        /* Intel/Altera MIF */
-        if(strcmp(outFileExtention,"MIF") == 0 || strcmp(outFileExtention,"mif") == 0)
-        {
-            createMIFFile(argv[outFileArg]);
-            return 0;
-        }
-        /* Lattice Semmiconductor MEM */
-        if(strcmp(outFileExtention,"MEM") == 0 || strcmp(outFileExtention,"mem") == 0)
-        {
-            createMEMFile(argv[outFileArg]);
-            return 0;
-        }
-        /* Error */
-        printf("Invalid output file extention\n");
+        pasm_write_output(ctx,argv[outFileArg]);
     }
+    fclose(fp);
+
+    printf("%s",pasm_get_messages(ctx));
+    pasm_ctx_destroy(ctx);
         
     return 0;
 }
 
 /* End of File */
-
@@ -0,0 +1,95 @@
+/*------------------------------------------------------------------------------------------------------
+--
+-- pasm.h
+-- Library interface to the pumpkin-cpu assembler (libpasm)
+--
+--------------------------------------------------------------------------------------------------------
+--
+-- This file is part of the pumpkin-cpu Project
+-- Copyright (C) 2020 Steve Teal
+--
+-- This source file may be used and distributed without restriction provided that this copyright
+-- statement is not removed from the file and that any derivative work contains the original
+-- copyright notice and the associated disclaimer.
+--
+-- This source file is free software; you can redistribute it and/or modify it under the terms
+-- of the GNU Lesser General Public License as published by the Free Software Foundation,
+-- either version 3 of the License, or (at your option) any later version.
+--
+-- This source is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+-- without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+-- See the GNU Lesser General Public License for more details.
+--
+-- You should have received a copy of the GNU Lesser General Public License along with this
+-- source; if not, download it from http://www.gnu.org/licenses/lgpl-3.0.en.html
+--
+--------------------------------------------------------------------------------------------------------
+--
+-- All assembler state is held in a context, contexts share nothing so separate contexts can be
+-- used from separate threads at the same time. A context can be reused for any number of
+-- assemblies, each assembly starts from a clean state.
+--
+-- Messages (errors and results) are collected in the context rather than printed, use
+-- pasm_get_messages() to retrieve them.
+--
+------------------------------------------------------------------------------------------------------*/
+#ifndef PASM_H
+#define PASM_H
+
+#include<stdio.h>
+#include<stddef.h>
+
+#define PASM_VERSION_STRING    "1.4"
+#define PASM_MIN_MEMORY_SIZE   (32)
+#define PASM_MAX_MEMORY_SIZE   (4096)
+
+/* Optimizer options for pasm_set_options() */
+#define PASM_OPTIMIZE_PEEPHOLE (1) /* Remove NOPs and redundant instructions, thread branch chains */
+#define PASM_OPTIMIZE_TAIL_CALL (2) /* Convert CALL followed by RETURN to BR */
+#define PASM_OPTIMIZE_DEAD_CODE (4) /* Remove code and data that can not be reached or referenced */
+
+/* Encoding options for pasm_set_options() */
+#define PASM_SHORT_IMMEDIATE   (8) /* Immediates 0 to 2047 held in the instruction, for a core with the short_immediate generic */
+
+typedef struct pasm_ctx pasm_ctx_t;
+
+/* Create a context for a target memory size; a 2^n number in the range 32 to 4096. Returns NULL on failure */
+pasm_ctx_t *pasm_ctx_create(int memorySize);
+
+/* Free a context and everything it holds */
+void pasm_ctx_destroy(pasm_ctx_t *ctx);
+
+/* Select the optimizations and encoding of following assemblies, a combination of PASM_OPTIMIZE_ flags and PASM_SHORT_IMMEDIATE, default 0 */
+void pasm_set_options(pasm_ctx_t *ctx, int options);
+
+/* Assemble source held in memory, returns 1 on success, 0 if errors were found */
+int pasm_assemble_buffer(pasm_ctx_t *ctx, const char *source, size_t length);
+
+/* Assemble source read from a file or stream, returns 1 on success, 0 if errors were found */
+int pasm_assemble_file(pasm_ctx_t *ctx, FILE *fp);
+
+/* Return the assembled memory image, size is set to the number of words in the image */
+const int *pasm_get_image(pasm_ctx_t *ctx, int *size);
+
+/* Number of memory words used by the program including the constant pool */
+int pasm_get_words_used(pasm_ctx_t *ctx);
+
+/* Number of labels defined by the last assembly */
+int pasm_get_label_count(pasm_ctx_t *ctx);
+
+/* Name of a label, index is 0 to count - 1 in the order labels were defined, address is set to its address. NULL if index is out of range */
+const char *pasm_get_label(pasm_ctx_t *ctx, int index, int *address);
+
+/* Number of errors found by the last assembly */
+int pasm_get_error_count(pasm_ctx_t *ctx);
+
+/* Messages collected since the context was created or last cleared */
+const char *pasm_get_messages(pasm_ctx_t *ctx);
+void pasm_clear_messages(pasm_ctx_t *ctx);
+
+/* Write the image to a file, the format (.vhd .mif .mem .c .sym) is determined by the file extension, .c also writes a .h header. Returns 1 on success */
+int pasm_write_output(pasm_ctx_t *ctx, const char *fileName);
+
+#endif
+
+/* End of File */
@@ -0,0 +1,219 @@
+/*------------------------------------------------------------------------------------------------------
+--
+-- pasm_test.c
+-- Tests for the pumpkin-cpu assembler library (libpasm)
+--
+--------------------------------------------------------------------------------------------------------
+--
+-- This file is part of the pumpkin-cpu Project
+-- Copyright (C) 2020 Steve Teal
+--
+-- This source file may be used and distributed without restriction provided that this copyright
+-- statement is not removed from the file and that any derivative work contains the original
+-- copyright notice and the associated disclaimer.
+--
+-- This source file is free software; you can redistribute it and/or modify it under the terms
+-- of the GNU Lesser General Public License as published by the Free Software Foundation,
+-- either version 3 of the License, or (at your option) any later version.
+--
+-- This source is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+-- without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+-- See the GNU Lesser General Public License for more details.
+--
+-- You should have received a copy of the GNU Lesser General Public License along with this
+-- source; if not, download it from http://www.gnu.org/licenses/lgpl-3.0.en.html
+--
+--------------------------------------------------------------------------------------------------------
+--
+-- A context can be reused for any number of assemblies and each must start from a clean state,
+-- as the workers of pasm --batch reuse theirs. Every program is assembled on a context that has
+-- already assembled each of the others, with each set of options, and the result compared with
+-- the same program assembled on a fresh context.
+--
+------------------------------------------------------------------------------------------------------*/
+#include<stdio.h>
+#include<string.h>
+#include "pasm.h"
+
+#define MEMORY_SIZE            (64)
+
+/* Programs that leave different state behind, ORG gaps, an interrupt vector, errors */
+const char *programs[] =
+{
+    "        BR S\n"
+    "        ORG 8\n"
+    "S       BR S\n",
+
+    "            BR START\n"
+    "LED_PORT    DW 0\n"
+    "COUNTER     DW 0\n"
+    "START       LOAD #1\n"
+    "LP1         OUT LED_PORT\n"
+    "            LOAD #30\n"
+    "LP2         STORE COUNTER\n"
+    "            LOAD #0xFFFF\n"
+    "LP3         SUB #1\n"
+    "            BNZ LP3\n"
+    "            LOAD COUNTER\n"
+    "            SUB #1\n"
+    "            BNZ LP2\n"
+    "            IN LED_PORT\n"
+    "            XOR #1\n"
+    "            BR LP1\n",
+
+    "        BR START\n"
+    "        IRQ HANDLER\n"
+    "SAVE_A  DW 0\n"
+    "START   NOP\n"
+    "        CALL SUB1\n"
+    "        BR START\n"
+    "SUB1    CALL SUB2\n"
+    "        RETURN\n"
+    "SUB2    RETURN\n"
+    "HANDLER STORE SAVE_A\n"
+    "        LOAD SAVE_A\n"
+    "        RETI\n",
+
+    "            BR START\n"
+    "LED_PORT    DW 0\n"
+    "START       NOP\n"
+    "            NOP\n"
+    "            LOAD #1\n"
+    "            NOP\n"
+    "LP1         OUT LED_PORT\n"
+    "            NOP\n"
+    "            XOR #1\n"
+    "            NOP\n"
+    "            BR LP1\n"
+    "            NOP\n",
+
+    "        BR MISSING\n"
+    "        ORG 4\n"
+    "        DW 1,2,3\n"
+};
+
+#define NUM_PROGRAMS           ((int)(sizeof(programs) / sizeof(programs[0])))
+
+const int optionSets[] =
+{
+    0,
+    PASM_OPTIMIZE_PEEPHOLE,
+    PASM_OPTIMIZE_PEEPHOLE|PASM_OPTIMIZE_TAIL_CALL|PASM_OPTIMIZE_DEAD_CODE
+};
+
+#define NUM_OPTION_SETS        ((int)(sizeof(optionSets) / sizeof(optionSets[0])))
+
+typedef struct
+{
+    int result;
+    int errors;
+    int wordsUsed;
+    int size;
+    int image[PASM_MAX_MEMORY_SIZE];
+    int labels;
+}result_t;
+
+/*
+    Assemble a program and keep what it produced
+*/
+
+void assembleProgram(pasm_ctx_t *ctx, int program, int options, result_t *result)
+{
+    const int *image;
+
+    pasm_set_options(ctx,options);
+    result->result = pasm_assemble_buffer(ctx,programs[program],strlen(programs[program]));
+    result->errors = pasm_get_error_count(ctx);
+    result->wordsUsed = pasm_get_words_used(ctx);
+    result->labels = pasm_get_label_count(ctx);
+    image = pasm_get_image(ctx,&result->size);
+    memset(result->image,0,sizeof(result->image));
+    if(image != NULL)
+    {
+        memcpy(result->image,image,result->size * sizeof(int));
+    }
+    pasm_clear_messages(ctx);
+}
+
+/*
+    Compare a program assembled after another on the same context with a fresh assembly,
+    returns 1 if they match
+*/
+
+int testReuse(int first, int second, int options)
+{
+    pasm_ctx_t *ctx;
+    result_t fresh;
+    result_t reused;
+    int i;
+
+    ctx = pasm_ctx_create(MEMORY_SIZE);
+    if(ctx == NULL)
+    {
+        printf("Error: could not create a context\n");
+        return 0;
+    }
+    assembleProgram(ctx,second,options,&fresh);
+    pasm_ctx_destroy(ctx);
+
+    ctx = pasm_ctx_create(MEMORY_SIZE);
+    if(ctx == NULL)
+    {
+        printf("Error: could not create a context\n");
+        return 0;
+    }
+    assembleProgram(ctx,first,options,&reused);
+    assembleProgram(ctx,second,options,&reused);
+    pasm_ctx_destroy(ctx);
+
+    if(reused.result != fresh.result || reused.errors != fresh.errors || reused.wordsUsed != fresh.wordsUsed ||
+       reused.size != fresh.size || reused.labels != fresh.labels)
+    {
+        printf("FAIL program %d after program %d, options %d: result %d/%d, errors %d/%d, words used %d/%d, labels %d/%d\n",
+               second,first,options,reused.result,fresh.result,reused.errors,fresh.errors,reused.wordsUsed,fresh.wordsUsed,
+               reused.labels,fresh.labels);
+        return 0;
+    }
+    for(i=0;i<fresh.size;i++)
+    {
+        if(reused.image[i] != fresh.image[i])
+        {
+            printf("FAIL program %d after program %d, options %d: word %03X is %04X, %04X on a fresh context\n",
+                   second,first,options,i,reused.image[i],fresh.image[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(void)
+{
+    int first;
+    int second;
+    int options;
+    int tests;
+    int failed;
+
+    tests = 0;
+    failed = 0;
+    for(options=0;options<NUM_OPTION_SETS;options++)
+    {
+        for(first=0;first<NUM_PROGRAMS;first++)
+        {
+            for(second=0;second<NUM_PROGRAMS;second++)
+            {
+                tests++;
+                if(!testReuse(first,second,optionSets[options]))
+                {
+                    failed++;
+                }
+            }
+        }
+    }
+
+    printf("%d tests, %d failed\n",tests,failed);
+    printf("%s\n",failed ? "FAIL" : "PASS");
+    return failed != 0;
+}
+
+/* End of File */
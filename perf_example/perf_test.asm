@@ -0,0 +1,66 @@
+;
+; Performance counter test program for pumpkin_psim_tb.vhd and PSIM -P
+;
+; The counters are read once as they are out of reset, then cleared and read again after a loop
+; of about 70000 cycles that makes nested CALLs, so the high half of the cycle counter is used and
+; the call stack high water mark is 3. Each value read is written to IO addresses 0 to 9, low
+; half first, so the IO writes of the core can be compared with those printed by PSIM -P -w.
+;
+
+                  BR START        ; Branch to start of program
+
+START             CALL READ       ; Counters from reset
+                  OUT PERF_CLEAR  ; Clear the counters
+LOOP              CALL LEVEL1     ; Three calls deep
+                  LOAD PASSES     ; Count the passes down
+                  SUB #1
+                  STORE PASSES
+                  BNC LOOP        ; Not taken, SUB leaves C set without a borrow
+                  BNZ LOOP
+                  CALL READ       ; Counters after the loop
+DONE              BR DONE
+
+LEVEL1            CALL LEVEL2
+                  RETURN
+LEVEL2            CALL LEVEL3
+                  RETURN
+LEVEL3            RETURN
+
+; Read the counters, writing each half to IO addresses 0 to 9
+
+READ              IN PERF_CYCLES_LO
+                  OUT #0
+                  IN PERF_CYCLES_HI
+                  OUT #1
+                  IN PERF_INSTRUCTIONS_LO
+                  OUT #2
+                  IN PERF_INSTRUCTIONS_HI
+                  OUT #3
+                  IN PERF_BRANCHES_LO
+                  OUT #4
+                  IN PERF_BRANCHES_HI
+                  OUT #5
+                  IN PERF_STALLS_LO
+                  OUT #6
+                  IN PERF_STALLS_HI
+                  OUT #7
+                  IN PERF_DEPTH_LO
+                  OUT #8
+                  IN PERF_DEPTH_HI
+                  OUT #9
+                  RETURN
+
+; Data
+
+PASSES            DW 5000
+PERF_CLEAR        DW 0xFFF0
+PERF_CYCLES_LO    DW 0xFFF0
+PERF_CYCLES_HI    DW 0xFFF1
+PERF_INSTRUCTIONS_LO DW 0xFFF2
+PERF_INSTRUCTIONS_HI DW 0xFFF3
+PERF_BRANCHES_LO  DW 0xFFF4
+PERF_BRANCHES_HI  DW 0xFFF5
+PERF_STALLS_LO    DW 0xFFF6
+PERF_STALLS_HI    DW 0xFFF7
+PERF_DEPTH_LO     DW 0xFFF8
+PERF_DEPTH_HI     DW 0xFFF9
@@ -0,0 +1,4660 @@
+/*------------------------------------------------------------------------------------------------------
+--
+-- psim.c
+-- A cycle accurate instruction set simulator for the pumpkin-cpu
+-- Version 1.1
+--
+--------------------------------------------------------------------------------------------------------
+--
+-- This file is part of the pumpkin-cpu Project
+-- Copyright (C) 2020 Steve Teal
+--
+-- This source file may be used and distributed without restriction provided that this copyright
+-- statement is not removed from the file and that any derivative work contains the original
+-- copyright notice and the associated disclaimer.
+--
+-- This source file is free software; you can redistribute it and/or modify it under the terms
+-- of the GNU Lesser General Public License as published by the Free Software Foundation,
+-- either version 3 of the License, or (at your option) any later version.
+--
+-- This source is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+-- without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+-- See the GNU Lesser General Public License for more details.
+--
+-- You should have received a copy of the GNU Lesser General Public License along with this
+-- source; if not, download it from http://www.gnu.org/licenses/lgpl-3.0.en.html
+--
+--------------------------------------------------------------------------------------------------------
+--
+-- The simulator follows the S0/S1/S2 state machine in pumpkin.vhd:
+--
+--   Reset (S0)                          1 cycle
+--   LOAD STORE ADD SUB OR AND XOR
+--   ROR SWAP IN OUT (S1 -> S2)          2 cycles
+--   BR BNC BNZ CALL RETURN (S1 only)    1 cycle
+--
+-- The call stack is modelled as the shift register in pumpkin.vhd, CALL pushes onto callstack(0)
+-- discarding the deepest entry, RETURN pops callstack(0) leaving the deepest entry unchanged.
+--
+------------------------------------------------------------------------------------------------------*/
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<ctype.h>
+#include<time.h>
+#include<pthread.h>
+#ifdef _WIN32
+#include<windows.h>
+#else
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#endif
+#include "pasm.h"
+#include "ptrace.h"
+#include "putil.h"
+
+/* The JIT generates x86-64 code for the System V calling convention */
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_SUPPORTED
+#endif
+
+#define VERSION_STRING         "1.1"
+#define MAX_MEMORY_SIZE        (4096)
+#define MAX_STACK_DEPTH        (64)
+#define IO_MEMORY_SIZE         (65536)
+#define MAX_LINE_LENGTH        (256)
+#define MAX_INPUT_LINE_LENGTH  (4096) /* Longest line of a batch input file */
+#define DEFAULT_STACK_DEPTH    (4)
+#define DEFAULT_MEMORY_SIZE    (2048) /* Memory size used when assembling, as PASM */
+#define LANE_HALTED            (0x8000) /* Set in a lane's pc once it branches to itself */
+#define MAX_THREADS            (256)
+#define DEFAULT_QUANTUM        (10000) /* Cycles run by each core between IO exchanges */
+#define PROFILE_HASH_SIZE      (4096) /* Buckets in the profiler's call tree hash, a power of 2 */
+#define TRACE_RING_SIZE        (16) /* Blocks between the simulation and the trace writer */
+#define TRACE_RING_RECORDS     (8192) /* Instructions recorded in each block of the ring */
+#define TRACE_HASH_BITS        (14) /* Size of the trace compressor's hash table */
+#define MAX_DEVICES            (16) /* Peripherals attached at once */
+#define EVENT_WHEEL_SIZE       (1024) /* Slots in the peripheral event timing wheel, a power of 2 */
+#define NO_EVENT               (~0ULL) /* Cycle of the next event when there is none */
+#define DEFAULT_UART_BIT       (104) /* Cycles per bit of a UART, 115200 baud with a 12MHz clock */
+#define IRQ_VECTOR             (1) /* Address the core calls when it takes an interrupt */
+
+/* Opcodes */
+#define I_LOAD   (0x0)
+#define I_STORE  (0x1)
+#define I_ADD    (0x2)
+#define I_SUB    (0x3)
+#define I_OR     (0x4)
+#define I_AND    (0x5)
+#define I_XOR    (0x6)
+#define I_ROR    (0x7)
+#define I_SWAP   (0x8)
+#define I_IN     (0x9)
+#define I_OUT    (0xA)
+#define I_BR     (0xB)
+#define I_BNC    (0xC)
+#define I_BNZ    (0xD)
+#define I_CALL   (0xE)
+#define I_RETURN (0xF)
+
+/* Short immediates, bit 11 of LOAD, ADD, SUB, OR, AND, XOR, ROR and SWAP with the short_immediate generic */
+#define SHORT_IMMEDIATE        (0x800)
+#define SHORT_IMMEDIATE_MAX    (0x7FF)
+#define SHORT_IMMEDIATE_MEMORY (2048) /* Largest memory size, bit 11 must not be an address bit */
+
+/* Snapshots */
+#define SNAPSHOT_MAGIC       "PSNP"
+#define SNAPSHOT_VERSION     (3)
+#define SNAPSHOT_BYTE_ORDER  (0x01020304) /* Reads back differently on a host of the other byte order */
+#define SNAPSHOT_S0          (0) /* States of pumpkin.vhd */
+#define SNAPSHOT_S1          (1)
+#define SNAPSHOT_S2          (2)
+
+/* Reasons for the simulation stopping */
+#define STOP_CYCLES (0)
+#define STOP_HALT   (1)
+
+/* JIT */
+#define JIT_CODE_SIZE       (16*1024*1024) /* Size of the code cache */
+#define JIT_MAX_BLOCK       (64) /* Maximum instructions in a block */
+#define JIT_MAX_BLOCK_CODE  (8192) /* Maximum bytes of code for a block */
+#define JIT_EXIT_BRANCH     (0) /* Block finished, pc is the next block */
+#define JIT_EXIT_STORE      (1) /* STORE into a translated block */
+#define JIT_EXIT_LIMIT      (2) /* Not enough cycles left to run the block */
+
+typedef unsigned long long cycle_t;
+
+typedef struct
+{
+    char *name;
+    unsigned int address;
+}symbol_t;
+
+int memorySize; /* Size of program memory, a 2^n number */
+int asmMemorySize; /* Memory size used when the image is assembled from source */
+unsigned int memory[MAX_MEMORY_SIZE]; /* Program memory */
+unsigned int ioMemory[IO_MEMORY_SIZE]; /* IO memory modelled as RAM */
+
+/* CPU state, names follow the signals in pumpkin.vhd */
+unsigned int a;
+unsigned int c;
+unsigned int pc;
+unsigned int callstack[MAX_STACK_DEPTH];
+int stackDepth;
+int stackTop; /* Index of callstack(0) within callstack[] */
+int inIrq; /* Set while an interrupt is handled, further interrupts are held off until RETI */
+unsigned int savedC; /* C saved when the interrupt was taken, restored by RETI */
+
+/* Interrupt input, driven by a peripheral */
+int irqSource; /* Set when a peripheral drives irq */
+cycle_t irqCycle = NO_EVENT; /* Cycle irq went high, NO_EVENT while it is low */
+cycle_t irqTake = NO_EVENT; /* First cycle an interrupt can be taken in, NO_EVENT while irq is low or in_irq is set */
+cycle_t interrupts; /* Interrupts taken */
+
+/* Events counted for the performance counters, by the interpreter only */
+int perfCounters; /* Set when the counters are modelled */
+cycle_t branchesTaken; /* BR, CALL and RETURN, BNC and BNZ when they branch */
+unsigned int callDepth; /* Entries on the call stack, including interrupts */
+unsigned int callDepthMax;
+
+cycle_t cycles;
+cycle_t instructions;
+int traceIO; /* Print IO writes when set */
+int skipLoops; /* Fast-forward delay loops when set */
+int traceLane; /* Lane shown with IO writes in batch mode, -1 otherwise */
+
+/* Wait states, clock_enable held low while a memory or IO access completes */
+cycle_t stateCycles = 1; /* Cycles each state takes, 1 + program memory wait states */
+unsigned int ioStall[IO_MEMORY_SIZE]; /* Cycles an IN or OUT waits beyond the program memory wait states */
+int ioWaits; /* Set if any IO address has a latency */
+cycle_t ioStallCycles; /* Cycles spent waiting for IO */
+
+unsigned int immediateMask; /* SHORT_IMMEDIATE when the core has short immediates, 0 otherwise */
+
+int numSymbols; /* Labels from the assembler or a symbol file */
+int maxSymbols; /* Allocated size of symbols */
+symbol_t *symbols;
+
+/*
+    Return pointer to filename extension
+*/
+
+char *getExtension(char *fileName)
+{
+    char *ptr;
+
+    ptr = fileName;
+
+    if(strlen(fileName)>3)
+    {
+        ptr += strlen(fileName);
+        do
+        {
+            ptr--;
+            if(*ptr == '.')
+            {
+                return ptr+1;
+            }
+        }
+        while(ptr != fileName);
+    }
+
+    return NULL;
+}
+
+/*
+    Case insensitive compare of a file extension, extension may be NULL
+*/
+
+int extensionIs(char *extension, char *match)
+{
+    if(extension == NULL || strlen(extension) != strlen(match))
+    {
+        return 0;
+    }
+    while(*match)
+    {
+        if(toupper(*extension++) != toupper(*match++))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+    Round size up to a 2^n memory size in the range 32 to 4096
+*/
+
+int roundMemorySize(int size)
+{
+    int m;
+
+    for(m=32;m<MAX_MEMORY_SIZE;m<<=1)
+    {
+        if(m >= size)
+        {
+            break;
+        }
+    }
+
+    return m;
+}
+
+/*
+    Load a MIF or MEM file, both use 'address : data' lines in hex
+*/
+
+int loadAddressDataFile(FILE *fp)
+{
+    char line[MAX_LINE_LENGTH+1];
+    unsigned int address;
+    unsigned int data;
+    int depth;
+    int highest;
+
+    depth = 0;
+    highest = 0;
+    while(fgets(line,sizeof(line),fp))
+    {
+        /* Depth is 'DEPTH = n;' in MIF and '#Depth=n' in MEM files */
+        if(sscanf(line,"DEPTH = %d",&depth) == 1 || sscanf(line,"#Depth=%d",&depth) == 1)
+        {
+            continue;
+        }
+        /* Skip comments */
+        if(line[0] == '-' || line[0] == '#')
+        {
+            continue;
+        }
+        if(sscanf(line,"%x : %x",&address,&data) == 2)
+        {
+            if(address >= MAX_MEMORY_SIZE)
+            {
+                printf("Error: address %X exceeds maximum memory size\n",address);
+                return 0;
+            }
+            memory[address] = data & 0xFFFF;
+            if((int)address >= highest)
+            {
+                highest = address + 1;
+            }
+        }
+    }
+
+    memorySize = roundMemorySize(depth > highest ? depth : highest);
+    return 1;
+}
+
+/*
+    Load a VHDL RAM model created by PASM, data is listed as X"nnnn" from address 0
+*/
+
+int loadVHDLFile(FILE *fp)
+{
+    char line[MAX_LINE_LENGTH+1];
+    char *ptr;
+    int depth;
+    int address;
+    unsigned int data;
+
+    depth = 0;
+    address = 0;
+    while(fgets(line,sizeof(line),fp))
+    {
+        ptr = strstr(line,"array (0 to ");
+        if(ptr != NULL)
+        {
+            depth = (int)strtol(ptr+12,NULL,0) + 1;
+            continue;
+        }
+        ptr = line;
+        while((ptr = strstr(ptr,"X\"")) != NULL)
+        {
+            if(sscanf(ptr+2,"%4x",&data) == 1)
+            {
+                if(address >= MAX_MEMORY_SIZE)
+                {
+                    printf("Error: VHDL file exceeds maximum memory size\n");
+                    return 0;
+                }
+                memory[address++] = data;
+            }
+            ptr += 2;
+        }
+    }
+
+    memorySize = roundMemorySize(depth > address ? depth : address);
+    return 1;
+}
+
+/*
+    Remove all symbols
+*/
+
+void clearSymbols(void)
+{
+    int i;
+
+    for(i=0;i<numSymbols;i++)
+    {
+        free(symbols[i].name);
+    }
+    numSymbols = 0;
+}
+
+/*
+    Add a label to the symbols, returns 0 if there is no memory for it
+*/
+
+int addSymbol(const char *name, unsigned int address)
+{
+    symbol_t *newSymbols;
+    char *copy;
+
+    if(numSymbols >= maxSymbols)
+    {
+        maxSymbols = maxSymbols ? maxSymbols * 2 : 64;
+        newSymbols = (symbol_t*)realloc(symbols,maxSymbols * sizeof(symbol_t));
+        if(newSymbols == NULL)
+        {
+            return 0;
+        }
+        symbols = newSymbols;
+    }
+    copy = (char*)malloc(strlen(name) + 1);
+    if(copy == NULL)
+    {
+        return 0;
+    }
+    strcpy(copy,name);
+    symbols[numSymbols].name = copy;
+    symbols[numSymbols].address = address;
+    numSymbols++;
+
+    return 1;
+}
+
+/*
+    Load a symbol file created by PASM, each line is 'address label' with the address in hex.
+    Lines starting with ';' or '#' are ignored.
+*/
+
+int loadSymbolFile(char *fileName)
+{
+    FILE *fp;
+    char line[MAX_LINE_LENGTH];
+    char *ptr;
+    char *name;
+    char *endStrol;
+    unsigned int address;
+    int lineNumber;
+
+    fp = fopen(fileName,"r");
+    if(fp == NULL)
+    {
+        printf("Could not open symbol file %s\n",fileName);
+        return 0;
+    }
+
+    clearSymbols();
+    lineNumber = 0;
+    while(fgets(line,sizeof(line),fp))
+    {
+        lineNumber++;
+        ptr = strtok(line," \t\r\n");
+        if(ptr == NULL || *ptr == ';' || *ptr == '#')
+        {
+            continue;
+        }
+        address = (unsigned int)strtoul(ptr,&endStrol,16);
+        name = strtok(NULL," \t\r\n");
+        if(*endStrol != 0 || name == NULL || address >= MAX_MEMORY_SIZE)
+        {
+            printf("Error symbol file line %d: syntax\n",lineNumber);
+            fclose(fp);
+            return 0;
+        }
+        if(!addSymbol(name,address))
+        {
+            printf("Error: out of memory\n");
+            fclose(fp);
+            return 0;
+        }
+    }
+    fclose(fp);
+
+    return 1;
+}
+
+/*
+    Assemble a source file with libpasm and take its memory image
+*/
+
+int loadSourceFile(FILE *fp)
+{
+    pasm_ctx_t *ctx;
+    const int *image;
+    const char *name;
+    int address;
+    int result;
+    int i;
+
+    ctx = pasm_ctx_create(asmMemorySize);
+    if(ctx == NULL)
+    {
+        printf("Error: invalid memory size %d\n",asmMemorySize);
+        return 0;
+    }
+    if(immediateMask)
+    {
+        pasm_set_options(ctx,PASM_SHORT_IMMEDIATE);
+    }
+
+    result = pasm_assemble_file(ctx,fp);
+    printf("%s",pasm_get_messages(ctx));
+    if(result)
+    {
+        image = pasm_get_image(ctx,&memorySize);
+        for(i=0;i<memorySize;i++)
+        {
+            memory[i] = image[i] & 0xFFFF;
+        }
+        /* Labels are kept for the profiler */
+        clearSymbols();
+        for(i=0;i<pasm_get_label_count(ctx);i++)
+        {
+            name = pasm_get_label(ctx,i,&address);
+            if(!addSymbol(name,(unsigned int)address))
+            {
+                printf("Error: out of memory\n");
+                result = 0;
+                break;
+            }
+        }
+    }
+    pasm_ctx_destroy(ctx);
+
+    return result;
+}
+
+/*
+    Load memory image, format is determined by file extension
+*/
+
+int loadImage(char *fileName)
+{
+    FILE *fp;
+    char *extension;
+    int result;
+
+    extension = getExtension(fileName);
+    if(!extensionIs(extension,"MIF") && !extensionIs(extension,"MEM") && !extensionIs(extension,"VHD") && !extensionIs(extension,"ASM"))
+    {
+        printf("Invalid image file extention\n");
+        return 0;
+    }
+
+    fp = fopen(fileName,"r");
+    if(fp == NULL)
+    {
+        printf("Could not open image file %s\n",fileName);
+        return 0;
+    }
+
+    memset(memory,0,sizeof(memory));
+    if(extensionIs(extension,"ASM"))
+    {
+        result = loadSourceFile(fp);
+    }
+    else if(extensionIs(extension,"VHD"))
+    {
+        result = loadVHDLFile(fp);
+    }
+    else
+    {
+        result = loadAddressDataFile(fp);
+    }
+    fclose(fp);
+
+    return result;
+}
+
+/*
+    Reset CPU, the S0 state takes a single cycle and fetches from address 0
+*/
+
+void reset(void)
+{
+    a = 0;
+    c = 0;
+    pc = 0;
+    stackTop = 0;
+    memset(callstack,0,sizeof(callstack));
+    memset(ioMemory,0,sizeof(ioMemory));
+    cycles = stateCycles;
+    instructions = 0;
+    inIrq = 0;
+    savedC = 0;
+    irqCycle = NO_EVENT;
+    irqTake = NO_EVENT;
+    interrupts = 0;
+    branchesTaken = 0;
+    callDepth = 0;
+    callDepthMax = 0;
+}
+
+/*
+    Snapshots
+
+    A snapshot holds the whole simulator state, the CPU registers named as in pumpkin.vhd, the call
+    stack, program memory and IO memory. The file is a header followed by the memories laid out as
+    they are held here, in the byte order of the host, so restoring is a check of the header and a
+    copy out of the mapped file. Snapshots are taken between instructions, where pumpkin.vhd is in
+    state S1 with pc one past the instruction being fetched. The ir register is only read in S2 and
+    is loaded before every S2, so it does not affect the simulation and is saved as 0. A snapshot
+    saved after the core halted is marked so that a run from it stops straight away.
+*/
+
+typedef struct
+{
+    char magic[4]; /* SNAPSHOT_MAGIC */
+    unsigned int version;
+    unsigned int byteOrder; /* SNAPSHOT_BYTE_ORDER as written by the host */
+    unsigned int headerSize; /* sizeof(snapshot_header_t) */
+    unsigned int memorySize;
+    unsigned int stackDepth;
+    unsigned int a;
+    unsigned int c;
+    unsigned int pc; /* pc register of pumpkin.vhd, address of the next instruction + 1 */
+    unsigned int state; /* SNAPSHOT_S0, SNAPSHOT_S1 or SNAPSHOT_S2 */
+    unsigned int ir;
+    unsigned int halted; /* 1 if the core had halted, pc is the branch to self */
+    unsigned int inIrq; /* in_irq of pumpkin.vhd, an interrupt is being handled */
+    unsigned int savedC; /* saved_c of pumpkin.vhd */
+    cycle_t cycles;
+    cycle_t instructions;
+    unsigned int callstack[MAX_STACK_DEPTH]; /* callstack(0) first */
+}snapshot_header_t;
+
+int snapshotHalted; /* Set when the snapshot restored was saved after the core halted */
+
+/*
+    Save the simulator state to a snapshot file, halted is set if the core has halted. Returns 0
+    on failure.
+*/
+
+int saveSnapshot(char *fileName, int halted)
+{
+    snapshot_header_t header;
+    FILE *fp;
+    int i;
+    int ok;
+
+    fp = fopen(fileName,"wb");
+    if(fp == NULL)
+    {
+        printf("Could not open snapshot file %s\n",fileName);
+        return 0;
+    }
+
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,SNAPSHOT_MAGIC,4);
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.headerSize = sizeof(header);
+    header.memorySize = memorySize;
+    header.stackDepth = stackDepth;
+    header.a = a;
+    header.c = c;
+    header.pc = (pc + 1) & (memorySize - 1);
+    header.state = SNAPSHOT_S1;
+    header.ir = 0;
+    header.halted = halted ? 1 : 0;
+    header.inIrq = inIrq;
+    header.savedC = savedC;
+    header.cycles = cycles;
+    header.instructions = instructions;
+    for(i=0;i<stackDepth;i++)
+    {
+        header.callstack[i] = callstack[(stackTop + i) % stackDepth];
+    }
+
+    ok = fwrite(&header,sizeof(header),1,fp) == 1 &&
+         fwrite(memory,sizeof(unsigned int),memorySize,fp) == (size_t)memorySize &&
+         fwrite(ioMemory,sizeof(ioMemory),1,fp) == 1;
+    ok = (fclose(fp) == 0) && ok;
+    if(!ok)
+    {
+        printf("Error writing snapshot file %s\n",fileName);
+        return 0;
+    }
+    printf("Snapshot      : cycle %llu saved to %s\n",cycles,fileName);
+
+    return 1;
+}
+
+/*
+    Set the simulator state from a snapshot held in memory, returns 0 if it is not valid
+*/
+
+int setSnapshot(char *fileName, const unsigned char *data, size_t size)
+{
+    snapshot_header_t header;
+    int i;
+
+    if(size < sizeof(header))
+    {
+        printf("Error: %s is not a snapshot\n",fileName);
+        return 0;
+    }
+    memcpy(&header,data,sizeof(header));
+    if(memcmp(header.magic,SNAPSHOT_MAGIC,4) != 0)
+    {
+        printf("Error: %s is not a snapshot\n",fileName);
+        return 0;
+    }
+    if(header.version != SNAPSHOT_VERSION || header.byteOrder != SNAPSHOT_BYTE_ORDER || header.headerSize != sizeof(header))
+    {
+        printf("Error: %s is snapshot version %u from a different host or version, version %d expected\n",fileName,header.version,SNAPSHOT_VERSION);
+        return 0;
+    }
+    if(header.memorySize < 2 || header.memorySize > MAX_MEMORY_SIZE || (header.memorySize & (header.memorySize - 1)) != 0 ||
+       header.stackDepth < 1 || header.stackDepth > MAX_STACK_DEPTH || header.state != SNAPSHOT_S1 || header.halted > 1 || header.inIrq > 1 || header.savedC > 1 ||
+       size != sizeof(header) + header.memorySize * sizeof(unsigned int) + sizeof(ioMemory))
+    {
+        printf("Error: snapshot %s is not valid\n",fileName);
+        return 0;
+    }
+
+    memorySize = header.memorySize;
+    stackDepth = header.stackDepth;
+    a = header.a & 0xFFFF;
+    c = header.c & 1;
+    pc = (header.pc - 1) & (memorySize - 1);
+    cycles = header.cycles;
+    instructions = header.instructions;
+    snapshotHalted = header.halted;
+    inIrq = header.inIrq;
+    savedC = header.savedC;
+    irqCycle = NO_EVENT;
+    irqTake = NO_EVENT;
+    interrupts = 0;
+    branchesTaken = 0;
+    callDepth = 0;
+    callDepthMax = 0;
+    stackTop = 0;
+    memset(callstack,0,sizeof(callstack));
+    for(i=0;i<stackDepth;i++)
+    {
+        callstack[i] = header.callstack[i] & (memorySize - 1);
+    }
+    memset(memory,0,sizeof(memory));
+    memcpy(memory,data + sizeof(header),memorySize * sizeof(unsigned int));
+    memcpy(ioMemory,data + sizeof(header) + memorySize * sizeof(unsigned int),sizeof(ioMemory));
+
+    return 1;
+}
+
+/*
+    Restore the simulator state from a snapshot file, the file is mapped rather than read
+    where the host allows. Returns 0 on failure.
+*/
+
+int restoreSnapshot(char *fileName)
+{
+#ifdef _WIN32
+    unsigned char *data;
+    FILE *fp;
+    long size;
+    int result;
+
+    fp = fopen(fileName,"rb");
+    if(fp == NULL)
+    {
+        printf("Could not open snapshot file %s\n",fileName);
+        return 0;
+    }
+    fseek(fp,0,SEEK_END);
+    size = ftell(fp);
+    fseek(fp,0,SEEK_SET);
+    data = (unsigned char*)malloc(size > 0 ? size : 1);
+    if(data == NULL || fread(data,1,size,fp) != (size_t)size)
+    {
+        printf("Error reading snapshot file %s\n",fileName);
+        free(data);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    result = setSnapshot(fileName,data,size);
+    free(data);
+
+    return result;
+#else
+    struct stat info;
+    void *data;
+    int fd;
+    int result;
+
+    fd = open(fileName,O_RDONLY);
+    if(fd < 0)
+    {
+        printf("Could not open snapshot file %s\n",fileName);
+        return 0;
+    }
+    if(fstat(fd,&info) != 0 || info.st_size == 0)
+    {
+        printf("Error: %s is not a snapshot\n",fileName);
+        close(fd);
+        return 0;
+    }
+    data = mmap(NULL,info.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        printf("Error mapping snapshot file %s\n",fileName);
+        return 0;
+    }
+    result = setSnapshot(fileName,(const unsigned char*)data,info.st_size);
+    munmap(data,info.st_size);
+
+    return result;
+#endif
+}
+
+/*
+    Peripherals
+
+    A peripheral claims a range of IO addresses, IN and OUT to its addresses call its read and
+    write functions with the cycle the IO access is made in, the S2 cycle of the instruction.
+    Writes go to IO memory as well, so the writes are printed and saved in snapshots as before.
+    A peripheral that needs to act later, such as sampling a line, schedules an event rather than
+    being called every cycle. Events are held in a timing wheel, one slot per cycle modulo the
+    size of the wheel with each slot in cycle order, events more than a turn away wait in their
+    slot until their turn comes round.
+
+    The simulation is run up to the next event, the event is called once every instruction
+    starting before its cycle has run, so it sees every IO access made up to and including its
+    cycle. A simulation with peripherals therefore costs time in proportion to the IO traffic
+    and events rather than the cycles simulated.
+*/
+
+typedef struct peripheral peripheral_t;
+
+struct peripheral
+{
+    char name[16];
+    unsigned int base; /* First IO address claimed */
+    unsigned int size; /* Number of IO addresses claimed */
+    unsigned int (*read)(peripheral_t *device, unsigned int address, cycle_t cycle); /* NULL reads IO memory */
+    void (*write)(peripheral_t *device, unsigned int address, unsigned int value, cycle_t cycle);
+    void (*event)(peripheral_t *device, int id, cycle_t cycle);
+    void (*start)(peripheral_t *device, cycle_t cycle); /* Called after a reset or a snapshot is restored */
+    void (*finish)(peripheral_t *device, cycle_t cycle); /* Called when the simulation ends */
+    void *data; /* State of the device */
+};
+
+typedef struct device_event
+{
+    cycle_t cycle;
+    peripheral_t *device;
+    int id; /* Passed back to the device */
+    struct device_event *next;
+}device_event_t;
+
+peripheral_t devices[MAX_DEVICES];
+int numDevices;
+unsigned char ioDevice[IO_MEMORY_SIZE]; /* Index + 1 of the device at each IO address, 0 for IO memory */
+device_event_t *eventWheel[EVENT_WHEEL_SIZE];
+device_event_t *freeEvents;
+int pendingEvents;
+cycle_t nextEvent = NO_EVENT; /* Cycle of the earliest pending event */
+cycle_t deviceTime; /* Cycle of the access or event being handled, events can not be scheduled before it */
+
+/*
+    Add a peripheral at IO addresses base to base + size - 1, returns NULL if the addresses
+    are taken or there is no room for another device
+*/
+
+peripheral_t *addPeripheral(char *name, unsigned int base, unsigned int size)
+{
+    peripheral_t *device;
+    unsigned int i;
+
+    if(numDevices >= MAX_DEVICES || size == 0 || base + size > IO_MEMORY_SIZE)
+    {
+        return NULL;
+    }
+    for(i=base;i<base+size;i++)
+    {
+        if(ioDevice[i])
+        {
+            return NULL;
+        }
+    }
+
+    device = &devices[numDevices++];
+    memset(device,0,sizeof(peripheral_t));
+    strncpy(device->name,name,sizeof(device->name) - 1);
+    device->base = base;
+    device->size = size;
+    for(i=base;i<base+size;i++)
+    {
+        ioDevice[i] = (unsigned char)numDevices;
+    }
+
+    return device;
+}
+
+/*
+    Schedule an event for a device, an event for a cycle already passed happens straight away
+*/
+
+void scheduleEvent(peripheral_t *device, int id, cycle_t cycle)
+{
+    device_event_t *event;
+    device_event_t **link;
+
+    if(cycle < deviceTime)
+    {
+        cycle = deviceTime;
+    }
+    event = freeEvents;
+    if(event != NULL)
+    {
+        freeEvents = event->next;
+    }
+    else
+    {
+        event = (device_event_t*)malloc(sizeof(device_event_t));
+        if(event == NULL)
+        {
+            printf("Error: out of memory\n");
+            exit(1);
+        }
+    }
+    event->cycle = cycle;
+    event->device = device;
+    event->id = id;
+
+    /* After any event for the same cycle, so events happen in the order they were scheduled */
+    link = &eventWheel[cycle & (EVENT_WHEEL_SIZE - 1)];
+    while(*link != NULL && (*link)->cycle <= cycle)
+    {
+        link = &(*link)->next;
+    }
+    event->next = *link;
+    *link = event;
+    pendingEvents++;
+    if(cycle < nextEvent)
+    {
+        nextEvent = cycle;
+    }
+}
+
+/*
+    Return the cycle of the earliest pending event, no event is before cycle from
+*/
+
+cycle_t findNextEvent(cycle_t from)
+{
+    device_event_t *event;
+    cycle_t next;
+    int i;
+
+    if(pendingEvents == 0)
+    {
+        return NO_EVENT;
+    }
+    for(i=0;i<EVENT_WHEEL_SIZE;i++)
+    {
+        event = eventWheel[(from + i) & (EVENT_WHEEL_SIZE - 1)];
+        if(event != NULL && event->cycle == from + i)
+        {
+            return event->cycle;
+        }
+    }
+
+    /* Every event is at least a turn of the wheel away */
+    next = NO_EVENT;
+    for(i=0;i<EVENT_WHEEL_SIZE;i++)
+    {
+        if(eventWheel[i] != NULL && eventWheel[i]->cycle < next)
+        {
+            next = eventWheel[i]->cycle;
+        }
+    }
+    return next;
+}
+
+/*
+    Call the events due up to and including cycle now, in cycle order
+*/
+
+void dispatchEvents(cycle_t now)
+{
+    device_event_t *event;
+    device_event_t **slot;
+
+    while(nextEvent <= now)
+    {
+        slot = &eventWheel[nextEvent & (EVENT_WHEEL_SIZE - 1)];
+        event = *slot;
+        *slot = event->next;
+        pendingEvents--;
+
+        deviceTime = event->cycle;
+        event->device->event(event->device,event->id,event->cycle);
+        event->next = freeEvents;
+        freeEvents = event;
+
+        nextEvent = findNextEvent(deviceTime);
+    }
+}
+
+/*
+    IN from an address claimed by a device
+*/
+
+unsigned int deviceRead(unsigned int address, cycle_t cycle)
+{
+    peripheral_t *device;
+
+    device = &devices[ioDevice[address] - 1];
+    if(device->read == NULL)
+    {
+        return ioMemory[address];
+    }
+    deviceTime = cycle;
+    return device->read(device,address,cycle) & 0xFFFF;
+}
+
+/*
+    OUT to an address claimed by a device, IO memory has already been written
+*/
+
+void deviceWrite(unsigned int address, unsigned int value, cycle_t cycle)
+{
+    peripheral_t *device;
+
+    device = &devices[ioDevice[address] - 1];
+    if(device->write != NULL)
+    {
+        deviceTime = cycle;
+        device->write(device,address,value,cycle);
+    }
+}
+
+/*
+    Start the devices from the state of IO memory
+*/
+
+void startDevices(void)
+{
+    int i;
+
+    deviceTime = cycles;
+    for(i=0;i<numDevices;i++)
+    {
+        if(devices[i].start != NULL)
+        {
+            devices[i].start(&devices[i],cycles);
+        }
+    }
+}
+
+/*
+    End the simulation for the devices, events up to cycle end happen first
+*/
+
+void finishDevices(cycle_t end)
+{
+    int i;
+
+    dispatchEvents(end);
+    for(i=0;i<numDevices;i++)
+    {
+        if(devices[i].finish != NULL)
+        {
+            deviceTime = end;
+            devices[i].finish(&devices[i],end);
+        }
+    }
+}
+
+/*
+    UART receiver
+
+    Decodes 8-n-1 serial data from bit 0 of an IO address, such as the TX pin driven by the
+    hello world example. A falling edge on an idle line starts a byte, the line is then sampled
+    in the middle of the start bit, each data bit and the stop bit by events a bit time apart.
+*/
+
+typedef struct
+{
+    cycle_t bitCycles; /* Cycles per bit */
+    int level; /* Line level */
+    int busy; /* Set while a byte is being received */
+    unsigned int shift; /* Data bits received so far */
+    int errors; /* Bytes with a low stop bit */
+    int count; /* Bytes received */
+    int size; /* Allocated size of text */
+    unsigned char *text; /* Bytes received */
+}uart_rx_t;
+
+#define UART_START  (0) /* Event ids, the data bits are 1 to 8 */
+#define UART_STOP   (9)
+
+void uartRxStart(peripheral_t *device, cycle_t cycle)
+{
+    uart_rx_t *uart;
+
+    (void)cycle;
+    uart = (uart_rx_t*)device->data;
+    uart->level = ioMemory[device->base] & 1;
+    uart->busy = 0;
+}
+
+void uartRxWrite(peripheral_t *device, unsigned int address, unsigned int value, cycle_t cycle)
+{
+    uart_rx_t *uart;
+
+    (void)address;
+    uart = (uart_rx_t*)device->data;
+    if(uart->level && !(value & 1) && !uart->busy)
+    {
+        uart->busy = 1;
+        scheduleEvent(device,UART_START,cycle + uart->bitCycles / 2);
+    }
+    uart->level = value & 1;
+}
+
+void uartRxEvent(peripheral_t *device, int id, cycle_t cycle)
+{
+    uart_rx_t *uart;
+    unsigned char *text;
+
+    uart = (uart_rx_t*)device->data;
+    if(id == UART_START)
+    {
+        /* A glitch rather than a start bit if the line is high again */
+        uart->busy = !uart->level;
+        uart->shift = 0;
+    }
+    else if(id < UART_STOP)
+    {
+        uart->shift |= uart->level << (id - 1);
+    }
+    else
+    {
+        uart->busy = 0;
+        if(!uart->level)
+        {
+            uart->errors++;
+            if(traceIO)
+            {
+                printf("Cycle %llu: UART %04X framing error\n",cycle,device->base);
+            }
+            return;
+        }
+        if(uart->count >= uart->size)
+        {
+            uart->size = uart->size ? uart->size * 2 : 256;
+            text = (unsigned char*)realloc(uart->text,uart->size);
+            if(text == NULL)
+            {
+                printf("Error: out of memory\n");
+                exit(1);
+            }
+            uart->text = text;
+        }
+        uart->text[uart->count++] = (unsigned char)uart->shift;
+        if(traceIO)
+        {
+            printf("Cycle %llu: UART %04X received %02X\n",cycle,device->base,uart->shift);
+        }
+    }
+    if(uart->busy)
+    {
+        scheduleEvent(device,id + 1,cycle + uart->bitCycles);
+    }
+}
+
+void uartRxFinish(peripheral_t *device, cycle_t cycle)
+{
+    uart_rx_t *uart;
+    int i;
+    int ch;
+
+    (void)cycle;
+    uart = (uart_rx_t*)device->data;
+    printf("UART %04X     : %d bytes received, %d framing errors\n",device->base,uart->count,uart->errors);
+    if(uart->count == 0)
+    {
+        return;
+    }
+    printf("                \"");
+    for(i=0;i<uart->count;i++)
+    {
+        ch = uart->text[i];
+        if(ch == '\r')
+        {
+            printf("\\r");
+        }
+        else if(ch == '\n')
+        {
+            printf("\\n");
+        }
+        else if(ch == '"' || ch == '\\')
+        {
+            printf("\\%c",ch);
+        }
+        else if(isprint(ch))
+        {
+            printf("%c",ch);
+        }
+        else
+        {
+            printf("\\x%02X",ch);
+        }
+    }
+    printf("\"\n");
+}
+
+/*
+    Add a UART receiver on bit 0 of an IO address, returns 0 on failure
+*/
+
+int addUartRx(unsigned int address, cycle_t bitCycles)
+{
+    peripheral_t *device;
+    uart_rx_t *uart;
+
+    uart = (uart_rx_t*)calloc(1,sizeof(uart_rx_t));
+    if(uart == NULL)
+    {
+        printf("Error: out of memory\n");
+        return 0;
+    }
+    device = addPeripheral("uart-rx",address,1);
+    if(device == NULL)
+    {
+        printf("Error: IO address %04X is already in use or too many devices\n",address);
+        free(uart);
+        return 0;
+    }
+    uart->bitCycles = bitCycles;
+    device->write = uartRxWrite;
+    device->event = uartRxEvent;
+    device->start = uartRxStart;
+    device->finish = uartRxFinish;
+    device->data = uart;
+
+    return 1;
+}
+
+/*
+    Interrupt source
+
+    Drives irq as a peripheral whose interrupt is acknowledged by an OUT to its IO address. irq
+    goes high a fixed number of cycles after the start and after each acknowledge, the OUT drops
+    it. The core takes the interrupt in the first instruction to start with irq high and no
+    interrupt being handled, as pumpkin.vhd does in S1.
+*/
+
+typedef struct
+{
+    cycle_t gap; /* Cycles from the start or an acknowledge to irq going high */
+    cycle_t rise; /* Cycle of the pending rise, NO_EVENT if none */
+}irq_source_t;
+
+/*
+    Set the irq input, high from cycle or low when cycle is NO_EVENT
+*/
+
+void setIrq(cycle_t cycle)
+{
+    irqCycle = cycle;
+    irqTake = inIrq ? NO_EVENT : cycle;
+}
+
+void irqSourceStart(peripheral_t *device, cycle_t cycle)
+{
+    irq_source_t *source;
+
+    source = (irq_source_t*)device->data;
+    setIrq(NO_EVENT);
+    source->rise = cycle + source->gap;
+    scheduleEvent(device,0,source->rise);
+}
+
+void irqSourceWrite(peripheral_t *device, unsigned int address, unsigned int value, cycle_t cycle)
+{
+    irq_source_t *source;
+
+    (void)address;
+    (void)value;
+    source = (irq_source_t*)device->data;
+    setIrq(NO_EVENT);
+    source->rise = cycle + source->gap;
+    scheduleEvent(device,0,source->rise);
+}
+
+void irqSourceEvent(peripheral_t *device, int id, cycle_t cycle)
+{
+    irq_source_t *source;
+
+    (void)id;
+    source = (irq_source_t*)device->data;
+    /* Rises scheduled before the last acknowledge are stale */
+    if(cycle == source->rise && irqCycle == NO_EVENT)
+    {
+        setIrq(cycle);
+        if(traceIO)
+        {
+            printf("Cycle %llu: IRQ %04X raised\n",cycle,device->base);
+        }
+    }
+}
+
+void irqSourceFinish(peripheral_t *device, cycle_t cycle)
+{
+    (void)cycle;
+    printf("IRQ %04X      : %llu interrupts taken\n",device->base,interrupts);
+}
+
+/*
+    Add an interrupt source acknowledged at an IO address, irq rises gap cycles after the start
+    and after each acknowledge. Returns 0 on failure.
+*/
+
+int addIrqSource(unsigned int address, cycle_t gap)
+{
+    peripheral_t *device;
+    irq_source_t *source;
+
+    source = (irq_source_t*)calloc(1,sizeof(irq_source_t));
+    if(source == NULL)
+    {
+        printf("Error: out of memory\n");
+        return 0;
+    }
+    device = addPeripheral("irq",address,1);
+    if(device == NULL)
+    {
+        printf("Error: IO address %04X is already in use or too many devices\n",address);
+        free(source);
+        return 0;
+    }
+    source->gap = gap;
+    device->write = irqSourceWrite;
+    device->event = irqSourceEvent;
+    device->start = irqSourceStart;
+    device->finish = irqSourceFinish;
+    device->data = source;
+    irqSource = 1;
+
+    return 1;
+}
+
+/*
+    Performance counters
+
+    The counters of pumpkin.vhd built with the counters generic, five 32 bit counters read by IN
+    from 10 IO addresses, low half first, reading the low half holds the high half. An OUT to the
+    first address clears them. The counters are taken from the simulation, so a program reads the
+    same values as on the core, stalls are the wait states added by -M and -L. A snapshot does not
+    hold the counters, they start from zero again when it is restored.
+*/
+
+#define PERF_ADDRESSES  (10)
+
+typedef struct
+{
+    cycle_t cycles; /* Cycle the counters were last cleared in, plus one */
+    cycle_t instructions; /* Counts at the clear */
+    cycle_t branches;
+    cycle_t stalls;
+    unsigned int high; /* High half held by reading the low half */
+}perf_counters_t;
+
+/*
+    Wait state cycles up to cycle
+*/
+
+cycle_t stallsAt(cycle_t cycle)
+{
+    return ioStallCycles + (cycle - ioStallCycles) / stateCycles * (stateCycles - 1);
+}
+
+/*
+    Clear the counters in cycle, the call stack high water mark is set to the current depth
+*/
+
+void perfClear(perf_counters_t *perf, cycle_t cycle)
+{
+    perf->cycles = cycle + 1;
+    perf->instructions = instructions;
+    perf->branches = branchesTaken;
+    perf->stalls = stallsAt(cycle + 1);
+    callDepthMax = callDepth;
+}
+
+/*
+    The counters start from zero in the reset cycle, the one before the run starts
+*/
+
+void perfStart(peripheral_t *device, cycle_t cycle)
+{
+    perfClear((perf_counters_t*)device->data,cycle - stateCycles - 1);
+}
+
+unsigned int perfRead(peripheral_t *device, unsigned int address, cycle_t cycle)
+{
+    perf_counters_t *perf;
+    cycle_t value;
+
+    perf = (perf_counters_t*)device->data;
+    switch((address - device->base) >> 1)
+    {
+        case 0:
+            value = cycle - perf->cycles;
+            break;
+        case 1:
+            value = instructions - perf->instructions;
+            break;
+        case 2:
+            value = branchesTaken - perf->branches;
+            break;
+        case 3:
+            value = stallsAt(cycle) - perf->stalls;
+            break;
+        default:
+            value = callDepthMax & 0xFFFF;
+            break;
+    }
+    if((address - device->base) & 1)
+    {
+        return perf->high;
+    }
+    perf->high = (unsigned int)(value >> 16) & 0xFFFF;
+    return (unsigned int)value & 0xFFFF;
+}
+
+void perfWrite(peripheral_t *device, unsigned int address, unsigned int value, cycle_t cycle)
+{
+    (void)value;
+    if(address == device->base)
+    {
+        perfClear((perf_counters_t*)device->data,cycle);
+    }
+}
+
+/*
+    Add the performance counters at IO addresses address to address + 9. Returns 0 on failure.
+*/
+
+int addPerfCounters(unsigned int address)
+{
+    peripheral_t *device;
+    perf_counters_t *perf;
+
+    perf = (perf_counters_t*)calloc(1,sizeof(perf_counters_t));
+    if(perf == NULL)
+    {
+        printf("Error: out of memory\n");
+        return 0;
+    }
+    device = addPeripheral("counters",address,PERF_ADDRESSES);
+    if(device == NULL)
+    {
+        printf("Error: IO addresses %04X to %04X are already in use or too many devices\n",address,address + PERF_ADDRESSES - 1);
+        free(perf);
+        return 0;
+    }
+    device->read = perfRead;
+    device->write = perfWrite;
+    device->start = perfStart;
+    device->data = perf;
+    perfCounters = 1;
+
+    return 1;
+}
+
+/*
+    Return 1 if address is the start of a delay loop, SUB or ADD followed by BNZ back to it
+*/
+
+int isDelayLoop(unsigned int address)
+{
+    unsigned int mask;
+    unsigned int next;
+
+    mask = memorySize - 1;
+    next = memory[(address + 1) & mask];
+    if(memory[address] & immediateMask)
+    {
+        return 0;
+    }
+    return ((memory[address] >> 12) == I_SUB || (memory[address] >> 12) == I_ADD) && (next >> 12) == I_BNZ && (next & mask) == address;
+}
+
+/*
+    Run the passes of a delay loop, opcode is I_SUB or I_ADD with operand value m. The loop does
+    no IO and no stores so each pass adds d = M or -M to A, the number of passes to reach 0 is
+    the smallest n > 0 with A + n*d = 0 modulo 2^16. As many whole passes as fit before maxCycles
+    are run at once, a pass that would be cut short by the limit is left to the caller. Returns
+    the number of passes run, A and C are updated as if each pass had been run.
+*/
+
+cycle_t delayLoopPasses(unsigned int opcode, unsigned int m, unsigned int *regA, unsigned int *regC, cycle_t count, cycle_t maxCycles)
+{
+    unsigned int d;
+    unsigned int g;
+    unsigned int period;
+    unsigned int target;
+    unsigned int inverse;
+    unsigned int odd;
+    unsigned int value;
+    cycle_t passes;
+    cycle_t limit;
+    int i;
+
+    /* Each pass is SUB or ADD (2 states) then BNZ (1 state), BNZ runs if count < maxCycles */
+    if(maxCycles - count <= 2 * stateCycles)
+    {
+        return 0;
+    }
+    limit = (maxCycles - count - 2 * stateCycles - 1) / (3 * stateCycles) + 1;
+
+    d = (opcode == I_SUB) ? (0x10000 - m) & 0xFFFF : m;
+
+    /* Solve n*d = -A modulo 2^16, d = g * odd where g is a power of 2 */
+    g = d ? (d & (0 - d)) : 0x10000;
+    period = 0x10000 / g;
+    target = (0x10000 - *regA) & 0xFFFF;
+    if(target % g == 0)
+    {
+        /* Inverse of odd modulo 2^32 by Newton's method, each step doubles the correct bits */
+        odd = d / g;
+        inverse = odd;
+        for(i=0;i<4;i++)
+        {
+            inverse *= 2 - odd * inverse;
+        }
+        passes = ((target / g) * inverse) & (period - 1);
+        if(passes == 0)
+        {
+            passes = period;
+        }
+        if(passes > limit)
+        {
+            passes = limit;
+        }
+    }
+    else
+    {
+        /* A never reaches 0, the loop runs until the cycle limit */
+        passes = limit;
+    }
+
+    /* A before the last pass, then the last pass as run() would */
+    value = (*regA + (unsigned int)((passes - 1) & 0xFFFF) * d) & 0xFFFF;
+    if(opcode == I_SUB)
+    {
+        value += (m ^ 0xFFFF) + 1;
+    }
+    else
+    {
+        value += m;
+    }
+    *regC = value >> 16;
+    *regA = value & 0xFFFF;
+
+    return passes;
+}
+
+/*
+    Fast-forward a delay loop at pc, SUB M or ADD M followed by BNZ back to it. Returns the
+    number of passes run, A C and pc are updated as if each pass had been run.
+*/
+
+cycle_t skipDelayLoop(unsigned int *regPC, unsigned int *regA, unsigned int *regC, cycle_t count, cycle_t maxCycles)
+{
+    unsigned int mask;
+    unsigned int ir;
+    cycle_t passes;
+
+    if(!isDelayLoop(*regPC))
+    {
+        return 0;
+    }
+
+    mask = memorySize - 1;
+    ir = memory[*regPC];
+    passes = delayLoopPasses(ir >> 12,memory[ir & mask],regA,regC,count,maxCycles);
+    if(passes != 0)
+    {
+        *regPC = *regA ? *regPC : (*regPC + 2) & mask;
+    }
+
+    return passes;
+}
+
+/*
+    Trace recorder
+
+    The simulation stores each instruction it runs as a fixed size record, the instruction, the
+    state after it and its IO address, in a block of a ring of TRACE_RING_SIZE blocks. A writer
+    thread takes the filled blocks, encodes the records as events, see ptrace.h for the format,
+    and compresses and writes a file block each time TRACE_BLOCK_SIZE bytes of events have built
+    up. The ring has a single producer and a single consumer that each only write their own
+    index so no lock is needed, when the ring is full the simulation waits for the writer. Apart
+    from the record the simulation does no work for the trace.
+*/
+
+typedef struct
+{
+    unsigned int records[2 * TRACE_RING_RECORDS]; /* Instruction and A, pc C and IO address */
+    int count;
+}trace_ring_t;
+
+typedef struct
+{
+    cycle_t startCycle;
+    cycle_t offset;
+}trace_index_t;
+
+int tracing; /* Set when instructions are recorded */
+trace_ring_t *traceRing;
+unsigned int traceHead; /* Blocks filled by the simulation */
+unsigned int traceTail; /* Blocks taken by the writer */
+int traceDone; /* Set when the last block has been filled */
+int traceThreaded; /* Set if the writer thread is running */
+pthread_t traceThread;
+unsigned int *traceRecord; /* Next record of the block being filled */
+unsigned int *traceLimit; /* End of the block being filled */
+
+/* Writer state */
+FILE *traceFp;
+unsigned char traceEvents[TRACE_BLOCK_SIZE]; /* Encoded events of the file block being built */
+unsigned char *traceEnd; /* End of the events */
+unsigned int traceCount; /* Events in the file block */
+unsigned int traceA; /* State after the last event */
+unsigned int traceC;
+unsigned int tracePC;
+unsigned int traceMask; /* Program memory size - 1 */
+cycle_t traceCycle;
+cycle_t traceInstruction;
+unsigned int traceStartA; /* State at the start of the file block */
+unsigned int traceStartC;
+unsigned int traceStartPC;
+cycle_t traceStartCycle;
+cycle_t traceStartInstruction;
+trace_index_t *traceIndex;
+int traceBlocks;
+int traceIndexSize;
+cycle_t traceOffset; /* Bytes written to the file */
+unsigned char *traceCompressed;
+int *traceHash;
+
+/*
+    Write a number to a buffer in little endian order
+*/
+
+void putLittleEndian(unsigned char *p, cycle_t value, int bytes)
+{
+    int i;
+
+    for(i=0;i<bytes;i++)
+    {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+/*
+    Write a varint, 7 bits per byte low bits first, returns the byte after it
+*/
+
+unsigned char *putVarint(unsigned char *p, unsigned int value)
+{
+    while(value >= 0x80)
+    {
+        *p++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (unsigned char)value;
+    return p;
+}
+
+/*
+    Write a literal or match length that did not fit in its nibble
+*/
+
+unsigned char *putLength(unsigned char *p, int length)
+{
+    while(length >= 255)
+    {
+        *p++ = 255;
+        length -= 255;
+    }
+    *p++ = (unsigned char)length;
+    return p;
+}
+
+/*
+    Compress length bytes of src to dst, which has room for TRACE_COMPRESSED_SIZE(length) bytes.
+    Four byte sequences are found through a hash table of their last position. Returns the
+    compressed size.
+*/
+
+int traceCompress(const unsigned char *src, int length, unsigned char *dst)
+{
+    unsigned char *p;
+    unsigned int sequence;
+    unsigned int h;
+    int anchor;
+    int ref;
+    int i;
+    int match;
+    int literals;
+
+    memset(traceHash,-1,(1 << TRACE_HASH_BITS) * sizeof(int));
+    p = dst;
+    anchor = 0;
+    i = 0;
+    /* The last bytes are always literals */
+    while(i + TRACE_MIN_MATCH + 4 <= length)
+    {
+        sequence = src[i] | (src[i+1] << 8) | (src[i+2] << 16) | ((unsigned int)src[i+3] << 24);
+        h = (sequence * 2654435761u) >> (32 - TRACE_HASH_BITS);
+        ref = traceHash[h];
+        traceHash[h] = i;
+        if(ref < 0 || i - ref > TRACE_MAX_OFFSET || memcmp(src + ref,src + i,TRACE_MIN_MATCH) != 0)
+        {
+            i++;
+            continue;
+        }
+        /* Extend the match four bytes at a time then byte by byte */
+        match = TRACE_MIN_MATCH;
+        while(i + match + 4 <= length - 4)
+        {
+            memcpy(&sequence,src + ref + match,4);
+            memcpy(&h,src + i + match,4);
+            if(sequence != h)
+            {
+                break;
+            }
+            match += 4;
+        }
+        while(i + match < length - 4 && src[ref + match] == src[i + match])
+        {
+            match++;
+        }
+
+        literals = i - anchor;
+        *p++ = (unsigned char)(((literals < 15 ? literals : 15) << 4) | (match - TRACE_MIN_MATCH < 15 ? match - TRACE_MIN_MATCH : 15));
+        if(literals >= 15)
+        {
+            p = putLength(p,literals - 15);
+        }
+        memcpy(p,src + anchor,literals);
+        p += literals;
+        putLittleEndian(p,i - ref,2);
+        p += 2;
+        if(match - TRACE_MIN_MATCH >= 15)
+        {
+            p = putLength(p,match - TRACE_MIN_MATCH - 15);
+        }
+        i += match;
+        anchor = i;
+    }
+
+    literals = length - anchor;
+    *p++ = (unsigned char)((literals < 15 ? literals : 15) << 4);
+    if(literals >= 15)
+    {
+        p = putLength(p,literals - 15);
+    }
+    memcpy(p,src + anchor,literals);
+    p += literals;
+
+    return (int)(p - dst);
+}
+
+/*
+    Start a file block with the state after the last event
+*/
+
+void traceStartBlock(void)
+{
+    traceEnd = traceEvents;
+    traceCount = 0;
+    traceStartA = traceA;
+    traceStartC = traceC;
+    traceStartPC = tracePC;
+    traceStartCycle = traceCycle;
+    traceStartInstruction = traceInstruction;
+}
+
+/*
+    Compress the events of the file block and write it to the trace file, adding it to the index
+*/
+
+void traceWriteBlock(void)
+{
+    unsigned char header[TRACE_BLOCK_HEADER];
+    trace_index_t *newIndex;
+    int rawSize;
+    int size;
+
+    rawSize = (int)(traceEnd - traceEvents);
+    size = traceCompress(traceEvents,rawSize,traceCompressed);
+    memset(header,0,sizeof(header));
+    memcpy(header,TRACE_BLOCK_MAGIC,4);
+    putLittleEndian(header + 4,size,4);
+    putLittleEndian(header + 8,rawSize,4);
+    putLittleEndian(header + 12,traceCount,4);
+    putLittleEndian(header + 16,traceStartCycle,8);
+    putLittleEndian(header + 24,traceStartInstruction,8);
+    putLittleEndian(header + 32,traceStartPC,2);
+    putLittleEndian(header + 34,traceStartA,2);
+    header[36] = (unsigned char)traceStartC;
+
+    if(traceBlocks >= traceIndexSize)
+    {
+        traceIndexSize = traceIndexSize ? traceIndexSize * 2 : 1024;
+        newIndex = (trace_index_t*)realloc(traceIndex,traceIndexSize * sizeof(trace_index_t));
+        if(newIndex == NULL)
+        {
+            printf("Error: out of memory\n");
+            exit(1);
+        }
+        traceIndex = newIndex;
+    }
+    traceIndex[traceBlocks].startCycle = traceStartCycle;
+    traceIndex[traceBlocks].offset = traceOffset;
+    traceBlocks++;
+
+    fwrite(header,1,sizeof(header),traceFp);
+    fwrite(traceCompressed,1,size,traceFp);
+    traceOffset += sizeof(header) + size;
+    traceStartBlock();
+}
+
+/*
+    Encode the records of a ring block as events, writing file blocks as they fill. State is held
+    in locals as the events are written through a char pointer.
+*/
+
+void traceEncode(trace_ring_t *block)
+{
+    unsigned int *record;
+    unsigned int *end;
+    unsigned char *p;
+    unsigned char *out;
+    unsigned char *limit;
+    unsigned int opcode;
+    unsigned int tag;
+    unsigned int delta;
+    unsigned int regA;
+    unsigned int regC;
+    unsigned int regPC;
+    unsigned int lastA;
+    unsigned int lastC;
+    unsigned int lastPC;
+    unsigned int mask;
+    cycle_t count;
+    unsigned int events;
+
+    record = block->records;
+    end = block->records + 2 * block->count;
+    while(record < end)
+    {
+        if(traceEnd > traceEvents + TRACE_BLOCK_SIZE - TRACE_MAX_EVENT)
+        {
+            traceWriteBlock();
+        }
+        out = traceEnd;
+        limit = traceEvents + TRACE_BLOCK_SIZE - TRACE_MAX_EVENT;
+        lastA = traceA;
+        lastC = traceC;
+        lastPC = tracePC;
+        mask = traceMask;
+        count = 0;
+        events = 0;
+        for(;record<end && out<=limit;record+=2)
+        {
+            opcode = (record[0] >> 12) & 0xF;
+            regA = record[0] >> 16;
+            regPC = record[1] & 0x7FFF;
+            regC = (record[1] >> 15) & 1;
+            tag = opcode << 4;
+            p = out + 1;
+            if(regPC != ((lastPC + 1) & mask))
+            {
+                tag |= TRACE_PC;
+                p = putVarint(p,regPC);
+            }
+            if(regA != lastA)
+            {
+                /* Zigzag encoded difference */
+                tag |= TRACE_A;
+                delta = (regA - lastA) & 0xFFFF;
+                p = putVarint(p,(delta & 0x8000) ? ((0x10000 - delta) << 1) - 1 : delta << 1);
+            }
+            tag |= (regC ^ lastC) ? TRACE_C : 0;
+            if(opcode == I_IN || opcode == I_OUT)
+            {
+                p = putVarint(p,record[1] >> 16);
+            }
+            *out = (unsigned char)tag;
+            out = p;
+            lastA = regA;
+            lastC = regC;
+            lastPC = regPC;
+            count += (opcode < I_BR) ? 2 : 1;
+            events++;
+        }
+        traceEnd = out;
+        traceA = lastA;
+        traceC = lastC;
+        tracePC = lastPC;
+        traceCycle += count;
+        traceInstruction += events;
+        traceCount += events;
+    }
+}
+
+/*
+    Give up the processor for a short time
+*/
+
+void traceSleep(void)
+{
+#ifdef _WIN32
+    Sleep(1);
+#else
+    struct timespec ts;
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = 200000;
+    nanosleep(&ts,NULL);
+#endif
+}
+
+/*
+    Writer thread, encodes blocks as the simulation fills them until the last one is done
+*/
+
+void *traceWriter(void *arg)
+{
+    unsigned int head;
+
+    (void)arg;
+    while(1)
+    {
+        head = __atomic_load_n(&traceHead,__ATOMIC_ACQUIRE);
+        if(head == traceTail)
+        {
+            /* The last block is filled before traceDone is set */
+            if(__atomic_load_n(&traceDone,__ATOMIC_ACQUIRE) && __atomic_load_n(&traceHead,__ATOMIC_ACQUIRE) == traceTail)
+            {
+                break;
+            }
+            traceSleep();
+            continue;
+        }
+        traceEncode(&traceRing[traceTail % TRACE_RING_SIZE]);
+        __atomic_store_n(&traceTail,traceTail + 1,__ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/*
+    Pass the block being filled to the writer and start the next, waiting if the ring is full
+*/
+
+void traceFlush(void)
+{
+    trace_ring_t *block;
+
+    block = &traceRing[traceHead % TRACE_RING_SIZE];
+    block->count = (int)(traceRecord - block->records) / 2;
+    if(traceThreaded)
+    {
+        __atomic_store_n(&traceHead,traceHead + 1,__ATOMIC_RELEASE);
+        while(traceHead - __atomic_load_n(&traceTail,__ATOMIC_ACQUIRE) >= TRACE_RING_SIZE)
+        {
+            traceSleep();
+        }
+    }
+    else
+    {
+        traceEncode(block);
+    }
+    block = &traceRing[traceHead % TRACE_RING_SIZE];
+    traceRecord = block->records;
+    traceLimit = block->records + 2 * TRACE_RING_RECORDS;
+}
+
+/*
+    Record an instruction, ir is the instruction run and regA regC and regPC the state after it
+*/
+
+void traceStep(unsigned int ir, unsigned int regA, unsigned int regC, unsigned int regPC)
+{
+    traceRecord[0] = ir | (regA << 16);
+    traceRecord[1] = regPC | (regC << 15) | (memory[ir & (memorySize - 1)] << 16);
+    traceRecord += 2;
+    if(traceRecord == traceLimit)
+    {
+        traceFlush();
+    }
+}
+
+/*
+    Open a trace file and start the writer, the trace starts from the current CPU state.
+    Returns 0 on failure.
+*/
+
+int traceOpen(char *fileName)
+{
+    unsigned char header[TRACE_FILE_HEADER];
+
+    traceFp = fopen(fileName,"wb");
+    if(traceFp == NULL)
+    {
+        printf("Could not open trace file %s\n",fileName);
+        return 0;
+    }
+    traceRing = (trace_ring_t*)malloc(TRACE_RING_SIZE * sizeof(trace_ring_t));
+    traceCompressed = (unsigned char*)malloc(TRACE_COMPRESSED_SIZE(TRACE_BLOCK_SIZE));
+    traceHash = (int*)malloc((1 << TRACE_HASH_BITS) * sizeof(int));
+    if(traceRing == NULL || traceCompressed == NULL || traceHash == NULL)
+    {
+        printf("Error: out of memory\n");
+        fclose(traceFp);
+        return 0;
+    }
+
+    memcpy(header,TRACE_FILE_MAGIC,4);
+    putLittleEndian(header + 4,TRACE_VERSION,4);
+    putLittleEndian(header + 8,memorySize,4);
+    fwrite(header,1,sizeof(header),traceFp);
+    traceOffset = sizeof(header);
+    traceBlocks = 0;
+
+    traceA = a;
+    traceC = c;
+    tracePC = pc;
+    traceMask = memorySize - 1;
+    traceCycle = cycles;
+    traceInstruction = instructions;
+    traceStartBlock();
+
+    traceHead = 0;
+    traceTail = 0;
+    traceDone = 0;
+    traceRecord = traceRing[0].records;
+    traceLimit = traceRing[0].records + 2 * TRACE_RING_RECORDS;
+
+    /* Without a thread the blocks are encoded as they fill */
+    traceThreaded = (pthread_create(&traceThread,NULL,traceWriter,NULL) == 0);
+    tracing = 1;
+
+    return 1;
+}
+
+/*
+    Write the last blocks and the index and close the trace file
+*/
+
+void traceClose(char *fileName)
+{
+    unsigned char entry[TRACE_INDEX_ENTRY];
+    int i;
+
+    tracing = 0;
+    traceFlush();
+    if(traceThreaded)
+    {
+        __atomic_store_n(&traceDone,1,__ATOMIC_RELEASE);
+        pthread_join(traceThread,NULL);
+    }
+    if(traceCount != 0)
+    {
+        traceWriteBlock();
+    }
+
+    for(i=0;i<traceBlocks;i++)
+    {
+        putLittleEndian(entry,traceIndex[i].startCycle,8);
+        putLittleEndian(entry + 8,traceIndex[i].offset,8);
+        fwrite(entry,1,sizeof(entry),traceFp);
+    }
+    putLittleEndian(entry,traceBlocks,4);
+    memcpy(entry + 4,TRACE_INDEX_MAGIC,4);
+    fwrite(entry,1,8,traceFp);
+    fclose(traceFp);
+
+    printf("Trace         : %llu instructions in %d blocks, %llu bytes written to %s\n",traceInstruction,traceBlocks,
+           traceOffset + (cycle_t)traceBlocks * TRACE_INDEX_ENTRY + 8,fileName);
+    free(traceRing);
+    free(traceCompressed);
+    free(traceHash);
+    free(traceIndex);
+    traceIndex = NULL;
+}
+
+/*
+    Run an instruction with a short immediate operand, returns 0 if the opcode does not take one
+*/
+
+int runImmediate(unsigned int ir, unsigned int *regA, unsigned int *regC)
+{
+    unsigned int m;
+
+    m = ir & SHORT_IMMEDIATE_MAX;
+    switch(ir >> 12)
+    {
+        case I_LOAD:
+            *regA = m;
+            break;
+        case I_ADD:
+            *regA += m;
+            *regC = *regA >> 16;
+            *regA &= 0xFFFF;
+            break;
+        case I_SUB:
+            *regA += (m ^ 0xFFFF) + 1;
+            *regC = *regA >> 16;
+            *regA &= 0xFFFF;
+            break;
+        case I_OR:
+            *regA |= m;
+            break;
+        case I_AND:
+            *regA &= m;
+            break;
+        case I_XOR:
+            *regA ^= m;
+            break;
+        case I_ROR:
+            *regA = (*regC << 15) | (m >> 1);
+            *regC = m & 1;
+            break;
+        case I_SWAP:
+            *regA = ((m << 8) | (m >> 8)) & 0xFFFF;
+            break;
+        default:
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+    Run until maxCycles is reached or the program halts with a branch to itself.
+    State is held in locals for speed and written back on exit.
+*/
+
+int run(cycle_t maxCycles)
+{
+    unsigned int mask;
+    unsigned int ir;
+    unsigned int x;
+    unsigned int m;
+    unsigned int regA;
+    unsigned int regC;
+    unsigned int regPC;
+    int top;
+    cycle_t count;
+    cycle_t executed;
+    cycle_t taken;
+    cycle_t passes;
+    cycle_t oneState;
+    cycle_t twoStates;
+    int stop;
+
+    mask = memorySize - 1;
+    regA = a;
+    regC = c;
+    regPC = pc;
+    top = stackTop;
+    count = cycles;
+    executed = 0;
+    taken = 0;
+    stop = STOP_CYCLES;
+    /* Cycles taken by instructions of one state and of two, S1 then S2, with wait states */
+    oneState = stateCycles;
+    twoStates = 2 * stateCycles;
+
+    while(count < maxCycles)
+    {
+        if(count >= irqTake)
+        {
+            /* The instruction at pc is replaced by a CALL to the vector, it is run after RETI */
+            top = (top == 0) ? stackDepth - 1 : top - 1;
+            callstack[top] = regPC;
+            savedC = regC;
+            inIrq = 1;
+            irqTake = NO_EVENT;
+            interrupts++;
+            if(++callDepth > callDepthMax)
+            {
+                callDepthMax = callDepth;
+            }
+            regPC = IRQ_VECTOR & mask;
+            count += oneState;
+            continue;
+        }
+        ir = memory[regPC];
+        x = ir & mask;
+        executed++;
+        /* A short immediate is completed in S1, the operand is not read */
+        if((ir & immediateMask) && runImmediate(ir,&regA,&regC))
+        {
+            regPC = (regPC + 1) & mask;
+            count += oneState;
+            continue;
+        }
+        switch(ir >> 12)
+        {
+            case I_LOAD:
+                regA = memory[x];
+                regPC = (regPC + 1) & mask;
+                count += twoStates;
+                break;
+            case I_STORE:
+                memory[x] = regA;
+                regPC = (regPC + 1) & mask;
+                count += twoStates;
+                break;
+            case I_ADD:
+                if(skipLoops && (passes = skipDelayLoop(&regPC,&regA,&regC,count,maxCycles)) != 0)
+                {
+                    /* This instruction has already been counted */
+                    executed += 2 * passes - 1;
+                    count += 3 * oneState * passes;
+                    break;
+                }
+                regA += memory[x];
+                regC = regA >> 16;
+                regA &= 0xFFFF;
+                regPC = (regPC + 1) & mask;
+                count += twoStates;
+                break;
+            case I_SUB:
+                if(skipLoops && (passes = skipDelayLoop(&regPC,&regA,&regC,count,maxCycles)) != 0)
+                {
+                    executed += 2 * passes - 1;
+                    count += 3 * oneState * passes;
+                    break;
+                }
+                /* As pumpkin.vhd, A + not M + 1, carry is set when there is no borrow */
+                regA += (memory[x] ^ 0xFFFF) + 1;
+                regC = regA >> 16;
+                regA &= 0xFFFF;
+                regPC = (regPC + 1) & mask;
+                count += twoStates;
+                break;
+            case I_OR:
+                regA |= memory[x];
+                regPC = (regPC + 1) & mask;
+                count += twoStates;
+                break;
+            case I_AND:
+                regA &= memory[x];
+                regPC = (regPC + 1) & mask;
+                count += twoStates;
+                break;
+            case I_XOR:
+                regA ^= memory[x];
+                regPC = (regPC + 1) & mask;
+                count += twoStates;
+                break;
+            case I_ROR:
+                m = memory[x];
+                regA = (regC << 15) | (m >> 1);
+                regC = m & 1;
+                regPC = (regPC + 1) & mask;
+                count += twoStates;
+                break;
+            case I_SWAP:
+                m = memory[x];
+                regA = ((m << 8) | (m >> 8)) & 0xFFFF;
+                regPC = (regPC + 1) & mask;
+                count += twoStates;
+                break;
+            case I_IN:
+                m = memory[x];
+                if(ioDevice[m])
+                {
+                    /* The device sees the counts up to and including this instruction */
+                    instructions += executed;
+                    branchesTaken += taken;
+                    executed = 0;
+                    taken = 0;
+                    regA = deviceRead(m,count+oneState);
+                }
+                else
+                {
+                    regA = ioMemory[m];
+                }
+                regPC = (regPC + 1) & mask;
+                count += twoStates + ioStall[m];
+                ioStallCycles += ioStall[m];
+                break;
+            case I_OUT:
+                m = memory[x];
+                ioMemory[m] = regA;
+                if(traceIO)
+                {
+                    if(traceLane >= 0)
+                    {
+                        printf("Lane %d: ",traceLane);
+                    }
+                    printf("Cycle %llu: OUT %04X = %04X\n",count+oneState,m,regA);
+                }
+                if(ioDevice[m])
+                {
+                    instructions += executed;
+                    branchesTaken += taken;
+                    executed = 0;
+                    taken = 0;
+                    deviceWrite(m,regA,count+oneState);
+                    /* Stop for an event the device has scheduled */
+                    if(nextEvent < maxCycles)
+                    {
+                        maxCycles = nextEvent;
+                    }
+                }
+                regPC = (regPC + 1) & mask;
+                count += twoStates + ioStall[m];
+                ioStallCycles += ioStall[m];
+                break;
+            case I_BR:
+                count += oneState;
+                if(x == regPC && irqSource && !inIrq)
+                {
+                    /* Waiting for an interrupt, the branch runs once a cycle up to the limit */
+                    passes = (maxCycles > count) ? (maxCycles - count + oneState - 1) / oneState : 0;
+                    executed += passes;
+                    taken += passes;
+                    count += passes * oneState;
+                    break;
+                }
+                if(x == regPC)
+                {
+                    /* Branch to self, nothing more can happen */
+                    if(tracing)
+                    {
+                        traceStep(ir,regA,regC,regPC);
+                    }
+                    stop = STOP_HALT;
+                    goto done;
+                }
+                regPC = x;
+                taken++;
+                break;
+            case I_BNC:
+                regPC = regC ? (regPC + 1) & mask : x;
+                taken += !regC;
+                count += oneState;
+                break;
+            case I_BNZ:
+                regPC = regA ? x : (regPC + 1) & mask;
+                taken += (regA != 0);
+                count += oneState;
+                break;
+            case I_CALL:
+                top = (top == 0) ? stackDepth - 1 : top - 1;
+                callstack[top] = (regPC + 1) & mask;
+                regPC = x;
+                count += oneState;
+                taken++;
+                if(++callDepth > callDepthMax)
+                {
+                    callDepthMax = callDepth;
+                }
+                break;
+            case I_RETURN:
+                regPC = callstack[top];
+                /* Deepest entry is left unchanged by the shift, it becomes callstack(stack_depth-1) again */
+                callstack[top] = callstack[(top + stackDepth - 1) % stackDepth];
+                top = (top + 1 == stackDepth) ? 0 : top + 1;
+                count += oneState;
+                taken++;
+                if(callDepth > 0)
+                {
+                    callDepth--;
+                }
+                if(ir & 1)
+                {
+                    /* RETI restores C and lets irq in again */
+                    regC = savedC;
+                    inIrq = 0;
+                    irqTake = irqCycle;
+                }
+                break;
+        }
+        if(tracing)
+        {
+            traceStep(ir,regA,regC,regPC);
+        }
+    }
+
+done:
+    a = regA;
+    c = regC;
+    pc = regPC;
+    stackTop = top;
+    cycles = count;
+    instructions += executed;
+    branchesTaken += taken;
+
+    return stop;
+}
+
+#ifdef JIT_SUPPORTED
+
+/*
+    x86-64 JIT
+
+    Basic blocks are translated to native code the first time they are run. A block runs from its
+    start address to the first branch, BR BNC and BNZ end a block and are translated, CALL, RETURN
+    and any instruction that can not be translated end a block before them and are run by the
+    interpreter. A block that branches back to its own start loops without leaving native code.
+
+    Register use in translated code:
+        rbx  jit_state_t pointer
+        r12d A
+        r13d C
+        r14  cycles at the start of the block
+        r15  program memory
+        rbp  instructions executed
+
+    Every STORE checks jitCodeMap, a count of the blocks covering each address. A store into a
+    translated block leaves native code, the blocks covering the address are invalidated and the
+    address is marked as written so it is run by the interpreter from then on.
+*/
+
+typedef struct
+{
+    cycle_t cycles;         /* 0  */
+    cycle_t limit;          /* 8  */
+    cycle_t instructions;   /* 16 */
+    unsigned int a;         /* 24 */
+    unsigned int c;         /* 28 */
+    unsigned int pc;        /* 32 */
+    unsigned int store;     /* 36 Address of STORE that hit a translated block */
+    unsigned int *memory;   /* 40 */
+    unsigned int *io;       /* 48 */
+    unsigned short *codeMap;/* 56 */
+}jit_state_t;
+
+typedef int (*jit_block_t)(jit_state_t *state);
+
+void jitFlush(void);
+
+typedef struct
+{
+    int start;
+    int end; /* Last address in the block */
+    unsigned char *code; /* NULL if the block has been invalidated */
+}jit_entry_t;
+
+unsigned char *jitCode; /* Code cache */
+int jitUsed; /* Bytes of code cache used */
+int jitBlock[MAX_MEMORY_SIZE]; /* Index+1 of the block starting at each address, 0 if none, -1 if not translatable */
+jit_entry_t jitEntries[MAX_MEMORY_SIZE]; /* Translated blocks */
+int jitNumEntries;
+unsigned short jitCodeMap[MAX_MEMORY_SIZE]; /* Number of blocks covering each address */
+unsigned char jitWritten[MAX_MEMORY_SIZE]; /* Set for addresses written while translated */
+unsigned char *jitPtr; /* Code being emitted */
+unsigned long long jitTranslated;
+unsigned long long jitInvalidated;
+
+/*
+    Emit code bytes
+*/
+
+void emit(const char *bytes, int count)
+{
+    memcpy(jitPtr,bytes,count);
+    jitPtr += count;
+}
+
+void emit32(unsigned int value)
+{
+    memcpy(jitPtr,&value,4);
+    jitPtr += 4;
+}
+
+/*
+    Emit an instruction with a [r15 + address*4] memory operand
+*/
+
+void emitMemory(const char *bytes, int count, unsigned int address)
+{
+    emit(bytes,count);
+    emit32(address * 4);
+}
+
+/*
+    Patch a rel32 jump to the current position
+*/
+
+void patchJump(unsigned char *rel32)
+{
+    int offset;
+
+    offset = (int)(jitPtr - (rel32 + 4));
+    memcpy(rel32,&offset,4);
+}
+
+/*
+    Emit a block exit, cycles and instructions are added, pc and the exit reason are set
+*/
+
+void emitExit(unsigned char *epilogue, cycle_t blockCycles, int blockInstructions, unsigned int nextPC, int reason)
+{
+    emit("\x49\x81\xC6",3);     /* add r14,imm32 */
+    emit32((unsigned int)blockCycles);
+    emit("\x48\x81\xC5",3);     /* add rbp,imm32 */
+    emit32(blockInstructions);
+    emit("\xC7\x43\x20",3);     /* mov dword [rbx+32],imm32 */
+    emit32(nextPC);
+    emit("\xB8",1);             /* mov eax,imm32 */
+    emit32(reason);
+    emit("\xE9",1);             /* jmp epilogue */
+    emit32((unsigned int)(epilogue - (jitPtr + 4)));
+}
+
+/*
+    Check if an instruction can be part of a block
+*/
+
+int jitCanTranslate(int address)
+{
+    int opcode;
+
+    opcode = memory[address] >> 12;
+    if(jitWritten[address] || opcode == I_CALL || opcode == I_RETURN)
+    {
+        return 0;
+    }
+    /* Short immediates are left to the interpreter */
+    if(memory[address] & immediateMask)
+    {
+        return 0;
+    }
+    if((opcode == I_IN || opcode == I_OUT) && (traceIO || numDevices > 0 || ioWaits))
+    {
+        return 0;
+    }
+    /* Branch to self halts, left to the interpreter */
+    if(opcode == I_BR && (memory[address] & (memorySize - 1)) == (unsigned int)address)
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+    Translate the block starting at start, returns the block index or -1 if the first
+    instruction can not be translated
+*/
+
+int translate(int start)
+{
+    unsigned int mask;
+    unsigned int x;
+    int address;
+    int opcode;
+    int count;
+    int terminal;
+    int i;
+    cycle_t blockCycles;
+    cycle_t cyclesSoFar;
+    unsigned char *code;
+    unsigned char *entry;
+    unsigned char *epilogue;
+    unsigned char *taken;
+    unsigned char *exits[JIT_MAX_BLOCK+1]; /* rel32 jumps to exit stubs */
+    unsigned int exitPC[JIT_MAX_BLOCK+1];
+    cycle_t exitCycles[JIT_MAX_BLOCK+1];
+    int exitInstructions[JIT_MAX_BLOCK+1];
+    int exitReason[JIT_MAX_BLOCK+1];
+    int numExits;
+
+    mask = memorySize - 1;
+
+    /* Delay loops are fast-forwarded by runJit() rather than translated */
+    if(skipLoops && isDelayLoop(start))
+    {
+        return -1;
+    }
+
+    /* Find the extent of the block */
+    count = 0;
+    terminal = -1;
+    blockCycles = 0;
+    address = start;
+    while(count < JIT_MAX_BLOCK && jitCanTranslate(address))
+    {
+        opcode = memory[address] >> 12;
+        count++;
+        blockCycles += (opcode >= I_BR) ? stateCycles : 2 * stateCycles;
+        if(opcode >= I_BR)
+        {
+            terminal = address;
+            break;
+        }
+        /* Stop at the end of memory, the next instruction wraps to address 0 */
+        if(address == (int)mask)
+        {
+            break;
+        }
+        address++;
+    }
+    if(count == 0)
+    {
+        return -1;
+    }
+    if(terminal < 0)
+    {
+        address = start + count - 1;
+    }
+
+    /* Make room, the whole cache is flushed when full */
+    if(jitUsed + JIT_MAX_BLOCK_CODE > JIT_CODE_SIZE || jitNumEntries >= MAX_MEMORY_SIZE)
+    {
+        jitFlush();
+    }
+
+    code = jitCode + jitUsed;
+    jitPtr = code;
+    numExits = 0;
+
+    /* Prologue */
+    emit("\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57",10); /* push rbx rbp r12 r13 r14 r15 */
+    emit("\x48\x89\xFB",3);             /* mov rbx,rdi */
+    emit("\x44\x8B\x63\x18",4);         /* mov r12d,[rbx+24] */
+    emit("\x44\x8B\x6B\x1C",4);         /* mov r13d,[rbx+28] */
+    emit("\x4C\x8B\x33",3);             /* mov r14,[rbx] */
+    emit("\x4C\x8B\x7B\x28",4);         /* mov r15,[rbx+40] */
+    emit("\x48\x8B\x6B\x10",4);         /* mov rbp,[rbx+16] */
+    emit("\xE9\x00\x00\x00\x00",5);     /* jmp entry */
+    taken = jitPtr - 4;
+
+    /* Epilogue, pc and the exit reason have been set */
+    epilogue = jitPtr;
+    emit("\x44\x89\x63\x18",4);         /* mov [rbx+24],r12d */
+    emit("\x44\x89\x6B\x1C",4);         /* mov [rbx+28],r13d */
+    emit("\x4C\x89\x33",3);             /* mov [rbx],r14 */
+    emit("\x48\x89\x6B\x10",4);         /* mov [rbx+16],rbp */
+    emit("\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5D\x5B\xC3",11); /* pop r15 r14 r13 r12 rbp rbx, ret */
+
+    /* Not enough cycles left to run the whole block, the interpreter finishes off */
+    patchJump(taken);
+    entry = jitPtr;
+    emit("\x49\x8D\x86",3);             /* lea rax,[r14+blockCycles] */
+    emit32((unsigned int)blockCycles);
+    emit("\x48\x3B\x43\x08",4);         /* cmp rax,[rbx+8] */
+    emit("\x0F\x87",2);                 /* ja limit */
+    emit32(0);
+    exits[numExits] = jitPtr - 4;
+    exitPC[numExits] = start;
+    exitCycles[numExits] = 0;
+    exitInstructions[numExits] = 0;
+    exitReason[numExits] = JIT_EXIT_LIMIT;
+    numExits++;
+
+    cyclesSoFar = 0;
+    for(i=0;i<count;i++)
+    {
+        address = start + i;
+        opcode = memory[address] >> 12;
+        x = memory[address] & mask;
+        cyclesSoFar += (opcode >= I_BR) ? stateCycles : 2 * stateCycles;
+        switch(opcode)
+        {
+            case I_LOAD:
+                emitMemory("\x45\x8B\xA7",3,x);         /* mov r12d,[r15+x*4] */
+                break;
+            case I_STORE:
+                emitMemory("\x45\x89\xA7",3,x);         /* mov [r15+x*4],r12d */
+                emit("\x48\x8B\x43\x38",4);             /* mov rax,[rbx+56] */
+                emit("\x66\x83\xB8",3);                 /* cmp word [rax+x*2],0 */
+                emit32(x * 2);
+                emit("\x00",1);
+                emit("\x0F\x85",2);                     /* jne store */
+                emit32(0);
+                exits[numExits] = jitPtr - 4;
+                exitPC[numExits] = (address + 1) & mask;
+                exitCycles[numExits] = cyclesSoFar;
+                exitInstructions[numExits] = i + 1;
+                exitReason[numExits] = JIT_EXIT_STORE;
+                numExits++;
+                break;
+            case I_ADD:
+                emitMemory("\x45\x03\xA7",3,x);         /* add r12d,[r15+x*4] */
+                emit("\x45\x89\xE5",3);                 /* mov r13d,r12d */
+                emit("\x41\xC1\xED\x10",4);             /* shr r13d,16 */
+                emit("\x41\x81\xE4\xFF\xFF\x00\x00",7); /* and r12d,0xFFFF */
+                break;
+            case I_SUB:
+                /* As pumpkin.vhd, A + not M + 1 */
+                emitMemory("\x41\x8B\x87",3,x);         /* mov eax,[r15+x*4] */
+                emit("\x35\xFF\xFF\x00\x00",5);         /* xor eax,0xFFFF */
+                emit("\x45\x8D\x64\x04\x01",5);         /* lea r12d,[r12+rax+1] */
+                emit("\x45\x89\xE5",3);                 /* mov r13d,r12d */
+                emit("\x41\xC1\xED\x10",4);             /* shr r13d,16 */
+                emit("\x41\x81\xE4\xFF\xFF\x00\x00",7); /* and r12d,0xFFFF */
+                break;
+            case I_OR:
+                emitMemory("\x45\x0B\xA7",3,x);         /* or r12d,[r15+x*4] */
+                break;
+            case I_AND:
+                emitMemory("\x45\x23\xA7",3,x);         /* and r12d,[r15+x*4] */
+                break;
+            case I_XOR:
+                emitMemory("\x45\x33\xA7",3,x);         /* xor r12d,[r15+x*4] */
+                break;
+            case I_ROR:
+                emitMemory("\x41\x8B\x87",3,x);         /* mov eax,[r15+x*4] */
+                emit("\x44\x89\xE9",3);                 /* mov ecx,r13d */
+                emit("\xC1\xE1\x0F",3);                 /* shl ecx,15 */
+                emit("\x41\x89\xC5",3);                 /* mov r13d,eax */
+                emit("\x41\x83\xE5\x01",4);             /* and r13d,1 */
+                emit("\xD1\xE8",2);                     /* shr eax,1 */
+                emit("\x09\xC8",2);                     /* or eax,ecx */
+                emit("\x41\x89\xC4",3);                 /* mov r12d,eax */
+                break;
+            case I_SWAP:
+                emitMemory("\x41\x8B\x87",3,x);         /* mov eax,[r15+x*4] */
+                emit("\x89\xC1",2);                     /* mov ecx,eax */
+                emit("\xC1\xE0\x08",3);                 /* shl eax,8 */
+                emit("\xC1\xE9\x08",3);                 /* shr ecx,8 */
+                emit("\x09\xC8",2);                     /* or eax,ecx */
+                emit("\x25\xFF\xFF\x00\x00",5);         /* and eax,0xFFFF */
+                emit("\x41\x89\xC4",3);                 /* mov r12d,eax */
+                break;
+            case I_IN:
+                emitMemory("\x41\x8B\x87",3,x);         /* mov eax,[r15+x*4] */
+                emit("\x48\x8B\x4B\x30",4);             /* mov rcx,[rbx+48] */
+                emit("\x44\x8B\x24\x81",4);             /* mov r12d,[rcx+rax*4] */
+                break;
+            case I_OUT:
+                emitMemory("\x41\x8B\x87",3,x);         /* mov eax,[r15+x*4] */
+                emit("\x48\x8B\x4B\x30",4);             /* mov rcx,[rbx+48] */
+                emit("\x44\x89\x24\x81",4);             /* mov [rcx+rax*4],r12d */
+                break;
+            case I_BR:
+                if(x == (unsigned int)start)
+                {
+                    /* Loop back inside native code */
+                    emit("\x49\x81\xC6",3);             /* add r14,imm32 */
+                    emit32((unsigned int)blockCycles);
+                    emit("\x48\x81\xC5",3);             /* add rbp,imm32 */
+                    emit32(count);
+                    emit("\xE9",1);                     /* jmp entry */
+                    emit32((unsigned int)(entry - (jitPtr + 4)));
+                }
+                else
+                {
+                    emitExit(epilogue,blockCycles,count,x,JIT_EXIT_BRANCH);
+                }
+                break;
+            case I_BNC:
+            case I_BNZ:
+                if(opcode == I_BNC)
+                {
+                    emit("\x45\x85\xED",3);             /* test r13d,r13d */
+                    emit("\x0F\x84",2);                 /* jz taken */
+                }
+                else
+                {
+                    emit("\x45\x85\xE4",3);             /* test r12d,r12d */
+                    emit("\x0F\x85",2);                 /* jnz taken */
+                }
+                emit32(0);
+                taken = jitPtr - 4;
+                emitExit(epilogue,blockCycles,count,(address + 1) & mask,JIT_EXIT_BRANCH);
+                patchJump(taken);
+                if(x == (unsigned int)start)
+                {
+                    emit("\x49\x81\xC6",3);             /* add r14,imm32 */
+                    emit32((unsigned int)blockCycles);
+                    emit("\x48\x81\xC5",3);             /* add rbp,imm32 */
+                    emit32(count);
+                    emit("\xE9",1);                     /* jmp entry */
+                    emit32((unsigned int)(entry - (jitPtr + 4)));
+                }
+                else
+                {
+                    emitExit(epilogue,blockCycles,count,x,JIT_EXIT_BRANCH);
+                }
+                break;
+        }
+    }
+    /* Block ended without a branch */
+    if(terminal < 0)
+    {
+        emitExit(epilogue,blockCycles,count,(start + count) & mask,JIT_EXIT_BRANCH);
+    }
+
+    /* Exit stubs */
+    for(i=0;i<numExits;i++)
+    {
+        patchJump(exits[i]);
+        if(exitReason[i] == JIT_EXIT_STORE)
+        {
+            /* Address written is needed to invalidate blocks */
+            emit("\xC7\x43\x24",3);     /* mov dword [rbx+36],imm32 */
+            emit32(memory[start + exitInstructions[i] - 1] & mask);
+        }
+        emitExit(epilogue,exitCycles[i],exitInstructions[i],exitPC[i],exitReason[i]);
+    }
+
+    jitUsed += (int)(jitPtr - code);
+    jitUsed = (jitUsed + 15) & ~15;
+
+    /* Record the block and the addresses it covers */
+    jitEntries[jitNumEntries].start = start;
+    jitEntries[jitNumEntries].end = start + count - 1;
+    jitEntries[jitNumEntries].code = code;
+    for(i=0;i<count;i++)
+    {
+        jitCodeMap[start + i]++;
+    }
+    jitTranslated++;
+
+    return jitNumEntries++;
+}
+
+/*
+    Invalidate every block covering address and run it in the interpreter from now on
+*/
+
+void jitInvalidate(int address)
+{
+    int i;
+    int j;
+    int k;
+    int first;
+
+    jitWritten[address] = 1;
+    first = address - JIT_MAX_BLOCK + 1;
+    for(i=(first < 0 ? 0 : first);i<=address;i++)
+    {
+        j = jitBlock[i] - 1;
+        if(j >= 0 && jitEntries[j].end >= address)
+        {
+            for(k=jitEntries[j].start;k<=jitEntries[j].end;k++)
+            {
+                jitCodeMap[k]--;
+            }
+            jitEntries[j].code = NULL;
+            jitBlock[i] = 0;
+            jitInvalidated++;
+        }
+    }
+}
+
+/*
+    Discard all translated code
+*/
+
+void jitFlush(void)
+{
+    memset(jitBlock,0,sizeof(jitBlock));
+    memset(jitCodeMap,0,sizeof(jitCodeMap));
+    jitNumEntries = 0;
+    jitUsed = 0;
+}
+
+/*
+    Allocate the code cache, returns 0 if executable memory is not available
+*/
+
+int jitInit(void)
+{
+    void *cache;
+
+    cache = mmap(NULL,JIT_CODE_SIZE,PROT_READ|PROT_WRITE|PROT_EXEC,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if(cache == MAP_FAILED)
+    {
+        return 0;
+    }
+    jitCode = (unsigned char*)cache;
+    memset(jitWritten,0,sizeof(jitWritten));
+    jitFlush();
+    jitTranslated = 0;
+    jitInvalidated = 0;
+    return 1;
+}
+
+/*
+    Run a single instruction in the interpreter, a STORE into translated code invalidates it
+*/
+
+int jitStep(void)
+{
+    unsigned int ir;
+    int stop;
+
+    ir = memory[pc];
+    stop = run(cycles + 1);
+    if((ir >> 12) == I_STORE && jitCodeMap[ir & (memorySize - 1)])
+    {
+        jitInvalidate(ir & (memorySize - 1));
+    }
+    return stop;
+}
+
+/*
+    Run until maxCycles is reached or the program halts, translated blocks are used where
+    possible. Cycle and instruction counts are the same as run().
+*/
+
+int runJit(cycle_t maxCycles)
+{
+    jit_state_t state;
+    cycle_t passes;
+    int block;
+    int reason;
+
+    state.memory = memory;
+    state.io = ioMemory;
+    state.codeMap = jitCodeMap;
+    state.limit = maxCycles;
+    while(cycles < maxCycles)
+    {
+        block = jitBlock[pc];
+        if(block == 0)
+        {
+            block = translate(pc) + 1;
+            jitBlock[pc] = block ? block : -1;
+        }
+        if(block <= 0)
+        {
+            if(skipLoops && (passes = skipDelayLoop(&pc,&a,&c,cycles,maxCycles)) != 0)
+            {
+                cycles += 3 * stateCycles * passes;
+                instructions += 2 * passes;
+                continue;
+            }
+            if(jitStep() == STOP_HALT)
+            {
+                return STOP_HALT;
+            }
+            if(nextEvent < maxCycles)
+            {
+                maxCycles = nextEvent;
+                state.limit = maxCycles;
+            }
+            continue;
+        }
+
+        state.cycles = cycles;
+        state.instructions = instructions;
+        state.a = a;
+        state.c = c;
+        reason = ((jit_block_t)jitEntries[block-1].code)(&state);
+        cycles = state.cycles;
+        instructions = state.instructions;
+        a = state.a;
+        c = state.c;
+        pc = state.pc;
+
+        switch(reason)
+        {
+            case JIT_EXIT_STORE:
+                jitInvalidate(state.store);
+                break;
+            case JIT_EXIT_LIMIT:
+                /* Too close to the cycle limit to run the block, finish in the interpreter */
+                while(cycles < maxCycles)
+                {
+                    if(jitStep() == STOP_HALT)
+                    {
+                        return STOP_HALT;
+                    }
+                    if(nextEvent < maxCycles)
+                    {
+                        maxCycles = nextEvent;
+                        state.limit = maxCycles;
+                    }
+                }
+                break;
+        }
+    }
+
+    return STOP_CYCLES;
+}
+
+#endif
+
+/*
+    Run with peripherals attached, the simulation is run up to each event in turn. A program
+    that halts leaves the devices to run on to the cycle limit.
+*/
+
+int runDevices(cycle_t maxCycles, int useJit)
+{
+    cycle_t limit;
+    int stop;
+
+    (void)useJit;
+    while(cycles < maxCycles)
+    {
+        limit = (nextEvent < maxCycles) ? nextEvent : maxCycles;
+#ifdef JIT_SUPPORTED
+        stop = useJit ? runJit(limit) : run(limit);
+#else
+        stop = run(limit);
+#endif
+        if(stop == STOP_HALT)
+        {
+            return STOP_HALT;
+        }
+        dispatchEvents(cycles);
+    }
+
+    return STOP_CYCLES;
+}
+
+/*
+    Profiler
+
+    Each instruction is run on its own and the cycles it takes are added to its address, then
+    rolled up to the label enclosing the address, the nearest label at or below it. CALL and
+    RETURN are followed with a shadow of the call stack that behaves as the one in the core, so
+    cycles are also added to the chain of routines that led to the instruction. The chains are
+    held as a tree, a node for each routine or label reached from its parent, and written out as
+    folded stacks, one line per chain 'ROUTINE;ROUTINE;LABEL cycles', the input used by flame
+    graph tools. The reset cycle is not part of any instruction.
+*/
+
+typedef struct
+{
+    int parent; /* Node of the calling routine, -1 for the root */
+    int label; /* Index of the label in symbols[], numSymbols for code with no label */
+    cycle_t cycles; /* Cycles spent at this node, not counting its children */
+    int next; /* Index of the next node in the same hash bucket, -1 for end of chain */
+}profile_node_t;
+
+typedef struct
+{
+    cycle_t calls; /* CALLs to the label */
+    cycle_t instructions;
+    cycle_t cycles; /* Cycles spent in code under the label */
+    cycle_t inclusive; /* Cycles spent while the label was running or on the call stack */
+    cycle_t stamp; /* Last instruction counted in inclusive, so recursion counts once */
+}profile_label_t;
+
+int profileLabelOf[MAX_MEMORY_SIZE]; /* Label enclosing each address */
+cycle_t profileAddressCycles[MAX_MEMORY_SIZE];
+cycle_t profileAddressHits[MAX_MEMORY_SIZE];
+profile_label_t *profileLabels;
+profile_node_t *profileNodes;
+int numProfileNodes;
+int maxProfileNodes;
+int profileHash[PROFILE_HASH_SIZE]; /* First node in each bucket, -1 for empty */
+
+/*
+    Order symbols by address, labels at the same address stay in the order they were defined
+*/
+
+int compareSymbols(const void *left, const void *right)
+{
+    const symbol_t *l = (const symbol_t*)left;
+    const symbol_t *r = (const symbol_t*)right;
+
+    if(l->address != r->address)
+    {
+        return l->address < r->address ? -1 : 1;
+    }
+    return l->name < r->name ? -1 : (l->name > r->name);
+}
+
+/*
+    Return the name of a label, code before the first label has none
+*/
+
+const char *profileLabelName(int label)
+{
+    return label < numSymbols ? symbols[label].name : "(none)";
+}
+
+/*
+    Return the node for label called from parent, it is created the first time it is used.
+    Returns -1 if there is no memory for it.
+*/
+
+int profileNode(int parent, int label)
+{
+    profile_node_t *newNodes;
+    unsigned int bucket;
+    int i;
+
+    bucket = ((unsigned int)parent * 31u + (unsigned int)label) & (PROFILE_HASH_SIZE - 1);
+    for(i=profileHash[bucket];i>=0;i=profileNodes[i].next)
+    {
+        if(profileNodes[i].parent == parent && profileNodes[i].label == label)
+        {
+            return i;
+        }
+    }
+
+    if(numProfileNodes >= maxProfileNodes)
+    {
+        maxProfileNodes = maxProfileNodes ? maxProfileNodes * 2 : 256;
+        newNodes = (profile_node_t*)realloc(profileNodes,maxProfileNodes * sizeof(profile_node_t));
+        if(newNodes == NULL)
+        {
+            return -1;
+        }
+        profileNodes = newNodes;
+    }
+    i = numProfileNodes++;
+    profileNodes[i].parent = parent;
+    profileNodes[i].label = label;
+    profileNodes[i].cycles = 0;
+    profileNodes[i].next = profileHash[bucket];
+    profileHash[bucket] = i;
+
+    return i;
+}
+
+/*
+    Set up the profile, symbols are sorted and the label enclosing each address found.
+    Returns 0 if there is no memory.
+*/
+
+int initProfile(void)
+{
+    unsigned int address;
+    int label;
+    int next;
+
+    qsort(symbols,numSymbols,sizeof(symbol_t),compareSymbols);
+    label = numSymbols;
+    next = 0;
+    for(address=0;address<MAX_MEMORY_SIZE;address++)
+    {
+        while(next < numSymbols && symbols[next].address <= address)
+        {
+            /* The first of several labels at the same address names it */
+            if(label == numSymbols || symbols[next].address != symbols[label].address)
+            {
+                label = next;
+            }
+            next++;
+        }
+        profileLabelOf[address] = label;
+    }
+
+    profileLabels = (profile_label_t*)calloc(numSymbols + 1,sizeof(profile_label_t));
+    memset(profileHash,-1,sizeof(profileHash));
+    numProfileNodes = 0;
+
+    /* Node 0 is the root */
+    return profileLabels != NULL && profileNode(-1,-1) == 0;
+}
+
+/*
+    Run until maxCycles is reached or the program halts one instruction at a time, adding the
+    cycles of each to the profile
+*/
+
+int runProfile(cycle_t maxCycles)
+{
+    int frames[MAX_STACK_DEPTH]; /* Node of each routine on the shadow call stack */
+    int depth;
+    int frame;
+    int node;
+    int label;
+    int stop;
+    int i;
+    unsigned int address;
+    unsigned int ir;
+    cycle_t before;
+    cycle_t spent;
+
+    depth = 0;
+    stop = STOP_CYCLES;
+    while(cycles < maxCycles && stop != STOP_HALT)
+    {
+        address = pc;
+        ir = memory[address];
+        before = cycles;
+        /* Exactly one instruction runs, delay loops are not fast-forwarded with a limit this close */
+        stop = run(cycles + 1);
+        spent = cycles - before;
+        dispatchEvents(cycles);
+
+        profileAddressCycles[address] += spent;
+        profileAddressHits[address]++;
+        label = profileLabelOf[address];
+        profileLabels[label].instructions++;
+        profileLabels[label].cycles += spent;
+
+        /* Code under the label of the running routine is the routine itself */
+        frame = depth ? frames[depth - 1] : 0;
+        node = (frame != 0 && profileNodes[frame].label == label) ? frame : profileNode(frame,label);
+        if(node < 0)
+        {
+            printf("Error: out of memory\n");
+            exit(1);
+        }
+        profileNodes[node].cycles += spent;
+
+        profileLabels[label].inclusive += spent;
+        profileLabels[label].stamp = instructions;
+        for(i=0;i<depth;i++)
+        {
+            label = profileNodes[frames[i]].label;
+            if(profileLabels[label].stamp != instructions)
+            {
+                profileLabels[label].inclusive += spent;
+                profileLabels[label].stamp = instructions;
+            }
+        }
+
+        if((ir >> 12) == I_CALL)
+        {
+            label = profileLabelOf[ir & (memorySize - 1)];
+            profileLabels[label].calls++;
+            /* As the core, a CALL with the stack full loses the deepest entry */
+            if(depth == stackDepth)
+            {
+                memmove(frames,frames + 1,(depth - 1) * sizeof(int));
+                depth--;
+            }
+            frames[depth] = profileNode(frame,label);
+            if(frames[depth++] < 0)
+            {
+                printf("Error: out of memory\n");
+                exit(1);
+            }
+        }
+        else if((ir >> 12) == I_RETURN && depth > 0)
+        {
+            depth--;
+        }
+    }
+
+    return stop;
+}
+
+/*
+    Write a node's chain of labels, root first
+*/
+
+void writeProfilePath(FILE *fp, int node)
+{
+    if(profileNodes[node].parent > 0)
+    {
+        writeProfilePath(fp,profileNodes[node].parent);
+        fprintf(fp,";");
+    }
+    fprintf(fp,"%s",profileLabelName(profileNodes[node].label));
+}
+
+/*
+    Write the folded stacks and print the table of labels, busiest first. When verbose the
+    cycles of each address are listed as well.
+*/
+
+int writeProfile(char *fileName, int verbose)
+{
+    FILE *fp;
+    cycle_t total;
+    char address[8];
+    int *order;
+    int count;
+    int label;
+    int i;
+    int j;
+
+    fp = fopen(fileName,"w");
+    if(fp == NULL)
+    {
+        printf("Could not open profile file %s\n",fileName);
+        return 0;
+    }
+    for(i=1;i<numProfileNodes;i++)
+    {
+        if(profileNodes[i].cycles != 0)
+        {
+            writeProfilePath(fp,i);
+            fprintf(fp," %llu\n",profileNodes[i].cycles);
+        }
+    }
+    fclose(fp);
+
+    order = (int*)malloc((numSymbols + 1) * sizeof(int));
+    if(order == NULL)
+    {
+        printf("Error: out of memory\n");
+        return 0;
+    }
+    total = 0;
+    count = 0;
+    for(label=0;label<=numSymbols;label++)
+    {
+        total += profileLabels[label].cycles;
+        if(profileLabels[label].instructions == 0 && profileLabels[label].calls == 0)
+        {
+            continue;
+        }
+        /* Insert in order of cycles */
+        for(j=count;j>0 && profileLabels[order[j-1]].cycles < profileLabels[label].cycles;j--)
+        {
+            order[j] = order[j-1];
+        }
+        order[j] = label;
+        count++;
+    }
+
+    printf("Profile       : %d labels, folded stacks written to %s\n",count,fileName);
+    printf("%-20s %7s %10s %14s %14s %6s %14s\n","Label","Address","Calls","Instructions","Cycles","%","Inclusive");
+    for(i=0;i<count;i++)
+    {
+        label = order[i];
+        snprintf(address,sizeof(address),label < numSymbols ? "%03X" : "-",label < numSymbols ? symbols[label].address : 0);
+        printf("%-20s %7s %10llu %14llu %14llu %6.2f %14llu\n",profileLabelName(label),address,profileLabels[label].calls,
+               profileLabels[label].instructions,profileLabels[label].cycles,
+               total ? 100.0 * (double)profileLabels[label].cycles / (double)total : 0.0,profileLabels[label].inclusive);
+    }
+    free(order);
+
+    if(verbose)
+    {
+        printf("%7s %-20s %14s %14s\n","Address","Label","Instructions","Cycles");
+        for(i=0;i<MAX_MEMORY_SIZE;i++)
+        {
+            if(profileAddressHits[i] != 0)
+            {
+                label = profileLabelOf[i];
+                printf("%7.3X %-20s %14llu %14llu\n",i,profileLabelName(label),profileAddressHits[i],profileAddressCycles[i]);
+            }
+        }
+    }
+
+    return 1;
+}
+
+/*
+    Batch simulation
+
+    The same image is run once for each line of an input file, each run is a lane. The lanes are
+    run one at a time, each from reset with its own copy of program memory and the IO memory it
+    starts with, and the final state of each is kept for the report. IO memory inputs are held
+    per address for every lane, allocated as an address is first given a value.
+*/
+
+int numLanes; /* Lanes read from the input file */
+unsigned short *laneA;
+unsigned short *laneC;
+unsigned short *lanePC; /* LANE_HALTED is set once the lane has halted */
+cycle_t *laneCycles;
+cycle_t *laneInstructions;
+unsigned short *laneIO[IO_MEMORY_SIZE]; /* IO memory for each address, NULL if never given */
+
+/*
+    Return the IO memory of an address for every lane, allocated the first time it is written
+*/
+
+unsigned short *laneIORow(unsigned int address)
+{
+    if(laneIO[address] == NULL)
+    {
+        laneIO[address] = (unsigned short*)calloc(numLanes,sizeof(unsigned short));
+    }
+    return laneIO[address];
+}
+
+/*
+    Read the input file, each line is a lane and lists the IO memory values it starts with as
+    'address=value' pairs. Blank lines are lanes with no inputs, lines starting with ';' or '#'
+    are ignored.
+*/
+
+int loadLanes(char *fileName)
+{
+    FILE *fp;
+    char line[MAX_INPUT_LINE_LENGTH+1];
+    char *ptr;
+    char *endStrol;
+    unsigned int address;
+    unsigned int value;
+    unsigned short *row;
+    int lineNumber;
+    int pass;
+    int lane;
+
+    fp = fopen(fileName,"r");
+    if(fp == NULL)
+    {
+        printf("Could not open input file %s\n",fileName);
+        return 0;
+    }
+
+    /* Count the lanes then read the inputs */
+    for(pass=0;pass<2;pass++)
+    {
+        rewind(fp);
+        lane = 0;
+        lineNumber = 0;
+        while(fgets(line,sizeof(line),fp))
+        {
+            lineNumber++;
+            ptr = strtok(line," \t\r\n");
+            if(ptr != NULL && (ptr[0] == ';' || ptr[0] == '#'))
+            {
+                continue;
+            }
+            while(pass == 1 && ptr != NULL)
+            {
+                address = (unsigned int)strtoul(ptr,&endStrol,0);
+                value = 0;
+                if(endStrol != ptr && *endStrol == '=')
+                {
+                    ptr = endStrol + 1;
+                    value = (unsigned int)strtoul(ptr,&endStrol,0);
+                }
+                if(endStrol == ptr || *endStrol != 0 || address >= IO_MEMORY_SIZE || value > 0xFFFF)
+                {
+                    printf("Error input line %d: address=value expected\n",lineNumber);
+                    fclose(fp);
+                    return 0;
+                }
+                row = laneIORow(address);
+                if(row == NULL)
+                {
+                    printf("Error: out of memory\n");
+                    fclose(fp);
+                    return 0;
+                }
+                row[lane] = (unsigned short)value;
+                ptr = strtok(NULL," \t\r\n");
+            }
+            lane++;
+        }
+        if(lane == 0)
+        {
+            printf("Error: no lanes in input file %s\n",fileName);
+            fclose(fp);
+            return 0;
+        }
+        if(pass == 0)
+        {
+            numLanes = lane;
+            laneA = (unsigned short*)calloc(numLanes,sizeof(unsigned short));
+            laneC = (unsigned short*)calloc(numLanes,sizeof(unsigned short));
+            lanePC = (unsigned short*)calloc(numLanes,sizeof(unsigned short));
+            laneCycles = (cycle_t*)calloc(numLanes,sizeof(cycle_t));
+            laneInstructions = (cycle_t*)calloc(numLanes,sizeof(cycle_t));
+            if(laneA == NULL || laneC == NULL || lanePC == NULL || laneCycles == NULL || laneInstructions == NULL)
+            {
+                printf("Error: out of memory\n");
+                fclose(fp);
+                return 0;
+            }
+        }
+    }
+    fclose(fp);
+
+    return 1;
+}
+
+/*
+    Run each lane in turn, as a single run of PSIM would, with the JIT when useJit is set and the
+    interpreter otherwise
+*/
+
+void runLanes(cycle_t maxCycles, int useJit)
+{
+    unsigned int image[MAX_MEMORY_SIZE];
+    int address;
+    int lane;
+    int stop;
+
+    memcpy(image,memory,sizeof(image));
+    for(lane=0;lane<numLanes;lane++)
+    {
+#ifdef JIT_SUPPORTED
+        /* Code translated after the last lane wrote to its program memory no longer matches */
+        if(useJit && memcmp(memory,image,sizeof(image)) != 0)
+        {
+            jitFlush();
+        }
+#endif
+        memcpy(memory,image,sizeof(image));
+        reset();
+        for(address=0;address<IO_MEMORY_SIZE;address++)
+        {
+            if(laneIO[address] != NULL)
+            {
+                ioMemory[address] = laneIO[address][lane];
+            }
+        }
+        traceLane = lane;
+#ifdef JIT_SUPPORTED
+        stop = useJit ? runJit(maxCycles) : run(maxCycles);
+#else
+        (void)useJit;
+        stop = run(maxCycles);
+#endif
+        if(stop == STOP_HALT)
+        {
+            pc |= LANE_HALTED;
+        }
+        traceLane = -1;
+        laneA[lane] = (unsigned short)a;
+        laneC[lane] = (unsigned short)c;
+        lanePC[lane] = (unsigned short)pc;
+        laneCycles[lane] = cycles;
+        laneInstructions[lane] = instructions;
+    }
+}
+
+/*
+    Run the image once for each line of the input file and print the result of each lane
+*/
+
+int runBatch(char *fileName, cycle_t maxCycles, int useJit)
+{
+    cycle_t totalInstructions;
+    cycle_t totalCycles;
+    clock_t start;
+    double seconds;
+    int halted;
+    int lane;
+
+    if(!loadLanes(fileName))
+    {
+        return 1;
+    }
+    printf("%d lanes from %s\n",numLanes,fileName);
+
+    start = clock();
+    runLanes(maxCycles,useJit);
+    seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    totalInstructions = 0;
+    totalCycles = 0;
+    halted = 0;
+    for(lane=0;lane<numLanes;lane++)
+    {
+        printf("Lane %d: A = %04X  C = %d  PC = %03X  %llu instructions  %llu cycles%s\n",lane,laneA[lane],laneC[lane],
+               lanePC[lane] & ~LANE_HALTED,laneInstructions[lane],laneCycles[lane],(lanePC[lane] & LANE_HALTED) ? "  halted" : "");
+        totalInstructions += laneInstructions[lane];
+        totalCycles += laneCycles[lane];
+        halted += (lanePC[lane] & LANE_HALTED) ? 1 : 0;
+    }
+    printf("Lanes         : %d, %d halted\n",numLanes,halted);
+    printf("Instructions  : %llu\n",totalInstructions);
+    printf("Cycles        : %llu\n",totalCycles);
+    printf("Host time     : %.3f s\n",seconds);
+    if(seconds > 0.0)
+    {
+        printf("Speed         : %.1f MIPS, %.1f M cycles/s\n",(double)totalInstructions/seconds/1e6,(double)totalCycles/seconds/1e6);
+    }
+
+    return 0;
+}
+
+/*
+    Multi-core system simulation
+
+    Several cores, each with its own program memory, memory size and call stack depth, share one
+    IO memory. The cores are run on a pool of threads in quanta of a fixed number of cycles. During
+    a quantum a core sees the shared IO memory as it was at the start of the quantum together with
+    its own writes, the writes of every core are kept in a list and applied to the shared IO memory
+    at the end of the quantum in order of the cycle they were made in, cores writing in the same
+    cycle are applied in core order so the highest numbered core wins. Nothing a core sees depends
+    on which thread runs it or when, so the results are the same from run to run and for any
+    number of threads. Writes made by other cores are seen from the next quantum on, a quantum of
+    1 cycle exchanges IO on every cycle.
+*/
+
+typedef struct
+{
+    cycle_t cycle; /* Cycle the write was made in */
+    unsigned int address;
+    unsigned int value;
+}io_write_t;
+
+typedef struct
+{
+    char *image;
+    int memorySize;
+    int stackDepth;
+    unsigned int memory[MAX_MEMORY_SIZE];
+    unsigned int a;
+    unsigned int c;
+    unsigned int pc;
+    unsigned int callstack[MAX_STACK_DEPTH];
+    int stackTop;
+    int inIrq; /* Cleared by RETI, there is no interrupt input in a system */
+    unsigned int savedC;
+    cycle_t cycles;
+    cycle_t instructions;
+    int halted;
+    io_write_t *writes; /* IO writes made in the current quantum */
+    int numWrites;
+    int writeSize;
+    int merged; /* Writes applied so far by mergeWrites() */
+    unsigned char *written; /* Set for each IO address written in the current quantum */
+    unsigned short *pending; /* Value of each IO address written in the current quantum */
+}core_t;
+
+int numCores;
+core_t *cores;
+cycle_t quantumEnd; /* Cores run until their cycle count reaches this */
+int nextCore; /* Index of the next core to be taken by a thread */
+int coresDone; /* Cores finished in the current quantum */
+int quantumNumber; /* Incremented to start a quantum */
+int systemRunning; /* Cleared to stop the threads */
+pthread_mutex_t systemLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t quantumStart = PTHREAD_COND_INITIALIZER;
+pthread_cond_t quantumDone = PTHREAD_COND_INITIALIZER;
+
+/*
+    Read the system file, each line is 'image [S] [D]' for one core. S is the memory size used
+    when assembling a source file and D the call stack depth, they default to the -m and -s
+    options. Blank lines and lines starting with ';' or '#' are ignored.
+*/
+
+int loadSystem(char *fileName)
+{
+    FILE *fp;
+    char line[MAX_LINE_LENGTH];
+    char *words[4];
+    char *endStrol;
+    char *ptr;
+    int wordCount;
+    int lineNumber;
+    int errors;
+    int size;
+    int depth;
+    int defaultSize;
+    core_t *newCores;
+    core_t *core;
+
+    fp = fopen(fileName,"r");
+    if(fp == NULL)
+    {
+        printf("Could not open system file %s\n",fileName);
+        return 0;
+    }
+
+    size = 0;
+    errors = 0;
+    lineNumber = 0;
+    defaultSize = asmMemorySize;
+    while(fgets(line,sizeof(line),fp))
+    {
+        lineNumber++;
+        wordCount = 0;
+        ptr = strtok(line," \t\r\n");
+        while(ptr != NULL && wordCount < 4)
+        {
+            words[wordCount++] = ptr;
+            ptr = strtok(NULL," \t\r\n");
+        }
+        if(wordCount == 0 || words[0][0] == ';' || words[0][0] == '#')
+        {
+            continue;
+        }
+        if(wordCount > 3)
+        {
+            printf("Error system file line %d: syntax\n",lineNumber);
+            errors++;
+            continue;
+        }
+
+        /* Make room for the new core */
+        if(numCores >= size)
+        {
+            size = size ? size * 2 : 16;
+            newCores = (core_t*)realloc(cores,size * sizeof(core_t));
+            if(newCores == NULL)
+            {
+                printf("Error: out of memory\n");
+                fclose(fp);
+                return 0;
+            }
+            cores = newCores;
+        }
+
+        depth = stackDepth;
+        asmMemorySize = defaultSize;
+        if(wordCount > 1)
+        {
+            asmMemorySize = (int)strtol(words[1],&endStrol,0);
+            if(*endStrol != 0)
+            {
+                printf("Error system file line %d: memory size expected\n",lineNumber);
+                errors++;
+                continue;
+            }
+        }
+        if(wordCount > 2)
+        {
+            depth = (int)strtol(words[2],&endStrol,0);
+            if(*endStrol != 0 || depth < 1 || depth > MAX_STACK_DEPTH)
+            {
+                printf("Error system file line %d: stack depth expected\n",lineNumber);
+                errors++;
+                continue;
+            }
+        }
+
+        /* Images are loaded one at a time into memory[] then copied to the core */
+        if(!loadImage(words[0]))
+        {
+            errors++;
+            continue;
+        }
+        core = &cores[numCores];
+        memset(core,0,sizeof(core_t));
+        core->image = copyString(words[0]);
+        core->memorySize = memorySize;
+        core->stackDepth = depth;
+        memcpy(core->memory,memory,sizeof(core->memory));
+        core->written = (unsigned char*)calloc(IO_MEMORY_SIZE,sizeof(unsigned char));
+        core->pending = (unsigned short*)malloc(IO_MEMORY_SIZE * sizeof(unsigned short));
+        if(core->image == NULL || core->written == NULL || core->pending == NULL)
+        {
+            printf("Error: out of memory\n");
+            fclose(fp);
+            return 0;
+        }
+        printf("Core %d: %s, %d words of program memory, stack depth %d\n",numCores,core->image,core->memorySize,core->stackDepth);
+        numCores++;
+    }
+    fclose(fp);
+
+    if(numCores == 0 && errors == 0)
+    {
+        printf("Error: no cores in system file %s\n",fileName);
+        errors++;
+    }
+
+    return (errors == 0);
+}
+
+/*
+    Reset a core, the S0 state takes a single cycle and fetches from address 0
+*/
+
+void resetCore(core_t *core)
+{
+    core->a = 0;
+    core->c = 0;
+    core->pc = 0;
+    core->stackTop = 0;
+    memset(core->callstack,0,sizeof(core->callstack));
+    core->inIrq = 0;
+    core->savedC = 0;
+    core->cycles = 1;
+    core->instructions = 0;
+    core->halted = 0;
+    core->numWrites = 0;
+}
+
+/*
+    Record an IO write made by a core, it is applied to the shared IO memory at the end of the
+    quantum. Returns 0 if there is no memory for it.
+*/
+
+int addCoreWrite(core_t *core, cycle_t cycle, unsigned int address, unsigned int value)
+{
+    io_write_t *newWrites;
+
+    if(core->numWrites >= core->writeSize)
+    {
+        core->writeSize = core->writeSize ? core->writeSize * 2 : 256;
+        newWrites = (io_write_t*)realloc(core->writes,core->writeSize * sizeof(io_write_t));
+        if(newWrites == NULL)
+        {
+            return 0;
+        }
+        core->writes = newWrites;
+    }
+    core->writes[core->numWrites].cycle = cycle;
+    core->writes[core->numWrites].address = address;
+    core->writes[core->numWrites].value = value;
+    core->numWrites++;
+    core->written[address] = 1;
+    core->pending[address] = (unsigned short)value;
+
+    return 1;
+}
+
+/*
+    Run a core until its cycle count reaches maxCycles or it halts, as run() but with the state
+    held in the core and IO going through the core's view of the shared IO memory
+*/
+
+void runCore(core_t *core, cycle_t maxCycles)
+{
+    unsigned int mask;
+    unsigned int ir;
+    unsigned int x;
+    unsigned int m;
+    unsigned int next;
+    unsigned int regA;
+    unsigned int regC;
+    unsigned int regPC;
+    unsigned int *mem;
+    int top;
+    int depth;
+    cycle_t count;
+    cycle_t executed;
+    cycle_t passes;
+
+    mask = core->memorySize - 1;
+    mem = core->memory;
+    depth = core->stackDepth;
+    regA = core->a;
+    regC = core->c;
+    regPC = core->pc;
+    top = core->stackTop;
+    count = core->cycles;
+    executed = 0;
+
+    while(count < maxCycles && !core->halted)
+    {
+        ir = mem[regPC];
+        x = ir & mask;
+        executed++;
+        switch(ir >> 12)
+        {
+            case I_LOAD:
+                regA = mem[x];
+                regPC = (regPC + 1) & mask;
+                count += 2;
+                break;
+            case I_STORE:
+                mem[x] = regA;
+                regPC = (regPC + 1) & mask;
+                count += 2;
+                break;
+            case I_ADD:
+            case I_SUB:
+                /* Delay loop, as skipDelayLoop() but on the core's memory */
+                next = mem[(regPC + 1) & mask];
+                if(skipLoops && (next >> 12) == I_BNZ && (next & mask) == regPC &&
+                   (passes = delayLoopPasses(ir >> 12,mem[x],&regA,&regC,count,maxCycles)) != 0)
+                {
+                    regPC = regA ? regPC : (regPC + 2) & mask;
+                    executed += 2 * passes - 1;
+                    count += 3 * passes;
+                    break;
+                }
+                if((ir >> 12) == I_ADD)
+                {
+                    regA += mem[x];
+                }
+                else
+                {
+                    regA += (mem[x] ^ 0xFFFF) + 1;
+                }
+                regC = regA >> 16;
+                regA &= 0xFFFF;
+                regPC = (regPC + 1) & mask;
+                count += 2;
+                break;
+            case I_OR:
+                regA |= mem[x];
+                regPC = (regPC + 1) & mask;
+                count += 2;
+                break;
+            case I_AND:
+                regA &= mem[x];
+                regPC = (regPC + 1) & mask;
+                count += 2;
+                break;
+            case I_XOR:
+                regA ^= mem[x];
+                regPC = (regPC + 1) & mask;
+                count += 2;
+                break;
+            case I_ROR:
+                m = mem[x];
+                regA = (regC << 15) | (m >> 1);
+                regC = m & 1;
+                regPC = (regPC + 1) & mask;
+                count += 2;
+                break;
+            case I_SWAP:
+                m = mem[x];
+                regA = ((m << 8) | (m >> 8)) & 0xFFFF;
+                regPC = (regPC + 1) & mask;
+                count += 2;
+                break;
+            case I_IN:
+                /* The IO memory is read in S2, cycle count + 1 */
+                m = mem[x];
+                regA = core->written[m] ? core->pending[m] : ioMemory[m];
+                regPC = (regPC + 1) & mask;
+                count += 2;
+                break;
+            case I_OUT:
+                if(!addCoreWrite(core,count + 1,mem[x],regA))
+                {
+                    printf("Error: out of memory\n");
+                    exit(1);
+                }
+                regPC = (regPC + 1) & mask;
+                count += 2;
+                break;
+            case I_BR:
+                count += 1;
+                if(x == regPC)
+                {
+                    core->halted = 1;
+                    break;
+                }
+                regPC = x;
+                break;
+            case I_BNC:
+                regPC = regC ? (regPC + 1) & mask : x;
+                count += 1;
+                break;
+            case I_BNZ:
+                regPC = regA ? x : (regPC + 1) & mask;
+                count += 1;
+                break;
+            case I_CALL:
+                top = (top == 0) ? depth - 1 : top - 1;
+                core->callstack[top] = (regPC + 1) & mask;
+                regPC = x;
+                count += 1;
+                break;
+            case I_RETURN:
+                regPC = core->callstack[top];
+                core->callstack[top] = core->callstack[(top + depth - 1) % depth];
+                top = (top + 1 == depth) ? 0 : top + 1;
+                count += 1;
+                if(ir & 1)
+                {
+                    /* RETI restores C */
+                    regC = core->savedC;
+                    core->inIrq = 0;
+                }
+                break;
+        }
+    }
+
+    core->a = regA;
+    core->c = regC;
+    core->pc = regPC;
+    core->stackTop = top;
+    core->cycles = count;
+    core->instructions += executed;
+}
+
+/*
+    Thread, waits for a quantum to start then takes cores from the list until there are none
+    left. Which thread runs a core makes no difference to the result.
+*/
+
+void *systemWorker(void *arg)
+{
+    int seen;
+    int i;
+
+    (void)arg;
+    seen = 0;
+    pthread_mutex_lock(&systemLock);
+    while(1)
+    {
+        while(systemRunning && quantumNumber == seen)
+        {
+            pthread_cond_wait(&quantumStart,&systemLock);
+        }
+        if(!systemRunning)
+        {
+            break;
+        }
+        seen = quantumNumber;
+        while(nextCore < numCores)
+        {
+            i = nextCore++;
+            pthread_mutex_unlock(&systemLock);
+            runCore(&cores[i],quantumEnd);
+            pthread_mutex_lock(&systemLock);
+            if(++coresDone == numCores)
+            {
+                pthread_cond_signal(&quantumDone);
+            }
+        }
+    }
+    pthread_mutex_unlock(&systemLock);
+
+    return NULL;
+}
+
+/*
+    Apply the IO writes of every core made in the last quantum to the shared IO memory in
+    order of cycle then core, and clear each core's view of them
+*/
+
+void mergeWrites(void)
+{
+    io_write_t *w;
+    core_t *core;
+    int best;
+    int i;
+
+    while(1)
+    {
+        /* Earliest write not yet applied, the lowest numbered core on a tie */
+        best = -1;
+        for(i=0;i<numCores;i++)
+        {
+            core = &cores[i];
+            if(core->merged < core->numWrites && (best < 0 || core->writes[core->merged].cycle < cores[best].writes[cores[best].merged].cycle))
+            {
+                best = i;
+            }
+        }
+        if(best < 0)
+        {
+            break;
+        }
+        w = &cores[best].writes[cores[best].merged++];
+        ioMemory[w->address] = w->value;
+        if(traceIO)
+        {
+            printf("Core %d: Cycle %llu: OUT %04X = %04X\n",best,w->cycle,w->address,w->value);
+        }
+    }
+    for(i=0;i<numCores;i++)
+    {
+        core = &cores[i];
+        while(core->numWrites > 0)
+        {
+            core->written[core->writes[--core->numWrites].address] = 0;
+        }
+        core->merged = 0;
+    }
+}
+
+/*
+    Run every core until it halts or reaches maxCycles, one quantum at a time on threads threads.
+    Returns the number of threads used.
+*/
+
+int runCores(cycle_t maxCycles, cycle_t quantum, int threads)
+{
+    pthread_t ids[MAX_THREADS];
+    cycle_t end;
+    int running;
+    int workers;
+    int i;
+
+    memset(ioMemory,0,sizeof(ioMemory));
+    for(i=0;i<numCores;i++)
+    {
+        resetCore(&cores[i]);
+    }
+
+    systemRunning = 1;
+    quantumNumber = 0;
+    workers = 0;
+    if(threads > 1)
+    {
+        for(workers=0;workers<threads;workers++)
+        {
+            if(pthread_create(&ids[workers],NULL,systemWorker,NULL) != 0)
+            {
+                break;
+            }
+        }
+    }
+
+    end = 1;
+    running = 1;
+    while(running)
+    {
+        end = (end < maxCycles && maxCycles - end > quantum) ? end + quantum : maxCycles;
+        if(workers > 0)
+        {
+            pthread_mutex_lock(&systemLock);
+            quantumEnd = end;
+            nextCore = 0;
+            coresDone = 0;
+            quantumNumber++;
+            pthread_cond_broadcast(&quantumStart);
+            while(coresDone < numCores)
+            {
+                pthread_cond_wait(&quantumDone,&systemLock);
+            }
+            pthread_mutex_unlock(&systemLock);
+        }
+        else
+        {
+            /* No threads could be started, run the cores here */
+            for(i=0;i<numCores;i++)
+            {
+                runCore(&cores[i],end);
+            }
+        }
+        mergeWrites();
+
+        running = 0;
+        for(i=0;i<numCores;i++)
+        {
+            if(!cores[i].halted && cores[i].cycles < maxCycles)
+            {
+                running = 1;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&systemLock);
+    systemRunning = 0;
+    pthread_cond_broadcast(&quantumStart);
+    pthread_mutex_unlock(&systemLock);
+    for(i=0;i<workers;i++)
+    {
+        pthread_join(ids[i],NULL);
+    }
+
+    return workers ? workers : 1;
+}
+
+/*
+    Load and run a multi-core system and print the result of each core
+*/
+
+int runSystem(char *fileName, cycle_t maxCycles, cycle_t quantum, int threads)
+{
+    cycle_t totalInstructions;
+    cycle_t totalCycles;
+    double start;
+    double seconds;
+    int halted;
+    int i;
+
+    if(!loadSystem(fileName))
+    {
+        return 1;
+    }
+    if(threads <= 0)
+    {
+        threads = getCoreCount(MAX_THREADS);
+    }
+    if(threads > numCores)
+    {
+        threads = numCores;
+    }
+
+    start = getWallTime();
+    threads = runCores(maxCycles,quantum,threads);
+    seconds = getWallTime() - start;
+
+    totalInstructions = 0;
+    totalCycles = 0;
+    halted = 0;
+    for(i=0;i<numCores;i++)
+    {
+        printf("Core %d: A = %04X  C = %d  PC = %03X  %llu instructions  %llu cycles%s\n",i,cores[i].a,cores[i].c,
+               cores[i].pc,cores[i].instructions,cores[i].cycles,cores[i].halted ? "  halted" : "");
+        totalInstructions += cores[i].instructions;
+        totalCycles += cores[i].cycles;
+        halted += cores[i].halted;
+    }
+    printf("Cores         : %d, %d halted\n",numCores,halted);
+    printf("Instructions  : %llu\n",totalInstructions);
+    printf("Cycles        : %llu\n",totalCycles);
+    printf("Host time     : %.3f s (%d thread%s, quantum %llu cycles)\n",seconds,threads,threads == 1 ? "" : "s",quantum);
+    if(seconds > 0.0)
+    {
+        printf("Speed         : %.1f MIPS, %.1f M cycles/s\n",(double)totalInstructions/seconds/1e6,(double)totalCycles/seconds/1e6);
+    }
+
+    return 0;
+}
+
+/*
+    Print CPU state
+*/
+
+void printState(void)
+{
+    int i;
+
+    printf("A = %04X  C = %d  PC = %03X\n",a,c,pc);
+    printf("Call stack:");
+    for(i=0;i<stackDepth;i++)
+    {
+        printf(" %03X",callstack[(stackTop + i) % stackDepth]);
+    }
+    printf("\n");
+}
+
+/*
+    Print simulation results and simulator speed, the speed is of the instructions and cycles run
+    since startInstruction and startCycle
+*/
+
+void printReport(int stop, double seconds, int useJit, cycle_t startInstruction, cycle_t startCycle)
+{
+    if(stop == STOP_HALT)
+    {
+        printf("Halted at %03X (branch to self)\n",pc);
+    }
+    else
+    {
+        printf("Cycle limit reached\n");
+    }
+    printf("Instructions  : %llu\n",instructions);
+    printf("Cycles        : %llu\n",cycles);
+    printf("Host time     : %.3f s\n",seconds);
+    if(seconds > 0.0 && cycles > startCycle)
+    {
+        printf("Speed         : %.1f MIPS, %.1f M cycles/s\n",(double)(instructions - startInstruction)/seconds/1e6,
+               (double)(cycles - startCycle)/seconds/1e6);
+    }
+#ifdef JIT_SUPPORTED
+    if(useJit)
+    {
+        printf("JIT           : %llu blocks translated, %llu invalidated\n",jitTranslated,jitInvalidated);
+    }
+#endif
+}
+
+/*
+    Print the cycles the CPU was stalled by wait states since cycle startCycle
+*/
+
+void printStalls(cycle_t startCycle)
+{
+    cycle_t memoryStall;
+
+    /* Apart from IO waits the cycles are states of stateCycles cycles, one enabled and the rest waiting */
+    memoryStall = (cycles - startCycle - ioStallCycles) / stateCycles * (stateCycles - 1);
+    printf("Stall cycles  : %llu, %llu program memory wait states, %llu IO wait states\n",memoryStall + ioStallCycles,
+           memoryStall,ioStallCycles);
+}
+
+void print_usage(void)
+{
+    printf("Usage:\n");
+    printf("       psim image.(vhd|mem|mif|asm|snp) [options]\n");
+    printf("       psim --system file [options]\n\n");
+    printf("       The image is a file created by PASM or a source file which is assembled first\n");
+    printf("       Options:\n");
+    printf("          -c N  stop after N cycles, defaults to 1000000000\n");
+    printf("          -s N  call stack depth (stack_depth generic), defaults to %d\n",DEFAULT_STACK_DEPTH);
+    printf("          -m S  memory size when assembling a source file, defaults to %d\n",DEFAULT_MEMORY_SIZE);
+    printf("          -w    print IO writes\n");
+    printf("          -v    print CPU state on exit\n");
+    printf("          -i    use the interpreter, by default blocks are translated to x86-64 code\n");
+    printf("                where supported\n");
+    printf("          -f    run every pass of delay loops, by default they are fast-forwarded\n");
+    printf("          -b F  batch mode, run the image once for each line of input file F, each\n");
+    printf("                line lists the IO memory values it starts with as address=value pairs\n");
+    printf("          -p F  profile, write folded call stacks to F and print the cycles spent\n");
+    printf("                under each label, -v adds the cycles of each address\n");
+    printf("          -r F  record a binary trace of every instruction to F, read it with ptrace\n");
+    printf("          -l F  symbol file created by PASM, labels for the profile of an image\n");
+    printf("          -S F  save a snapshot of the simulator state to F when the run ends, an\n");
+    printf("                image with the .snp extension restores a snapshot and carries on from it\n");
+    printf("          -u A  UART receiver on bit 0 of IO address A, A:N for N cycles per bit,\n");
+    printf("                defaults to %d, the bytes received are printed at the end\n",DEFAULT_UART_BIT);
+    printf("          -R A:N  interrupt source, irq goes high N cycles after the start and after\n");
+    printf("                each OUT to IO address A, the OUT acknowledges and drops it\n");
+    printf("          -P A  performance counters at IO addresses A to A+9, as the counters\n");
+    printf("                generic with counter_address A\n");
+    printf("          -I    short immediates, as the short_immediate generic, for an image\n");
+    printf("                assembled with PASM -I, a source file is assembled with -I\n");
+    printf("          -M N  N program memory wait states on every cycle\n");
+    printf("          -L A:N  IO latency, IN and OUT to IO address A wait N cycles, A-B:N for\n");
+    printf("                a range of addresses, the CPU is stalled as by clock_enable\n");
+    printf("          -q N  cycles each core runs between IO exchanges with --system,\n");
+    printf("                defaults to %d\n",DEFAULT_QUANTUM);
+    printf("          -t N  threads used with --system, defaults to one per processor\n");
+    printf("       A system file lists one core per line in the form 'image [S] [D]', S is the\n");
+    printf("       memory size when assembling and D the call stack depth, the cores share IO memory\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char *endStrol;
+    cycle_t maxCycles;
+    char *inputFile;
+    char *systemFile;
+    char *profileFile;
+    char *symbolFile;
+    char *traceFile;
+    char *snapshotFile;
+    char *extension;
+    int restored;
+    cycle_t quantum;
+    cycle_t bitCycles;
+    unsigned long address;
+    unsigned long last;
+    unsigned long latency;
+    cycle_t startCycle;
+    cycle_t startInstruction;
+    int threads;
+    int verbose;
+    int useJit;
+    int stop;
+    int i;
+    clock_t start;
+    double seconds;
+
+    if(argc < 2)
+    {
+        print_usage();
+        return 0;
+    }
+
+    maxCycles = 1000000000ULL;
+    stackDepth = DEFAULT_STACK_DEPTH;
+    asmMemorySize = DEFAULT_MEMORY_SIZE;
+    verbose = 0;
+    traceIO = 0;
+    useJit = 1;
+    skipLoops = 1;
+    traceLane = -1;
+    inputFile = NULL;
+    systemFile = NULL;
+    profileFile = NULL;
+    symbolFile = NULL;
+    traceFile = NULL;
+    snapshotFile = NULL;
+    quantum = DEFAULT_QUANTUM;
+    threads = 0;
+
+    /* A system file takes the place of the image */
+    i = 2;
+    if(strcmp(argv[1],"--system") == 0)
+    {
+        if(argc < 3)
+        {
+            print_usage();
+            return 0;
+        }
+        systemFile = argv[2];
+        i = 3;
+    }
+
+    for(;i<argc;i++)
+    {
+        if(strcmp(argv[i],"-c") == 0 && i+1 < argc)
+        {
+            maxCycles = strtoull(argv[++i],&endStrol,0);
+            if(*endStrol != 0)
+            {
+                print_usage();
+                return 0;
+            }
+            continue;
+        }
+        if(strcmp(argv[i],"-s") == 0 && i+1 < argc)
+        {
+            stackDepth = (int)strtol(argv[++i],&endStrol,0);
+            if(*endStrol != 0 || stackDepth < 1 || stackDepth > MAX_STACK_DEPTH)
+            {
+                print_usage();
+                return 0;
+            }
+            continue;
+        }
+        if(strcmp(argv[i],"-m") == 0 && i+1 < argc)
+        {
+            asmMemorySize = (int)strtol(argv[++i],&endStrol,0);
+            if(*endStrol != 0)
+            {
+                print_usage();
+                return 0;
+            }
+            continue;
+        }
+        if(strcmp(argv[i],"-w") == 0)
+        {
+            traceIO = 1;
+            continue;
+        }
+        if(strcmp(argv[i],"-v") == 0)
+        {
+            verbose = 1;
+            continue;
+        }
+        if(strcmp(argv[i],"-i") == 0)
+        {
+            useJit = 0;
+            continue;
+        }
+        if(strcmp(argv[i],"-f") == 0)
+        {
+            skipLoops = 0;
+            continue;
+        }
+        if(strcmp(argv[i],"-b") == 0 && i+1 < argc)
+        {
+            inputFile = argv[++i];
+            continue;
+        }
+        if(strcmp(argv[i],"-p") == 0 && i+1 < argc)
+        {
+            profileFile = argv[++i];
+            continue;
+        }
+        if(strcmp(argv[i],"-r") == 0 && i+1 < argc)
+        {
+            traceFile = argv[++i];
+            continue;
+        }
+        if(strcmp(argv[i],"-l") == 0 && i+1 < argc)
+        {
+            symbolFile = argv[++i];
+            continue;
+        }
+        if(strcmp(argv[i],"-S") == 0 && i+1 < argc)
+        {
+            snapshotFile = argv[++i];
+            continue;
+        }
+        if(strcmp(argv[i],"-u") == 0 && i+1 < argc)
+        {
+            /* IO address with an optional number of cycles per bit */
+            address = strtoul(argv[++i],&endStrol,0);
+            bitCycles = DEFAULT_UART_BIT;
+            if(*endStrol == ':')
+            {
+                bitCycles = strtoull(endStrol + 1,&endStrol,0);
+            }
+            if(*endStrol != 0 || address >= IO_MEMORY_SIZE || bitCycles < 2)
+            {
+                print_usage();
+                return 0;
+            }
+            if(!addUartRx((unsigned int)address,bitCycles))
+            {
+                return 1;
+            }
+            continue;
+        }
+        if(strcmp(argv[i],"-R") == 0 && i+1 < argc)
+        {
+            /* IO address of the acknowledge and cycles to irq going high */
+            address = strtoul(argv[++i],&endStrol,0);
+            bitCycles = 0;
+            if(*endStrol == ':')
+            {
+                bitCycles = strtoull(endStrol + 1,&endStrol,0);
+            }
+            if(*endStrol != 0 || address >= IO_MEMORY_SIZE || bitCycles < 1)
+            {
+                print_usage();
+                return 0;
+            }
+            if(!addIrqSource((unsigned int)address,bitCycles))
+            {
+                return 1;
+            }
+            continue;
+        }
+        if(strcmp(argv[i],"-P") == 0 && i+1 < argc)
+        {
+            address = strtoul(argv[++i],&endStrol,0);
+            if(*endStrol != 0 || address >= IO_MEMORY_SIZE)
+            {
+                print_usage();
+                return 0;
+            }
+            if(!addPerfCounters((unsigned int)address))
+            {
+                return 1;
+            }
+            continue;
+        }
+        if(strcmp(argv[i],"-I") == 0)
+        {
+            immediateMask = SHORT_IMMEDIATE;
+            continue;
+        }
+        if(strcmp(argv[i],"-M") == 0 && i+1 < argc)
+        {
+            stateCycles = strtoull(argv[++i],&endStrol,0) + 1;
+            if(*endStrol != 0 || stateCycles < 1 || stateCycles > 0x10000)
+            {
+                print_usage();
+                return 0;
+            }
+            continue;
+        }
+        if(strcmp(argv[i],"-L") == 0 && i+1 < argc)
+        {
+            /* A:N or A-B:N */
+            address = strtoul(argv[++i],&endStrol,0);
+            last = address;
+            if(*endStrol == '-')
+            {
+                last = strtoul(endStrol + 1,&endStrol,0);
+            }
+            latency = 0;
+            if(*endStrol == ':')
+            {
+                latency = strtoul(endStrol + 1,&endStrol,0);
+            }
+            if(*endStrol != 0 || last < address || last >= IO_MEMORY_SIZE || latency > 0x10000)
+            {
+                print_usage();
+                return 0;
+            }
+            for(;address<=last;address++)
+            {
+                ioStall[address] = (unsigned int)latency;
+            }
+            ioWaits = 1;
+            continue;
+        }
+        if(strcmp(argv[i],"-q") == 0 && i+1 < argc)
+        {
+            quantum = strtoull(argv[++i],&endStrol,0);
+            if(*endStrol != 0 || quantum == 0)
+            {
+                print_usage();
+                return 0;
+            }
+            continue;
+        }
+        if(strcmp(argv[i],"-t") == 0 && i+1 < argc)
+        {
+            threads = (int)strtol(argv[++i],&endStrol,0);
+            if(*endStrol != 0 || threads < 1 || threads > MAX_THREADS)
+            {
+                print_usage();
+                return 0;
+            }
+            continue;
+        }
+        print_usage();
+        return 0;
+    }
+
+    if((stateCycles > 1 || ioWaits) && (systemFile != NULL || inputFile != NULL || traceFile != NULL))
+    {
+        printf("Error: wait states can not be used with batch mode, --system or a trace\n");
+        return 1;
+    }
+    /* The program memory wait states of the S2 cycle of IN and OUT overlap the IO latency */
+    for(i=0;i<IO_MEMORY_SIZE && ioWaits;i++)
+    {
+        ioStall[i] = (ioStall[i] > stateCycles - 1) ? ioStall[i] - (unsigned int)(stateCycles - 1) : 0;
+    }
+    if(immediateMask && (systemFile != NULL || inputFile != NULL || traceFile != NULL))
+    {
+        printf("Error: short immediates can not be used with batch mode, --system or a trace\n");
+        return 1;
+    }
+    if(numDevices > 0 && (systemFile != NULL || inputFile != NULL))
+    {
+        printf("Error: peripherals can not be used with batch mode or --system\n");
+        return 1;
+    }
+    if(irqSource && (traceFile != NULL || profileFile != NULL))
+    {
+        printf("Error: an interrupt source can not be used with a trace or the profiler\n");
+        return 1;
+    }
+    if(systemFile != NULL)
+    {
+        return runSystem(systemFile,maxCycles,quantum,threads);
+    }
+
+    /* A snapshot takes the place of the image and the reset */
+    extension = getExtension(argv[1]);
+    restored = extensionIs(extension,"SNP");
+    if(restored)
+    {
+        if(inputFile != NULL)
+        {
+            printf("Error: a snapshot can not be used with batch mode\n");
+            return 1;
+        }
+        start = clock();
+        if(!restoreSnapshot(argv[1]))
+        {
+            return 1;
+        }
+        seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        printf("Restored %s at cycle %llu, %d words of program memory in %.0f us\n",argv[1],cycles,memorySize,seconds*1e6);
+    }
+    else
+    {
+        if(!loadImage(argv[1]))
+        {
+            return 1;
+        }
+        printf("Loaded %s, %d words of program memory\n",argv[1],memorySize);
+    }
+    if(immediateMask && memorySize > SHORT_IMMEDIATE_MEMORY)
+    {
+        printf("Error: short immediates need a memory size of %d or less\n",SHORT_IMMEDIATE_MEMORY);
+        return 1;
+    }
+    if(symbolFile != NULL && !loadSymbolFile(symbolFile))
+    {
+        return 1;
+    }
+
+    /* The profiler and the trace need every instruction to go through the interpreter */
+    if(profileFile != NULL || traceFile != NULL)
+    {
+        useJit = 0;
+        skipLoops = 0;
+    }
+    /* Interrupts are taken and the counters counted by the interpreter */
+    if(irqSource || perfCounters)
+    {
+        useJit = 0;
+        skipLoops = 0;
+    }
+
+#ifdef JIT_SUPPORTED
+    if(useJit && !jitInit())
+    {
+        printf("Executable memory not available, using the interpreter\n");
+        useJit = 0;
+    }
+#else
+    useJit = 0;
+#endif
+
+    if(inputFile != NULL)
+    {
+        return runBatch(inputFile,maxCycles,useJit);
+    }
+
+    if(!restored)
+    {
+        reset();
+    }
+    startDevices();
+    if(traceFile != NULL && !traceOpen(traceFile))
+    {
+        return 1;
+    }
+    if(profileFile != NULL && !initProfile())
+    {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+
+    startCycle = cycles;
+    startInstruction = instructions;
+    start = clock();
+    if(restored && snapshotHalted)
+    {
+        /* Nothing more can happen */
+        stop = STOP_HALT;
+    }
+    else if(profileFile != NULL)
+    {
+        stop = runProfile(maxCycles);
+    }
+    else if(numDevices > 0)
+    {
+        stop = runDevices(maxCycles,useJit);
+    }
+    else
+    {
+#ifdef JIT_SUPPORTED
+        stop = useJit ? runJit(maxCycles) : run(maxCycles);
+#else
+        stop = run(maxCycles);
+#endif
+    }
+    seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    printReport(stop,seconds,useJit,startInstruction,startCycle);
+    if(stateCycles > 1 || ioWaits)
+    {
+        printStalls(startCycle);
+    }
+    if(numDevices > 0)
+    {
+        finishDevices(stop == STOP_HALT ? maxCycles : cycles);
+    }
+    if(traceFile != NULL)
+    {
+        traceClose(traceFile);
+    }
+    if(verbose)
+    {
+        printState();
+    }
+    if(snapshotFile != NULL && !saveSnapshot(snapshotFile,stop == STOP_HALT))
+    {
+        return 1;
+    }
+    if(profileFile != NULL && !writeProfile(profileFile,verbose))
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* End of File */
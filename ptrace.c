@@ -0,0 +1,1095 @@
+/*------------------------------------------------------------------------------------------------------
+--
+-- ptrace.c
+-- Reader for binary execution traces recorded by the pumpkin-cpu simulator (psim -r)
+-- Version 1.0
+--
+--------------------------------------------------------------------------------------------------------
+--
+-- This file is part of the pumpkin-cpu Project
+-- Copyright (C) 2020 Steve Teal
+--
+-- This source file may be used and distributed without restriction provided that this copyright
+-- statement is not removed from the file and that any derivative work contains the original
+-- copyright notice and the associated disclaimer.
+--
+-- This source file is free software; you can redistribute it and/or modify it under the terms
+-- of the GNU Lesser General Public License as published by the Free Software Foundation,
+-- either version 3 of the License, or (at your option) any later version.
+--
+-- This source is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+-- without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+-- See the GNU Lesser General Public License for more details.
+--
+-- You should have received a copy of the GNU Lesser General Public License along with this
+-- source; if not, download it from http://www.gnu.org/licenses/lgpl-3.0.en.html
+--
+--------------------------------------------------------------------------------------------------------
+--
+-- The index at the end of the file gives the start cycle of each block, the block holding a cycle
+-- is found with a binary search and only the blocks that are printed are read and decompressed.
+-- If the index is missing, as it is when the simulator did not finish, the block headers are read
+-- through from the start instead.
+--
+-- With -w a capture of the core's trace FIFO is read instead. The FIFO only holds changes of
+-- program flow, the instructions run between them are rebuilt from the program image: from the
+-- address the last change went to the image is followed in sequence, BNC and BNZ fall through,
+-- until the address of the next change is reached. A gap marks lost entries, the instructions
+-- before the entry after it are not known.
+--
+------------------------------------------------------------------------------------------------------*/
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include "ptrace.h"
+
+#define DEFAULT_COUNT          (20) /* Events printed when -n is not given */
+#define MAX_MEMORY_SIZE        (4096)
+#define MAX_LINE_LENGTH        (256)
+
+/* Opcodes */
+#define I_IN     (0x9)
+#define I_OUT    (0xA)
+#define I_BR     (0xB)
+#define I_BNC    (0xC)
+#define I_BNZ    (0xD)
+#define I_CALL   (0xE)
+#define I_RETURN (0xF)
+
+typedef unsigned long long cycle_t;
+
+typedef struct
+{
+    cycle_t startCycle;
+    cycle_t offset;
+}trace_index_t;
+
+typedef struct
+{
+    int compressedSize;
+    int rawSize;
+    unsigned int events;
+    cycle_t startCycle;
+    cycle_t startInstruction;
+    unsigned int pc;
+    unsigned int a;
+    unsigned int c;
+}block_header_t;
+
+typedef struct
+{
+    unsigned int tag;
+    unsigned int opcode;
+    unsigned int pc; /* Address of the instruction */
+    unsigned int address; /* IO address of IN and OUT */
+    unsigned int a; /* State after the instruction */
+    unsigned int c;
+    unsigned int nextPC;
+    cycle_t cycle; /* Cycle the instruction started in */
+    cycle_t nextCycle;
+}event_t;
+
+typedef struct
+{
+    unsigned int kind;
+    unsigned int gap;
+    unsigned int source; /* Address of the instruction */
+    unsigned int target; /* Address of the next instruction run */
+}hw_entry_t;
+
+typedef struct
+{
+    char *name;
+    unsigned int address;
+    int order; /* Order the label was defined in */
+    cycle_t instructions; /* Instructions run under the label */
+}symbol_t;
+
+const char *mnemonics[16] = {"LOAD","STORE","ADD","SUB","OR","AND","XOR","ROR","SWAP","IN","OUT","BR","BNC","BNZ","CALL","RETURN"};
+
+FILE *traceFp;
+int memorySize;
+int numBlocks;
+trace_index_t *blockIndex;
+unsigned char compressed[TRACE_COMPRESSED_SIZE(TRACE_BLOCK_SIZE)];
+unsigned char raw[TRACE_BLOCK_SIZE];
+
+/* Hardware trace */
+unsigned int image[MAX_MEMORY_SIZE];
+int imageSize;
+hw_entry_t *hwEntries;
+int numHwEntries;
+symbol_t *symbols;
+int numSymbols;
+int labelOf[MAX_MEMORY_SIZE]; /* Index in symbols of the label enclosing each address, -1 for none */
+int labelAt[MAX_MEMORY_SIZE]; /* Index in symbols of the first label at each address, -1 for none */
+
+/*
+    Read a little endian number from a buffer
+*/
+
+cycle_t getLittleEndian(const unsigned char *p, int bytes)
+{
+    cycle_t value;
+    int i;
+
+    value = 0;
+    for(i=bytes-1;i>=0;i--)
+    {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+/*
+    Read a varint, returns the byte after it
+*/
+
+const unsigned char *getVarint(const unsigned char *p, unsigned int *value)
+{
+    int shift;
+
+    *value = 0;
+    shift = 0;
+    do
+    {
+        *value |= (unsigned int)(*p & 0x7F) << shift;
+        shift += 7;
+    }
+    while(*p++ & 0x80);
+    return p;
+}
+
+/*
+    Read a block header at the current file position, returns 0 if there is not one
+*/
+
+int readBlockHeader(block_header_t *header)
+{
+    unsigned char buffer[TRACE_BLOCK_HEADER];
+
+    if(fread(buffer,1,sizeof(buffer),traceFp) != sizeof(buffer) || memcmp(buffer,TRACE_BLOCK_MAGIC,4) != 0)
+    {
+        return 0;
+    }
+    header->compressedSize = (int)getLittleEndian(buffer + 4,4);
+    header->rawSize = (int)getLittleEndian(buffer + 8,4);
+    header->events = (unsigned int)getLittleEndian(buffer + 12,4);
+    header->startCycle = getLittleEndian(buffer + 16,8);
+    header->startInstruction = getLittleEndian(buffer + 24,8);
+    header->pc = (unsigned int)getLittleEndian(buffer + 32,2);
+    header->a = (unsigned int)getLittleEndian(buffer + 34,2);
+    header->c = buffer[36];
+
+    return header->rawSize <= TRACE_BLOCK_SIZE && header->compressedSize <= (int)sizeof(compressed);
+}
+
+/*
+    Add a block to the index
+*/
+
+int addBlock(cycle_t startCycle, cycle_t offset, int *size)
+{
+    trace_index_t *newIndex;
+
+    if(numBlocks >= *size)
+    {
+        *size = *size ? *size * 2 : 1024;
+        newIndex = (trace_index_t*)realloc(blockIndex,*size * sizeof(trace_index_t));
+        if(newIndex == NULL)
+        {
+            printf("Error: out of memory\n");
+            return 0;
+        }
+        blockIndex = newIndex;
+    }
+    blockIndex[numBlocks].startCycle = startCycle;
+    blockIndex[numBlocks].offset = offset;
+    numBlocks++;
+
+    return 1;
+}
+
+/*
+    Open a trace file and read its index, or rebuild the index from the block headers if the
+    file has none
+*/
+
+int openTrace(char *fileName)
+{
+    unsigned char buffer[TRACE_INDEX_ENTRY];
+    block_header_t header;
+    long end;
+    long offset;
+    int size;
+    int i;
+
+    traceFp = fopen(fileName,"rb");
+    if(traceFp == NULL)
+    {
+        printf("Could not open trace file %s\n",fileName);
+        return 0;
+    }
+    if(fread(buffer,1,TRACE_FILE_HEADER,traceFp) != TRACE_FILE_HEADER || memcmp(buffer,TRACE_FILE_MAGIC,4) != 0)
+    {
+        printf("Error: %s is not a trace file\n",fileName);
+        return 0;
+    }
+    if(getLittleEndian(buffer + 4,4) != TRACE_VERSION)
+    {
+        printf("Error: %s is trace version %d, version %d expected\n",fileName,(int)getLittleEndian(buffer + 4,4),TRACE_VERSION);
+        return 0;
+    }
+    memorySize = (int)getLittleEndian(buffer + 8,4);
+
+    /* Index at the end of the file */
+    size = 0;
+    numBlocks = 0;
+    fseek(traceFp,0,SEEK_END);
+    end = ftell(traceFp);
+    if(end >= TRACE_FILE_HEADER + 8)
+    {
+        fseek(traceFp,end - 8,SEEK_SET);
+        if(fread(buffer,1,8,traceFp) == 8 && memcmp(buffer + 4,TRACE_INDEX_MAGIC,4) == 0)
+        {
+            size = (int)getLittleEndian(buffer,4);
+            offset = end - 8 - (long)size * TRACE_INDEX_ENTRY;
+            blockIndex = (trace_index_t*)malloc((size + 1) * sizeof(trace_index_t));
+            if(offset >= TRACE_FILE_HEADER && blockIndex != NULL)
+            {
+                fseek(traceFp,offset,SEEK_SET);
+                for(i=0;i<size && fread(buffer,1,TRACE_INDEX_ENTRY,traceFp) == TRACE_INDEX_ENTRY;i++)
+                {
+                    blockIndex[i].startCycle = getLittleEndian(buffer,8);
+                    blockIndex[i].offset = getLittleEndian(buffer + 8,8);
+                }
+                numBlocks = i;
+                if(numBlocks == size)
+                {
+                    return 1;
+                }
+            }
+        }
+    }
+
+    /* No index, read through the block headers */
+    printf("No index in %s, reading the block headers\n",fileName);
+    numBlocks = 0;
+    size = 0;
+    offset = TRACE_FILE_HEADER;
+    fseek(traceFp,offset,SEEK_SET);
+    while(readBlockHeader(&header) && offset + TRACE_BLOCK_HEADER + header.compressedSize <= end)
+    {
+        /* A block cut short at the end of the file is left out */
+        if(!addBlock(header.startCycle,(cycle_t)offset,&size))
+        {
+            return 0;
+        }
+        offset += TRACE_BLOCK_HEADER + header.compressedSize;
+        if(fseek(traceFp,offset,SEEK_SET) != 0)
+        {
+            break;
+        }
+    }
+
+    return 1;
+}
+
+/*
+    Decompress size bytes of src to dst which has room for capacity bytes, returns the number
+    of bytes decompressed or -1 if the data is not valid
+*/
+
+int traceDecompress(const unsigned char *src, int size, unsigned char *dst, int capacity)
+{
+    const unsigned char *end;
+    int length;
+    int literals;
+    int match;
+    int offset;
+    int out;
+
+    end = src + size;
+    out = 0;
+    while(src < end)
+    {
+        literals = *src >> 4;
+        match = (*src++ & 0x0F) + TRACE_MIN_MATCH;
+        if(literals == 15)
+        {
+            do
+            {
+                if(src >= end)
+                {
+                    return -1;
+                }
+                length = *src++;
+                literals += length;
+            }
+            while(length == 255);
+        }
+        if(literals > end - src || literals > capacity - out)
+        {
+            return -1;
+        }
+        memcpy(dst + out,src,literals);
+        src += literals;
+        out += literals;
+        if(src == end)
+        {
+            /* The last sequence has no match */
+            break;
+        }
+
+        if(end - src < 2)
+        {
+            return -1;
+        }
+        offset = src[0] | (src[1] << 8);
+        src += 2;
+        if(match == 15 + TRACE_MIN_MATCH)
+        {
+            do
+            {
+                if(src >= end)
+                {
+                    return -1;
+                }
+                length = *src++;
+                match += length;
+            }
+            while(length == 255);
+        }
+        if(offset == 0 || offset > out || match > capacity - out)
+        {
+            return -1;
+        }
+        /* Byte by byte as the match may overlap itself */
+        while(match-- > 0)
+        {
+            dst[out] = dst[out - offset];
+            out++;
+        }
+    }
+
+    return out;
+}
+
+/*
+    Read and decompress a block, returns 0 on failure
+*/
+
+int readBlock(int block, block_header_t *header)
+{
+    if(fseek(traceFp,(long)blockIndex[block].offset,SEEK_SET) != 0 || !readBlockHeader(header) ||
+       fread(compressed,1,header->compressedSize,traceFp) != (size_t)header->compressedSize ||
+       traceDecompress(compressed,header->compressedSize,raw,sizeof(raw)) != header->rawSize)
+    {
+        printf("Error: block %d is not valid\n",block);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+    Return the block holding cycle, the last block starting at or before it
+*/
+
+int findBlock(cycle_t cycle)
+{
+    int low;
+    int high;
+    int middle;
+
+    low = 0;
+    high = numBlocks - 1;
+    while(low < high)
+    {
+        middle = (low + high + 1) / 2;
+        if(blockIndex[middle].startCycle <= cycle)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+/*
+    Decode the event at p, state holds the pc of the instruction and A C and the cycle before it
+    and is moved on to the next instruction. Returns the byte after the event.
+*/
+
+const unsigned char *decodeEvent(const unsigned char *p, event_t *state)
+{
+    unsigned int value;
+
+    state->tag = *p++;
+    state->opcode = state->tag >> 4;
+    state->pc = state->nextPC;
+    state->cycle = state->nextCycle;
+    state->nextPC = (state->pc + 1) & (memorySize - 1);
+    if(state->tag & TRACE_PC)
+    {
+        p = getVarint(p,&state->nextPC);
+    }
+    if(state->tag & TRACE_A)
+    {
+        /* Zigzag decode */
+        p = getVarint(p,&value);
+        state->a = (state->a + ((value & 1) ? 0x10000 - ((value + 1) >> 1) : (value >> 1))) & 0xFFFF;
+    }
+    if(state->tag & TRACE_C)
+    {
+        state->c ^= 1;
+    }
+    state->address = 0;
+    if(state->opcode == I_IN || state->opcode == I_OUT)
+    {
+        p = getVarint(p,&state->address);
+    }
+    state->nextCycle += (state->opcode < I_BR) ? 2 : 1;
+
+    return p;
+}
+
+/*
+    Set up the decode state for the start of a block
+*/
+
+void startBlock(block_header_t *header, event_t *state)
+{
+    state->nextPC = header->pc;
+    state->a = header->a;
+    state->c = header->c;
+    state->nextCycle = header->startCycle;
+}
+
+/*
+    Print count events starting with the first that starts at or after cycle, only IN and OUT
+    when ioOnly is set. Returns the number of events printed.
+*/
+
+cycle_t printEvents(cycle_t cycle, cycle_t count, int ioOnly)
+{
+    block_header_t header;
+    event_t event;
+    const unsigned char *p;
+    const unsigned char *end;
+    cycle_t printed;
+    int io;
+    int block;
+
+    printed = 0;
+    for(block=findBlock(cycle);block<numBlocks && printed<count;block++)
+    {
+        if(!readBlock(block,&header))
+        {
+            break;
+        }
+        startBlock(&header,&event);
+        p = raw;
+        end = raw + header.rawSize;
+        while(p < end && printed < count)
+        {
+            p = decodeEvent(p,&event);
+            io = (event.opcode == I_IN || event.opcode == I_OUT);
+            if(event.cycle < cycle || (ioOnly && !io))
+            {
+                continue;
+            }
+            printf("Cycle %llu: %03X %-6s A = %04X  C = %d",event.cycle,event.pc,mnemonics[event.opcode],event.a,event.c);
+            if(io)
+            {
+                printf("  %s %04X = %04X",mnemonics[event.opcode],event.address,event.a);
+            }
+            if(event.tag & TRACE_PC)
+            {
+                printf("  -> %03X",event.nextPC);
+            }
+            printf("\n");
+            printed++;
+        }
+    }
+
+    return printed;
+}
+
+/*
+    Print a summary of the trace
+*/
+
+void printSummary(char *fileName)
+{
+    block_header_t header;
+    event_t event;
+    const unsigned char *p;
+    const unsigned char *end;
+    long size;
+
+    fseek(traceFp,0,SEEK_END);
+    size = ftell(traceFp);
+    printf("Trace file    : %s, %d words of program memory\n",fileName,memorySize);
+    printf("Blocks        : %d\n",numBlocks);
+    if(numBlocks == 0 || !readBlock(numBlocks - 1,&header))
+    {
+        return;
+    }
+
+    /* The last block is decoded to find the state at the end */
+    startBlock(&header,&event);
+    p = raw;
+    end = raw + header.rawSize;
+    while(p < end)
+    {
+        p = decodeEvent(p,&event);
+    }
+
+    printf("Instructions  : %llu\n",header.startInstruction + header.events);
+    printf("Cycles        : %llu to %llu\n",blockIndex[0].startCycle,event.nextCycle);
+    printf("Final state   : A = %04X  C = %d  PC = %03X\n",event.a,event.c,event.nextPC);
+    printf("File size     : %ld bytes, %.2f bytes per instruction\n",size,
+           header.startInstruction + header.events ? (double)size / (double)(header.startInstruction + header.events) : 0.0);
+}
+
+/*
+    Load a program image created by PASM, a MEM or MIF file with lines of the form 'address : data'
+*/
+
+int loadImage(char *fileName)
+{
+    FILE *fp;
+    char line[MAX_LINE_LENGTH+1];
+    unsigned int address;
+    unsigned int data;
+    int depth;
+    int highest;
+
+    fp = fopen(fileName,"r");
+    if(fp == NULL)
+    {
+        printf("Could not open image file %s\n",fileName);
+        return 0;
+    }
+    depth = 0;
+    highest = 0;
+    while(fgets(line,sizeof(line),fp))
+    {
+        /* Depth is 'DEPTH = n;' in MIF and '#Depth=n' in MEM files */
+        if(sscanf(line,"DEPTH = %d",&depth) == 1 || sscanf(line,"#Depth=%d",&depth) == 1)
+        {
+            continue;
+        }
+        if(line[0] == '-' || line[0] == '#')
+        {
+            continue;
+        }
+        if(sscanf(line,"%x : %x",&address,&data) == 2)
+        {
+            if(address >= MAX_MEMORY_SIZE)
+            {
+                printf("Error: address %X exceeds maximum memory size\n",address);
+                fclose(fp);
+                return 0;
+            }
+            image[address] = data & 0xFFFF;
+            if((int)address >= highest)
+            {
+                highest = address + 1;
+            }
+        }
+    }
+    fclose(fp);
+
+    if(depth > highest)
+    {
+        highest = depth;
+    }
+    for(imageSize=2;imageSize<highest && imageSize<MAX_MEMORY_SIZE;imageSize*=2);
+    if(highest == 0)
+    {
+        printf("Error: %s holds no program\n",fileName);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+    Load a symbol file created by PASM, each line is 'address label' with the address in hex.
+    Lines starting with ';' or '#' are ignored.
+*/
+
+int loadSymbols(char *fileName)
+{
+    FILE *fp;
+    char line[MAX_LINE_LENGTH];
+    char *ptr;
+    char *name;
+    char *endStrol;
+    unsigned int address;
+    symbol_t *newSymbols;
+    int maxSymbols;
+    int lineNumber;
+
+    fp = fopen(fileName,"r");
+    if(fp == NULL)
+    {
+        printf("Could not open symbol file %s\n",fileName);
+        return 0;
+    }
+
+    maxSymbols = 0;
+    lineNumber = 0;
+    while(fgets(line,sizeof(line),fp))
+    {
+        lineNumber++;
+        ptr = strtok(line," \t\r\n");
+        if(ptr == NULL || *ptr == ';' || *ptr == '#')
+        {
+            continue;
+        }
+        address = (unsigned int)strtoul(ptr,&endStrol,16);
+        name = strtok(NULL," \t\r\n");
+        if(*endStrol != 0 || name == NULL || address >= MAX_MEMORY_SIZE)
+        {
+            printf("Error symbol file line %d: syntax\n",lineNumber);
+            fclose(fp);
+            return 0;
+        }
+        if(numSymbols >= maxSymbols)
+        {
+            maxSymbols = maxSymbols ? maxSymbols * 2 : 64;
+            newSymbols = (symbol_t*)realloc(symbols,maxSymbols * sizeof(symbol_t));
+            if(newSymbols == NULL)
+            {
+                printf("Error: out of memory\n");
+                fclose(fp);
+                return 0;
+            }
+            symbols = newSymbols;
+        }
+        symbols[numSymbols].name = (char*)malloc(strlen(name) + 1);
+        if(symbols[numSymbols].name == NULL)
+        {
+            printf("Error: out of memory\n");
+            fclose(fp);
+            return 0;
+        }
+        strcpy(symbols[numSymbols].name,name);
+        symbols[numSymbols].address = address;
+        symbols[numSymbols].order = numSymbols;
+        symbols[numSymbols].instructions = 0;
+        numSymbols++;
+    }
+    fclose(fp);
+
+    return 1;
+}
+
+/*
+    Order symbols by address, labels at the same address stay in the order they were defined
+*/
+
+int compareSymbols(const void *p1, const void *p2)
+{
+    const symbol_t *s1 = (const symbol_t*)p1;
+    const symbol_t *s2 = (const symbol_t*)p2;
+
+    if(s1->address != s2->address)
+    {
+        return s1->address < s2->address ? -1 : 1;
+    }
+    return s1->order - s2->order;
+}
+
+/*
+    Order symbols by instructions run, most first
+*/
+
+int compareInstructions(const void *p1, const void *p2)
+{
+    const symbol_t *s1 = (const symbol_t*)p1;
+    const symbol_t *s2 = (const symbol_t*)p2;
+
+    if(s1->instructions != s2->instructions)
+    {
+        return s1->instructions > s2->instructions ? -1 : 1;
+    }
+    return compareSymbols(p1,p2);
+}
+
+/*
+    Find the label at and the label enclosing each address, the nearest label at or below it
+*/
+
+void findLabels(void)
+{
+    int address;
+    int next;
+    int label;
+
+    qsort(symbols,numSymbols,sizeof(symbol_t),compareSymbols);
+    label = -1;
+    next = 0;
+    for(address=0;address<MAX_MEMORY_SIZE;address++)
+    {
+        labelAt[address] = -1;
+        while(next < numSymbols && symbols[next].address == (unsigned int)address)
+        {
+            /* The first of several labels at the same address names it */
+            if(labelAt[address] < 0)
+            {
+                labelAt[address] = next;
+                label = next;
+            }
+            next++;
+        }
+        labelOf[address] = label;
+    }
+}
+
+/*
+    Read a capture of the trace FIFO, hex words separated by white space. A number of more than
+    4 digits is a whole entry, first word in the high half. ';' or '#' starts a comment.
+*/
+
+int readCapture(char *fileName)
+{
+    FILE *fp;
+    char line[MAX_LINE_LENGTH];
+    char *ptr;
+    char *endStrol;
+    unsigned long value;
+    unsigned long first;
+    hw_entry_t *newEntries;
+    int maxEntries;
+    int half;
+    int lineNumber;
+
+    fp = fopen(fileName,"r");
+    if(fp == NULL)
+    {
+        printf("Could not open capture file %s\n",fileName);
+        return 0;
+    }
+
+    maxEntries = 0;
+    half = 0;
+    first = 0;
+    lineNumber = 0;
+    while(fgets(line,sizeof(line),fp))
+    {
+        lineNumber++;
+        ptr = strpbrk(line,";#");
+        if(ptr != NULL)
+        {
+            *ptr = 0;
+        }
+        for(ptr=strtok(line," \t\r\n,");ptr!=NULL;ptr=strtok(NULL," \t\r\n,"))
+        {
+            value = strtoul(ptr,&endStrol,16);
+            if(*endStrol != 0 || value > 0xFFFFFFFFul || (strlen(ptr) > 4 && half))
+            {
+                printf("Error capture file line %d: syntax\n",lineNumber);
+                fclose(fp);
+                return 0;
+            }
+            if(strlen(ptr) <= 4 && !half)
+            {
+                /* First word, the entry is complete with the second */
+                first = value;
+                half = 1;
+                continue;
+            }
+            if(strlen(ptr) <= 4)
+            {
+                value |= first << 16;
+                half = 0;
+            }
+            if(numHwEntries >= maxEntries)
+            {
+                maxEntries = maxEntries ? maxEntries * 2 : 1024;
+                newEntries = (hw_entry_t*)realloc(hwEntries,maxEntries * sizeof(hw_entry_t));
+                if(newEntries == NULL)
+                {
+                    printf("Error: out of memory\n");
+                    fclose(fp);
+                    return 0;
+                }
+                hwEntries = newEntries;
+            }
+            hwEntries[numHwEntries].kind = HW_TRACE_KIND(value >> 16);
+            hwEntries[numHwEntries].gap = ((value >> 16) & HW_TRACE_GAP) != 0;
+            hwEntries[numHwEntries].source = (value >> 16) & HW_TRACE_ADDRESS & (imageSize - 1);
+            hwEntries[numHwEntries].target = value & HW_TRACE_ADDRESS & (imageSize - 1);
+            numHwEntries++;
+        }
+    }
+    fclose(fp);
+    if(half)
+    {
+        printf("Warning: capture ends with half an entry, it is ignored\n");
+    }
+
+    return 1;
+}
+
+/*
+    Count an instruction rebuilt from the trace, print it if it is one of count starting with start
+*/
+
+void runInstruction(unsigned int address, cycle_t number, cycle_t start, cycle_t count)
+{
+    unsigned int word;
+    unsigned int opcode;
+
+    word = image[address];
+    opcode = word >> 12;
+    if(labelOf[address] >= 0)
+    {
+        symbols[labelOf[address]].instructions++;
+    }
+    if(number < start || number - start >= count)
+    {
+        return;
+    }
+    printf("%llu: %03X %-16s ",number,address,labelAt[address] >= 0 ? symbols[labelAt[address]].name : "");
+    if(opcode == I_RETURN)
+    {
+        printf("%s\n",(word & 1) ? "RETI" : mnemonics[opcode]);
+    }
+    else
+    {
+        printf("%-6s %03X\n",mnemonics[opcode],word & HW_TRACE_ADDRESS & (imageSize - 1));
+    }
+}
+
+/*
+    Rebuild the instructions run from the trace and the image. Instructions numbered start on
+    are printed, up to count of them, then the number of instructions run under each label.
+*/
+
+void decodeHwTrace(char *captureName, char *imageName, cycle_t start, cycle_t count)
+{
+    static const unsigned int kindOpcodes[4] = {I_BR,I_CALL,I_RETURN,I_CALL};
+    hw_entry_t *entry;
+    cycle_t instructions;
+    unsigned int pc;
+    unsigned int opcode;
+    int kinds[4];
+    int known;
+    int gaps;
+    int mismatches;
+    int steps;
+    int i;
+
+    memset(kinds,0,sizeof(kinds));
+    instructions = 0;
+    gaps = 0;
+    mismatches = 0;
+    /* The trace starts at reset */
+    pc = 0;
+    known = 1;
+    for(i=0;i<numHwEntries;i++)
+    {
+        entry = &hwEntries[i];
+        if(entry->gap)
+        {
+            gaps++;
+            known = 0;
+            if(instructions >= start && instructions - start < count)
+            {
+                printf("-- gap --\n");
+            }
+        }
+        if(known)
+        {
+            /* Run in sequence to the change of flow. Only BNC and BNZ can fall through, any other
+               change of flow passed was written over by the program as it ran, as a NOP is by
+               'STORE RB1' in the hello world example. */
+            for(steps=0;pc!=entry->source && steps<imageSize;steps++)
+            {
+                opcode = image[pc] >> 12;
+                if(opcode == I_BR || opcode == I_CALL || opcode == I_RETURN)
+                {
+                    mismatches++;
+                    if(instructions >= start && instructions - start < count)
+                    {
+                        printf("-- instruction at %03X does not match the image --\n",pc);
+                    }
+                }
+                runInstruction(pc,instructions++,start,count);
+                pc = (pc + 1) & (imageSize - 1);
+            }
+            if(pc != entry->source)
+            {
+                /* Wrapped all the way round, the image is not the program that was traced */
+                mismatches++;
+            }
+        }
+        kinds[entry->kind]++;
+        opcode = image[entry->source] >> 12;
+        if(entry->kind == HW_TRACE_IRQ)
+        {
+            if(instructions >= start && instructions - start < count)
+            {
+                printf("-- interrupt --\n");
+            }
+        }
+        else
+        {
+            if(opcode != kindOpcodes[entry->kind] && !(entry->kind == HW_TRACE_BRANCH && (opcode == I_BNC || opcode == I_BNZ)))
+            {
+                mismatches++;
+                if(instructions >= start && instructions - start < count)
+                {
+                    printf("-- instruction at %03X does not match the image --\n",entry->source);
+                }
+            }
+            runInstruction(entry->source,instructions++,start,count);
+        }
+        pc = entry->target;
+        known = 1;
+    }
+
+    printf("Capture       : %s, %d entries, %d gaps\n",captureName,numHwEntries,gaps);
+    printf("Image         : %s, %d words of program memory\n",imageName,imageSize);
+    printf("Instructions  : %llu\n",instructions);
+    printf("Flow changes  : %d branches, %d calls, %d returns, %d interrupts\n",
+           kinds[HW_TRACE_BRANCH],kinds[HW_TRACE_CALL],kinds[HW_TRACE_RETURN],kinds[HW_TRACE_IRQ]);
+    if(mismatches)
+    {
+        printf("Mismatches    : %d, instructions changed as the program ran or the wrong image\n",mismatches);
+    }
+    if(numSymbols == 0 || instructions == 0)
+    {
+        return;
+    }
+    qsort(symbols,numSymbols,sizeof(symbol_t),compareInstructions);
+    printf("\nInstructions  Percent  Label\n");
+    for(i=0;i<numSymbols && symbols[i].instructions;i++)
+    {
+        printf("%12llu  %6.2f%%  %s\n",symbols[i].instructions,100.0 * (double)symbols[i].instructions / (double)instructions,symbols[i].name);
+    }
+}
+
+void print_usage(void)
+{
+    printf("Usage:\n");
+    printf("       ptrace trace [options]\n\n");
+    printf("       Reads a trace recorded with psim -r, with no options a summary is printed\n");
+    printf("       Options:\n");
+    printf("          -s N  print instructions from cycle N on\n");
+    printf("          -n N  number of instructions printed, defaults to %d\n",DEFAULT_COUNT);
+    printf("          -o    print only IN and OUT instructions\n\n");
+    printf("       ptrace -w capture image [options]\n\n");
+    printf("       Rebuilds the instructions run from a capture of the core's trace FIFO and the\n");
+    printf("       program image (.mem or .mif), with no options a summary is printed\n");
+    printf("       Options:\n");
+    printf("          -y F  symbol file from PASM, instructions run under each label are printed\n");
+    printf("          -s N  print instructions from instruction N on\n");
+    printf("          -n N  number of instructions printed, defaults to %d\n",DEFAULT_COUNT);
+}
+
+int main(int argc, char *argv[])
+{
+    char *endStrol;
+    char *symbolFile;
+    cycle_t cycle;
+    cycle_t count;
+    int hardware;
+    int ioOnly;
+    int print;
+    int i;
+
+    if(argc < 2)
+    {
+        print_usage();
+        return 0;
+    }
+
+    /* A capture of the trace FIFO is followed by the image */
+    hardware = (strcmp(argv[1],"-w") == 0);
+    if(hardware && argc < 4)
+    {
+        print_usage();
+        return 0;
+    }
+
+    cycle = 0;
+    count = DEFAULT_COUNT;
+    ioOnly = 0;
+    print = 0;
+    symbolFile = NULL;
+    for(i=hardware?4:2;i<argc;i++)
+    {
+        if(strcmp(argv[i],"-s") == 0 && i+1 < argc)
+        {
+            cycle = strtoull(argv[++i],&endStrol,0);
+            if(*endStrol != 0)
+            {
+                print_usage();
+                return 0;
+            }
+            print = 1;
+            continue;
+        }
+        if(strcmp(argv[i],"-n") == 0 && i+1 < argc)
+        {
+            count = strtoull(argv[++i],&endStrol,0);
+            if(*endStrol != 0)
+            {
+                print_usage();
+                return 0;
+            }
+            print = 1;
+            continue;
+        }
+        if(strcmp(argv[i],"-y") == 0 && i+1 < argc && hardware)
+        {
+            symbolFile = argv[++i];
+            continue;
+        }
+        if(strcmp(argv[i],"-o") == 0 && !hardware)
+        {
+            ioOnly = 1;
+            print = 1;
+            continue;
+        }
+        print_usage();
+        return 0;
+    }
+
+    if(hardware)
+    {
+        if(!loadImage(argv[3]) || (symbolFile != NULL && !loadSymbols(symbolFile)) || !readCapture(argv[2]))
+        {
+            return 1;
+        }
+        findLabels();
+        decodeHwTrace(argv[2],argv[3],cycle,print ? count : 0);
+        return 0;
+    }
+
+    if(!openTrace(argv[1]))
+    {
+        return 1;
+    }
+    if(print)
+    {
+        printEvents(cycle,count,ioOnly);
+    }
+    else
+    {
+        printSummary(argv[1]);
+    }
+    fclose(traceFp);
+
+    return 0;
+}
+
+/* End of File */
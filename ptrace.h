@@ -0,0 +1,101 @@
+/*------------------------------------------------------------------------------------------------------
+--
+-- ptrace.h
+-- Binary execution trace format shared by the simulator (psim) and the trace reader (ptrace)
+--
+--------------------------------------------------------------------------------------------------------
+--
+-- This file is part of the pumpkin-cpu Project
+-- Copyright (C) 2020 Steve Teal
+--
+-- This source file may be used and distributed without restriction provided that this copyright
+-- statement is not removed from the file and that any derivative work contains the original
+-- copyright notice and the associated disclaimer.
+--
+-- This source file is free software; you can redistribute it and/or modify it under the terms
+-- of the GNU Lesser General Public License as published by the Free Software Foundation,
+-- either version 3 of the License, or (at your option) any later version.
+--
+-- This source is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+-- without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+-- See the GNU Lesser General Public License for more details.
+--
+-- You should have received a copy of the GNU Lesser General Public License along with this
+-- source; if not, download it from http://www.gnu.org/licenses/lgpl-3.0.en.html
+--
+--------------------------------------------------------------------------------------------------------
+--
+-- A trace file is a file header, a sequence of blocks and an index. All numbers are little endian.
+--
+--   File header   "PTRC", version (4 bytes), program memory size (4 bytes)
+--   Block         block header then the compressed events
+--   Index         start cycle (8 bytes) and file offset (8 bytes) of each block,
+--                 number of blocks (4 bytes), "PTIX"
+--
+-- The block header holds the state before the first event of the block so a block can be decoded
+-- on its own:
+--
+--   "PTBK", compressed size (4), raw size (4), events (4), start cycle (8),
+--   start instruction (8), pc (2), A (2), C (1), reserved (3)
+--
+-- Each event is one executed instruction, a tag byte followed by the fields the tag calls for:
+--
+--   bits 7-4   opcode
+--   bit 0      pc after the instruction follows, otherwise it is the pc of the instruction + 1
+--   bit 1      change of A follows, as a signed 16 bit difference
+--   bit 2      C was inverted
+--   IN, OUT    the IO address follows, the value is A after the instruction
+--
+-- Fields are varints, 7 bits per byte low bits first with bit 7 set on all but the last byte,
+-- the change of A is zigzag encoded first so small steps either way take a byte. The cycle of
+-- each event follows from the opcodes, the pc of the first event of a block is in its header.
+--
+-- The events of a block are compressed with a byte oriented LZ77 scheme. Each sequence is a token,
+-- literal count in the high nibble and match length - 4 in the low nibble, a value of 15 is
+-- followed by bytes of 255 and a final byte that are added to it. The literals follow, then the
+-- match offset (2 bytes) unless the literals end the block.
+--
+-- The core's trace FIFO (pumpkin.vhd with the trace generic) gives two 16 bit words for each
+-- change of program flow, ptrace -w reads them as text in hex, a 32 bit number is both words:
+--
+--   First word    kind (bits 15-14), gap (bit 13), address of the instruction (bits 11-0)
+--   Second word   address of the next instruction run (bits 11-0)
+--
+-- Gap is set on the first entry after entries were dropped or the trace was enabled.
+--
+------------------------------------------------------------------------------------------------------*/
+#ifndef PTRACE_H
+#define PTRACE_H
+
+#define TRACE_VERSION          (1)
+#define TRACE_FILE_MAGIC       "PTRC"
+#define TRACE_BLOCK_MAGIC      "PTBK"
+#define TRACE_INDEX_MAGIC      "PTIX"
+#define TRACE_FILE_HEADER      (12) /* Bytes in the file header */
+#define TRACE_BLOCK_HEADER     (40) /* Bytes in a block header */
+#define TRACE_INDEX_ENTRY      (16) /* Bytes in an index entry */
+#define TRACE_BLOCK_SIZE       (65536) /* Largest raw size of a block */
+#define TRACE_MAX_EVENT        (10) /* Largest encoded event */
+
+/* Event tag bits */
+#define TRACE_PC               (0x01)
+#define TRACE_A                (0x02)
+#define TRACE_C                (0x04)
+
+/* Hardware trace */
+#define HW_TRACE_KIND(w)       (((w) >> 14) & 3)
+#define HW_TRACE_GAP           (0x2000)
+#define HW_TRACE_ADDRESS       (0x0FFF)
+#define HW_TRACE_BRANCH        (0) /* BR, BNC or BNZ taken */
+#define HW_TRACE_CALL          (1)
+#define HW_TRACE_RETURN        (2) /* RETURN or RETI */
+#define HW_TRACE_IRQ           (3) /* Instruction replaced by a CALL to the interrupt vector */
+
+/* Compression */
+#define TRACE_MIN_MATCH        (4)
+#define TRACE_MAX_OFFSET       (65535)
+#define TRACE_COMPRESSED_SIZE(n) ((n) + (n) / 255 + 16) /* Worst case compressed size of n bytes */
+
+#endif
+
+/* End of File */
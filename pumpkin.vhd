@@ -61,6 +61,78 @@
 --  | 0xF   | RETURN    | 1    | RETURN from subroutine     |
 --  +-------+-----------+------+----------------------------+
 --
+--  RETI, RETURN with bit 0 set, returns from an interrupt and restores the carry flag.
+--
+--  While irq is high and no interrupt is being handled the instruction decoded in S1 is replaced
+--  by a CALL to the interrupt vector, address 1. The address of the replaced instruction is
+--  pushed onto the call stack and C is saved, RETI returns to it and restores C. Further
+--  interrupts are held off until RETI. The vector is read in the first S1 cycle with irq high,
+--  the cycle irq goes high or the one after when the core is in S2, the pipelined core is always
+--  in S1. irq must be synchronous to clock.
+--
+--  With the pipelined generic set every instruction takes 1 cycle. The operand of an instruction
+--  is read on a second program memory port (operand_address, operand_data_in) while the next
+--  instruction is fetched, the instruction is completed in the following cycle as the next one
+--  is decoded. A and C are forwarded from the instruction being completed to the branch decisions
+--  and to data_out. A STORE writes on the program port with program_wr, in that cycle the next
+--  instruction is fetched on the operand port, and if the STORE writes the word being fetched the
+--  stored value is used in place of the word read.
+--
+--  With the short_immediate generic set bit 11 of LOAD, ADD, SUB, OR, AND, XOR, ROR and SWAP
+--  selects a short immediate, the operand is bits 10 to 0 zero extended in place of M(X). This
+--  needs program_size of 11 or less so that bit 11 is not an address bit. The operand is not
+--  read from memory, the instruction takes 1 cycle.
+--
+--   15    14    13    12    11    10    9     8     7     6     5     4     3     2     1     0
+--  +-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+
+--  |        Op-Code        |  1  |                       Immediate value                           |
+--  +-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+
+--
+--  With the counters generic set the core counts events in 32 bit counters read by IN from IO
+--  addresses counter_address to counter_address+9, low half first. Reading the low half holds
+--  the high half of the same counter for the next read. IN from these addresses returns the
+--  counter in place of io_data_in, OUT to counter_address clears the counters. io_rd and io_wr
+--  are still driven so peripherals must not use these addresses.
+--
+--  +------+----------------------------------------------------------------+
+--  |Offset|Counter                                                         |
+--  +------+----------------------------------------------------------------+
+--  | 0, 1 | Cycles out of reset, including cycles with clock_enable low    |
+--  | 2, 3 | Instructions decoded, interrupts not counted                   |
+--  | 4, 5 | Branches taken, BR, CALL, RETURN and BNC, BNZ taken            |
+--  | 6, 7 | Cycles with clock_enable low                                   |
+--  | 8, 9 | Most entries on the call stack, interrupts included            |
+--  +------+----------------------------------------------------------------+
+--
+--  With the trace generic set each change of program flow, a taken branch, CALL, RETURN or
+--  interrupt, is written to a FIFO of 2**trace_size entries as the address of the instruction
+--  and the address it goes to. Instructions run in sequence between them are not written, they
+--  follow from the program image. The FIFO is drained either by IN from IO addresses
+--  trace_address to trace_address+2 or on trace_data with trace_valid and trace_ready. When the
+--  FIFO is full entries are dropped and the next entry written is marked as following a gap.
+--
+--  +------+----------------------------------------------------------------+
+--  |Offset|IN                                                              |
+--  +------+----------------------------------------------------------------+
+--  | 0    | Bit 15 trace enabled, bits 14 to 0 entries in the FIFO         |
+--  | 1    | First word of the oldest entry                                 |
+--  | 2    | Second word of the oldest entry, removes it from the FIFO      |
+--  +------+----------------------------------------------------------------+
+--
+--  OUT to trace_address enables the trace when bit 0 of A is set and stops it when clear, the
+--  trace is enabled out of reset. The first entry after the trace is enabled is marked as
+--  following a gap.
+--
+--   15    14    13    12    11    10    9     8     7     6     5     4     3     2     1     0
+--  +-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+
+--  |   Kind    | Gap |  0  |                 Address of the instruction                            |
+--  +-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+
+--  |  0  |  0  |  0  |  0  |                 Address of the next instruction run                   |
+--  +-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+-----+
+--
+--  Kind is 0 for BR, BNC and BNZ, 1 for CALL, 2 for RETURN and RETI and 3 for an interrupt, where
+--  the address is that of the instruction replaced and the next address is the vector.
+--
 ----------------------------------------------------------------------------------------------------------
 
 library ieee;
@@ -70,7 +142,14 @@ use ieee.numeric_std.all;
 entity pumpkin is
 	generic(
 		stack_depth     : integer := 4;
-		program_size    : integer := 12);
+		program_size    : integer := 12;
+		pipelined       : boolean := false;
+		short_immediate : boolean := false;
+		counters        : boolean := false;
+		counter_address : integer := 16#FFF0#;
+		trace           : boolean := false;
+		trace_size      : integer := 5;
+		trace_address   : integer := 16#FFE0#);
 	port (
 		clock 			 : in std_logic;
 		clock_enable	 : in std_logic;
@@ -82,7 +161,15 @@ entity pumpkin is
 		io_data_in      : in std_logic_vector(15 downto 0);
 		io_address      : out std_logic_vector(15 downto 0);
 		io_rd           : out std_logic;
-		io_wr           : out std_logic);
+		io_wr           : out std_logic;
+		irq             : in std_logic := '0';
+		-- Trace FIFO read by external logic, used with the trace generic
+		trace_data      : out std_logic_vector(31 downto 0);
+		trace_valid     : out std_logic;
+		trace_ready     : in std_logic := '0';
+		-- Second, read only, program memory port used when pipelined
+		operand_data_in : in std_logic_vector(15 downto 0) := (others=>'0');
+		operand_address : out std_logic_vector(program_size-1 downto 0));
 end entity;
 
 architecture rtl of pumpkin is
@@ -105,6 +192,74 @@ architecture rtl of pumpkin is
 	signal next_pc  : std_logic_vector(program_size-1 downto 0); 
 	
 	signal program_address_buffer : std_logic_vector(program_size-1 downto 0);
+	signal operand_address_buffer : std_logic_vector(program_size-1 downto 0);
+	signal fetch_address          : std_logic_vector(program_size-1 downto 0);
+	
+	signal fetched     : std_logic_vector(15 downto 0); -- Instruction word read from program memory
+	signal instruction : std_logic_vector(15 downto 0); -- Instruction word decoded in S1
+	signal operand     : std_logic_vector(15 downto 0); -- M(X) of the instruction completed by the ALU
+	signal alu_enable  : std_logic;                     -- ALU completes the instruction in ir
+	signal alu_op      : std_logic_vector(3 downto 0);  -- Op-code of the instruction the ALU completes
+	signal alu_a       : std_logic_vector(15 downto 0);
+	signal alu_c       : std_logic;
+	signal a_next      : std_logic_vector(15 downto 0); -- A and C once this cycle's ALU result is in
+	signal c_next      : std_logic;
+	
+	-- Pipelined
+	signal ex_valid    : std_logic;                     -- ir holds an instruction to complete
+	signal fetch_b     : std_logic;                     -- Instruction was fetched on the operand port
+	signal bypass      : std_logic;                     -- Instruction was written as it was fetched
+	signal bypass_data : std_logic_vector(15 downto 0);
+	signal ex_imm      : std_logic;                     -- ir has a short immediate operand
+	signal ex_data     : std_logic_vector(15 downto 0);
+	
+	-- Short immediate
+	signal immediate      : std_logic;                     -- Instruction decoded in S1 has a short immediate
+	signal immediate_data : std_logic_vector(15 downto 0);
+	
+	-- Interrupt
+	signal take_irq  : std_logic;                          -- Instruction in S1 replaced by a CALL to the vector
+	signal reti      : std_logic;                          -- RETI decoded in S1
+	signal in_irq    : std_logic;                          -- Interrupt being handled, held off until RETI
+	signal saved_c   : std_logic;
+	signal return_pc : std_logic_vector(program_size-1 downto 0); -- Address pushed by CALL or interrupt
+	
+	-- Performance counters
+	signal io_address_buffer : std_logic_vector(15 downto 0);
+	signal in_data           : std_logic_vector(15 downto 0); -- Value read by IN
+	signal counter_hit       : std_logic;                     -- IN reads a counter
+	signal counter_in        : std_logic_vector(15 downto 0);
+	signal counter_offset    : unsigned(15 downto 0);         -- IO address from counter_address
+	signal counter_value     : unsigned(31 downto 0);         -- Counter selected by IO address
+	signal counter_high      : unsigned(15 downto 0);         -- High half held by reading the low half
+	signal perf_cycles       : unsigned(31 downto 0);
+	signal perf_instructions : unsigned(31 downto 0);
+	signal perf_branches     : unsigned(31 downto 0);
+	signal perf_stalls       : unsigned(31 downto 0);
+	signal perf_depth        : unsigned(15 downto 0);         -- Entries on the call stack
+	signal perf_depth_max    : unsigned(15 downto 0);
+	signal perf_clear        : std_logic;                     -- OUT to counter_address
+	signal perf_step         : std_logic;                     -- Instruction counted this cycle
+	signal perf_taken        : std_logic;                     -- Branch taken this cycle
+	
+	-- Trace
+	type trace_buffer_type is array(0 to 2**trace_size-1) of std_logic_vector(31 downto 0);
+	signal trace_buffer    : trace_buffer_type;
+	signal trace_hit       : std_logic;                           -- IN reads the trace FIFO
+	signal trace_in        : std_logic_vector(15 downto 0);
+	signal trace_offset    : unsigned(15 downto 0);               -- IO address from trace_address
+	signal trace_head      : std_logic_vector(31 downto 0);       -- Oldest entry
+	signal trace_entry     : std_logic_vector(31 downto 0);       -- Entry for the instruction in S1
+	signal trace_kind      : std_logic_vector(1 downto 0);
+	signal trace_target    : std_logic_vector(program_size-1 downto 0);
+	signal trace_push      : std_logic;                           -- Instruction in S1 changes program flow
+	signal trace_write     : std_logic;
+	signal trace_pop       : std_logic;
+	signal trace_enable    : std_logic;
+	signal trace_lost      : std_logic;                           -- Entries dropped or trace enabled since the last entry
+	signal trace_write_ptr : unsigned(trace_size-1 downto 0);
+	signal trace_read_ptr  : unsigned(trace_size-1 downto 0);
+	signal trace_count     : unsigned(trace_size downto 0);
 	
 	constant I_LOAD   : std_logic_vector(3 downto 0) := "0000";
 	constant I_STORE  : std_logic_vector(3 downto 0) := "0001";
@@ -123,40 +278,124 @@ architecture rtl of pumpkin is
 	constant I_CALL   : std_logic_vector(3 downto 0) := "1110";
 	constant I_RETURN : std_logic_vector(3 downto 0) := "1111";
 	
+	constant IRQ_VECTOR : integer := 1;
+	constant COUNTER_ADDRESSES : integer := 10;
+	constant TRACE_ADDRESSES   : integer := 3;
+	constant TRACE_BRANCH      : std_logic_vector(1 downto 0) := "00";
+	constant TRACE_CALL        : std_logic_vector(1 downto 0) := "01";
+	constant TRACE_RETURN      : std_logic_vector(1 downto 0) := "10";
+	constant TRACE_IRQ         : std_logic_vector(1 downto 0) := "11";
+	
 begin
 
+	assert not short_immediate or program_size <= 11
+		report "short_immediate needs program_size of 11 or less" severity failure;
+	assert not trace or (trace_size >= 1 and trace_size <= 14)
+		report "trace_size must be 1 to 14" severity failure;
+
 	program_address <= program_address_buffer;
-	data_out <= a;
-	io_address <= program_data_in;
+	operand_address <= operand_address_buffer;
+	io_address <= io_address_buffer;
+	
+	--
+	-- Instruction and operand sources
+	--
+	
+	single: if not pipelined generate
+		fetched <= program_data_in;
+		operand <= immediate_data when immediate = '1' else program_data_in;
+		alu_op <= instruction(15 downto 12) when immediate = '1' else ir;
+		alu_enable <= '1' when state = S2 or immediate = '1' else '0';
+		data_out <= a;
+		io_address_buffer <= program_data_in;
+	end generate;
+	
+	pipe: if pipelined generate
+		fetched <= bypass_data when bypass = '1' else
+		           operand_data_in when fetch_b = '1' else
+		           program_data_in;
+		operand <= ex_data when ex_imm = '1' else operand_data_in;
+		alu_op <= ir;
+		alu_enable <= ex_valid;
+		data_out <= a_next;
+		io_address_buffer <= operand_data_in;
+	end generate;
+	
+	--
+	-- Interrupt, taken in place of the instruction fetched
+	--
+	
+	take_irq <= '1' when irq = '1' and in_irq = '0' and state = S1 else '0';
+	instruction <= I_CALL & std_logic_vector(to_unsigned(IRQ_VECTOR,12)) when take_irq = '1' else fetched;
+	reti <= '1' when state = S1 and instruction(15 downto 12) = I_RETURN and instruction(0) = '1' else '0';
+	return_pc <= std_logic_vector(unsigned(pc) - 1) when take_irq = '1' else pc;
+	
+	process(clock)
+	begin
+		if rising_edge(clock) then
+			if reset = '1' then
+				in_irq <= '0';
+			elsif clock_enable = '1' then
+				if take_irq = '1' then
+					in_irq <= '1';
+					saved_c <= c_next;
+				elsif reti = '1' then
+					in_irq <= '0';
+				end if;
+			end if;
+		end if;
+	end process;
+	
+	--
+	-- Short immediate, decoded in S1
+	--
+	
+	immediate <= '1' when short_immediate and state = S1 and instruction(11) = '1' and
+	                      (instruction(15 downto 12) = I_LOAD or
+	                       (unsigned(instruction(15 downto 12)) >= unsigned(I_ADD) and
+	                        unsigned(instruction(15 downto 12)) <= unsigned(I_SWAP))) else '0';
+	immediate_data <= "00000" & instruction(10 downto 0);
 	
 	--
 	-- RAM address source 
 	--
 	
-	process(state,program_data_in,callstack(0),pc,a,c)
+	process(state,instruction,callstack(0),pc,a_next,c_next,immediate)
 	begin
+		operand_address_buffer <= instruction(program_size-1 downto 0);
 		case state is
 			when S0 =>
 				program_address_buffer <= (others=>'0');
 			when S1 =>
-				case program_data_in(15 downto 12) is
+				case instruction(15 downto 12) is
 					when I_RETURN =>
 						program_address_buffer <= callstack(0);
 					when I_BNZ =>
-						if a = X"0000" then		
+						if a_next = X"0000" then		
 							program_address_buffer <= pc; 
 						else
-							program_address_buffer <= program_data_in(program_size-1 downto 0);							
+							program_address_buffer <= instruction(program_size-1 downto 0);							
 						end if;
 					when I_BNC =>
-						if c = '1' then
+						if c_next = '1' then
 							program_address_buffer <= pc;
 						else
-							program_address_buffer <= program_data_in(program_size-1 downto 0);							
+							program_address_buffer <= instruction(program_size-1 downto 0);							
 						end if;
+					when I_BR|I_CALL|I_STORE =>
+						program_address_buffer <= instruction(program_size-1 downto 0);
 					when others =>
-						program_address_buffer <= program_data_in(program_size-1 downto 0);
+						if pipelined or immediate = '1' then
+							-- Operand read on the operand port or in the instruction, next instruction fetched
+							program_address_buffer <= pc;
+						else
+							program_address_buffer <= instruction(program_size-1 downto 0);
+						end if;
 				end case;
+				if pipelined and instruction(15 downto 12) = I_STORE then
+					-- Program port is writing, next instruction fetched on the operand port
+					operand_address_buffer <= pc;
+				end if;
 			when S2 =>
 				program_address_buffer <= pc;
 		end case;
@@ -170,13 +409,13 @@ begin
 	begin
 		if rising_edge(clock) then
 			if clock_enable = '1' and state = S1 then
-				case program_data_in(15 downto 12) is
+				case instruction(15 downto 12) is
 					when I_RETURN =>
 						for i in 1 to stack_depth-1 loop
 							callstack(i-1) <= callstack(i);
 						end loop;
 					when I_CALL =>
-						callstack(0) <= pc;
+						callstack(0) <= return_pc;
 						for i in 1 to stack_depth-1 loop
 							callstack(i) <= callstack(i-1);
 						end loop;
@@ -191,53 +430,106 @@ begin
 	-- State machine and Program Counter
 	--
 	
-	next_pc <= std_logic_vector(unsigned(program_address_buffer) + 1);
+	fetch_address <= operand_address_buffer when pipelined and state = S1 and instruction(15 downto 12) = I_STORE else
+	                 program_address_buffer;
+	next_pc <= std_logic_vector(unsigned(fetch_address) + 1);
 	
-	process(clock)
-	begin
-		if rising_edge(clock) then
-			if reset = '1' then
-				state <= S0;
-			elsif clock_enable = '1' then
-				case state is
-					when S0 =>
-						state <= S1;
-						pc <= next_pc;
-					when S1 =>
-						case program_data_in(15 downto 12) is
+	single_state: if not pipelined generate
+		process(clock)
+		begin
+			if rising_edge(clock) then
+				if reset = '1' then
+					state <= S0;
+				elsif clock_enable = '1' then
+					case state is
+						when S0 =>
+							state <= S1;
+							pc <= next_pc;
+						when S1 =>
+							case instruction(15 downto 12) is
+								when I_BR|I_BNC|I_BNZ|I_CALL|I_RETURN =>
+									state <= S1;
+									pc <= next_pc;
+								when others =>
+									if immediate = '1' then
+										-- Completed by the ALU in this state
+										state <= S1;
+										pc <= next_pc;
+									else
+										ir <= instruction(15 downto 12);
+										state <= S2;
+									end if;
+							end case;
+						when S2 =>
+							state <= S1;
+							pc <= next_pc;
+					end case;
+				end if;
+			end if;
+		end process;
+	end generate;
+	
+	--
+	-- Pipelined, an instruction is decoded in S1 every cycle while the one before it is completed
+	--
+	
+	pipe_state: if pipelined generate
+		process(clock)
+		begin
+			if rising_edge(clock) then
+				if reset = '1' then
+					state <= S0;
+					ex_valid <= '0';
+					ex_imm <= '0';
+					fetch_b <= '0';
+					bypass <= '0';
+				elsif clock_enable = '1' then
+					state <= S1;
+					pc <= next_pc;
+					ex_valid <= '0';
+					fetch_b <= '0';
+					bypass <= '0';
+					if state = S1 then
+						case instruction(15 downto 12) is
 							when I_BR|I_BNC|I_BNZ|I_CALL|I_RETURN =>
-								state <= S1;
-								pc <= next_pc;
+								null;
+							when I_STORE =>
+								fetch_b <= '1';
+								-- Writing the word being fetched, the read returns the old word
+								if instruction(program_size-1 downto 0) = pc then
+									bypass <= '1';
+									bypass_data <= a_next;
+								end if;
 							when others =>
-								ir <= program_data_in(15 downto 12);
-								state <= S2;
+								ir <= instruction(15 downto 12);
+								ex_valid <= '1';
+								ex_imm <= immediate;
+								ex_data <= immediate_data;
 						end case;
-					when S2 =>
-						state <= S1;
-						pc <= next_pc;
-				end case;
+					end if;
+				end if;
 			end if;
-		end if;
-	end process;
+		end process;
+	end generate;
 	
 	--
 	-- Memory control
 	--
 	
-	program_wr <= '1' when clock_enable = '1' and state = S1 and program_data_in(15 downto 12) = I_STORE else '0';
+	program_wr <= '1' when clock_enable = '1' and state = S1 and instruction(15 downto 12) = I_STORE else '0';
 	
 	process(clock)
 	begin
 		if rising_edge(clock) then
 			if clock_enable = '1' then
 				-- IO Write (OUT)
-				if state = S1 and program_data_in(15 downto 12) = I_OUT then
+				if state = S1 and instruction(15 downto 12) = I_OUT then
 					io_wr <= '1';
 				else
 					io_wr <= '0';
 				end if;
 				-- IO Read (IN)
-				if state = S1 and program_data_in(15 downto 12) = I_IN then
+				if state = S1 and instruction(15 downto 12) = I_IN then
 					io_rd <= '1';
 				else
 					io_rd <= '0';
@@ -250,31 +542,48 @@ begin
 	-- ALU
 	--
 	
+	process(alu_op,a,c,operand,adder,in_data)
+	begin
+		alu_a <= a;
+		alu_c <= c;
+		case alu_op is
+			when I_LOAD =>
+				alu_a <= operand;
+			when I_ADD|I_SUB =>
+				alu_a <= std_logic_vector(adder(15 downto 0));
+				alu_c <= adder(16);
+			when I_OR =>
+				alu_a <= a or operand;
+			when I_AND =>
+				alu_a <= a and operand;
+			when I_XOR =>
+				alu_a <= a xor operand;
+			when I_ROR =>
+				alu_a <= c & operand(15 downto 1);
+				alu_c <= operand(0);
+			when I_SWAP =>
+				alu_a <= operand(7 downto 0) & operand(15 downto 8);
+			when I_IN =>
+				alu_a <= in_data;
+			when others => null;
+		end case;
+	end process;
+	
+	a_next <= alu_a when alu_enable = '1' else a;
+	c_next <= alu_c when alu_enable = '1' else c;
+	
 	process(clock)
 	begin
 		if rising_edge(clock) then
-			if clock_enable = '1' and state = S2 then
-				case ir is
-					when I_LOAD =>
-						a <= program_data_in;
-					when I_ADD|I_SUB =>
-						a <= std_logic_vector(adder(15 downto 0));
-						c <= adder(16);
-					when I_OR =>
-						a <= a or program_data_in;
-					when I_AND =>
-						a <= a and program_data_in;
-					when I_XOR =>
-						a <= a xor program_data_in;
-					when I_ROR =>
-						a <= c & program_data_in(15 downto 1);
-						c <= program_data_in(0);
-					when I_SWAP =>
-						a <= program_data_in(7 downto 0) & program_data_in(15 downto 8);
-					when I_IN =>
-						a <= io_data_in;
-					when others => null;
-				end case;
+			if clock_enable = '1' then
+				if alu_enable = '1' then
+					a <= alu_a;
+					c <= alu_c;
+				end if;
+				-- RETI follows the instruction completed
+				if reti = '1' then
+					c <= saved_c;
+				end if;
 			end if;
 		end if;
 	end process;
@@ -284,11 +593,211 @@ begin
 	--
 	
 	adder_a <= unsigned('0' & a);
-	adder_b <= unsigned('0' & not program_data_in) when ir = I_SUB else unsigned('0' & program_data_in);
-	carry_in <= '1' when ir = I_SUB else '0';
+	adder_b <= unsigned('0' & not operand) when alu_op = I_SUB else unsigned('0' & operand);
+	carry_in <= '1' when alu_op = I_SUB else '0';
 	adder <= adder_a + adder_b + ((16 downto 1 => '0') & carry_in);
+	
+	--
+	-- Performance counters and trace, read by IN in place of io_data_in
+	--
+	
+	in_data <= counter_in when counter_hit = '1' else
+	           trace_in when trace_hit = '1' else
+	           io_data_in;
+	
+	no_perf: if not counters generate
+		counter_hit <= '0';
+		counter_in <= (others=>'0');
+	end generate;
+	
+	perf: if counters generate
+		counter_offset <= unsigned(io_address_buffer) - to_unsigned(counter_address,16);
+		
+		with to_integer(counter_offset(15 downto 1)) select counter_value <=
+			perf_cycles when 0,
+			perf_instructions when 1,
+			perf_branches when 2,
+			perf_stalls when 3,
+			X"0000" & perf_depth_max when 4,
+			(others=>'0') when others;
+		
+		counter_hit <= '1' when counter_offset < COUNTER_ADDRESSES else '0';
+		counter_in <= std_logic_vector(counter_value(15 downto 0)) when counter_offset(0) = '0' else
+		              std_logic_vector(counter_high);
+		
+		perf_clear <= '1' when clock_enable = '1' and alu_enable = '1' and counter_hit = '1' and
+		                       alu_op = I_OUT and counter_offset = 0 else '0';
+		perf_step <= '1' when clock_enable = '1' and state = S1 and take_irq = '0' else '0';
+		
+		process(perf_step,instruction,c_next,a_next)
+		begin
+			perf_taken <= '0';
+			if perf_step = '1' then
+				case instruction(15 downto 12) is
+					when I_BR|I_CALL|I_RETURN =>
+						perf_taken <= '1';
+					when I_BNC =>
+						perf_taken <= not c_next;
+					when I_BNZ =>
+						if a_next /= X"0000" then
+							perf_taken <= '1';
+						end if;
+					when others =>
+						null;
+				end case;
+			end if;
+		end process;
+		
+		process(clock)
+		begin
+			if rising_edge(clock) then
+				if reset = '1' then
+					perf_cycles <= (others=>'0');
+					perf_instructions <= (others=>'0');
+					perf_branches <= (others=>'0');
+					perf_stalls <= (others=>'0');
+					perf_depth <= (others=>'0');
+					perf_depth_max <= (others=>'0');
+				elsif perf_clear = '1' then
+					-- The pipelined core clears in the S1 of the next instruction, it is counted
+					perf_cycles <= (0=>perf_step, others=>'0');
+					perf_instructions <= (0=>perf_step, others=>'0');
+					perf_branches <= (0=>perf_taken, others=>'0');
+					perf_stalls <= (others=>'0');
+					perf_depth_max <= perf_depth;
+				else
+					perf_cycles <= perf_cycles + 1;
+					if clock_enable = '0' then
+						perf_stalls <= perf_stalls + 1;
+					end if;
+					if perf_step = '1' then
+						perf_instructions <= perf_instructions + 1;
+					end if;
+					if perf_taken = '1' then
+						perf_branches <= perf_branches + 1;
+					end if;
+				end if;
+				if reset = '0' and clock_enable = '1' and state = S1 then
+					if instruction(15 downto 12) = I_CALL then
+						perf_depth <= perf_depth + 1;
+						if perf_depth = perf_depth_max or perf_clear = '1' then
+							perf_depth_max <= perf_depth + 1;
+						end if;
+					elsif instruction(15 downto 12) = I_RETURN and perf_depth /= 0 then
+						perf_depth <= perf_depth - 1;
+					end if;
+				end if;
+				-- IN of a low half holds the high half
+				if clock_enable = '1' and alu_enable = '1' and counter_hit = '1' and alu_op = I_IN and counter_offset(0) = '0' then
+					counter_high <= counter_value(31 downto 16);
+				end if;
+			end if;
+		end process;
+	end generate;
+	
+	no_trace: if not trace generate
+		trace_hit <= '0';
+		trace_in <= (others=>'0');
+		trace_data <= (others=>'0');
+		trace_valid <= '0';
+	end generate;
+	
+	trace_fifo: if trace generate
+		trace_offset <= unsigned(io_address_buffer) - to_unsigned(trace_address,16);
+		trace_hit <= '1' when trace_offset < TRACE_ADDRESSES else '0';
+		trace_head <= trace_buffer(to_integer(trace_read_ptr));
+		
+		with to_integer(trace_offset(1 downto 0)) select trace_in <=
+			trace_enable & std_logic_vector(resize(trace_count,15)) when 0,
+			trace_head(31 downto 16) when 1,
+			trace_head(15 downto 0) when others;
+		
+		trace_data <= trace_head;
+		trace_valid <= '1' when trace_count /= 0 else '0';
+		
+		-- Change of program flow by the instruction in S1
+		process(state,take_irq,instruction,a_next,c_next,callstack(0))
+		begin
+			trace_push <= '0';
+			trace_kind <= TRACE_BRANCH;
+			trace_target <= instruction(program_size-1 downto 0);
+			if state = S1 then
+				if take_irq = '1' then
+					-- Instruction is the CALL to the vector
+					trace_push <= '1';
+					trace_kind <= TRACE_IRQ;
+				else
+					case instruction(15 downto 12) is
+						when I_BR =>
+							trace_push <= '1';
+						when I_BNC =>
+							trace_push <= not c_next;
+						when I_BNZ =>
+							if a_next /= X"0000" then
+								trace_push <= '1';
+							end if;
+						when I_CALL =>
+							trace_push <= '1';
+							trace_kind <= TRACE_CALL;
+						when I_RETURN =>
+							trace_push <= '1';
+							trace_kind <= TRACE_RETURN;
+							trace_target <= callstack(0);
+						when others =>
+							null;
+					end case;
+				end if;
+			end if;
+		end process;
+		
+		trace_entry <= trace_kind & trace_lost & '0' & std_logic_vector(resize(unsigned(pc) - 1,12)) &
+		               "0000" & std_logic_vector(resize(unsigned(trace_target),12));
+		
+		-- IN of the second word or the external reader takes the oldest entry
+		trace_pop <= '1' when trace_count /= 0 and
+		                      (trace_ready = '1' or
+		                       (clock_enable = '1' and alu_enable = '1' and alu_op = I_IN and trace_offset = 2)) else '0';
+		trace_write <= '1' when clock_enable = '1' and trace_push = '1' and trace_enable = '1' and
+		                        (trace_count /= 2**trace_size or trace_pop = '1') else '0';
+		
+		process(clock)
+		begin
+			if rising_edge(clock) then
+				if reset = '1' then
+					trace_write_ptr <= (others=>'0');
+					trace_read_ptr <= (others=>'0');
+					trace_count <= (others=>'0');
+					trace_enable <= '1';
+					trace_lost <= '0';
+				else
+					if trace_write = '1' then
+						trace_buffer(to_integer(trace_write_ptr)) <= trace_entry;
+						trace_write_ptr <= trace_write_ptr + 1;
+						trace_lost <= '0';
+					elsif clock_enable = '1' and trace_push = '1' and trace_enable = '1' then
+						-- FIFO full
+						trace_lost <= '1';
+					end if;
+					if trace_pop = '1' then
+						trace_read_ptr <= trace_read_ptr + 1;
+					end if;
+					if trace_write = '1' and trace_pop = '0' then
+						trace_count <= trace_count + 1;
+					elsif trace_write = '0' and trace_pop = '1' then
+						trace_count <= trace_count - 1;
+					end if;
+					-- OUT to trace_address starts or stops the trace
+					if clock_enable = '1' and alu_enable = '1' and alu_op = I_OUT and trace_offset = 0 then
+						trace_enable <= a(0);
+						if trace_enable = '0' and a(0) = '1' then
+							trace_lost <= '1';
+						end if;
+					end if;
+				end if;
+			end if;
+		end process;
+	end generate;
 						
 end rtl;
 
 -- End of file
-
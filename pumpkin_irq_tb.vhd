@@ -0,0 +1,301 @@
+---------------------------------------------------------------------------------------------------
+--
+-- pumpkin_irq_tb.vhd
+--
+-- Testbench measuring the interrupt latency of the pumpkin-cpu
+--
+-- The core runs irq_test.mem, a main program that keeps a 32 bit count using the carry flag and
+-- an interrupt handler that changes A and C. irq is raised, held until the handler writes IO
+-- address 0, then raised again after a gap that changes every time so that interrupts arrive in
+-- every state of every instruction of the main program. The latency of each interrupt is the
+-- number of cycles from the cycle irq goes high to the cycle the vector is read, counting both.
+-- Once the program writes its results the count is checked, showing A and C were kept, and the
+-- number of interrupts and the shortest and longest latency are reported. The test fails if a
+-- latency is longer than max_latency, 2 cycles for the standard core and 1 when pipelined.
+--
+-- GHDL:
+--   pasm irq_example/irq_test.asm 2048 irq_test.mem
+--   ghdl -a pumpkin.vhd pumpkin_irq_tb.vhd
+--   ghdl -e pumpkin_irq_tb
+--   ghdl -r pumpkin_irq_tb
+--   ghdl -r pumpkin_irq_tb -gpipelined=true -gmax_latency=1
+--
+---------------------------------------------------------------------------------------------------
+--
+-- This file is part of the pumpkin-cpu Project
+-- Copyright (C) 2020 Steve Teal
+--
+-- This source file may be used and distributed without restriction provided that this copyright
+-- statement is not removed from the file and that any derivative work contains the original
+-- copyright notice and the associated disclaimer.
+--
+-- This source file is free software; you can redistribute it and/or modify it under the terms
+-- of the GNU Lesser General Public License as published by the Free Software Foundation,
+-- either version 3 of the License, or (at your option) any later version.
+--
+-- This source is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+-- without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+-- See the GNU Lesser General Public License for more details.
+--
+-- You should have received a copy of the GNU Lesser General Public License along with this
+-- source; if not, download it from http://www.gnu.org/licenses/lgpl-3.0.en.html
+--
+---------------------------------------------------------------------------------------------------
+library ieee;
+use ieee.std_logic_1164.all;
+use ieee.numeric_std.all;
+use std.textio.all;
+
+entity pumpkin_irq_tb is
+    generic(
+        program_file : string := "irq_test.mem";
+        program_size : integer := 11;        -- Address bits, 11 for PASM's default of 2048 words
+        stack_depth  : integer := 4;
+        pipelined    : boolean := false;
+        max_latency  : integer := 2;         -- Longest latency allowed in cycles
+        expected_low : integer := 16#8000#;  -- Count written by irq_test.asm, 1000 * 0x9000
+        expected_high : integer := 16#0232#;
+        max_cycles   : integer := 1000000);  -- Give up after this many cycles
+end entity;
+
+architecture sim of pumpkin_irq_tb is
+
+    type ram_type is array (0 to 2**program_size-1) of std_logic_vector(15 downto 0);
+
+    constant IRQ_VECTOR  : integer := 1;
+    constant FIRST_IRQ   : integer := 100; -- Cycles before the first interrupt
+    constant ACK_PORT    : integer := 0;
+    constant LOW_PORT    : integer := 1;
+    constant HIGH_PORT   : integer := 2;
+    constant COUNT_PORT  : integer := 3;
+
+    --
+    -- Value of a hex digit, -1 if the character is not one
+    --
+    function hex_value(ch : character) return integer is
+    begin
+        case ch is
+            when '0' to '9' => return character'pos(ch) - character'pos('0');
+            when 'A' to 'F' => return character'pos(ch) - character'pos('A') + 10;
+            when 'a' to 'f' => return character'pos(ch) - character'pos('a') + 10;
+            when others => return -1;
+        end case;
+    end function;
+
+    --
+    -- Read a PASM .mem file, lines of the form 'AAA : DDDD', lines starting with '#' are comments
+    --
+    impure function load_program return ram_type is
+        file fp          : text open read_mode is program_file;
+        variable l       : line;
+        variable ram     : ram_type := (others => (others => '0'));
+        variable ch      : character;
+        variable good    : boolean;
+        variable digit   : integer;
+        variable field   : integer; -- 0 for the address, 1 for the data after ':'
+        variable address : integer;
+        variable value   : integer;
+    begin
+        while not endfile(fp) loop
+            readline(fp,l);
+            if l'length > 0 and l(l'low) /= '#' then
+                address := 0;
+                value := 0;
+                field := 0;
+                loop
+                    read(l,ch,good);
+                    exit when not good;
+                    digit := hex_value(ch);
+                    if digit >= 0 and field = 0 then
+                        address := address * 16 + digit;
+                    elsif digit >= 0 then
+                        value := value * 16 + digit;
+                    elsif ch = ':' then
+                        field := 1;
+                    end if;
+                end loop;
+                if field = 1 and address < 2**program_size then
+                    ram(address) := std_logic_vector(to_unsigned(value,16));
+                end if;
+            end if;
+        end loop;
+        return ram;
+    end function;
+
+    signal clock : std_logic := '0';
+    signal reset : std_logic := '1';
+    signal done  : boolean := false;
+    signal cycle : natural := 0;
+
+    signal ram             : ram_type := load_program;
+    signal data            : std_logic_vector(15 downto 0);
+    signal ram_data        : std_logic_vector(15 downto 0);
+    signal operand         : std_logic_vector(15 downto 0);
+    signal io_data         : std_logic_vector(15 downto 0) := (others => '0'); -- The program does no IN
+    signal address         : std_logic_vector(program_size-1 downto 0);
+    signal operand_address : std_logic_vector(program_size-1 downto 0);
+    signal io_address      : std_logic_vector(15 downto 0);
+    signal wr              : std_logic;
+    signal io_rd           : std_logic;
+    signal io_wr           : std_logic;
+    signal irq             : std_logic := '0';
+
+    signal gap        : natural := 2;         -- Cycles between the acknowledge and the next interrupt
+    signal wait_count : natural := FIRST_IRQ; -- Cycles left before irq is raised
+    signal raised     : natural := 0;         -- Cycle irq went high
+    signal pending    : boolean := false;     -- irq is high and the vector has not been read
+    signal taken      : natural := 0;
+    signal shortest   : natural := natural'high;
+    signal longest    : natural := 0;
+    signal result_low  : integer := -1;
+    signal result_high : integer := -1;
+    signal result_count : integer := -1;
+
+begin
+
+    clock <= not clock after 5 ns when not done;
+
+    --
+    -- Reset, cycle 0 is the first cycle with reset released, the S0 cycle
+    --
+    process(clock)
+    begin
+        if rising_edge(clock) then
+            if reset = '1' then
+                cycle <= 0;
+            else
+                cycle <= cycle + 1;
+            end if;
+        end if;
+    end process;
+
+    reset <= '0' after 40 ns;
+
+    --
+    -- Core and dual port program memory, the operand port is only used when pipelined
+    --
+u_pumpkin: entity work.pumpkin
+        generic map (
+            stack_depth => stack_depth,
+            program_size => program_size,
+            pipelined => pipelined)
+        port map(
+            clock => clock,
+            clock_enable => '1',
+            reset => reset,
+            program_data_in => ram_data,
+            data_out => data,
+            program_address => address,
+            program_wr => wr,
+            io_data_in => io_data,
+            io_address => io_address,
+            io_rd => io_rd,
+            io_wr => io_wr,
+            irq => irq,
+            operand_data_in => operand,
+            operand_address => operand_address);
+
+    process(clock)
+    begin
+        if rising_edge(clock) then
+            if wr = '1' then
+                ram(to_integer(unsigned(address))) <= data;
+            else
+                ram_data <= ram(to_integer(unsigned(address)));
+            end if;
+            operand <= ram(to_integer(unsigned(operand_address)));
+        end if;
+    end process;
+
+    --
+    -- Interrupt source, irq is held until the handler writes ACK_PORT then raised again after a
+    -- gap of 2 to 24 cycles. No more are raised once the program starts writing its results so the
+    -- count it writes is final.
+    --
+    process(clock)
+    begin
+        if rising_edge(clock) then
+            if reset = '1' then
+                irq <= '0';
+            elsif io_wr = '1' and to_integer(unsigned(io_address)) = ACK_PORT then
+                irq <= '0';
+                wait_count <= gap;
+                gap <= 2 + (gap * 7 + 3) mod 23;
+            elsif irq = '0' and wait_count > 0 and result_low < 0 then
+                if wait_count = 1 then
+                    irq <= '1';
+                    raised <= cycle + 1;
+                    pending <= true;
+                end if;
+                wait_count <= wait_count - 1;
+            end if;
+            -- The vector is only read on an interrupt
+            if pending and irq = '1' and to_integer(unsigned(address)) = IRQ_VECTOR then
+                pending <= false;
+                taken <= taken + 1;
+                if cycle - raised + 1 < shortest then
+                    shortest <= cycle - raised + 1;
+                end if;
+                if cycle - raised + 1 > longest then
+                    longest <= cycle - raised + 1;
+                end if;
+            end if;
+        end if;
+    end process;
+
+    --
+    -- Results written by the program
+    --
+    process(clock)
+    begin
+        if rising_edge(clock) then
+            if io_wr = '1' and reset = '0' then
+                case to_integer(unsigned(io_address)) is
+                    when LOW_PORT => result_low <= to_integer(unsigned(data));
+                    when HIGH_PORT => result_high <= to_integer(unsigned(data));
+                    when COUNT_PORT => result_count <= to_integer(unsigned(data));
+                    when others => null;
+                end case;
+            end if;
+        end if;
+    end process;
+
+    process
+        variable errors : natural;
+    begin
+        wait until result_count >= 0 or cycle = max_cycles;
+        wait until rising_edge(clock);
+        errors := 0;
+        if result_count < 0 then
+            report "Program did not finish in " & integer'image(max_cycles) & " cycles" severity error;
+            errors := errors + 1;
+        else
+            if result_low /= expected_low or result_high /= expected_high then
+                report "Count is " & integer'image(result_high) & ":" & integer'image(result_low) &
+                       ", expected " & integer'image(expected_high) & ":" & integer'image(expected_low) severity error;
+                errors := errors + 1;
+            end if;
+            if result_count /= taken then
+                report "Handler ran " & integer'image(result_count) & " times for " &
+                       integer'image(taken) & " interrupts" severity error;
+                errors := errors + 1;
+            end if;
+            report integer'image(taken) & " interrupts, latency " & integer'image(shortest) & " to " &
+                   integer'image(longest) & " cycles, finished at cycle " & integer'image(cycle);
+            if longest > max_latency then
+                report "Latency is longer than " & integer'image(max_latency) & " cycles" severity error;
+                errors := errors + 1;
+            end if;
+        end if;
+        if errors = 0 then
+            report "PASS";
+        else
+            report "FAIL, " & integer'image(errors) & " errors" severity error;
+        end if;
+        done <= true;
+        wait;
+    end process;
+
+end sim;
+
+--- End of file ---
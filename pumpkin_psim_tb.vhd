@@ -0,0 +1,291 @@
+---------------------------------------------------------------------------------------------------
+--
+-- pumpkin_psim_tb.vhd
+--
+-- Testbench writing the IO writes of the pumpkin-cpu in the format of PSIM -w
+--
+-- The core runs a program from a PASM .mem file with a dual port program memory, the operand
+-- port is only used when pipelined, and an IO memory of 256 words addressed by the low 8 bits of
+-- the IO address. Every IO write is written to write_file as 'Cycle N: OUT AAAA = DDDD', cycles
+-- are counted from the reset cycle (S0) as cycle 0, as PSIM does, so the file of the standard
+-- core matches the IO writes printed by PSIM with the same options line for line. The run ends
+-- after max_writes writes.
+--
+-- With the counters generic the core has its performance counters at IO address 16#FFF0#, PSIM
+-- models them with -P 0xFFF0. perf_test.asm writes the counters it reads to IO, so the file
+-- checks the counters of the core against the cycles and instructions counted by PSIM.
+--
+-- With the trace generic the trace FIFO is drained with trace_ready held high and each entry is
+-- written to trace_file, which PTRACE -w reads with the program image to rebuild the instructions
+-- run. They are the start of those recorded by PSIM -r, the entries made after the run ends are
+-- not written.
+--
+-- GHDL:
+--   pasm -I hello_world.asm 2048 hello_world.mem
+--   ghdl -a pumpkin.vhd pumpkin_psim_tb.vhd
+--   ghdl -e pumpkin_psim_tb
+--   ghdl -r pumpkin_psim_tb -gprogram_file=hello_world.mem -gshort_immediate=true
+--   psim hello_world.mem -I -w | grep OUT > psim_writes.txt
+--   diff writes.txt psim_writes.txt
+--
+--   pasm hello_world.asm 2048 hello_world.mem
+--   ghdl -r pumpkin_psim_tb -gprogram_file=hello_world.mem -gtrace=true
+--   ptrace -w trace.txt hello_world.mem -n 100000 | awk '/^[0-9]+:/ {print $2}' > trace_pcs.txt
+--   psim hello_world.mem -r hello_world.trc
+--   ptrace hello_world.trc -n 100000 | awk '{print $3}' | head -n $(wc -l < trace_pcs.txt) > psim_pcs.txt
+--   diff trace_pcs.txt psim_pcs.txt
+--
+--   pasm perf_test.asm 2048 perf_test.mem
+--   ghdl -r pumpkin_psim_tb -gprogram_file=perf_test.mem -gcounters=true -gmax_writes=21
+--   psim perf_test.mem -P 0xFFF0 -w | grep OUT > psim_writes.txt
+--   diff writes.txt psim_writes.txt
+--
+---------------------------------------------------------------------------------------------------
+--
+-- This file is part of the pumpkin-cpu Project
+-- Copyright (C) 2020 Steve Teal
+--
+-- This source file may be used and distributed without restriction provided that this copyright
+-- statement is not removed from the file and that any derivative work contains the original
+-- copyright notice and the associated disclaimer.
+--
+-- This source file is free software; you can redistribute it and/or modify it under the terms
+-- of the GNU Lesser General Public License as published by the Free Software Foundation,
+-- either version 3 of the License, or (at your option) any later version.
+--
+-- This source is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+-- without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+-- See the GNU Lesser General Public License for more details.
+--
+-- You should have received a copy of the GNU Lesser General Public License along with this
+-- source; if not, download it from http://www.gnu.org/licenses/lgpl-3.0.en.html
+--
+---------------------------------------------------------------------------------------------------
+library ieee;
+use ieee.std_logic_1164.all;
+use ieee.numeric_std.all;
+use std.textio.all;
+
+entity pumpkin_psim_tb is
+    generic(
+        program_file : string := "hello_world.mem";
+        write_file   : string := "writes.txt";   -- IO writes in the format of PSIM -w
+        program_size : integer := 11;             -- Address bits, 11 for PASM's default of 2048 words
+        stack_depth  : integer := 4;
+        pipelined    : boolean := false;
+        short_immediate : boolean := false;       -- Set for an image assembled with PASM -I
+        counters     : boolean := false;          -- Performance counters at 16#FFF0#, PSIM -P 0xFFF0
+        trace        : boolean := false;          -- Trace FIFO drained to trace_file
+        trace_file   : string := "trace.txt";     -- Trace entries in the format of PTRACE -w
+        max_writes   : integer := 321;            -- IO writes made before the run ends
+        max_cycles   : integer := 10000000);      -- Give up after this many cycles
+end entity;
+
+architecture sim of pumpkin_psim_tb is
+
+    type ram_type is array (0 to 2**program_size-1) of std_logic_vector(15 downto 0);
+    type io_type is array (0 to 255) of std_logic_vector(15 downto 0); -- Low 8 bits of the IO address
+
+    --
+    -- Value of a hex digit, -1 if the character is not one
+    --
+    function hex_value(ch : character) return integer is
+    begin
+        case ch is
+            when '0' to '9' => return character'pos(ch) - character'pos('0');
+            when 'A' to 'F' => return character'pos(ch) - character'pos('A') + 10;
+            when 'a' to 'f' => return character'pos(ch) - character'pos('a') + 10;
+            when others => return -1;
+        end case;
+    end function;
+
+    --
+    -- Four hex digits of a 16 bit value, as PSIM prints them
+    --
+    function hex(value : natural) return string is
+        constant DIGITS : string(1 to 16) := "0123456789ABCDEF";
+        variable s      : string(1 to 4);
+        variable v      : natural := value;
+    begin
+        for i in 4 downto 1 loop
+            s(i) := DIGITS(v mod 16 + 1);
+            v := v / 16;
+        end loop;
+        return s;
+    end function;
+
+    --
+    -- Read a PASM .mem file, lines of the form 'AAA : DDDD', lines starting with '#' are comments
+    --
+    impure function load_program return ram_type is
+        file fp          : text open read_mode is program_file;
+        variable l       : line;
+        variable ram     : ram_type := (others => (others => '0'));
+        variable ch      : character;
+        variable good    : boolean;
+        variable digit   : integer;
+        variable field   : integer; -- 0 for the address, 1 for the data after ':'
+        variable address : integer;
+        variable value   : integer;
+    begin
+        while not endfile(fp) loop
+            readline(fp,l);
+            if l'length > 0 and l(l'low) /= '#' then
+                address := 0;
+                value := 0;
+                field := 0;
+                loop
+                    read(l,ch,good);
+                    exit when not good;
+                    digit := hex_value(ch);
+                    if digit >= 0 and field = 0 then
+                        address := address * 16 + digit;
+                    elsif digit >= 0 then
+                        value := value * 16 + digit;
+                    elsif ch = ':' then
+                        field := 1;
+                    end if;
+                end loop;
+                if field = 1 and address < 2**program_size then
+                    ram(address) := std_logic_vector(to_unsigned(value,16));
+                end if;
+            end if;
+        end loop;
+        return ram;
+    end function;
+
+    file writes : text open write_mode is write_file;
+    file traces : text open write_mode is trace_file;
+
+    signal clock : std_logic := '0';
+    signal reset : std_logic := '1';
+    signal done  : boolean := false;
+    signal cycle : natural := 0;
+
+    signal ram             : ram_type := load_program;
+    signal io              : io_type := (others => (others => '0'));
+    signal data            : std_logic_vector(15 downto 0);
+    signal ram_data        : std_logic_vector(15 downto 0);
+    signal operand         : std_logic_vector(15 downto 0);
+    signal io_data         : std_logic_vector(15 downto 0);
+    signal address         : std_logic_vector(program_size-1 downto 0);
+    signal operand_address : std_logic_vector(program_size-1 downto 0);
+    signal io_address      : std_logic_vector(15 downto 0);
+    signal wr              : std_logic;
+    signal io_rd           : std_logic;
+    signal io_wr           : std_logic;
+    signal trace_data      : std_logic_vector(31 downto 0);
+    signal trace_valid     : std_logic;
+
+    signal count : natural := 0; -- IO writes made
+    signal last  : natural := 0; -- Cycle of the last write
+
+begin
+
+    clock <= not clock after 5 ns when not done;
+
+    --
+    -- Reset, cycle 0 is the first cycle with reset released, the S0 cycle
+    --
+    process(clock)
+    begin
+        if rising_edge(clock) then
+            if reset = '1' then
+                cycle <= 0;
+            else
+                cycle <= cycle + 1;
+            end if;
+        end if;
+    end process;
+
+    reset <= '0' after 40 ns;
+
+u_pumpkin: entity work.pumpkin
+        generic map (
+            stack_depth => stack_depth,
+            program_size => program_size,
+            pipelined => pipelined,
+            short_immediate => short_immediate,
+            counters => counters,
+            trace => trace)
+        port map(
+            clock => clock,
+            clock_enable => '1',
+            reset => reset,
+            program_data_in => ram_data,
+            data_out => data,
+            program_address => address,
+            program_wr => wr,
+            io_data_in => io_data,
+            io_address => io_address,
+            io_rd => io_rd,
+            io_wr => io_wr,
+            operand_data_in => operand,
+            operand_address => operand_address,
+            trace_data => trace_data,
+            trace_valid => trace_valid,
+            trace_ready => '1');
+
+    process(clock)
+    begin
+        if rising_edge(clock) then
+            if wr = '1' then
+                ram(to_integer(unsigned(address))) <= data;
+            else
+                ram_data <= ram(to_integer(unsigned(address)));
+            end if;
+            operand <= ram(to_integer(unsigned(operand_address)));
+        end if;
+    end process;
+
+    io_data <= io(to_integer(unsigned(io_address(7 downto 0)))) when io_rd = '1' else (others => '0');
+
+    --
+    -- IO writes, each written to the file as PSIM -w prints it
+    --
+    process(clock)
+        variable l : line;
+    begin
+        if rising_edge(clock) then
+            if io_wr = '1' and reset = '0' then
+                io(to_integer(unsigned(io_address(7 downto 0)))) <= data;
+                if count < max_writes then
+                    write(l,"Cycle " & integer'image(cycle) & ": OUT " & hex(to_integer(unsigned(io_address))) &
+                            " = " & hex(to_integer(unsigned(data))));
+                    writeline(writes,l);
+                    count <= count + 1;
+                    last <= cycle;
+                end if;
+            end if;
+        end if;
+    end process;
+
+    --
+    -- Trace FIFO, drained an entry a cycle so no entries are lost, each written as 8 hex digits
+    --
+    process(clock)
+        variable l : line;
+    begin
+        if rising_edge(clock) then
+            if trace_valid = '1' and reset = '0' then
+                write(l,hex(to_integer(unsigned(trace_data(31 downto 16)))) & hex(to_integer(unsigned(trace_data(15 downto 0)))));
+                writeline(traces,l);
+            end if;
+        end if;
+    end process;
+
+    process
+    begin
+        wait until count = max_writes or cycle = max_cycles;
+        wait until rising_edge(clock);
+        if count < max_writes then
+            report "Only " & integer'image(count) & " writes in " & integer'image(max_cycles) & " cycles" severity error;
+        end if;
+        report integer'image(count) & " writes, last at cycle " & integer'image(last) & ", written to " & write_file;
+        done <= true;
+        wait;
+    end process;
+
+end sim;
+
+--- End of file ---
@@ -0,0 +1,341 @@
+---------------------------------------------------------------------------------------------------
+--
+-- pumpkin_tb.vhd
+--
+-- Testbench comparing the pipelined pumpkin-cpu with the standard core
+--
+-- Both cores run the same program from a PASM .mem file, each with its own program memory and
+-- IO memory, IO memory is 256 words addressed by the low 8 bits of the IO address. Every IO write
+-- of each core is recorded with the cycle it was made in, cycles are counted from the reset
+-- cycle (S0) as cycle 0, as PSIM does. Once both cores have made max_writes writes the writes
+-- are compared, along with program memory as it was at the last write, and the cycle counts of
+-- the two cores are reported.
+--
+-- GHDL:
+--   pasm hello_world.asm 2048 hello_world.mem
+--   ghdl -a pumpkin.vhd pumpkin_tb.vhd
+--   ghdl -e pumpkin_tb
+--   ghdl -r pumpkin_tb -gprogram_file=hello_world.mem -gmax_writes=321
+--   ghdl -r pumpkin_tb -gprogram_file=led.mem -gmax_writes=4 -gmax_cycles=30000000
+--
+---------------------------------------------------------------------------------------------------
+--
+-- This file is part of the pumpkin-cpu Project
+-- Copyright (C) 2020 Steve Teal
+-- 
+-- This source file may be used and distributed without restriction provided that this copyright
+-- statement is not removed from the file and that any derivative work contains the original
+-- copyright notice and the associated disclaimer.
+-- 
+-- This source file is free software; you can redistribute it and/or modify it under the terms
+-- of the GNU Lesser General Public License as published by the Free Software Foundation,
+-- either version 3 of the License, or (at your option) any later version.
+-- 
+-- This source is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+-- without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. 
+-- See the GNU Lesser General Public License for more details.
+-- 
+-- You should have received a copy of the GNU Lesser General Public License along with this
+-- source; if not, download it from http://www.gnu.org/licenses/lgpl-3.0.en.html
+--
+---------------------------------------------------------------------------------------------------
+library ieee;
+use ieee.std_logic_1164.all;
+use ieee.numeric_std.all;
+use std.textio.all;
+
+entity pumpkin_tb is
+    generic(
+        program_file : string := "hello_world.mem";
+        program_size : integer := 11;        -- Address bits, 11 for PASM's default of 2048 words
+        stack_depth  : integer := 4;
+        short_immediate : boolean := false;  -- Set for an image assembled with PASM -I
+        max_writes   : integer := 321;       -- IO writes compared
+        max_cycles   : integer := 10000000;  -- Give up after this many cycles
+        verbose      : boolean := false);    -- Report every IO write
+end entity;
+
+architecture sim of pumpkin_tb is
+
+    type ram_type is array (0 to 2**program_size-1) of std_logic_vector(15 downto 0);
+    type io_type is array (0 to 255) of std_logic_vector(15 downto 0); -- Low 8 bits of the IO address
+
+    type write_type is record
+        address : std_logic_vector(15 downto 0);
+        data    : std_logic_vector(15 downto 0);
+        cycle   : natural;
+    end record;
+    type write_list is array (1 to max_writes) of write_type;
+
+    --
+    -- Value of a hex digit, -1 if the character is not one
+    --
+    function hex_value(ch : character) return integer is
+    begin
+        case ch is
+            when '0' to '9' => return character'pos(ch) - character'pos('0');
+            when 'A' to 'F' => return character'pos(ch) - character'pos('A') + 10;
+            when 'a' to 'f' => return character'pos(ch) - character'pos('a') + 10;
+            when others => return -1;
+        end case;
+    end function;
+
+    --
+    -- Read a PASM .mem file, lines of the form 'AAA : DDDD', lines starting with '#' are comments
+    --
+    impure function load_program return ram_type is
+        file fp          : text open read_mode is program_file;
+        variable l       : line;
+        variable ram     : ram_type := (others => (others => '0'));
+        variable ch      : character;
+        variable good    : boolean;
+        variable digit   : integer;
+        variable field   : integer; -- 0 for the address, 1 for the data after ':'
+        variable address : integer;
+        variable value   : integer;
+    begin
+        while not endfile(fp) loop
+            readline(fp,l);
+            if l'length > 0 and l(l'low) /= '#' then
+                address := 0;
+                value := 0;
+                field := 0;
+                loop
+                    read(l,ch,good);
+                    exit when not good;
+                    digit := hex_value(ch);
+                    if digit >= 0 and field = 0 then
+                        address := address * 16 + digit;
+                    elsif digit >= 0 then
+                        value := value * 16 + digit;
+                    elsif ch = ':' then
+                        field := 1;
+                    end if;
+                end loop;
+                if field = 1 and address < 2**program_size then
+                    ram(address) := std_logic_vector(to_unsigned(value,16));
+                end if;
+            end if;
+        end loop;
+        return ram;
+    end function;
+
+    signal clock : std_logic := '0';
+    signal reset : std_logic := '1';
+    signal done  : boolean := false;
+    signal cycle : natural := 0;
+
+    -- Standard core
+    signal ram_s        : ram_type := load_program;
+    signal io_s         : io_type := (others => (others => '0'));
+    signal data_s       : std_logic_vector(15 downto 0);
+    signal ram_data_s   : std_logic_vector(15 downto 0);
+    signal io_data_s    : std_logic_vector(15 downto 0);
+    signal address_s    : std_logic_vector(program_size-1 downto 0);
+    signal io_address_s : std_logic_vector(15 downto 0);
+    signal wr_s         : std_logic;
+    signal io_rd_s      : std_logic;
+    signal io_wr_s      : std_logic;
+    signal writes_s     : write_list;
+    signal count_s      : natural := 0;
+    signal final_s      : ram_type;
+
+    -- Pipelined core
+    signal ram_p         : ram_type := load_program;
+    signal io_p          : io_type := (others => (others => '0'));
+    signal data_p        : std_logic_vector(15 downto 0);
+    signal ram_data_p    : std_logic_vector(15 downto 0);
+    signal operand_p     : std_logic_vector(15 downto 0);
+    signal io_data_p     : std_logic_vector(15 downto 0);
+    signal address_p     : std_logic_vector(program_size-1 downto 0);
+    signal operand_address_p : std_logic_vector(program_size-1 downto 0);
+    signal io_address_p  : std_logic_vector(15 downto 0);
+    signal wr_p          : std_logic;
+    signal io_rd_p       : std_logic;
+    signal io_wr_p       : std_logic;
+    signal writes_p      : write_list;
+    signal count_p       : natural := 0;
+    signal final_p       : ram_type;
+
+begin
+
+    clock <= not clock after 5 ns when not done;
+
+    --
+    -- Reset, cycle 0 is the first cycle with reset released, the S0 cycle
+    --
+    process(clock)
+    begin
+        if rising_edge(clock) then
+            if reset = '1' then
+                cycle <= 0;
+            else
+                cycle <= cycle + 1;
+            end if;
+        end if;
+    end process;
+
+    reset <= '0' after 40 ns;
+
+    --
+    -- Standard core, single port program memory
+    --
+u_single: entity work.pumpkin
+        generic map (
+            stack_depth => stack_depth,
+            program_size => program_size,
+            pipelined => false,
+            short_immediate => short_immediate)
+        port map(
+            clock => clock,
+            clock_enable => '1',
+            reset => reset,
+            program_data_in => ram_data_s,
+            data_out => data_s,
+            program_address => address_s,
+            program_wr => wr_s,
+            io_data_in => io_data_s,
+            io_address => io_address_s,
+            io_rd => io_rd_s,
+            io_wr => io_wr_s,
+            operand_address => open);
+
+    process(clock)
+    begin
+        if rising_edge(clock) then
+            if wr_s = '1' then
+                ram_s(to_integer(unsigned(address_s))) <= data_s;
+            else
+                ram_data_s <= ram_s(to_integer(unsigned(address_s)));
+            end if;
+        end if;
+    end process;
+
+    io_data_s <= io_s(to_integer(unsigned(io_address_s(7 downto 0)))) when io_rd_s = '1' else (others => '0');
+
+    process(clock)
+    begin
+        if rising_edge(clock) then
+            if io_wr_s = '1' and reset = '0' then
+                io_s(to_integer(unsigned(io_address_s(7 downto 0)))) <= data_s;
+                if count_s < max_writes then
+                    writes_s(count_s + 1) <= (io_address_s, data_s, cycle);
+                    count_s <= count_s + 1;
+                    if count_s + 1 = max_writes then
+                        final_s <= ram_s;
+                    end if;
+                end if;
+            end if;
+        end if;
+    end process;
+
+    --
+    -- Pipelined core, dual port program memory, the operand port reads the old word when both
+    -- ports use the same address as the program port writes
+    --
+u_pipelined: entity work.pumpkin
+        generic map (
+            stack_depth => stack_depth,
+            program_size => program_size,
+            pipelined => true,
+            short_immediate => short_immediate)
+        port map(
+            clock => clock,
+            clock_enable => '1',
+            reset => reset,
+            program_data_in => ram_data_p,
+            data_out => data_p,
+            program_address => address_p,
+            program_wr => wr_p,
+            io_data_in => io_data_p,
+            io_address => io_address_p,
+            io_rd => io_rd_p,
+            io_wr => io_wr_p,
+            operand_data_in => operand_p,
+            operand_address => operand_address_p);
+
+    process(clock)
+    begin
+        if rising_edge(clock) then
+            if wr_p = '1' then
+                ram_p(to_integer(unsigned(address_p))) <= data_p;
+            else
+                ram_data_p <= ram_p(to_integer(unsigned(address_p)));
+            end if;
+            operand_p <= ram_p(to_integer(unsigned(operand_address_p)));
+        end if;
+    end process;
+
+    io_data_p <= io_p(to_integer(unsigned(io_address_p(7 downto 0)))) when io_rd_p = '1' else (others => '0');
+
+    process(clock)
+    begin
+        if rising_edge(clock) then
+            if io_wr_p = '1' and reset = '0' then
+                io_p(to_integer(unsigned(io_address_p(7 downto 0)))) <= data_p;
+                if count_p < max_writes then
+                    writes_p(count_p + 1) <= (io_address_p, data_p, cycle);
+                    count_p <= count_p + 1;
+                    if count_p + 1 = max_writes then
+                        final_p <= ram_p;
+                    end if;
+                end if;
+            end if;
+        end if;
+    end process;
+
+    --
+    -- Compare the results once both cores have made max_writes writes
+    --
+    process
+        variable errors : natural;
+    begin
+        wait until (count_s = max_writes and count_p = max_writes) or cycle = max_cycles;
+        wait until rising_edge(clock);
+        errors := 0;
+        if count_s /= count_p then
+            report "Standard core made " & integer'image(count_s) & " writes, pipelined core " &
+                   integer'image(count_p) severity error;
+            errors := errors + 1;
+        end if;
+        for i in 1 to max_writes loop
+            exit when i > count_s or i > count_p;
+            if verbose then
+                report "Write " & integer'image(i) & " cycle " & integer'image(writes_s(i).cycle) &
+                       " / " & integer'image(writes_p(i).cycle) & ": OUT " &
+                       integer'image(to_integer(unsigned(writes_s(i).address))) & " = " &
+                       integer'image(to_integer(unsigned(writes_s(i).data)));
+            end if;
+            if writes_s(i).address /= writes_p(i).address or writes_s(i).data /= writes_p(i).data then
+                report "Write " & integer'image(i) & " differs: OUT " &
+                       integer'image(to_integer(unsigned(writes_s(i).address))) & " = " &
+                       integer'image(to_integer(unsigned(writes_s(i).data))) & " against OUT " &
+                       integer'image(to_integer(unsigned(writes_p(i).address))) & " = " &
+                       integer'image(to_integer(unsigned(writes_p(i).data))) severity error;
+                errors := errors + 1;
+            end if;
+        end loop;
+        if count_s = max_writes and count_p = max_writes then
+            for i in ram_type'range loop
+                if final_s(i) /= final_p(i) then
+                    report "Program memory differs at " & integer'image(i) severity error;
+                    errors := errors + 1;
+                end if;
+            end loop;
+            report "Standard core:  " & integer'image(max_writes) & " writes, last at cycle " &
+                   integer'image(writes_s(max_writes).cycle);
+            report "Pipelined core: " & integer'image(max_writes) & " writes, last at cycle " &
+                   integer'image(writes_p(max_writes).cycle);
+        end if;
+        if errors = 0 then
+            report "PASS, results are identical";
+        else
+            report "FAIL, " & integer'image(errors) & " differences" severity error;
+        end if;
+        done <= true;
+        wait;
+    end process;
+
+end sim;
+
+--- End of file ---
@@ -0,0 +1,90 @@
+/*------------------------------------------------------------------------------------------------------
+--
+-- putil.c
+-- Host helpers shared by the assembler (pasm) and the simulator (psim)
+--
+--------------------------------------------------------------------------------------------------------
+--
+-- This file is part of the pumpkin-cpu Project
+-- Copyright (C) 2020 Steve Teal
+--
+-- This source file may be used and distributed without restriction provided that this copyright
+-- statement is not removed from the file and that any derivative work contains the original
+-- copyright notice and the associated disclaimer.
+--
+-- This source file is free software; you can redistribute it and/or modify it under the terms
+-- of the GNU Lesser General Public License as published by the Free Software Foundation,
+-- either version 3 of the License, or (at your option) any later version.
+--
+-- This source is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+-- without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+-- See the GNU Lesser General Public License for more details.
+--
+-- You should have received a copy of the GNU Lesser General Public License along with this
+-- source; if not, download it from http://www.gnu.org/licenses/lgpl-3.0.en.html
+--
+------------------------------------------------------------------------------------------------------*/
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#ifdef _WIN32
+#include<windows.h>
+#else
+#include<unistd.h>
+#endif
+#include "putil.h"
+
+/*
+    Return number of processors available, at least 1 and at most maxCount
+*/
+
+int getCoreCount(int maxCount)
+{
+    int count;
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    count = (int)info.dwNumberOfProcessors;
+#else
+    count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if(count > maxCount)
+    {
+        count = maxCount;
+    }
+    if(count < 1)
+    {
+        count = 1;
+    }
+    return count;
+}
+
+/*
+    Return wall clock time in seconds
+*/
+
+double getWallTime(void)
+{
+    struct timespec ts;
+
+    timespec_get(&ts,TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+    Copy a string to the heap, returns NULL if out of memory
+*/
+
+char *copyString(const char *str)
+{
+    char *copy;
+
+    copy = (char*)malloc(strlen(str) + 1);
+    if(copy != NULL)
+    {
+        strcpy(copy,str);
+    }
+    return copy;
+}
+
+/* End of File */
@@ -0,0 +1,36 @@
+/*------------------------------------------------------------------------------------------------------
+--
+-- putil.h
+-- Host helpers shared by the assembler (pasm) and the simulator (psim)
+--
+--------------------------------------------------------------------------------------------------------
+--
+-- This file is part of the pumpkin-cpu Project
+-- Copyright (C) 2020 Steve Teal
+--
+-- This source file may be used and distributed without restriction provided that this copyright
+-- statement is not removed from the file and that any derivative work contains the original
+-- copyright notice and the associated disclaimer.
+--
+-- This source file is free software; you can redistribute it and/or modify it under the terms
+-- of the GNU Lesser General Public License as published by the Free Software Foundation,
+-- either version 3 of the License, or (at your option) any later version.
+--
+-- This source is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+-- without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+-- See the GNU Lesser General Public License for more details.
+--
+-- You should have received a copy of the GNU Lesser General Public License along with this
+-- source; if not, download it from http://www.gnu.org/licenses/lgpl-3.0.en.html
+--
+------------------------------------------------------------------------------------------------------*/
+#ifndef PUTIL_H
+#define PUTIL_H
+
+int getCoreCount(int maxCount);
+double getWallTime(void);
+char *copyString(const char *str);
+
+#endif
+
+/* End of File */